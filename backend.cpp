@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "backend.h"
+#include "io_util.h"
+#include <sstream>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+
+namespace
+{
+    // Maximum number of file operations to wait for at once
+    const size_t max_file_batch = 64;
+    const uint64_t page_size = 4096;
+}
+
+std::string FileBackend::describe() const
+{
+    std::ostringstream ret;
+    ret << "backing file of " << size/(1024*1024) << " MB";
+    return ret.str();
+}
+
+fuse_io_context::io_uring_task<int> FileBackend::flush(fuse_io_context& io,
+    bool datasync)
+{
+    std::vector<int> fds = {io.fuse_ring.backing_fd};
+    std::vector<int> rcs;
+    if(co_await sync_files(io, fds, datasync, rcs)!=0)
+        co_return -1;
+
+    co_return std::min(rcs[0], 0);
+}
+
+fuse_io_context::io_uring_task<int> FileBackend::discard(fuse_io_context& io,
+    uint64_t offset, uint64_t len, bool punch)
+{
+    std::vector<FileRange> ranges = {FileRange{io.fuse_ring.backing_fd, offset, len}};
+    co_return co_await fallocate_file_ranges(io, ranges,
+        (punch ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE) | FALLOC_FL_KEEP_SIZE);
+}
+
+fuse_io_context::io_uring_task<int> FileBackend::allocate(fuse_io_context& io,
+    uint64_t offset, uint64_t len)
+{
+    std::vector<FileRange> ranges = {FileRange{io.fuse_ring.backing_fd, offset, len}};
+    co_return co_await fallocate_file_ranges(io, ranges, FALLOC_FL_KEEP_SIZE);
+}
+
+fuse_io_context::io_uring_task<int> file_io(fuse_io_context& io, bool write, int fd,
+    std::vector<BlockIo>& ios)
+{
+    // Bytes of ios[i] transferred so far and where the next transfer starts.
+    // Reads start at a page boundary, so rounding them up to whole pages
+    // does not go past the end of the buffer
+    std::vector<uint64_t> done(ios.size(), 0);
+    std::vector<uint64_t> start(ios.size(), 0);
+    std::vector<size_t> pending;
+    for(size_t i=0;i<ios.size();++i)
+    {
+        ios[i].res = 0;
+        if(ios[i].len>0)
+            pending.push_back(i);
+    }
+
+    while(!pending.empty())
+    {
+        std::vector<size_t> short_ios;
+        for(size_t i=0;i<pending.size();)
+        {
+            size_t n = std::min(pending.size() - i, max_file_batch);
+
+            io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+            if(sqe==nullptr)
+                co_return -1;
+
+            std::vector<io_uring_sqe*> sqes;
+            for(size_t j=0;j<n;++j)
+            {
+                if(j>0)
+                    sqe = io.get_reserved_backing_sqe();
+
+                size_t idx = pending[i+j];
+                const BlockIo& req = ios[idx];
+                start[idx] = write ? done[idx] : done[idx] / page_size * page_size;
+                char* buf = req.buf + start[idx];
+                uint64_t off = req.offset + start[idx];
+                uint64_t len = req.len - start[idx];
+                if(write)
+                {
+                    if(req.buf_idx>=0)
+                        io_uring_prep_write_fixed(sqe, fd, buf, len, off, req.buf_idx);
+                    else
+                        io_uring_prep_write(sqe, fd, buf, len, off);
+                }
+                else
+                {
+                    // Whole pages for O_DIRECT
+                    len = round_up<uint64_t>(len, page_size);
+                    if(req.buf_idx>=0)
+                        io_uring_prep_read_fixed(sqe, fd, buf, len, off, req.buf_idx);
+                    else
+                        io_uring_prep_read(sqe, fd, buf, len, off);
+                }
+                sqe->flags |= IOSQE_FIXED_FILE;
+                sqes.push_back(sqe);
+            }
+
+            std::vector<int> rcs = co_await io.complete(sqes);
+            for(size_t j=0;j<n;++j)
+            {
+                size_t idx = pending[i+j];
+                if(rcs[j]<0)
+                {
+                    ios[idx].res = rcs[j];
+                }
+                else if(start[idx] + static_cast<uint64_t>(rcs[j])<=done[idx])
+                {
+                    // The file ends before the data
+                    ios[idx].res = -EIO;
+                }
+                else
+                {
+                    done[idx] = start[idx] + static_cast<uint64_t>(rcs[j]);
+                    if(done[idx]>=ios[idx].len)
+                        ios[idx].res = static_cast<int>(ios[idx].len);
+                    else
+                        short_ios.push_back(idx);
+                }
+            }
+
+            i+=n;
+        }
+
+        pending.swap(short_ios);
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> sync_files(fuse_io_context& io,
+    const std::vector<int>& fds, bool datasync, std::vector<int>& rcs)
+{
+    io_uring_sqe* sqe = co_await io.get_sqe(fds.size());
+    if(sqe==nullptr)
+        co_return -1;
+
+    std::vector<io_uring_sqe*> sqes;
+    for(size_t i=0;i<fds.size();++i)
+    {
+        if(i>0)
+            sqe = io.get_reserved_sqe();
+
+        io_uring_prep_fsync(sqe, fds[i], datasync ? IORING_FSYNC_DATASYNC : 0);
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqes.push_back(sqe);
+    }
+
+    rcs = co_await io.complete(sqes);
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> fallocate_file_ranges(fuse_io_context& io,
+    const std::vector<FileRange>& ranges, int mode)
+{
+    int ret = 0;
+    for(size_t i=0;i<ranges.size();)
+    {
+        size_t n = std::min(ranges.size() - i, max_file_batch);
+
+        io_uring_sqe* sqe = co_await io.get_sqe(n);
+        if(sqe==nullptr)
+            co_return -1;
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_sqe();
+
+            const FileRange& range = ranges[i+j];
+            io_uring_prep_fallocate(sqe, range.fd, mode, range.offset, range.len);
+            sqe->flags |= IOSQE_FIXED_FILE;
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+        for(int rc: rcs)
+        {
+            if(rc<0)
+                ret = rc;
+        }
+
+        i+=n;
+    }
+
+    co_return ret;
+}
+
+fuse_io_context::io_uring_task<int> backend_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios)
+{
+    std::vector<BlockIo> submit;
+    std::vector<size_t> submit_idx;
+    for(size_t i=0;i<ios.size();++i)
+    {
+        BlockIo& req = ios[i];
+        uint64_t len = block_io_len(req, io.fuse_ring.backing_f_size);
+        if(len==0)
+        {
+            req.res = write ? -ENOSPC : 0;
+            continue;
+        }
+
+        submit.push_back(BlockIo{req.buf, req.buf_idx, req.offset, len, 0});
+        submit_idx.push_back(i);
+    }
+
+    if(submit.empty())
+        co_return 0;
+
+    if(co_await io.fuse_ring.volume->transfer(io, write, submit)!=0)
+        co_return -1;
+
+    for(size_t i=0;i<submit.size();++i)
+    {
+        ios[submit_idx[i]].res = submit[i].res;
+    }
+
+    co_return 0;
+}
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include "block_io.h"
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <stdint.h>
+
+// Storage of the volume. The raw backing file (FileBackend), every volume
+// layer (striping, mirroring, VHD, chunk store, snapshot, dedup, integrity,
+// encryption) and the external backends (NBD, S3) implement it. Volume
+// layers are mutually exclusive, so the ring has exactly one of them as
+// volume, and reads, writes, block cache fills, FUSE_FSYNC and
+// FUSE_FALLOCATE of copy mode are passed to it. The raw backing file keeps
+// its splice data path outside of copy mode.
+//
+// Backends are shared by all worker threads. Per thread state is kept by
+// thread_idx of the ring.
+class Backend
+{
+public:
+    virtual ~Backend() {}
+
+    virtual std::string describe() const = 0;
+
+    virtual uint64_t get_size() const = 0;
+
+    // Fd the worker thread thread_idx registers as fixed file after the
+    // backing file, or -1. The files of the volume layers are registered
+    // by fuseuring_run (FixedFileLayout)
+    virtual int get_thread_fd(size_t) const
+    {
+        return -1;
+    }
+
+    // Starts the background tasks of the worker thread of io
+    virtual void start(fuse_io_context&) {}
+
+    // Reads or writes all of ios. They are submitted together and complete
+    // in any order. Returns 0 once the res of all ios is set
+    [[nodiscard]] virtual fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io,
+        bool write, std::vector<BlockIo>& ios) = 0;
+
+    // Makes all completed writes durable. Only the data (and the metadata
+    // needed to read it) with datasync. Returns 0 or a negative errno
+    [[nodiscard]] virtual fuse_io_context::io_uring_task<int> flush(fuse_io_context& io,
+        bool datasync) = 0;
+
+    // [offset, offset+len) reads as zeros afterwards. The space is freed with
+    // punch, otherwise it stays allocated. Returns 0 or a negative errno,
+    // -EOPNOTSUPP if the volume does not support it
+    [[nodiscard]] virtual fuse_io_context::io_uring_task<int> discard(fuse_io_context&,
+        uint64_t, uint64_t, bool)
+    {
+        co_return -EOPNOTSUPP;
+    }
+
+    // Allocates the space of [offset, offset+len) without changing the
+    // data. Returns 0 or a negative errno, -EOPNOTSUPP if the volume does
+    // not support it
+    [[nodiscard]] virtual fuse_io_context::io_uring_task<int> allocate(fuse_io_context&,
+        uint64_t, uint64_t)
+    {
+        co_return -EOPNOTSUPP;
+    }
+
+    // One line for --stats-interval, empty if there is nothing to report
+    virtual std::string get_stats() const = 0;
+};
+
+// Reads or writes ios on the fixed file fd. The offsets of ios are offsets
+// in the file. All of them are submitted together and short transfers are
+// continued. Reads are rounded up to whole pages for O_DIRECT. Returns 0
+// once the res of all ios is set or -1 if there was no sqe
+[[nodiscard]] fuse_io_context::io_uring_task<int> file_io(fuse_io_context& io, bool write, int fd,
+    std::vector<BlockIo>& ios);
+
+// The raw backing file, fixed file backing_fd of the ring
+class FileBackend : public Backend
+{
+public:
+    explicit FileBackend(uint64_t size)
+        : size(size) {}
+
+    std::string describe() const override;
+
+    uint64_t get_size() const override
+    {
+        return size;
+    }
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io,
+        bool write, std::vector<BlockIo>& ios) override
+    {
+        return file_io(io, write, io.fuse_ring.backing_fd, ios);
+    }
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush(fuse_io_context& io,
+        bool datasync) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> discard(fuse_io_context& io,
+        uint64_t offset, uint64_t len, bool punch) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> allocate(fuse_io_context& io,
+        uint64_t offset, uint64_t len) override;
+
+    std::string get_stats() const override
+    {
+        return std::string();
+    }
+
+private:
+    uint64_t size;
+};
+
+// [offset, offset+len) of the fixed file fd
+struct FileRange
+{
+    int fd;
+    uint64_t offset;
+    uint64_t len;
+};
+
+// fsync()s the fixed files fds together. rcs are their results. Returns 0
+// or -1 if there was no sqe
+[[nodiscard]] fuse_io_context::io_uring_task<int> sync_files(fuse_io_context& io,
+    const std::vector<int>& fds, bool datasync, std::vector<int>& rcs);
+
+// fallocate()s all of ranges with mode. Returns the last error, 0 or -1 if
+// there was no sqe
+[[nodiscard]] fuse_io_context::io_uring_task<int> fallocate_file_ranges(fuse_io_context& io,
+    const std::vector<FileRange>& ranges, int mode);
+
+// Clamps ios to the volume and passes them to the volume of the ring
+[[nodiscard]] fuse_io_context::io_uring_task<int> backend_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios);
@@ -6,20 +6,136 @@ FMNT=/media/test
 BMNT=/media/bench
 mkdir -p "$FMNT"
 mkdir -p "$BMNT"
-./fuseuring /tmp/backing_file.img "$FMNT" $((500*1024*1024)) 1000 5000 1 &
-while ! test -e "$FMNT/volume"; do sleep 1; done
-LODEV=$(losetup --find --show "$FMNT/volume" --direct-io=on)
-mkfs.ext4 -F $LODEV
-mount $LODEV "$BMNT"
-losetup -d $LODEV
 
 cp /usr/share/doc/fio/examples/ssd-test.fio ./
 sed -i 's/iodepth=4/iodepth=2048/g' ssd-test.fio
 sed -i 's/size=10g/size=400m/g' ssd-test.fio
 sed -i 's/libaio/io_uring/g' ssd-test.fio
 sed -i "s@directory=/mount-point-of-ssd@directory=$BMNT@g" ssd-test.fio
-fio ssd-test.fio
 
-umount "$BMNT"
+CLK_TCK=$(getconf CLK_TCK)
+
+# utime+stime of all threads of the process (includes io_uring
+# io-wq workers and the SQ poll thread)
+proc_cpu_ticks() {
+	awk '{ print $14+$15 }' "/proc/$1/stat"
+}
+
+# run_bench [name] [fuseuring options...]
+# BACKING overrides the backing file path, THREADS the number of worker
+# threads (default 1)
+run_bench() {
+	local name=$1
+	shift
+	./fuseuring "${BACKING:-/tmp/backing_file.img}" "$FMNT" $((500*1024*1024)) 1000 5000 "${THREADS:-1}" "$@" > "fuseuring_$name.log" &
+	local fpid=$!
+	while ! test -e "$FMNT/volume"; do sleep 1; done
+	LODEV=$(losetup --find --show "$FMNT/volume" --direct-io=on)
+	mkfs.ext4 -F $LODEV
+	mount $LODEV "$BMNT"
+	losetup -d $LODEV
+
+	local cpu_start=$(proc_cpu_ticks $fpid)
+	fio --output-format=terse --terse-version=3 ssd-test.fio > "fio_$name.terse"
+	local cpu_end=$(proc_cpu_ticks $fpid)
+
+	umount "$BMNT"
+	umount "$FMNT"
+	wait $fpid || true
+
+	# terse v3: 3=jobname 8=read iops 9=read runtime(ms) 49=write iops 50=write runtime(ms)
+	awk -F';' -v name="$name" -v cpu=$(( cpu_end - cpu_start )) -v tck=$CLK_TCK '
+		{
+			ios = $8*$9/1000 + $49*$50/1000
+			iops = $8 + $49
+			total += ios
+			printf "%s %s: IOPS=%.0f\n", name, $3, iops
+		}
+		END {
+			cpu_s = cpu/tck
+			if(cpu_s>0)
+				printf "%s: %.0f I/Os in %.1f CPU seconds. IOPS per core=%.0f\n", name, total, cpu_s, total/cpu_s
+		}' "fio_$name.terse" | tee -a bench_summary.txt
+}
+
+rm -f bench_summary.txt
+run_bench default
+run_bench sqpoll --sqpoll --sqpoll-idle=2000
+# Worker rings attached to the SQ poll thread of the first ring
+THREADS=4 run_bench sqpoll_shared --sqpoll --sqpoll-idle=2000
+run_bench backing_ring --backing-ring
+run_bench backing_iopoll --backing-iopoll
+
+# Backing file in RAM, so the backing storage is out of the picture. These
+# are the ceiling of the daemon itself and catch regressions in the ring and
+# coroutine code
+run_bench memfd --memfd
+run_bench memfd_copy --memfd --copy-mode
+run_bench memfd_huge --memfd=huge
+
+# Checksums on top of the copy-mode data path. Compare with copy_mode for their cost
+run_bench copy_mode --copy-mode
+rm -f /tmp/backing_file.crc
+run_bench integrity --integrity=/tmp/backing_file.crc --stats-interval=5
+grep "^Integrity:" fuseuring_integrity.log | tail -n 1 | tee -a bench_summary.txt
+
+# XTS-AES of every request. Should have at least half the IOPS per core of copy_mode
+head -c 64 /dev/urandom > /tmp/backing_file.key
+run_bench encrypted --encrypt-key=/tmp/backing_file.key --stats-interval=5
+grep "^Encryption:" fuseuring_encrypted.log | tail -n 1 | tee -a bench_summary.txt
+
+# Compressed chunk store, packed from the backing file of the runs above.
+# It is read-only, so instead of fio the whole volume is read sequentially
+# with direct I/O, which shows the fetch and decompression throughput
+rm -f /tmp/backing_file.chunks
+./fuseuring /tmp/backing_file.chunks "$FMNT" $((500*1024*1024)) 1000 5000 1 --chunk-store \
+	--chunk-pack=/tmp/backing_file.img --stats-interval=5 > fuseuring_chunk_store.log &
+FPID=$!
+while ! test -e "$FMNT/volume"; do sleep 1; done
+dd if="$FMNT/volume" of=/dev/null bs=1M iflag=direct 2>&1 | tail -n 1 | sed 's/^/chunk_store seq-read: /' | tee -a bench_summary.txt
 umount "$FMNT"
+wait $FPID || true
+grep "^Chunk store:" fuseuring_chunk_store.log | tail -n 1 | tee -a bench_summary.txt
+
+# NBD backend, with a local nbdkit serving the backing file
+if command -v nbdkit > /dev/null; then
+	rm -f /tmp/backing_file.sock
+	nbdkit -f -U /tmp/backing_file.sock file /tmp/backing_file.img &
+	NBDKIT_PID=$!
+	while ! test -S /tmp/backing_file.sock; do sleep 1; done
+	BACKING=/tmp/backing_file.sock run_bench nbd --nbd --stats-interval=5
+	kill $NBDKIT_PID
+	wait $NBDKIT_PID || true
+	grep "^NBD:" fuseuring_nbd.log | tail -n 1 | tee -a bench_summary.txt
+fi
+
+# S3 backend, with a local MinIO server as object store
+if command -v minio > /dev/null; then
+	rm -rf /tmp/backing_file.minio
+	export MINIO_ROOT_USER=fuseuring MINIO_ROOT_PASSWORD=fuseuring-bench
+	minio server /tmp/backing_file.minio --address 127.0.0.1:19000 > minio.log 2>&1 &
+	MINIO_PID=$!
+	while ! curl -sf http://127.0.0.1:19000/minio/health/live > /dev/null; do sleep 1; done
+	AWS_ACCESS_KEY_ID=$MINIO_ROOT_USER AWS_SECRET_ACCESS_KEY=$MINIO_ROOT_PASSWORD \
+		BACKING=http://127.0.0.1:19000/fuseuring/volume- run_bench s3 --s3 --stats-interval=5
+	kill $MINIO_PID
+	wait $MINIO_PID || true
+	grep "^S3:" fuseuring_s3.log | tail -n 1 | tee -a bench_summary.txt
+fi
+
+# Comma separated list of additional files/devices, e.g.
+# STRIPE_FILES=/dev/nvme1n1,/dev/nvme2n1
+# Runs with 1 to N stripe files (the backing file plus the first N-1 of the
+# list), to check that the bandwidth scales with the number of disks. One
+# stripe file is plain copy mode
+if test -n "$STRIPE_FILES"; then
+	IFS=',' read -r -a STRIPE_LIST <<< "$STRIPE_FILES"
+	run_bench striped_1 --copy-mode
+	for (( n=2; n<=${#STRIPE_LIST[@]}+1; n++ )); do
+		STRIPES=$(IFS=','; echo "${STRIPE_LIST[*]:0:n-1}")
+		run_bench striped_$n --stripe="$STRIPES" --stats-interval=5
+		grep "^Stripes:" fuseuring_striped_$n.log | tail -n 1 | tee -a bench_summary.txt
+	done
+fi
 
+cat bench_summary.txt
@@ -0,0 +1,344 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "block_cache.h"
+#include <sys/mman.h>
+#include <stdio.h>
+#include <algorithm>
+
+namespace
+{
+    // io_uring limits the size of a single registered buffer to 1GiB
+    const size_t max_reg_size = 1024*1024*1024;
+}
+
+BlockCache::BlockCache(size_t block_size, size_t cache_size, size_t n_shards)
+    : block_size(block_size), mem(nullptr), mem_size(0),
+        hits(0), misses(0), evictions(0), invalidations(0)
+{
+    n_shards = std::max(static_cast<size_t>(1), n_shards);
+    slots_per_shard = std::max(static_cast<size_t>(1), cache_size / block_size / n_shards);
+    n_slots = slots_per_shard*n_shards;
+    slots_per_reg = std::max(static_cast<size_t>(1), max_reg_size / block_size);
+
+    slots.resize(n_slots);
+    for(size_t i=0;i<n_shards;++i)
+    {
+        std::unique_ptr<Shard> shard = std::make_unique<Shard>();
+        shard->slot_start = i*slots_per_shard;
+        shard->n_slots = slots_per_shard;
+        shard->p = 0;
+        for(size_t j=shard->slot_start + shard->n_slots;j>shard->slot_start;--j)
+        {
+            slots[j-1].state = SlotState::Free;
+            slots[j-1].pins = 0;
+            shard->free_slots.push_back(j-1);
+        }
+        shards.push_back(std::move(shard));
+    }
+}
+
+BlockCache::~BlockCache()
+{
+    if(mem!=nullptr)
+        munmap(mem, mem_size);
+}
+
+bool BlockCache::init()
+{
+    mem_size = n_slots*block_size;
+    void* p = mmap(nullptr, mem_size, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if(p==MAP_FAILED)
+    {
+        perror("Error allocating block cache memory");
+        return false;
+    }
+    mem = static_cast<char*>(p);
+    return true;
+}
+
+std::vector<struct iovec> BlockCache::reg_iovecs() const
+{
+    std::vector<struct iovec> ret;
+    for(size_t slot=0;slot<n_slots;slot+=slots_per_reg)
+    {
+        struct iovec iov;
+        iov.iov_base = slot_buf(slot);
+        iov.iov_len = std::min(slots_per_reg, n_slots - slot)*block_size;
+        ret.push_back(iov);
+    }
+    return ret;
+}
+
+BlockCache::Stats BlockCache::get_stats() const
+{
+    Stats ret;
+    ret.hits = hits.load(std::memory_order_relaxed);
+    ret.misses = misses.load(std::memory_order_relaxed);
+    ret.evictions = evictions.load(std::memory_order_relaxed);
+    ret.invalidations = invalidations.load(std::memory_order_relaxed);
+    return ret;
+}
+
+BlockCache::LookupRes BlockCache::lookup(uint64_t block, size_t& slot)
+{
+    Shard& shard = get_shard(block);
+    std::scoped_lock lock(shard.mutex);
+
+    auto it = shard.resident.find(block);
+    if(it!=shard.resident.end())
+    {
+        Slot& s = slots[it->second];
+        if(s.state!=SlotState::Valid)
+            return LookupRes::Busy;
+
+        // Move to most recently used of t2
+        if(s.in_t2)
+        {
+            shard.t2.splice(shard.t2.begin(), shard.t2, s.it);
+        }
+        else
+        {
+            shard.t2.splice(shard.t2.begin(), shard.t1, s.it);
+            s.in_t2 = true;
+        }
+
+        ++s.pins;
+        ++hits;
+        slot = it->second;
+        return LookupRes::Hit;
+    }
+
+    ++misses;
+
+    const size_t c = shard.n_slots;
+    bool to_t2 = false;
+    auto ghost_it = shard.ghosts.find(block);
+    if(ghost_it!=shard.ghosts.end())
+    {
+        // Ghost hit. Adapt the target size of t1
+        bool in_b2 = ghost_it->second.in_b2;
+        if(!in_b2)
+        {
+            size_t delta = std::max(static_cast<size_t>(1), shard.b2.size() / shard.b1.size());
+            shard.p = std::min(c, shard.p + delta);
+        }
+        else
+        {
+            size_t delta = std::max(static_cast<size_t>(1), shard.b1.size() / shard.b2.size());
+            shard.p = shard.p>delta ? shard.p - delta : 0;
+        }
+
+        if(shard.free_slots.empty() &&
+            !replace(shard, in_b2, slot))
+            return LookupRes::Busy;
+
+        remove_ghost(shard, block);
+        to_t2 = true;
+    }
+    else
+    {
+        if(shard.t1.size() + shard.b1.size() >= c)
+        {
+            if(shard.t1.size()<c)
+            {
+                if(!shard.b1.empty())
+                    remove_ghost(shard, shard.b1.back());
+            }
+            else if(shard.free_slots.empty())
+            {
+                // t1 is the whole cache. Evict without remembering
+                if(!evict_lru(shard, shard.t1, slot))
+                    return LookupRes::Busy;
+
+                shard.free_slots.push_back(slot);
+            }
+        }
+        else if(shard.t1.size() + shard.t2.size() + shard.b1.size() + shard.b2.size() >= 2*c)
+        {
+            if(!shard.b2.empty())
+                remove_ghost(shard, shard.b2.back());
+        }
+
+        if(shard.free_slots.empty() &&
+            !replace(shard, false, slot))
+            return LookupRes::Busy;
+    }
+
+    if(!shard.free_slots.empty())
+    {
+        slot = shard.free_slots.back();
+        shard.free_slots.pop_back();
+    }
+
+    Slot& s = slots[slot];
+    s.block = block;
+    s.state = SlotState::Filling;
+    s.pins = 1;
+    s.in_t2 = to_t2;
+    if(to_t2)
+    {
+        shard.t2.push_front(slot);
+        s.it = shard.t2.begin();
+    }
+    else
+    {
+        shard.t1.push_front(slot);
+        s.it = shard.t1.begin();
+    }
+    shard.resident[block] = slot;
+
+    return LookupRes::Fill;
+}
+
+void BlockCache::fill_done(size_t slot, bool success)
+{
+    Shard& shard = slot_shard(slot);
+    std::scoped_lock lock(shard.mutex);
+
+    Slot& s = slots[slot];
+    if(s.state!=SlotState::Filling)
+        return;
+
+    if(success)
+    {
+        s.state = SlotState::Valid;
+    }
+    else
+    {
+        remove_resident(shard, slot);
+        s.state = SlotState::Dropped;
+    }
+}
+
+void BlockCache::unpin(size_t slot)
+{
+    Shard& shard = slot_shard(slot);
+    std::scoped_lock lock(shard.mutex);
+
+    Slot& s = slots[slot];
+    --s.pins;
+    if(s.pins==0 &&
+        s.state==SlotState::Dropped)
+    {
+        s.state = SlotState::Free;
+        shard.free_slots.push_back(slot);
+    }
+}
+
+void BlockCache::invalidate(uint64_t offset, uint64_t len)
+{
+    if(len==0)
+        return;
+
+    uint64_t first_block = offset / block_size;
+    uint64_t last_block = (offset + len - 1) / block_size;
+    for(uint64_t block=first_block;block<=last_block;++block)
+    {
+        Shard& shard = get_shard(block);
+        std::scoped_lock lock(shard.mutex);
+
+        auto it = shard.resident.find(block);
+        if(it==shard.resident.end())
+            continue;
+
+        size_t slot = it->second;
+        Slot& s = slots[slot];
+        remove_resident(shard, slot);
+        ++invalidations;
+
+        if(s.pins==0)
+        {
+            s.state = SlotState::Free;
+            shard.free_slots.push_back(slot);
+        }
+        else
+        {
+            // A pending fill may have read old data
+            s.state = SlotState::Dropped;
+        }
+    }
+}
+
+bool BlockCache::replace(Shard& shard, bool in_b2, size_t& slot)
+{
+    bool from_t1 = !shard.t1.empty() &&
+        (shard.t1.size()>shard.p || (in_b2 && shard.t1.size()==shard.p));
+
+    // Fall back to the other list if all blocks are pinned
+    for(size_t i=0;i<2;++i)
+    {
+        std::list<size_t>& list = from_t1 ? shard.t1 : shard.t2;
+        if(evict_lru(shard, list, slot))
+        {
+            add_ghost(shard, slots[slot].block, !from_t1);
+            return true;
+        }
+        from_t1 = !from_t1;
+    }
+
+    return false;
+}
+
+bool BlockCache::evict_lru(Shard& shard, std::list<size_t>& list, size_t& slot)
+{
+    for(auto it=list.rbegin();it!=list.rend();++it)
+    {
+        Slot& s = slots[*it];
+        if(s.pins==0 &&
+            s.state==SlotState::Valid)
+        {
+            slot = *it;
+            remove_resident(shard, slot);
+            s.state = SlotState::Free;
+            ++evictions;
+            return true;
+        }
+    }
+    return false;
+}
+
+void BlockCache::remove_ghost(Shard& shard, uint64_t block)
+{
+    auto it = shard.ghosts.find(block);
+    if(it==shard.ghosts.end())
+        return;
+
+    if(it->second.in_b2)
+        shard.b2.erase(it->second.it);
+    else
+        shard.b1.erase(it->second.it);
+
+    shard.ghosts.erase(it);
+}
+
+void BlockCache::add_ghost(Shard& shard, uint64_t block, bool in_b2)
+{
+    remove_ghost(shard, block);
+
+    std::list<uint64_t>& list = in_b2 ? shard.b2 : shard.b1;
+    list.push_front(block);
+
+    Ghost ghost;
+    ghost.in_b2 = in_b2;
+    ghost.it = list.begin();
+    shard.ghosts[block] = ghost;
+
+    // Ghost lists remember at most one cache size of evicted blocks
+    while(shard.b1.size() + shard.b2.size() > shard.n_slots)
+    {
+        std::list<uint64_t>& trim = shard.b2.size()>shard.b1.size() ? shard.b2 : shard.b1;
+        remove_ghost(shard, trim.back());
+    }
+}
+
+void BlockCache::remove_resident(Shard& shard, size_t slot)
+{
+    Slot& s = slots[slot];
+    if(s.in_t2)
+        shard.t2.erase(s.it);
+    else
+        shard.t1.erase(s.it);
+
+    shard.resident.erase(s.block);
+}
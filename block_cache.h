@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Read cache for fixed size blocks of the backing file. Cache memory is
+// allocated once and registered with the worker rings, so backing reads
+// can go directly into it (read_fixed) and hits are sent to fuse from it.
+// Blocks are assigned to shards by block number. Each shard has its own
+// lock and uses ARC (adaptive replacement cache) for eviction, which is
+// scan resistant.
+class BlockCache
+{
+public:
+    enum class LookupRes
+    {
+        // Block is cached. Slot is pinned
+        Hit,
+        // Block is not cached. A slot was reserved (and pinned). Call fill_done()
+        // after reading the block into it
+        Fill,
+        // Block is being filled by someone else or all slots are pinned
+        Busy
+    };
+
+    struct Stats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t invalidations;
+    };
+
+    BlockCache(size_t block_size, size_t cache_size, size_t n_shards);
+    ~BlockCache();
+
+    bool init();
+
+    LookupRes lookup(uint64_t block, size_t& slot);
+    void fill_done(size_t slot, bool success);
+    void unpin(size_t slot);
+
+    // Drops all blocks overlapping [offset, offset+len)
+    void invalidate(uint64_t offset, uint64_t len);
+
+    char* slot_buf(size_t slot) const
+    {
+        return mem + slot*block_size;
+    }
+
+    // Index into the iovecs returned by reg_iovecs()
+    int slot_reg_idx(size_t slot) const
+    {
+        return static_cast<int>(slot / slots_per_reg);
+    }
+
+    size_t get_block_size() const
+    {
+        return block_size;
+    }
+
+    std::vector<struct iovec> reg_iovecs() const;
+
+    Stats get_stats() const;
+
+private:
+    enum class SlotState
+    {
+        Free,
+        Filling,
+        Valid,
+        // Invalidated while pinned. Freed on unpin
+        Dropped
+    };
+
+    struct Slot
+    {
+        uint64_t block;
+        SlotState state;
+        unsigned int pins;
+        bool in_t2;
+        std::list<size_t>::iterator it;
+    };
+
+    struct Ghost
+    {
+        bool in_b2;
+        std::list<uint64_t>::iterator it;
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        size_t slot_start;
+        size_t n_slots;
+        // Adaptive target size of t1
+        size_t p;
+        std::vector<size_t> free_slots;
+        std::unordered_map<uint64_t, size_t> resident;
+        std::unordered_map<uint64_t, Ghost> ghosts;
+        // Front is most recently used
+        std::list<size_t> t1;
+        std::list<size_t> t2;
+        std::list<uint64_t> b1;
+        std::list<uint64_t> b2;
+    };
+
+    Shard& get_shard(uint64_t block)
+    {
+        return *shards[block % shards.size()];
+    }
+
+    Shard& slot_shard(size_t slot)
+    {
+        return *shards[slot / slots_per_shard];
+    }
+
+    bool replace(Shard& shard, bool in_b2, size_t& slot);
+    bool evict_lru(Shard& shard, std::list<size_t>& list, size_t& slot);
+    void remove_ghost(Shard& shard, uint64_t block);
+    void add_ghost(Shard& shard, uint64_t block, bool in_b2);
+    void remove_resident(Shard& shard, size_t slot);
+
+    size_t block_size;
+    size_t n_slots;
+    size_t slots_per_shard;
+    size_t slots_per_reg;
+    char* mem;
+    size_t mem_size;
+    std::vector<Slot> slots;
+    std::vector<std::unique_ptr<Shard> > shards;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> evictions;
+    std::atomic<uint64_t> invalidations;
+};
@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "block_io.h"
+#include <errno.h>
+
+uint64_t block_io_len(const BlockIo& req, uint64_t volume_size)
+{
+    if(req.offset>=volume_size)
+        return 0;
+
+    return req.len<volume_size - req.offset ? req.len : volume_size - req.offset;
+}
+
+int block_io_piece_res(int rc, uint64_t expected)
+{
+    if(rc<0)
+        return rc;
+
+    if(static_cast<uint64_t>(rc)<expected)
+        return -EIO;
+
+    return rc;
+}
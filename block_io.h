@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include <stdint.h>
+
+// A read or write of [offset, offset+len) of the volume, the request type
+// of all layers (striping, VHD, chunk store, snapshot, dedup, integrity,
+// encryption, backends). buf is a registered buffer if buf_idx>=0, so fixed
+// buffer operations can be used on it. Buffers of reads are whole pages.
+// res is the number of bytes transferred or a negative errno.
+//
+// Short transfers are handled the same by all layers:
+// * Requests are cut off at the end of the volume. Reads beyond it transfer
+//   nothing (res 0), writes beyond it fail with ENOSPC.
+// * Inside the volume all bytes are transferred or the request fails.
+//   Ranges a layer has no data for (unallocated VHD blocks, missing S3
+//   objects, ...) are zero-filled and count as transferred. A file that
+//   ends before the data that should be there is an error (EIO), not
+//   zeros, since that would hide lost data.
+// The caller zero-fills buf after res of a read that was cut off.
+struct BlockIo
+{
+    char* buf;
+    int buf_idx;
+    uint64_t offset;
+    uint64_t len;
+    int res;
+};
+
+// Length of the part of req inside a volume of volume_size
+uint64_t block_io_len(const BlockIo& req, uint64_t volume_size);
+
+// Result of a read or write of expected bytes of a file that completed
+// with rc. Returns rc or -EIO if it was short
+int block_io_piece_res(int rc, uint64_t expected);
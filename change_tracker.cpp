@@ -0,0 +1,434 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "change_tracker.h"
+#include "io_util.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <iostream>
+#include <algorithm>
+
+namespace
+{
+    const char cbt_magic[8] = {'F', 'U', 'S', 'C', 'B', 'T', '0', '1'};
+    const uint32_t cbt_version = 1;
+    const uint64_t cbt_header_size = 4096;
+    const uint64_t cbt_page_size = 4096;
+    const uint64_t words_per_page = cbt_page_size / sizeof(uint64_t);
+    // Maximum size of one write to the bitmap file
+    const uint64_t max_write_chunk = 16*1024*1024;
+
+    // Header of the bitmap file and of the file exposing the frozen bitmap
+    struct CbtFileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        // Offset of the bitmap in the exposed file
+        uint32_t header_size;
+        uint64_t block_size;
+        uint64_t volume_size;
+        // Number of resets
+        uint64_t epoch;
+        uint64_t n_bits;
+        uint64_t checksum;
+    };
+
+    // Bits of word w in [first_bit, last_bit]
+    uint64_t word_mask(uint64_t w, uint64_t first_bit, uint64_t last_bit)
+    {
+        uint64_t lo = std::max(first_bit, w*64) - w*64;
+        uint64_t hi = std::min(last_bit, w*64 + 63) - w*64;
+        if(hi-lo==63)
+            return ~0ULL;
+        return ((1ULL << (hi - lo + 1)) - 1) << lo;
+    }
+}
+
+ChangeTracker::ChangeTracker(const std::string& path, uint64_t volume_size, uint64_t block_size)
+    : path(path), fd(-1), volume_size(volume_size), block_size(block_size),
+        epoch(0), resetting(false), inflight_writes(0), flushes(0),
+        flush_waits(0), reset_waits(0)
+{
+    n_bits = (volume_size + block_size - 1) / block_size;
+    n_words = (n_bits + 63) / 64;
+    bitmap_size = ((n_words*sizeof(uint64_t) + cbt_page_size - 1) / cbt_page_size) * cbt_page_size;
+}
+
+ChangeTracker::~ChangeTracker()
+{
+    if(fd!=-1)
+        close(fd);
+}
+
+void ChangeTracker::fill_header(char* buf, uint64_t p_epoch)
+{
+    CbtFileHeader header = {};
+    memcpy(header.magic, cbt_magic, sizeof(cbt_magic));
+    header.version = cbt_version;
+    header.header_size = sizeof(CbtFileHeader);
+    header.block_size = block_size;
+    header.volume_size = volume_size;
+    header.epoch = p_epoch;
+    header.n_bits = n_bits;
+    header.checksum = hash_header(reinterpret_cast<const char*>(&header), offsetof(CbtFileHeader, checksum));
+    memcpy(buf, &header, sizeof(header));
+}
+
+bool ChangeTracker::init()
+{
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if(fd==-1)
+    {
+        perror(("Error opening changed block tracking file \""+path+"\"").c_str());
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st)!=0)
+    {
+        perror("Error getting changed block tracking file size");
+        return false;
+    }
+
+    bits = std::make_unique<std::atomic<uint64_t>[]>(n_words);
+    durable = std::make_unique<std::atomic<uint64_t>[]>(n_words);
+    frozen.resize(n_words);
+    page_flushing.resize(bitmap_size / cbt_page_size);
+
+    uint64_t file_size = cbt_header_size + 2*bitmap_size;
+    std::vector<char> header_buf(cbt_header_size);
+
+    if(st.st_size==0)
+    {
+        fill_header(header_buf.data(), 0);
+
+        if(ftruncate(fd, file_size)!=0)
+        {
+            perror("Error resizing changed block tracking file");
+            return false;
+        }
+
+        if(pwrite(fd, header_buf.data(), header_buf.size(), 0)!=static_cast<ssize_t>(header_buf.size()) ||
+            fdatasync(fd)!=0)
+        {
+            perror("Error writing changed block tracking file header");
+            return false;
+        }
+
+        for(uint64_t i=0;i<n_words;++i)
+        {
+            bits[i].store(0, std::memory_order_relaxed);
+            durable[i].store(0, std::memory_order_relaxed);
+        }
+
+        std::cout << "Created changed block tracking file \"" << path << "\"" << std::endl;
+        return true;
+    }
+
+    if(!pread_full(fd, header_buf.data(), header_buf.size(), 0))
+    {
+        perror("Error reading changed block tracking file header");
+        return false;
+    }
+
+    CbtFileHeader header;
+    memcpy(&header, header_buf.data(), sizeof(header));
+    if(memcmp(header.magic, cbt_magic, sizeof(cbt_magic))!=0 ||
+        header.version!=cbt_version ||
+        header.checksum!=hash_header(header_buf.data(), offsetof(CbtFileHeader, checksum)))
+    {
+        std::cerr << "Invalid changed block tracking file \"" << path << "\". "
+            "Remove it to start tracking from scratch." << std::endl;
+        return false;
+    }
+
+    if(header.block_size!=block_size ||
+        header.volume_size!=volume_size ||
+        static_cast<uint64_t>(st.st_size)<file_size)
+    {
+        std::cerr << "Changed block tracking file \"" << path << "\" has block size "
+            << header.block_size << " and volume size " << header.volume_size
+            << ". Remove it to start tracking with block size " << block_size
+            << " and volume size " << volume_size << "." << std::endl;
+        return false;
+    }
+
+    std::vector<uint64_t> curr(n_words);
+    if(!pread_full(fd, reinterpret_cast<char*>(frozen.data()), n_words*sizeof(uint64_t), cbt_header_size) ||
+        !pread_full(fd, reinterpret_cast<char*>(curr.data()), n_words*sizeof(uint64_t), cbt_header_size + bitmap_size))
+    {
+        perror("Error reading changed block tracking bitmap");
+        return false;
+    }
+
+    for(uint64_t i=0;i<n_words;++i)
+    {
+        bits[i].store(curr[i], std::memory_order_relaxed);
+        durable[i].store(curr[i], std::memory_order_relaxed);
+    }
+
+    epoch.store(header.epoch, std::memory_order_relaxed);
+
+    std::cout << "Loaded changed block tracking file \"" << path << "\" epoch " << header.epoch << std::endl;
+    return true;
+}
+
+void ChangeTracker::end_write()
+{
+    if(inflight_writes.fetch_sub(1)==1 &&
+        resetting.load())
+    {
+        std::scoped_lock lock(mutex);
+        drain_waiters.notify_all();
+    }
+}
+
+bool ChangeTracker::is_durable(uint64_t first_word, uint64_t last_word,
+    uint64_t first_bit, uint64_t last_bit)
+{
+    for(uint64_t w=first_word;w<=last_word;++w)
+    {
+        uint64_t mask = word_mask(w, first_bit, last_bit);
+        if((durable[w].load(std::memory_order_acquire) & mask)!=mask)
+            return false;
+    }
+    return true;
+}
+
+fuse_io_context::io_uring_task<int> ChangeTracker::write_full(fuse_io_context& io, int cbt_fd,
+    const char* buf, uint64_t len, uint64_t off)
+{
+    uint64_t done = 0;
+    while(done<len)
+    {
+        io_uring_sqe* sqe = co_await io.get_sqe();
+        if(sqe==nullptr)
+            co_return -EIO;
+
+        io_uring_prep_write(sqe, cbt_fd, buf + done,
+            std::min(len - done, max_write_chunk), off + done);
+        sqe->rw_flags = RWF_DSYNC;
+        sqe->flags |= IOSQE_FIXED_FILE;
+
+        int rc = co_await io.complete(sqe);
+        if(rc<=0)
+        {
+            static bool erronce=true;
+            if(erronce)
+            {
+                std::cerr << "Writing changed block tracking file failed rc=" << rc << std::endl;
+                erronce=false;
+            }
+            co_return rc<0 ? rc : -EIO;
+        }
+
+        done+=rc;
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> ChangeTracker::flush_page(fuse_io_context& io, int cbt_fd,
+    uint64_t page)
+{
+    uint64_t first_word = page*words_per_page;
+    uint64_t n = std::min(words_per_page, n_words - first_word);
+
+    co_return co_await flush_meta_page(io, mutex, flush_waiters, page_flushing, page, cbt_fd,
+        cbt_header_size + bitmap_size + first_word*sizeof(uint64_t), n*sizeof(uint64_t),
+        [this, first_word, n](char* buf) {
+            uint64_t* words = reinterpret_cast<uint64_t*>(buf);
+            for(uint64_t i=0;i<n;++i)
+                words[i] = bits[first_word + i].load(std::memory_order_acquire);
+            ++flushes;
+        },
+        [this, first_word, n](int rc, const char* buf) {
+            if(rc!=0)
+                return;
+
+            const uint64_t* words = reinterpret_cast<const uint64_t*>(buf);
+            for(uint64_t i=0;i<n;++i)
+                durable[first_word + i].store(words[i], std::memory_order_release);
+        });
+}
+
+fuse_io_context::io_uring_task<int> ChangeTracker::begin_write(fuse_io_context& io, int cbt_fd,
+    uint64_t offset, uint64_t len, WriteGuard& guard)
+{
+    while(true)
+    {
+        if(!resetting.load())
+        {
+            inflight_writes.fetch_add(1);
+            if(!resetting.load())
+                break;
+            end_write();
+        }
+
+        ++reset_waits;
+        std::unique_lock lock(mutex);
+        if(resetting.load())
+            co_await reset_waiters.wait(io, lock);
+    }
+
+    guard.tracker = this;
+
+    uint64_t first_bit = offset / block_size;
+    if(len==0 || first_bit>=n_bits)
+        co_return 0;
+
+    uint64_t last_bit = std::min(n_bits - 1, (offset + len - 1) / block_size);
+    uint64_t first_word = first_bit / 64;
+    uint64_t last_word = last_bit / 64;
+
+    for(uint64_t w=first_word;w<=last_word;++w)
+    {
+        bits[w].fetch_or(word_mask(w, first_bit, last_bit), std::memory_order_relaxed);
+    }
+
+    while(!is_durable(first_word, last_word, first_bit, last_bit))
+    {
+        bool busy = false;
+        uint64_t busy_page = 0;
+        for(uint64_t page=first_word/words_per_page;page<=last_word/words_per_page;++page)
+        {
+            uint64_t page_first = std::max(first_word, page*words_per_page);
+            uint64_t page_last = std::min(last_word, (page+1)*words_per_page - 1);
+            if(is_durable(page_first, page_last, first_bit, last_bit))
+                continue;
+
+            int rc = co_await flush_page(io, cbt_fd, page);
+            if(rc<0)
+                co_return rc;
+            if(rc==1)
+            {
+                busy = true;
+                busy_page = page;
+            }
+        }
+
+        if(busy)
+        {
+            ++flush_waits;
+            std::unique_lock lock(mutex);
+            if(page_flushing[busy_page])
+                co_await flush_waiters.wait(io, lock);
+        }
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> ChangeTracker::reset(fuse_io_context& io, int cbt_fd,
+    uint64_t p_epoch)
+{
+    {
+        std::scoped_lock lock(mutex);
+        if(p_epoch!=epoch.load() ||
+            resetting.load())
+            co_return -ESTALE;
+
+        resetting.store(true);
+    }
+
+    // New writes wait for the reset. Bitmap file pages are only
+    // written by writes, so there are no page writes either afterwards
+    {
+        std::unique_lock lock(mutex);
+        while(inflight_writes.load()>0)
+        {
+            co_await drain_waiters.wait(io, lock);
+        }
+    }
+
+    std::vector<uint64_t> new_frozen(n_words);
+    for(uint64_t i=0;i<n_words;++i)
+    {
+        new_frozen[i] = bits[i].exchange(0, std::memory_order_relaxed);
+        durable[i].store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t new_epoch = p_epoch + 1;
+    {
+        std::scoped_lock lock(mutex);
+        frozen.swap(new_frozen);
+        epoch.store(new_epoch);
+    }
+
+    // Frozen bitmap first. Until the header with the new epoch is written,
+    // the current bitmap in the file still has all bits of the old epoch
+    // and afterwards it has a superset of the bits of the new one
+    int rc = co_await write_full(io, cbt_fd, reinterpret_cast<const char*>(frozen.data()),
+                n_words*sizeof(uint64_t), cbt_header_size);
+
+    if(rc==0)
+    {
+        std::vector<char> header_buf(cbt_header_size);
+        fill_header(header_buf.data(), new_epoch);
+        rc = co_await write_full(io, cbt_fd, header_buf.data(), header_buf.size(), 0);
+    }
+
+    if(rc==0)
+    {
+        std::vector<char> zero_buf(n_words*sizeof(uint64_t));
+        rc = co_await write_full(io, cbt_fd, zero_buf.data(), zero_buf.size(), cbt_header_size + bitmap_size);
+    }
+
+    {
+        std::scoped_lock lock(mutex);
+        resetting.store(false);
+        reset_waiters.notify_all();
+    }
+
+    if(rc==0)
+        std::cout << "Changed block tracking epoch " << new_epoch << std::endl;
+
+    co_return rc;
+}
+
+uint64_t ChangeTracker::get_file_size() const
+{
+    return sizeof(CbtFileHeader) + (n_bits + 7) / 8;
+}
+
+size_t ChangeTracker::read_file(uint64_t offset, char* buf, size_t size)
+{
+    uint64_t file_size = get_file_size();
+    if(offset>=file_size)
+        return 0;
+
+    size = std::min(static_cast<uint64_t>(size), file_size - offset);
+
+    char header_buf[sizeof(CbtFileHeader)];
+
+    std::scoped_lock lock(mutex);
+    fill_header(header_buf, epoch.load());
+
+    size_t done = 0;
+    if(offset<sizeof(CbtFileHeader))
+    {
+        done = std::min(size, static_cast<size_t>(sizeof(CbtFileHeader) - offset));
+        memcpy(buf, header_buf + offset, done);
+    }
+
+    if(done<size)
+    {
+        uint64_t bitmap_off = offset + done - sizeof(CbtFileHeader);
+        memcpy(buf + done, reinterpret_cast<const char*>(frozen.data()) + bitmap_off, size - done);
+    }
+
+    return size;
+}
+
+ChangeTracker::Stats ChangeTracker::get_stats() const
+{
+    Stats ret;
+    ret.epoch = epoch.load(std::memory_order_relaxed);
+    ret.flushes = flushes.load(std::memory_order_relaxed);
+    ret.flush_waits = flush_waits.load(std::memory_order_relaxed);
+    ret.reset_waits = reset_waits.load(std::memory_order_relaxed);
+    return ret;
+}
@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+
+// Changed block tracking for incremental backups. One bit per block of
+// block_size bytes is set for every write, hole punch or zeroed range.
+// The bitmap is shared by all worker threads and updated with atomic
+// operations only.
+//
+// Tracking is divided into epochs. A reset ends the current epoch: the
+// bits of the ending epoch are moved to the frozen bitmap, which is what
+// backup tools read (see read_file()), and tracking starts again with an
+// empty bitmap. Resets wait until in-flight writes are finished, so every
+// write is either in the frozen bitmap or in the next epoch.
+//
+// The bitmap file has a 4K header followed by the frozen and the current
+// bitmap. Newly set bits are written to the file before the write they
+// belong to is applied, so after a crash the bitmap still contains all
+// changes.
+class ChangeTracker
+{
+public:
+    struct Stats
+    {
+        uint64_t epoch;
+        uint64_t flushes;
+        uint64_t flush_waits;
+        uint64_t reset_waits;
+    };
+
+    // Keeps a write in the current epoch. Released on destruction
+    class WriteGuard
+    {
+    public:
+        WriteGuard() noexcept
+            : tracker(nullptr) {}
+
+        WriteGuard(WriteGuard&& other) noexcept
+            : tracker(std::exchange(other.tracker, nullptr)) {}
+
+        WriteGuard& operator=(WriteGuard&& other) noexcept
+        {
+            std::swap(tracker, other.tracker);
+            return *this;
+        }
+
+        WriteGuard(WriteGuard const&) = delete;
+        WriteGuard& operator=(WriteGuard const&) = delete;
+
+        ~WriteGuard()
+        {
+            if(tracker!=nullptr)
+                tracker->end_write();
+        }
+
+    private:
+        friend class ChangeTracker;
+        ChangeTracker* tracker;
+    };
+
+    ChangeTracker(const std::string& path, uint64_t volume_size, uint64_t block_size);
+    ~ChangeTracker();
+
+    // Loads the bitmap file or creates a new one
+    bool init();
+
+    int get_fd()
+    {
+        return fd;
+    }
+
+    // Sets the bits of [offset, offset+len) and waits until they are in
+    // the bitmap file. The write has to be applied before guard is released.
+    // Returns 0 or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> begin_write(fuse_io_context& io, int cbt_fd,
+        uint64_t offset, uint64_t len, WriteGuard& guard);
+
+    // Starts a new epoch if epoch is the current one. Returns -ESTALE otherwise
+    [[nodiscard]] fuse_io_context::io_uring_task<int> reset(fuse_io_context& io, int cbt_fd,
+        uint64_t epoch);
+
+    // Size and contents of the file exposing the frozen bitmap: A header
+    // (see CbtFileHeader in change_tracker.cpp) followed by one bit per
+    // block. Bit i (byte i/8, bit i%8) is set if block i was changed
+    // between the last two resets
+    uint64_t get_file_size() const;
+    size_t read_file(uint64_t offset, char* buf, size_t size);
+
+    uint64_t get_epoch() const
+    {
+        return epoch.load(std::memory_order_relaxed);
+    }
+
+    Stats get_stats() const;
+
+private:
+    void end_write();
+    bool is_durable(uint64_t first_word, uint64_t last_word,
+        uint64_t first_bit, uint64_t last_bit);
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush_page(fuse_io_context& io, int cbt_fd,
+        uint64_t page);
+    [[nodiscard]] fuse_io_context::io_uring_task<int> write_full(fuse_io_context& io, int cbt_fd,
+        const char* buf, uint64_t len, uint64_t off);
+    void fill_header(char* buf, uint64_t p_epoch);
+
+    std::string path;
+    int fd;
+    uint64_t volume_size;
+    uint64_t block_size;
+    uint64_t n_bits;
+    uint64_t n_words;
+    // Bytes of each bitmap in the bitmap file
+    uint64_t bitmap_size;
+
+    // Bits of the current epoch
+    std::unique_ptr<std::atomic<uint64_t>[]> bits;
+    // Bits of the current epoch that are in the bitmap file
+    std::unique_ptr<std::atomic<uint64_t>[]> durable;
+
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> resetting;
+    std::atomic<uint64_t> inflight_writes;
+
+    std::mutex mutex;
+    // Bitmap file pages currently being written
+    std::vector<bool> page_flushing;
+    std::vector<uint64_t> frozen;
+    // Writes waiting for a page write or a reset, reset waiting for
+    // in-flight writes
+    fuse_io_context::SharedWaitQueue flush_waiters;
+    fuse_io_context::SharedWaitQueue reset_waiters;
+    fuse_io_context::SharedWaitQueue drain_waiters;
+
+    std::atomic<uint64_t> flushes;
+    std::atomic<uint64_t> flush_waits;
+    std::atomic<uint64_t> reset_waits;
+};
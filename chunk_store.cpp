@@ -0,0 +1,1322 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "config.h"
+#include "chunk_store.h"
+#include "io_util.h"
+#include <iostream>
+#include <sstream>
+#include <random>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace
+{
+    const char chunk_store_magic[8] = {'F', 'U', 'S', 'C', 'H', 'K', '0', '1'};
+    const char overlay_magic[8] = {'F', 'U', 'S', 'C', 'O', 'V', '0', '1'};
+    const uint32_t chunk_store_version = 1;
+    const uint64_t page_size = 4096;
+    // Chunk data starts after the header page
+    const uint64_t chunk_store_header_size = page_size;
+    const uint64_t words_per_page = page_size / sizeof(uint64_t);
+    // Chunk is stored uncompressed
+    const uint32_t chunk_flag_raw = 1;
+    const uint32_t max_chunk_size = 64*1024*1024;
+    // Maximum size of one read of chunks that are adjacent in the file
+    const uint64_t max_chunk_read = 4*1024*1024;
+    // Maximum number of reads/writes to wait for at once
+    const size_t max_chunk_batch = 64;
+    // Chunks each thread compresses per round while packing
+    const size_t pack_chunks_per_thread = 16;
+
+    struct ChunkStoreHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t chunk_size;
+        uint32_t algorithm;
+        uint64_t volume_size;
+        uint64_t n_chunks;
+        // Index of n_chunks entries (offset, size, flags), after the chunk data
+        uint64_t index_offset;
+        uint8_t store_id[16];
+        uint64_t checksum;
+    };
+
+    // At the start of the bitmap area of the overlay
+    struct OverlayHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t chunk_size;
+        uint64_t n_chunks;
+        // Id of the chunk store the overlay belongs to
+        uint8_t store_id[16];
+        uint64_t checksum;
+    };
+
+    bool is_zero_buf(const char* buf, size_t len)
+    {
+        return len==0 ||
+            (buf[0]==0 && memcmp(buf, buf + 1, len - 1)==0);
+    }
+
+    bool algorithm_supported([[maybe_unused]] ChunkStore::Algorithm algorithm)
+    {
+#ifdef HAVE_LZ4
+        if(algorithm==ChunkStore::Algorithm::Lz4)
+            return true;
+#endif
+#ifdef HAVE_ZSTD
+        if(algorithm==ChunkStore::Algorithm::Zstd)
+            return true;
+#endif
+        return false;
+    }
+
+    const char* algorithm_name(ChunkStore::Algorithm algorithm)
+    {
+        switch(algorithm)
+        {
+        case ChunkStore::Algorithm::Lz4: return "lz4";
+        case ChunkStore::Algorithm::Zstd: return "zstd";
+        }
+        return "unknown";
+    }
+
+    size_t compress_bound([[maybe_unused]] ChunkStore::Algorithm algorithm, size_t len)
+    {
+#ifdef HAVE_LZ4
+        if(algorithm==ChunkStore::Algorithm::Lz4)
+            return static_cast<size_t>(LZ4_compressBound(static_cast<int>(len)));
+#endif
+#ifdef HAVE_ZSTD
+        if(algorithm==ChunkStore::Algorithm::Zstd)
+            return ZSTD_compressBound(len);
+#endif
+        return len;
+    }
+}
+
+ChunkStore::ChunkStore(uint64_t cache_size, size_t n_decompress_threads, size_t n_threads)
+    : fd(-1), chunk_size(0), algorithm(Algorithm::Lz4), volume_size(0),
+        n_chunks(0), compressed_size(0),
+        n_decompress_threads(std::max(static_cast<size_t>(1), n_decompress_threads)),
+        stop(false), cache_max_chunks(0), cache_size(cache_size),
+        overlay_fd(-1), map_offset(0), n_words(0),
+        cache_hits(0), cache_misses(0), read_bytes(0), decompressed_bytes(0),
+        decompress_errors(0), overlay_chunks(0), overlay_copies(0), copy_waits(0)
+{
+    memset(store_id, 0, sizeof(store_id));
+
+    for(size_t i=0;i<n_threads;++i)
+    {
+        std::unique_ptr<ThreadQueue> queue = std::make_unique<ThreadQueue>();
+        queue->eventfd = -1;
+        queue->eventfd_val = 0;
+        thread_queues.push_back(std::move(queue));
+    }
+}
+
+ChunkStore::~ChunkStore()
+{
+    {
+        std::scoped_lock lock(jobs_mutex);
+        stop = true;
+    }
+    jobs_cond.notify_all();
+
+    for(std::thread& thread: decompress_threads)
+    {
+        thread.join();
+    }
+
+    for(std::unique_ptr<ThreadQueue>& queue: thread_queues)
+    {
+        if(queue->eventfd!=-1)
+            close(queue->eventfd);
+    }
+
+    if(overlay_fd!=-1)
+        close(overlay_fd);
+}
+
+bool ChunkStore::parse_algorithm(const std::string& name, Algorithm& algorithm)
+{
+    if(name=="lz4")
+        algorithm = Algorithm::Lz4;
+    else if(name=="zstd")
+        algorithm = Algorithm::Zstd;
+    else
+        return false;
+
+    return true;
+}
+
+bool ChunkStore::pack(const std::string& src_path, const std::string& path,
+    uint32_t chunk_size, Algorithm algorithm, [[maybe_unused]] int level, size_t n_threads)
+{
+    static_assert(sizeof(IndexEntry)==16);
+
+    if(!algorithm_supported(algorithm))
+    {
+        std::cerr << "Compiled without " << algorithm_name(algorithm) << " support" << std::endl;
+        return false;
+    }
+
+    int src_fd = ::open(src_path.c_str(), O_RDONLY|O_CLOEXEC);
+    if(src_fd==-1)
+    {
+        perror(("Error opening "+src_path).c_str());
+        return false;
+    }
+
+    // Also works for block devices
+    off_t src_size = lseek(src_fd, 0, SEEK_END);
+    if(src_size<0)
+    {
+        perror(("Error getting size of "+src_path).c_str());
+        close(src_fd);
+        return false;
+    }
+
+    int dst_fd = ::open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, S_IRUSR|S_IWUSR);
+    if(dst_fd==-1)
+    {
+        perror(("Error creating chunk store "+path).c_str());
+        close(src_fd);
+        return false;
+    }
+
+    n_threads = std::max(static_cast<size_t>(1), n_threads);
+    const uint64_t volume_size = static_cast<uint64_t>(src_size);
+    const uint64_t n_chunks = (volume_size + chunk_size - 1) / chunk_size;
+    const size_t round_chunks = n_threads*pack_chunks_per_thread;
+    const size_t bound = compress_bound(algorithm, chunk_size);
+
+    std::vector<IndexEntry> index(n_chunks);
+    std::vector<char> raw(round_chunks*chunk_size);
+    std::vector<char> comp(round_chunks*bound);
+    std::vector<size_t> comp_len(round_chunks);
+    std::vector<char> out;
+    uint64_t pos = chunk_store_header_size;
+    bool ok = true;
+
+    for(uint64_t first=0;ok && first<n_chunks;first+=round_chunks)
+    {
+        size_t n = static_cast<size_t>(std::min(static_cast<uint64_t>(round_chunks), n_chunks - first));
+        uint64_t raw_off = first*chunk_size;
+        size_t raw_len = static_cast<size_t>(std::min(static_cast<uint64_t>(n)*chunk_size, volume_size - raw_off));
+
+        if(!pread_full(src_fd, raw.data(), raw_len, raw_off))
+        {
+            perror(("Error reading "+src_path).c_str());
+            ok = false;
+            break;
+        }
+
+        // comp_len is 0 for chunks that are all zeros and the raw
+        // size for chunks that do not compress
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> threads;
+        for(size_t t=0;t<std::min(n_threads, n);++t)
+        {
+            threads.push_back(std::thread([&]() {
+#ifdef HAVE_ZSTD
+                std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+#endif
+                size_t i;
+                while((i=next++)<n)
+                {
+                    const char* src = raw.data() + i*chunk_size;
+                    size_t len = std::min(static_cast<size_t>(chunk_size), raw_len - i*chunk_size);
+                    if(is_zero_buf(src, len))
+                    {
+                        comp_len[i] = 0;
+                        continue;
+                    }
+
+                    size_t rc = 0;
+#ifdef HAVE_LZ4
+                    if(algorithm==Algorithm::Lz4)
+                    {
+                        rc = static_cast<size_t>(LZ4_compress_default(src, comp.data() + i*bound, static_cast<int>(len),
+                                static_cast<int>(bound)));
+                    }
+#endif
+#ifdef HAVE_ZSTD
+                    if(algorithm==Algorithm::Zstd)
+                    {
+                        rc = cctx ? ZSTD_compressCCtx(cctx.get(), comp.data() + i*bound, bound, src, len, level) : 0;
+                        if(ZSTD_isError(rc))
+                            rc = 0;
+                    }
+#endif
+                    comp_len[i] = (rc==0 || rc>=len) ? len : rc;
+                }
+            }));
+        }
+
+        for(std::thread& thread: threads)
+        {
+            thread.join();
+        }
+
+        out.clear();
+        for(size_t i=0;i<n;++i)
+        {
+            size_t len = std::min(static_cast<size_t>(chunk_size), raw_len - i*chunk_size);
+            IndexEntry& entry = index[first + i];
+            entry.offset = pos + out.size();
+            entry.size = static_cast<uint32_t>(comp_len[i]);
+            entry.flags = 0;
+            if(comp_len[i]==0)
+            {
+                entry.offset = 0;
+            }
+            else if(comp_len[i]==len)
+            {
+                entry.flags = chunk_flag_raw;
+                out.insert(out.end(), raw.data() + i*chunk_size, raw.data() + i*chunk_size + len);
+            }
+            else
+            {
+                out.insert(out.end(), comp.data() + i*bound, comp.data() + i*bound + comp_len[i]);
+            }
+        }
+
+        if(!pwrite_full(dst_fd, out.data(), out.size(), pos))
+        {
+            perror(("Error writing chunk store "+path).c_str());
+            ok = false;
+            break;
+        }
+
+        pos+=out.size();
+    }
+
+    close(src_fd);
+
+    // The header is written last, so an incomplete chunk store is invalid.
+    // The file is padded to whole pages for O_DIRECT reads of the index
+    ChunkStoreHeader header = {};
+    if(ok)
+    {
+        memcpy(header.magic, chunk_store_magic, sizeof(chunk_store_magic));
+        header.version = chunk_store_version;
+        header.header_size = chunk_store_header_size;
+        header.chunk_size = chunk_size;
+        header.algorithm = static_cast<uint32_t>(algorithm);
+        header.volume_size = volume_size;
+        header.n_chunks = n_chunks;
+        header.index_offset = pos;
+        std::random_device rd;
+        for(size_t i=0;i<sizeof(header.store_id);++i)
+            header.store_id[i] = static_cast<uint8_t>(rd());
+        header.checksum = hash_header(reinterpret_cast<const char*>(&header), offsetof(ChunkStoreHeader, checksum));
+
+        std::vector<char> header_buf(chunk_store_header_size);
+        memcpy(header_buf.data(), &header, sizeof(header));
+
+        uint64_t index_size = n_chunks*sizeof(IndexEntry);
+        if(!pwrite_full(dst_fd, reinterpret_cast<const char*>(index.data()), index_size, pos) ||
+            ftruncate(dst_fd, round_up(pos + index_size, page_size))!=0 ||
+            fdatasync(dst_fd)!=0 ||
+            !pwrite_full(dst_fd, header_buf.data(), header_buf.size(), 0) ||
+            fdatasync(dst_fd)!=0)
+        {
+            perror(("Error writing chunk store "+path).c_str());
+            ok = false;
+        }
+    }
+
+    close(dst_fd);
+
+    if(!ok)
+        return false;
+
+    std::cout << "Packed " << volume_size/(1024*1024) << " MB into " << n_chunks << " chunks of "
+        << chunk_size/1024 << " KB (" << algorithm_name(algorithm) << "), "
+        << pos/(1024*1024) << " MB compressed" << std::endl;
+    return true;
+}
+
+bool ChunkStore::open(int p_fd)
+{
+    fd = p_fd;
+
+    std::unique_ptr<char, decltype(&free)> header_buf(alloc_aligned(chunk_store_header_size), &free);
+    if(!header_buf ||
+        !pread_full(fd, header_buf.get(), chunk_store_header_size, 0))
+    {
+        perror("Error reading chunk store header");
+        return false;
+    }
+
+    ChunkStoreHeader header;
+    memcpy(&header, header_buf.get(), sizeof(header));
+    if(memcmp(header.magic, chunk_store_magic, sizeof(chunk_store_magic))!=0 ||
+        header.version!=chunk_store_version ||
+        header.checksum!=hash_header(header_buf.get(), offsetof(ChunkStoreHeader, checksum)))
+    {
+        std::cerr << "Backing file is not a chunk store (create one with --chunk-pack)" << std::endl;
+        return false;
+    }
+
+    if(header.volume_size==0 ||
+        header.chunk_size<page_size ||
+        header.chunk_size>max_chunk_size ||
+        (header.chunk_size & (header.chunk_size - 1))!=0 ||
+        header.n_chunks!=(header.volume_size + header.chunk_size - 1) / header.chunk_size ||
+        header.index_offset<chunk_store_header_size)
+    {
+        std::cerr << "Invalid chunk store header" << std::endl;
+        return false;
+    }
+
+    chunk_size = header.chunk_size;
+    algorithm = static_cast<Algorithm>(header.algorithm);
+    volume_size = header.volume_size;
+    n_chunks = header.n_chunks;
+    memcpy(store_id, header.store_id, sizeof(store_id));
+
+    if(!algorithm_supported(algorithm))
+    {
+        std::cerr << "Chunk store is compressed with " << algorithm_name(algorithm)
+            << ", which is not supported by this build" << std::endl;
+        return false;
+    }
+
+    // Whole pages for O_DIRECT
+    uint64_t index_start = header.index_offset / page_size * page_size;
+    uint64_t index_end = round_up(header.index_offset + n_chunks*sizeof(IndexEntry), page_size);
+    std::unique_ptr<char, decltype(&free)> index_buf(alloc_aligned(index_end - index_start), &free);
+    if(!index_buf ||
+        !pread_full(fd, index_buf.get(), index_end - index_start, index_start))
+    {
+        perror("Error reading chunk store index");
+        return false;
+    }
+
+    index.resize(n_chunks);
+    memcpy(index.data(), index_buf.get() + (header.index_offset - index_start), n_chunks*sizeof(IndexEntry));
+
+    for(uint64_t i=0;i<n_chunks;++i)
+    {
+        const IndexEntry& entry = index[i];
+        if(entry.size==0)
+            continue;
+
+        if(entry.offset<chunk_store_header_size ||
+            entry.offset + entry.size > header.index_offset ||
+            entry.size>raw_size(i) ||
+            ((entry.flags & chunk_flag_raw) && entry.size!=raw_size(i)))
+        {
+            std::cerr << "Invalid chunk store index entry of chunk " << i << std::endl;
+            return false;
+        }
+
+        compressed_size+=entry.size;
+    }
+
+    cache_max_chunks = cache_size / chunk_size;
+
+    for(std::unique_ptr<ThreadQueue>& queue: thread_queues)
+    {
+        queue->eventfd = eventfd(0, EFD_CLOEXEC);
+        if(queue->eventfd==-1)
+        {
+            perror("Error creating chunk store eventfd");
+            return false;
+        }
+    }
+
+    for(size_t i=0;i<n_decompress_threads;++i)
+    {
+        decompress_threads.push_back(std::thread([this]() {
+            decompress_thread();
+        }));
+    }
+
+    return true;
+}
+
+bool ChunkStore::open_overlay(const std::string& path, bool direct_io)
+{
+    map_offset = round_up(volume_size, page_size);
+    n_words = (n_chunks + 63) / 64;
+    uint64_t bitmap_size = round_up(n_words*sizeof(uint64_t), page_size);
+    uint64_t file_size = map_offset + page_size + bitmap_size;
+
+    overlay_fd = ::open(path.c_str(), O_RDWR|O_CREAT|O_CLOEXEC|(direct_io ? O_DIRECT : 0), S_IRUSR|S_IWUSR);
+    if(overlay_fd==-1)
+    {
+        perror(("Error opening chunk store overlay "+path).c_str());
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(overlay_fd, &st)!=0)
+    {
+        perror("Error getting chunk store overlay size");
+        return false;
+    }
+
+    marked = std::make_unique<std::atomic<uint64_t>[]>(n_words);
+    present = std::make_unique<std::atomic<uint64_t>[]>(n_words);
+    page_flushing.resize(bitmap_size / page_size);
+
+    std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(std::max(page_size, bitmap_size)), &free);
+    if(!buf)
+    {
+        std::cerr << "Error allocating chunk store overlay bitmap" << std::endl;
+        return false;
+    }
+
+    if(st.st_size==0)
+    {
+        OverlayHeader header = {};
+        memcpy(header.magic, overlay_magic, sizeof(overlay_magic));
+        header.version = chunk_store_version;
+        header.chunk_size = chunk_size;
+        header.n_chunks = n_chunks;
+        memcpy(header.store_id, store_id, sizeof(store_id));
+        header.checksum = hash_header(reinterpret_cast<const char*>(&header), offsetof(OverlayHeader, checksum));
+
+        memset(buf.get(), 0, page_size);
+        memcpy(buf.get(), &header, sizeof(header));
+
+        if(ftruncate(overlay_fd, file_size)!=0 ||
+            !pwrite_full(overlay_fd, buf.get(), page_size, map_offset) ||
+            fdatasync(overlay_fd)!=0)
+        {
+            perror("Error creating chunk store overlay");
+            return false;
+        }
+
+        for(uint64_t i=0;i<n_words;++i)
+        {
+            marked[i].store(0, std::memory_order_relaxed);
+            present[i].store(0, std::memory_order_relaxed);
+        }
+
+        std::cout << "Created chunk store overlay \"" << path << "\"" << std::endl;
+        return true;
+    }
+
+    if(!pread_full(overlay_fd, buf.get(), page_size, map_offset))
+    {
+        perror("Error reading chunk store overlay header");
+        return false;
+    }
+
+    OverlayHeader header;
+    memcpy(&header, buf.get(), sizeof(header));
+    if(memcmp(header.magic, overlay_magic, sizeof(overlay_magic))!=0 ||
+        header.version!=chunk_store_version ||
+        header.checksum!=hash_header(buf.get(), offsetof(OverlayHeader, checksum)) ||
+        header.chunk_size!=chunk_size ||
+        header.n_chunks!=n_chunks ||
+        memcmp(header.store_id, store_id, sizeof(store_id))!=0 ||
+        static_cast<uint64_t>(st.st_size)<file_size)
+    {
+        std::cerr << "Chunk store overlay \"" << path << "\" does not belong to this chunk store" << std::endl;
+        return false;
+    }
+
+    if(!pread_full(overlay_fd, buf.get(), bitmap_size, map_offset + page_size))
+    {
+        perror("Error reading chunk store overlay bitmap");
+        return false;
+    }
+
+    const uint64_t* words = reinterpret_cast<const uint64_t*>(buf.get());
+    uint64_t n_present = 0;
+    for(uint64_t i=0;i<n_words;++i)
+    {
+        marked[i].store(words[i], std::memory_order_relaxed);
+        present[i].store(words[i], std::memory_order_relaxed);
+        n_present+=__builtin_popcountll(words[i]);
+    }
+    overlay_chunks = n_present;
+
+    std::cout << "Loaded chunk store overlay \"" << path << "\" with " << n_present << " chunks" << std::endl;
+    return true;
+}
+
+std::string ChunkStore::describe() const
+{
+    std::ostringstream ret;
+    ret << volume_size/(1024*1024) << " MB in " << n_chunks << " chunks of "
+        << chunk_size/1024 << " KB (" << algorithm_name(algorithm) << ", "
+        << compressed_size/(1024*1024) << " MB compressed), "
+        << n_decompress_threads << " decompression threads, cache of "
+        << cache_max_chunks << " chunks";
+    if(overlay_fd!=-1)
+        ret << ", write overlay";
+    return ret.str();
+}
+
+void ChunkStore::decompress_thread()
+{
+#ifdef HAVE_ZSTD
+    std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+#endif
+
+    while(true)
+    {
+        Job* job;
+        {
+            std::unique_lock lock(jobs_mutex);
+            jobs_cond.wait(lock, [this]() {
+                return stop || !jobs.empty();
+            });
+
+            if(jobs.empty())
+                return;
+
+            job = jobs.front();
+            jobs.pop_front();
+        }
+
+        job->res = -EIO;
+#ifdef HAVE_LZ4
+        if(algorithm==Algorithm::Lz4)
+        {
+            int rc = LZ4_decompress_safe(job->src, job->dst, static_cast<int>(job->src_len),
+                        static_cast<int>(job->dst_len));
+            if(rc>=0 && static_cast<size_t>(rc)==job->dst_len)
+                job->res = 0;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        if(algorithm==Algorithm::Zstd && dctx)
+        {
+            size_t rc = ZSTD_decompressDCtx(dctx.get(), job->dst, job->dst_len, job->src, job->src_len);
+            if(!ZSTD_isError(rc) && rc==job->dst_len)
+                job->res = 0;
+        }
+#endif
+        job_done(*job);
+    }
+}
+
+void ChunkStore::job_done(Job& job)
+{
+    Batch* batch = job.batch;
+    size_t thread_idx = batch->thread_idx;
+    if(batch->pending.fetch_sub(1)!=1)
+        return;
+
+    // Last job of the batch. The worker thread resumes the waiting
+    // coroutine once it read the eventfd
+    ThreadQueue& queue = *thread_queues[thread_idx];
+    {
+        std::scoped_lock lock(queue.mutex);
+        queue.done.push_back(batch);
+    }
+
+    uint64_t val = 1;
+    if(write(queue.eventfd, &val, sizeof(val))!=sizeof(val))
+    {
+        static bool erronce=true;
+        if(erronce)
+        {
+            perror("Error signalling chunk store eventfd");
+            erronce=false;
+        }
+    }
+}
+
+void ChunkStore::BatchAwaiter::await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+{
+    batch.awaiter = p_awaiter;
+    batch.pending.store(batch.jobs.size());
+
+    {
+        std::scoped_lock lock(store.jobs_mutex);
+        for(Job& job: batch.jobs)
+        {
+            store.jobs.push_back(&job);
+        }
+    }
+
+    if(batch.jobs.size()==1)
+        store.jobs_cond.notify_one();
+    else
+        store.jobs_cond.notify_all();
+}
+
+fuse_io_context::io_uring_task_discard<int> ChunkStore::completions(fuse_io_context& io)
+{
+    ThreadQueue& queue = *thread_queues[io.fuse_ring.thread_idx];
+    std::vector<Batch*> done;
+    while(true)
+    {
+        io_uring_sqe* sqe = co_await io.get_sqe();
+        if(sqe==nullptr)
+            co_return -1;
+
+        io_uring_prep_read(sqe, queue.eventfd, &queue.eventfd_val,
+            sizeof(queue.eventfd_val), 0);
+
+        int rc = co_await io.complete(sqe);
+        if(rc<0 && rc!=-EINTR && rc!=-EAGAIN)
+        {
+            std::cerr << "Error reading chunk store eventfd rc=" << rc << std::endl;
+            co_return -1;
+        }
+
+        {
+            std::scoped_lock lock(queue.mutex);
+            done.swap(queue.done);
+        }
+
+        for(Batch* batch: done)
+        {
+            batch->awaiter.resume();
+        }
+        done.clear();
+    }
+}
+
+std::shared_ptr<const char[]> ChunkStore::cache_get(uint64_t chunk)
+{
+    std::scoped_lock lock(cache_mutex);
+    auto it = cache_map.find(chunk);
+    if(it==cache_map.end())
+        return nullptr;
+
+    cache_lru.splice(cache_lru.begin(), cache_lru, it->second);
+    return it->second->data;
+}
+
+void ChunkStore::cache_put(uint64_t chunk, std::shared_ptr<const char[]> data)
+{
+    if(cache_max_chunks==0)
+        return;
+
+    std::scoped_lock lock(cache_mutex);
+    if(cache_map.find(chunk)!=cache_map.end())
+        return;
+
+    cache_lru.push_front(CacheEntry{chunk, std::move(data)});
+    cache_map[chunk] = cache_lru.begin();
+
+    while(cache_lru.size()>cache_max_chunks)
+    {
+        cache_map.erase(cache_lru.back().chunk);
+        cache_lru.pop_back();
+    }
+}
+
+fuse_io_context::io_uring_task<int> ChunkStore::get_chunks(fuse_io_context& io,
+    const std::vector<uint64_t>& chunks, std::vector<std::shared_ptr<const char[]> >& data)
+{
+    data.assign(chunks.size(), nullptr);
+
+    std::vector<size_t> misses;
+    for(size_t i=0;i<chunks.size();++i)
+    {
+        if(is_zero(chunks[i]))
+            continue;
+
+        data[i] = cache_get(chunks[i]);
+        if(data[i])
+        {
+            ++cache_hits;
+        }
+        else
+        {
+            ++cache_misses;
+            misses.push_back(i);
+        }
+    }
+
+    if(misses.empty())
+        co_return 0;
+
+    // Misses that are adjacent in the file are read together, in whole
+    // pages for O_DIRECT
+    struct ChunkRead
+    {
+        uint64_t offset;
+        uint64_t len;
+        size_t first;
+        size_t n;
+    };
+
+    std::vector<ChunkRead> reads;
+    for(size_t i=0;i<misses.size();++i)
+    {
+        const IndexEntry& entry = index[chunks[misses[i]]];
+        uint64_t start = entry.offset / page_size * page_size;
+        uint64_t end = round_up(entry.offset + entry.size, page_size);
+
+        if(!reads.empty())
+        {
+            ChunkRead& prev = reads.back();
+            const IndexEntry& prev_entry = index[chunks[misses[i-1]]];
+            if(prev_entry.offset + prev_entry.size==entry.offset &&
+                end - prev.offset<=max_chunk_read)
+            {
+                prev.len = end - prev.offset;
+                ++prev.n;
+                continue;
+            }
+        }
+
+        reads.push_back(ChunkRead{start, end - start, i, 1});
+    }
+
+    std::vector<std::unique_ptr<char, decltype(&free)> > bufs;
+    for(const ChunkRead& read: reads)
+    {
+        bufs.push_back(std::unique_ptr<char, decltype(&free)>(alloc_aligned(read.len), &free));
+        if(!bufs.back())
+            co_return -ENOMEM;
+    }
+
+    for(size_t i=0;i<reads.size();)
+    {
+        size_t n = std::min(reads.size() - i, max_chunk_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+        if(sqe==nullptr)
+            co_return -1;
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            io_uring_prep_read(sqe, io.fuse_ring.backing_fd, bufs[i+j].get(),
+                reads[i+j].len, reads[i+j].offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+        for(size_t j=0;j<n;++j)
+        {
+            if(rcs[j]<0)
+                co_return rcs[j];
+
+            // The chunk store is padded to whole pages
+            if(static_cast<uint64_t>(rcs[j])<reads[i+j].len)
+                co_return -EIO;
+
+            read_bytes+=rcs[j];
+        }
+
+        i+=n;
+    }
+
+    Batch batch;
+    batch.thread_idx = io.fuse_ring.thread_idx;
+    std::vector<std::shared_ptr<char[]> > dsts(misses.size());
+    for(size_t r=0;r<reads.size();++r)
+    {
+        const ChunkRead& read = reads[r];
+        for(size_t i=read.first;i<read.first+read.n;++i)
+        {
+            uint64_t chunk = chunks[misses[i]];
+            const IndexEntry& entry = index[chunk];
+            const char* src = bufs[r].get() + (entry.offset - read.offset);
+            dsts[i] = std::shared_ptr<char[]>(new char[raw_size(chunk)]);
+
+            if(entry.flags & chunk_flag_raw)
+                memcpy(dsts[i].get(), src, entry.size);
+            else
+                batch.jobs.push_back(Job{&batch, src, entry.size, dsts[i].get(), raw_size(chunk), 0});
+        }
+    }
+
+    co_await BatchAwaiter(*this, batch);
+
+    int rc = 0;
+    for(const Job& job: batch.jobs)
+    {
+        if(job.res!=0)
+        {
+            ++decompress_errors;
+            rc = job.res;
+        }
+    }
+
+    if(rc<0)
+    {
+        static bool erronce=true;
+        if(erronce)
+        {
+            std::cerr << "Decompressing chunk store chunk failed rc=" << rc << std::endl;
+            erronce=false;
+        }
+        co_return rc;
+    }
+
+    for(size_t i=0;i<misses.size();++i)
+    {
+        uint64_t chunk = chunks[misses[i]];
+        decompressed_bytes+=raw_size(chunk);
+        data[misses[i]] = dsts[i];
+        cache_put(chunk, dsts[i]);
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task_discard<int> ChunkStore::prefetch(fuse_io_context& io, uint64_t offset, uint64_t len)
+{
+    if(cache_max_chunks==0 ||
+        len==0 ||
+        offset>=volume_size)
+        co_return 0;
+
+    uint64_t last = (std::min(offset + len, volume_size) - 1) / chunk_size;
+    std::vector<uint64_t> chunks;
+    for(uint64_t chunk=offset/chunk_size;chunk<=last;++chunk)
+    {
+        if(!in_overlay(chunk) && !is_zero(chunk))
+            chunks.push_back(chunk);
+    }
+
+    if(chunks.empty())
+        co_return 0;
+
+    std::vector<std::shared_ptr<const char[]> > data;
+    co_return co_await get_chunks(io, chunks, data);
+}
+
+fuse_io_context::io_uring_task<int> ChunkStore::flush_map_page(fuse_io_context& io, uint64_t page)
+{
+    uint64_t first_word = page*words_per_page;
+    uint64_t n = std::min(words_per_page, n_words - first_word);
+
+    co_return co_await flush_meta_page(io, overlay_mutex, overlay_waiters, page_flushing, page,
+        io.fuse_ring.files.chunk_overlay, map_offset + page_size + page*page_size, page_size,
+        [this, first_word, n](char* buf) {
+            uint64_t* words = reinterpret_cast<uint64_t*>(buf);
+            for(uint64_t i=0;i<n;++i)
+                words[i] = marked[first_word + i].load(std::memory_order_acquire);
+        },
+        [this, first_word, n](int rc, const char* buf) {
+            if(rc!=0)
+                return;
+
+            const uint64_t* words = reinterpret_cast<const uint64_t*>(buf);
+            for(uint64_t i=0;i<n;++i)
+                present[first_word + i].store(words[i], std::memory_order_release);
+        });
+}
+
+fuse_io_context::io_uring_task<int> ChunkStore::wait_page_flushed(fuse_io_context& io, uint64_t page)
+{
+    std::unique_lock lock(overlay_mutex);
+    while(page_flushing[page])
+    {
+        co_await overlay_waiters.wait(io, lock);
+    }
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> ChunkStore::copy_to_overlay(fuse_io_context& io,
+    const char* buf, uint64_t offset, uint64_t len)
+{
+    const uint64_t first = offset / chunk_size;
+    const uint64_t last = (offset + len - 1) / chunk_size;
+
+    // Claims the chunks that are not in the overlay yet. If another write
+    // copies one of them, waits until it is done
+    std::vector<uint64_t> chunks;
+    {
+        std::unique_lock lock(overlay_mutex);
+        while(true)
+        {
+            bool busy = false;
+            chunks.clear();
+            for(uint64_t chunk=first;chunk<=last;++chunk)
+            {
+                if(in_overlay(chunk))
+                    continue;
+
+                if(copying.find(chunk)!=copying.end())
+                {
+                    busy = true;
+                    break;
+                }
+
+                chunks.push_back(chunk);
+            }
+
+            if(!busy)
+            {
+                copying.insert(chunks.begin(), chunks.end());
+                break;
+            }
+
+            ++copy_waits;
+            co_await overlay_waiters.wait(io, lock);
+        }
+    }
+
+    if(chunks.empty())
+        co_return 0;
+
+    std::vector<std::shared_ptr<const char[]> > data;
+    int rc = co_await get_chunks(io, chunks, data);
+
+    // Whole chunks with the write applied, in whole pages for O_DIRECT.
+    // The last chunk is followed by padding up to map_offset
+    std::vector<std::unique_ptr<char, decltype(&free)> > bufs;
+    for(size_t i=0;rc==0 && i<chunks.size();++i)
+    {
+        uint64_t chunk_start = chunks[i]*chunk_size;
+        uint64_t raw = raw_size(chunks[i]);
+        uint64_t buf_len = round_up(raw, page_size);
+        bufs.push_back(std::unique_ptr<char, decltype(&free)>(alloc_aligned(buf_len), &free));
+        char* chunk_buf = bufs.back().get();
+        if(chunk_buf==nullptr)
+        {
+            rc = -ENOMEM;
+            break;
+        }
+
+        if(data[i])
+            memcpy(chunk_buf, data[i].get(), raw);
+        else
+            memset(chunk_buf, 0, raw);
+        memset(chunk_buf + raw, 0, buf_len - raw);
+
+        uint64_t write_start = std::max(offset, chunk_start);
+        uint64_t write_end = std::min(offset + len, chunk_start + raw);
+        memcpy(chunk_buf + (write_start - chunk_start), buf + (write_start - offset),
+            write_end - write_start);
+    }
+
+    for(size_t i=0;rc==0 && i<chunks.size();)
+    {
+        size_t n = std::min(chunks.size() - i, max_chunk_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+        if(sqe==nullptr)
+        {
+            rc = -EIO;
+            break;
+        }
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            io_uring_prep_write(sqe, io.fuse_ring.files.chunk_overlay, bufs[i+j].get(),
+                round_up(raw_size(chunks[i+j]), page_size), chunks[i+j]*chunk_size);
+            // Has to be on disk before the bitmap says the chunk is in the overlay
+            sqe->rw_flags = RWF_DSYNC;
+            sqe->flags |= IOSQE_FIXED_FILE;
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+        for(size_t j=0;j<n;++j)
+        {
+            if(rcs[j]<0)
+                rc = rcs[j];
+            else if(static_cast<uint64_t>(rcs[j])!=round_up(raw_size(chunks[i+j]), page_size))
+                rc = -EIO;
+        }
+
+        i+=n;
+    }
+
+    if(rc==0)
+    {
+        for(uint64_t chunk: chunks)
+        {
+            marked[chunk/64].fetch_or(1ULL << (chunk % 64), std::memory_order_release);
+        }
+
+        for(uint64_t chunk: chunks)
+        {
+            while(!in_overlay(chunk))
+            {
+                uint64_t page = chunk/64/words_per_page;
+                int frc = co_await flush_map_page(io, page);
+                if(frc<0)
+                {
+                    rc = frc;
+                    break;
+                }
+
+                if(frc==1)
+                    co_await wait_page_flushed(io, page);
+            }
+
+            if(rc<0)
+                break;
+        }
+
+        overlay_chunks+=chunks.size();
+        overlay_copies+=chunks.size();
+    }
+
+    if(rc<0)
+    {
+        static bool erronce=true;
+        if(erronce)
+        {
+            std::cerr << "Copying chunks to the chunk store overlay failed rc=" << rc << std::endl;
+            erronce=false;
+        }
+    }
+
+    std::scoped_lock lock(overlay_mutex);
+    for(uint64_t chunk: chunks)
+    {
+        copying.erase(chunk);
+    }
+    overlay_waiters.notify_all();
+
+    co_return rc;
+}
+
+ChunkStore::Stats ChunkStore::get_stats() const
+{
+    Stats ret;
+    ret.cache_hits = cache_hits.load(std::memory_order_relaxed);
+    ret.cache_misses = cache_misses.load(std::memory_order_relaxed);
+    ret.read_bytes = read_bytes.load(std::memory_order_relaxed);
+    ret.decompressed_bytes = decompressed_bytes.load(std::memory_order_relaxed);
+    ret.decompress_errors = decompress_errors.load(std::memory_order_relaxed);
+    ret.overlay_chunks = overlay_chunks.load(std::memory_order_relaxed);
+    ret.overlay_copies = overlay_copies.load(std::memory_order_relaxed);
+    ret.copy_waits = copy_waits.load(std::memory_order_relaxed);
+    return ret;
+}
+
+fuse_io_context::io_uring_task<int> chunk_store_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios)
+{
+    ChunkStore* store = io.fuse_ring.chunk_store;
+    const uint64_t chunk_size = store->get_chunk_size();
+
+    struct Piece
+    {
+        size_t req;
+        uint64_t offset;
+        uint64_t len;
+        uint64_t req_offset;
+    };
+
+    // Overlay pieces are at their volume offset in the overlay. Chunk pieces
+    // are copied from the decompressed chunks[piece_chunk[...]]
+    std::vector<Piece> overlay_pieces;
+    std::vector<Piece> chunk_pieces;
+    std::vector<uint64_t> chunks;
+    std::vector<size_t> piece_chunk;
+    std::vector<uint64_t> req_len(ios.size());
+    for(size_t i=0;i<ios.size();++i)
+    {
+        BlockIo& req = ios[i];
+        req.res = 0;
+        req_len[i] = block_io_len(req, store->get_size());
+
+        if(write)
+        {
+            if(!store->has_overlay())
+            {
+                req.res = -EROFS;
+                continue;
+            }
+
+            if(req_len[i]==0)
+            {
+                req.res = -ENOSPC;
+                continue;
+            }
+
+            int rc = co_await store->copy_to_overlay(io, req.buf, req.offset, req_len[i]);
+            if(rc<0)
+            {
+                req.res = rc;
+                continue;
+            }
+        }
+
+        const uint64_t req_end = req.offset + req_len[i];
+        for(uint64_t off=req.offset;off<req_end;)
+        {
+            uint64_t chunk = off / chunk_size;
+            uint64_t end = std::min(req_end, (chunk + 1)*chunk_size);
+            Piece piece = {i, off, end - off, off - req.offset};
+
+            if(write || store->in_overlay(chunk))
+            {
+                if(!overlay_pieces.empty() &&
+                    overlay_pieces.back().req==i &&
+                    overlay_pieces.back().offset + overlay_pieces.back().len==off)
+                    overlay_pieces.back().len+=piece.len;
+                else
+                    overlay_pieces.push_back(piece);
+            }
+            else if(store->is_zero(chunk))
+            {
+                memset(req.buf + piece.req_offset, 0, piece.len);
+            }
+            else
+            {
+                if(chunks.empty() || chunks.back()!=chunk)
+                    chunks.push_back(chunk);
+                piece_chunk.push_back(chunks.size() - 1);
+                chunk_pieces.push_back(piece);
+            }
+
+            off = end;
+        }
+    }
+
+    for(size_t i=0;i<overlay_pieces.size();)
+    {
+        size_t n = std::min(overlay_pieces.size() - i, max_chunk_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+        if(sqe==nullptr)
+            co_return -1;
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            const Piece& piece = overlay_pieces[i+j];
+            const BlockIo& req = ios[piece.req];
+            int overlay_fd = io.fuse_ring.files.chunk_overlay;
+            char* buf = req.buf + piece.req_offset;
+            uint64_t len = piece.len;
+            // Reads of the end of the request in whole pages for O_DIRECT. Request
+            // buffers are whole pages
+            if(!write &&
+                io.fuse_ring.direct_io &&
+                piece.req_offset + piece.len==req_len[piece.req])
+                len = round_up(len, page_size);
+
+            if(write && req.buf_idx>=0)
+                io_uring_prep_write_fixed(sqe, overlay_fd, buf, len, piece.offset, req.buf_idx);
+            else if(write)
+                io_uring_prep_write(sqe, overlay_fd, buf, len, piece.offset);
+            else if(req.buf_idx>=0)
+                io_uring_prep_read_fixed(sqe, overlay_fd, buf, len, piece.offset, req.buf_idx);
+            else
+                io_uring_prep_read(sqe, overlay_fd, buf, len, piece.offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+
+        for(size_t j=0;j<n;++j)
+        {
+            const Piece& piece = overlay_pieces[i+j];
+            BlockIo& req = ios[piece.req];
+            if(req.res<0)
+                continue;
+
+            // The overlay has the size of the volume, so short transfers are errors
+            req.res = block_io_piece_res(rcs[j], piece.len);
+        }
+
+        i+=n;
+    }
+
+    if(!chunks.empty())
+    {
+        std::vector<std::shared_ptr<const char[]> > data;
+        int rc = co_await store->get_chunks(io, chunks, data);
+
+        for(size_t i=0;i<chunk_pieces.size();++i)
+        {
+            const Piece& piece = chunk_pieces[i];
+            BlockIo& req = ios[piece.req];
+            if(req.res<0)
+                continue;
+
+            if(rc<0)
+            {
+                req.res = rc;
+                continue;
+            }
+
+            uint64_t chunk = chunks[piece_chunk[i]];
+            memcpy(req.buf + piece.req_offset, data[piece_chunk[i]].get() + (piece.offset - chunk*chunk_size),
+                piece.len);
+        }
+    }
+
+    for(size_t i=0;i<ios.size();++i)
+    {
+        if(ios[i].res>=0)
+            ios[i].res = static_cast<int>(req_len[i]);
+    }
+
+    co_return 0;
+}
+
+void ChunkStoreBackend::start(fuse_io_context& io)
+{
+    chunk_store->completions(io);
+}
+
+fuse_io_context::io_uring_task<int> ChunkStoreBackend::flush(fuse_io_context& io,
+    bool datasync)
+{
+    std::vector<int> fds = {io.fuse_ring.backing_fd};
+    if(io.fuse_ring.files.chunk_overlay!=-1)
+        fds.push_back(io.fuse_ring.files.chunk_overlay);
+
+    std::vector<int> rcs;
+    if(co_await sync_files(io, fds, datasync, rcs)!=0)
+        co_return -1;
+
+    int ret = 0;
+    for(int rc: rcs)
+    {
+        if(rc<0)
+            ret = rc;
+    }
+
+    co_return ret;
+}
+
+std::string ChunkStoreBackend::get_stats() const
+{
+    ChunkStore::Stats chunk_stats = chunk_store->get_stats();
+    std::ostringstream ret;
+    ret << "Chunk store: cache hits=" << chunk_stats.cache_hits
+        << " cache misses=" << chunk_stats.cache_misses
+        << " read MB=" << chunk_stats.read_bytes/(1024*1024)
+        << " decompressed MB=" << chunk_stats.decompressed_bytes/(1024*1024)
+        << " decompress errors=" << chunk_stats.decompress_errors
+        << " overlay chunks=" << chunk_stats.overlay_chunks
+        << " overlay copies=" << chunk_stats.overlay_copies
+        << " copy waits=" << chunk_stats.copy_waits;
+    return ret.str();
+}
@@ -0,0 +1,291 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include "backend.h"
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+
+// Backing file in chunk store format: the volume in chunks of a fixed size,
+// each compressed with LZ4 or zstd, followed by an index with the file
+// offset and compressed size of every chunk. pack() creates one from a
+// raw image.
+//
+// Compressed chunks are read on the backing ring and decompressed by a pool
+// of decompression threads. The worker thread that needs a chunk is woken
+// up via its eventfd, which completions() reads, once all chunks it waits
+// for are decompressed. Decompressed chunks are kept in an LRU cache shared
+// by all worker threads.
+//
+// The chunk store itself is never written. With an overlay file, a chunk is
+// copied (decompressed) to the overlay on the first write to it and read
+// from there afterwards. The overlay has the chunks at their volume offset,
+// followed by a bitmap of the chunks it has, which is written after the
+// chunk data. Its fixed file index is files.chunk_overlay of the ring.
+class ChunkStore
+{
+public:
+    enum class Algorithm : uint32_t
+    {
+        Lz4 = 1,
+        Zstd = 2
+    };
+
+    struct Stats
+    {
+        uint64_t cache_hits;
+        uint64_t cache_misses;
+        uint64_t read_bytes;
+        uint64_t decompressed_bytes;
+        uint64_t decompress_errors;
+        uint64_t overlay_chunks;
+        uint64_t overlay_copies;
+        uint64_t copy_waits;
+    };
+
+    // cache_size is the size of the decompressed chunk cache in bytes.
+    // n_threads is the number of worker threads
+    ChunkStore(uint64_t cache_size, size_t n_decompress_threads, size_t n_threads);
+    ~ChunkStore();
+
+    // Reads header and index from fd and starts the decompression threads
+    bool open(int fd);
+
+    // Opens or creates the write overlay
+    bool open_overlay(const std::string& path, bool direct_io);
+
+    // Compresses src_path into a new chunk store at path, on n_threads threads.
+    // level is only used by zstd
+    static bool pack(const std::string& src_path, const std::string& path,
+        uint32_t chunk_size, Algorithm algorithm, int level, size_t n_threads);
+
+    static bool parse_algorithm(const std::string& name, Algorithm& algorithm);
+
+    uint64_t get_size() const
+    {
+        return volume_size;
+    }
+
+    bool has_overlay() const
+    {
+        return overlay_fd!=-1;
+    }
+
+    int get_overlay_fd() const
+    {
+        return overlay_fd;
+    }
+
+    std::string describe() const;
+
+    // Resumes the coroutines of this worker thread whose chunks were
+    // decompressed. Runs on every worker thread
+    fuse_io_context::io_uring_task_discard<int> completions(fuse_io_context& io);
+
+    // Decompresses the chunks of [offset, offset+len) into the cache
+    fuse_io_context::io_uring_task_discard<int> prefetch(fuse_io_context& io, uint64_t offset, uint64_t len);
+
+    // Decompressed chunks (from the cache if possible) in the order of chunks. Returns 0 or
+    // a negative errno. Chunks that are all zeros are nullptr
+    [[nodiscard]] fuse_io_context::io_uring_task<int> get_chunks(fuse_io_context& io,
+        const std::vector<uint64_t>& chunks, std::vector<std::shared_ptr<const char[]> >& data);
+
+    // Copies the chunks of [offset, offset+len) that are not in the overlay yet
+    // to it, with the data of the write at buf applied. Returns 0 or a negative
+    // errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> copy_to_overlay(fuse_io_context& io,
+        const char* buf, uint64_t offset, uint64_t len);
+
+    bool in_overlay(uint64_t chunk) const
+    {
+        return overlay_fd!=-1 &&
+            (present[chunk/64].load(std::memory_order_acquire) & (1ULL << (chunk % 64)))!=0;
+    }
+
+    uint32_t get_chunk_size() const
+    {
+        return chunk_size;
+    }
+
+    // Decompressed size of the chunk
+    uint64_t raw_size(uint64_t chunk) const
+    {
+        return std::min(static_cast<uint64_t>(chunk_size), volume_size - chunk*chunk_size);
+    }
+
+    bool is_zero(uint64_t chunk) const
+    {
+        return index[chunk].size==0;
+    }
+
+    Stats get_stats() const;
+
+private:
+    struct IndexEntry
+    {
+        uint64_t offset;
+        uint32_t size;
+        uint32_t flags;
+    };
+
+    struct Batch;
+
+    struct Job
+    {
+        Batch* batch;
+        const char* src;
+        size_t src_len;
+        char* dst;
+        size_t dst_len;
+        int res;
+    };
+
+    // Chunks a coroutine waits for
+    struct Batch
+    {
+        std::vector<Job> jobs;
+        std::atomic<size_t> pending;
+        size_t thread_idx;
+        std::coroutine_handle<> awaiter;
+    };
+
+    struct BatchAwaiter
+    {
+        BatchAwaiter(ChunkStore& store, Batch& batch) noexcept
+            : store(store), batch(batch) {}
+
+        bool await_ready() const noexcept
+        {
+            return batch.jobs.empty();
+        }
+
+        void await_suspend(std::coroutine_handle<> p_awaiter) noexcept;
+
+        void await_resume() const noexcept
+        {
+        }
+
+    private:
+        ChunkStore& store;
+        Batch& batch;
+    };
+
+    struct ThreadQueue
+    {
+        std::mutex mutex;
+        std::vector<Batch*> done;
+        int eventfd;
+        uint64_t eventfd_val;
+    };
+
+    void decompress_thread();
+    void job_done(Job& job);
+    std::shared_ptr<const char[]> cache_get(uint64_t chunk);
+    void cache_put(uint64_t chunk, std::shared_ptr<const char[]> data);
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush_map_page(fuse_io_context& io, uint64_t page);
+    [[nodiscard]] fuse_io_context::io_uring_task<int> wait_page_flushed(fuse_io_context& io, uint64_t page);
+
+    int fd;
+    uint32_t chunk_size;
+    Algorithm algorithm;
+    uint64_t volume_size;
+    uint64_t n_chunks;
+    uint8_t store_id[16];
+    uint64_t compressed_size;
+    std::vector<IndexEntry> index;
+
+    // Decompression threads and their queue
+    size_t n_decompress_threads;
+    std::vector<std::thread> decompress_threads;
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_cond;
+    std::deque<Job*> jobs;
+    bool stop;
+    std::vector<std::unique_ptr<ThreadQueue> > thread_queues;
+
+    // Decompressed chunk cache (LRU, most recent first)
+    struct CacheEntry
+    {
+        uint64_t chunk;
+        std::shared_ptr<const char[]> data;
+    };
+    std::mutex cache_mutex;
+    size_t cache_max_chunks;
+    uint64_t cache_size;
+    std::list<CacheEntry> cache_lru;
+    std::unordered_map<uint64_t, std::list<CacheEntry>::iterator> cache_map;
+
+    // Write overlay. marked has one bit per chunk copied to the overlay,
+    // present the bits that are in the bitmap in the overlay file. Chunks
+    // are only read from the overlay once they are present
+    int overlay_fd;
+    uint64_t map_offset;
+    uint64_t n_words;
+    std::unique_ptr<std::atomic<uint64_t>[]> marked;
+    std::unique_ptr<std::atomic<uint64_t>[]> present;
+    std::mutex overlay_mutex;
+    std::unordered_set<uint64_t> copying;
+    std::vector<bool> page_flushing;
+    // Writes waiting for copies of the same chunks and bitmap page writes
+    fuse_io_context::SharedWaitQueue overlay_waiters;
+
+    std::atomic<uint64_t> cache_hits;
+    std::atomic<uint64_t> cache_misses;
+    std::atomic<uint64_t> read_bytes;
+    std::atomic<uint64_t> decompressed_bytes;
+    std::atomic<uint64_t> decompress_errors;
+    std::atomic<uint64_t> overlay_chunks;
+    std::atomic<uint64_t> overlay_copies;
+    std::atomic<uint64_t> copy_waits;
+};
+
+// Reads from the overlay and the (cached) decompressed chunks. Writes
+// go to the overlay, or fail with EROFS without one
+[[nodiscard]] fuse_io_context::io_uring_task<int> chunk_store_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios);
+
+// The chunk store as backend. Syncs the overlay too, if there is one
+class ChunkStoreBackend : public Backend
+{
+public:
+    explicit ChunkStoreBackend(ChunkStore* chunk_store)
+        : chunk_store(chunk_store) {}
+
+    std::string describe() const override
+    {
+        return chunk_store->describe();
+    }
+
+    uint64_t get_size() const override
+    {
+        return chunk_store->get_size();
+    }
+
+    // Decompression completions on every worker thread
+    void start(fuse_io_context& io) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io,
+        bool write, std::vector<BlockIo>& ios) override
+    {
+        return chunk_store_io(io, write, ios);
+    }
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush(fuse_io_context& io,
+        bool datasync) override;
+
+    std::string get_stats() const override;
+
+private:
+    ChunkStore* chunk_store;
+};
@@ -0,0 +1,1169 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "dedup.h"
+#include "io_util.h"
+#include <iostream>
+#include <sstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    const char dedup_magic[8] = {'F', 'U', 'S', 'D', 'D', 'P', '0', '1'};
+    const uint32_t dedup_version = 1;
+    const uint64_t page_size = 4096;
+    // Block map starts after the header page
+    const uint64_t dedup_header_size = page_size;
+    // Maximum number of reads/writes to wait for at once
+    const size_t max_dedup_batch = 64;
+    // Size of the block map reads when opening the store
+    const uint64_t map_read_size = 4*1024*1024;
+
+    struct DedupHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t block_size;
+        uint32_t reserved;
+        uint64_t volume_size;
+        uint64_t n_blocks;
+        uint64_t n_slots;
+        uint64_t map_offset;
+        uint64_t data_offset;
+        uint64_t checksum;
+    };
+
+    // Block map entry. slot is the slot+1, 0 for zeros
+    struct MapEntry
+    {
+        uint64_t slot;
+        uint64_t hash[2];
+        uint64_t reserved;
+    };
+
+    const uint64_t entries_per_page = page_size / sizeof(MapEntry);
+
+    // Hash: 8 64-bit lanes over 64 byte stripes, accumulated like XXH3
+    // (data xor key, low half times high half, plus the data of the
+    // neighbour lane) and scrambled every 16 stripes. The lanes are folded
+    // into 128 bits at the end
+    const size_t hash_stripe_size = 64;
+    const size_t stripes_per_scramble = 16;
+    const uint64_t prime32_1 = 0x9E3779B1ULL;
+    const uint64_t prime64_1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+    alignas(32) const uint64_t hash_init[8] = {
+        0x00000000C2B2AE3DULL, 0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+        0x85EBCA77C2B2AE63ULL, 0x0000000085EBCA77ULL, 0x27D4EB2F165667C5ULL, 0x000000009E3779B1ULL};
+    alignas(32) const uint64_t hash_key[8] = {
+        0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+        0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL};
+    alignas(32) const uint64_t scramble_key[8] = {
+        0xcb00c391bb52283cULL, 0xa32e531b8b65d088ULL, 0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+        0x3f349ce33f76faa8ULL, 0x1d4f0bc7c7bbdcf9ULL, 0x3159b4cd4be0518aULL, 0x647378d9c97e9fc8ULL};
+
+    void accumulate_stripe(uint64_t acc[8], const char* p)
+    {
+        uint64_t d[8];
+        memcpy(d, p, sizeof(d));
+        for(size_t i=0;i<8;++i)
+        {
+            uint64_t dk = d[i] ^ hash_key[i];
+            acc[i] += d[i ^ 1] + (dk & 0xFFFFFFFFULL)*(dk >> 32);
+        }
+    }
+
+    void scramble_acc(uint64_t acc[8])
+    {
+        for(size_t i=0;i<8;++i)
+        {
+            uint64_t a = acc[i];
+            a ^= a >> 47;
+            a ^= scramble_key[i];
+            acc[i] = a*prime32_1;
+        }
+    }
+
+    void hash_stripes(uint64_t acc[8], const char* data, size_t n_stripes)
+    {
+        for(size_t s=0;s<n_stripes;++s)
+        {
+            accumulate_stripe(acc, data + s*hash_stripe_size);
+            if((s + 1) % stripes_per_scramble==0)
+                scramble_acc(acc);
+        }
+    }
+
+#if defined(__x86_64__)
+    // Same as hash_stripes() with two lanes of four per AVX2 register
+    __attribute__((target("avx2"))) void hash_stripes_avx2(uint64_t acc[8], const char* data, size_t n_stripes)
+    {
+        __m256i a[2];
+        __m256i key[2];
+        __m256i skey[2];
+        for(size_t h=0;h<2;++h)
+        {
+            a[h] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + h*4));
+            key[h] = _mm256_load_si256(reinterpret_cast<const __m256i*>(hash_key + h*4));
+            skey[h] = _mm256_load_si256(reinterpret_cast<const __m256i*>(scramble_key + h*4));
+        }
+        const __m256i prime = _mm256_set1_epi64x(prime32_1);
+
+        for(size_t s=0;s<n_stripes;++s)
+        {
+            const char* p = data + s*hash_stripe_size;
+            for(size_t h=0;h<2;++h)
+            {
+                __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + h*32));
+                __m256i dk = _mm256_xor_si256(d, key[h]);
+                // High halves into the low halves, so mul_epu32 multiplies the two halves
+                __m256i dk_hi = _mm256_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1));
+                __m256i prod = _mm256_mul_epu32(dk, dk_hi);
+                // Swaps neighbouring lanes
+                __m256i d_swap = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+                a[h] = _mm256_add_epi64(a[h], _mm256_add_epi64(prod, d_swap));
+            }
+
+            if((s + 1) % stripes_per_scramble==0)
+            {
+                for(size_t h=0;h<2;++h)
+                {
+                    __m256i v = _mm256_xor_si256(a[h], _mm256_srli_epi64(a[h], 47));
+                    v = _mm256_xor_si256(v, skey[h]);
+                    __m256i lo = _mm256_mul_epu32(v, prime);
+                    __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(v, 32), prime);
+                    a[h] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+                }
+            }
+        }
+
+        for(size_t h=0;h<2;++h)
+        {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + h*4), a[h]);
+        }
+    }
+#endif
+
+    uint64_t avalanche(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    bool is_zero(const char* data, size_t len)
+    {
+        return len==0 ||
+            (data[0]==0 && memcmp(data, data + 1, len - 1)==0);
+    }
+}
+
+DedupStore::Hash dedup_hash(const char* data, size_t len)
+{
+    uint64_t acc[8];
+    memcpy(acc, hash_init, sizeof(acc));
+
+    size_t n_stripes = len / hash_stripe_size;
+#if defined(__x86_64__)
+    static const bool have_avx2 = __builtin_cpu_supports("avx2");
+    if(have_avx2)
+        hash_stripes_avx2(acc, data, n_stripes);
+    else
+        hash_stripes(acc, data, n_stripes);
+#else
+    hash_stripes(acc, data, n_stripes);
+#endif
+
+    if(len % hash_stripe_size!=0)
+    {
+        char tail[hash_stripe_size] = {};
+        memcpy(tail, data + n_stripes*hash_stripe_size, len % hash_stripe_size);
+        accumulate_stripe(acc, tail);
+    }
+
+    DedupStore::Hash ret;
+    ret.h[0] = len*prime64_1;
+    ret.h[1] = len*prime64_2 + 1;
+    for(size_t i=0;i<8;++i)
+    {
+        ret.h[0] = avalanche(ret.h[0] ^ acc[i]);
+        ret.h[1] = avalanche(ret.h[1] + acc[7 - i]*prime64_1);
+    }
+    return ret;
+}
+
+DedupStore::DedupStore(size_t n_hash_threads, size_t n_threads, bool verify)
+    : fd(-1), block_size(0), volume_size(0), n_blocks(0), n_slots(0),
+        map_offset(dedup_header_size), data_offset(0), verify(verify),
+        n_hash_threads(n_hash_threads), stop(false), next_slot(0),
+        used_slots(0), zero_blocks(0), dedup_hits(0), new_slots(0),
+        verify_mismatches(0), hashed_bytes(0), lock_waits(0)
+{
+    for(size_t i=0;i<n_threads;++i)
+    {
+        std::unique_ptr<ThreadQueue> queue = std::make_unique<ThreadQueue>();
+        queue->eventfd = -1;
+        queue->eventfd_val = 0;
+        thread_queues.push_back(std::move(queue));
+    }
+}
+
+DedupStore::~DedupStore()
+{
+    {
+        std::scoped_lock lock(jobs_mutex);
+        stop = true;
+    }
+    jobs_cond.notify_all();
+
+    for(std::thread& thread: hash_threads)
+    {
+        thread.join();
+    }
+
+    for(std::unique_ptr<ThreadQueue>& queue: thread_queues)
+    {
+        if(queue->eventfd!=-1)
+            close(queue->eventfd);
+    }
+}
+
+bool DedupStore::open(int p_fd, uint64_t p_volume_size, uint32_t p_block_size)
+{
+    fd = p_fd;
+
+    struct stat st;
+    if(fstat(fd, &st)!=0)
+    {
+        perror("Error getting dedup store size");
+        return false;
+    }
+
+    std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(std::max(page_size, map_read_size)), &free);
+    if(!buf)
+    {
+        std::cerr << "Error allocating dedup store buffer" << std::endl;
+        return false;
+    }
+
+    DedupHeader header;
+    if(st.st_size==0)
+    {
+        if(p_volume_size==0)
+        {
+            std::cerr << "Dedup store needs a size" << std::endl;
+            return false;
+        }
+
+        header = {};
+        memcpy(header.magic, dedup_magic, sizeof(dedup_magic));
+        header.version = dedup_version;
+        header.header_size = dedup_header_size;
+        header.block_size = p_block_size;
+        header.volume_size = p_volume_size;
+        header.n_blocks = (p_volume_size + p_block_size - 1) / p_block_size;
+        // Up to two slots per block, while the block map in the file still has
+        // the old one. The file is sparse, so this only uses what is written
+        header.n_slots = header.n_blocks*2;
+        header.map_offset = dedup_header_size;
+        header.data_offset = round_up(header.map_offset + header.n_blocks*sizeof(MapEntry),
+                                static_cast<uint64_t>(p_block_size));
+        header.checksum = hash_header(reinterpret_cast<const char*>(&header), offsetof(DedupHeader, checksum));
+
+        memset(buf.get(), 0, page_size);
+        memcpy(buf.get(), &header, sizeof(header));
+
+        if(ftruncate(fd, header.data_offset + header.n_slots*header.block_size)!=0 ||
+            !pwrite_full(fd, buf.get(), page_size, 0) ||
+            fdatasync(fd)!=0)
+        {
+            perror("Error creating dedup store");
+            return false;
+        }
+
+        std::cout << "Created dedup store of " << p_volume_size/(1024*1024) << " MB" << std::endl;
+    }
+    else
+    {
+        if(!pread_full(fd, buf.get(), page_size, 0))
+        {
+            perror("Error reading dedup store header");
+            return false;
+        }
+
+        memcpy(&header, buf.get(), sizeof(header));
+        if(memcmp(header.magic, dedup_magic, sizeof(dedup_magic))!=0 ||
+            header.version!=dedup_version ||
+            header.checksum!=hash_header(buf.get(), offsetof(DedupHeader, checksum)))
+        {
+            std::cerr << "Backing file is not a dedup store" << std::endl;
+            return false;
+        }
+
+        if(header.header_size!=dedup_header_size ||
+            header.block_size<page_size ||
+            (header.block_size & (header.block_size-1))!=0 ||
+            header.n_blocks!=(header.volume_size + header.block_size - 1) / header.block_size ||
+            header.map_offset!=dedup_header_size ||
+            header.data_offset<header.map_offset + header.n_blocks*sizeof(MapEntry) ||
+            header.data_offset % header.block_size!=0 ||
+            static_cast<uint64_t>(st.st_size)<header.data_offset + header.n_slots*header.block_size)
+        {
+            std::cerr << "Dedup store header is invalid" << std::endl;
+            return false;
+        }
+    }
+
+    block_size = header.block_size;
+    volume_size = header.volume_size;
+    n_blocks = header.n_blocks;
+    n_slots = header.n_slots;
+    map_offset = header.map_offset;
+    data_offset = header.data_offset;
+
+    mem_slot.resize(n_blocks);
+    disk_slot.resize(n_blocks);
+    page_flushing.resize((n_blocks + entries_per_page - 1) / entries_per_page);
+
+    // Reference counts and fingerprint index from the block map
+    uint64_t map_size = round_up(n_blocks*sizeof(MapEntry), page_size);
+    for(uint64_t off=0;off<map_size;off+=map_read_size)
+    {
+        uint64_t len = std::min(map_read_size, map_size - off);
+        if(!pread_full(fd, buf.get(), len, map_offset + off))
+        {
+            perror("Error reading dedup store block map");
+            return false;
+        }
+
+        const MapEntry* entries = reinterpret_cast<const MapEntry*>(buf.get());
+        uint64_t first = off / sizeof(MapEntry);
+        for(uint64_t i=0;i<len/sizeof(MapEntry) && first + i<n_blocks;++i)
+        {
+            const MapEntry& entry = entries[i];
+            if(entry.slot==0)
+            {
+                ++zero_blocks;
+                continue;
+            }
+
+            uint64_t slot = entry.slot - 1;
+            if(slot>=n_slots)
+            {
+                std::cerr << "Block " << first + i << " of the dedup store has invalid slot " << slot << std::endl;
+                return false;
+            }
+
+            if(slot>=next_slot)
+            {
+                next_slot = slot + 1;
+                refs.resize(next_slot);
+                slot_hash.resize(next_slot);
+            }
+
+            Hash hash = {{entry.hash[0], entry.hash[1]}};
+            if(refs[slot]==0)
+            {
+                slot_hash[slot] = hash;
+                index.insert(std::make_pair(hash, slot));
+                ++used_slots;
+            }
+            else if(!(slot_hash[slot]==hash))
+            {
+                std::cerr << "Blocks of slot " << slot << " of the dedup store have different hashes" << std::endl;
+                return false;
+            }
+
+            // Referenced by the block map in memory and in the file
+            refs[slot]+=2;
+            mem_slot[first + i] = entry.slot;
+            disk_slot[first + i] = entry.slot;
+        }
+    }
+
+    for(uint64_t slot=next_slot;slot-->0;)
+    {
+        if(refs[slot]==0)
+            free_slots.push_back(slot);
+    }
+
+    for(std::unique_ptr<ThreadQueue>& queue: thread_queues)
+    {
+        queue->eventfd = eventfd(0, EFD_CLOEXEC);
+        if(queue->eventfd==-1)
+        {
+            perror("Error creating dedup eventfd");
+            return false;
+        }
+    }
+
+    for(size_t i=0;i<n_hash_threads;++i)
+    {
+        hash_threads.push_back(std::thread([this]() {
+            hash_thread();
+        }));
+    }
+
+    return true;
+}
+
+std::string DedupStore::describe() const
+{
+    std::ostringstream ret;
+    ret << volume_size/(1024*1024) << " MB in " << n_blocks << " blocks of "
+        << block_size/1024 << " KB, " << used_slots.load() << " slots used ("
+        << used_slots.load()*block_size/(1024*1024) << " MB), "
+        << n_hash_threads << " hash threads";
+    if(!verify)
+        ret << ", not verifying duplicates";
+    return ret.str();
+}
+
+void DedupStore::run_job(Job& job)
+{
+    job.zero = is_zero(job.data, job.len);
+    if(!job.zero)
+        job.hash = dedup_hash(job.data, job.len);
+}
+
+void DedupStore::hash_thread()
+{
+    while(true)
+    {
+        Job* job;
+        {
+            std::unique_lock lock(jobs_mutex);
+            jobs_cond.wait(lock, [this]() {
+                return stop || !jobs.empty();
+            });
+
+            if(jobs.empty())
+                return;
+
+            job = jobs.front();
+            jobs.pop_front();
+        }
+
+        run_job(*job);
+        job_done(*job);
+    }
+}
+
+void DedupStore::job_done(Job& job)
+{
+    Batch* batch = job.batch;
+    size_t thread_idx = batch->thread_idx;
+    if(batch->pending.fetch_sub(1)!=1)
+        return;
+
+    // Last job of the batch. The worker thread resumes the waiting
+    // coroutine once it read the eventfd
+    ThreadQueue& queue = *thread_queues[thread_idx];
+    {
+        std::scoped_lock lock(queue.mutex);
+        queue.done.push_back(batch);
+    }
+
+    uint64_t val = 1;
+    if(::write(queue.eventfd, &val, sizeof(val))!=sizeof(val))
+    {
+        static bool erronce=true;
+        if(erronce)
+        {
+            perror("Error signalling dedup eventfd");
+            erronce=false;
+        }
+    }
+}
+
+void DedupStore::BatchAwaiter::await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+{
+    batch.awaiter = p_awaiter;
+    batch.pending.store(batch.jobs.size());
+
+    {
+        std::scoped_lock lock(store.jobs_mutex);
+        for(Job& job: batch.jobs)
+        {
+            store.jobs.push_back(&job);
+        }
+    }
+
+    if(batch.jobs.size()==1)
+        store.jobs_cond.notify_one();
+    else
+        store.jobs_cond.notify_all();
+}
+
+fuse_io_context::io_uring_task_discard<int> DedupStore::completions(fuse_io_context& io)
+{
+    ThreadQueue& queue = *thread_queues[io.fuse_ring.thread_idx];
+    std::vector<Batch*> done;
+    while(true)
+    {
+        io_uring_sqe* sqe = co_await io.get_sqe();
+        if(sqe==nullptr)
+            co_return -1;
+
+        io_uring_prep_read(sqe, queue.eventfd, &queue.eventfd_val,
+            sizeof(queue.eventfd_val), 0);
+
+        int rc = co_await io.complete(sqe);
+        if(rc<0 && rc!=-EINTR && rc!=-EAGAIN)
+        {
+            std::cerr << "Error reading dedup eventfd rc=" << rc << std::endl;
+            co_return -1;
+        }
+
+        {
+            std::scoped_lock lock(queue.mutex);
+            done.swap(queue.done);
+        }
+
+        for(Batch* batch: done)
+        {
+            batch->awaiter.resume();
+        }
+        done.clear();
+    }
+}
+
+void DedupStore::pin(uint64_t first, uint64_t last, std::vector<uint64_t>& slots)
+{
+    std::scoped_lock lock(mutex);
+    for(uint64_t block=first;block<=last;++block)
+    {
+        uint64_t slot = mem_slot[block];
+        if(slot!=0)
+            ++refs[slot - 1];
+        slots.push_back(slot);
+    }
+}
+
+void DedupStore::unpin(const std::vector<uint64_t>& slots)
+{
+    std::scoped_lock lock(mutex);
+    for(uint64_t slot: slots)
+    {
+        release(slot);
+    }
+}
+
+void DedupStore::release(uint64_t slot)
+{
+    if(slot==0)
+        return;
+
+    --slot;
+    if(--refs[slot]>0)
+        return;
+
+    auto it = index.find(slot_hash[slot]);
+    if(it!=index.end() && it->second==slot)
+        index.erase(it);
+
+    free_slots.push_back(slot);
+    --used_slots;
+}
+
+bool DedupStore::alloc_slot(uint64_t& slot)
+{
+    if(!free_slots.empty())
+    {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    else if(next_slot<n_slots)
+    {
+        slot = next_slot++;
+        refs.resize(next_slot);
+        slot_hash.resize(next_slot);
+    }
+    else
+    {
+        return false;
+    }
+
+    refs[slot] = 1;
+    ++used_slots;
+    return true;
+}
+
+fuse_io_context::io_uring_task<int> DedupStore::flush_map_page(fuse_io_context& io, uint64_t page)
+{
+    uint64_t first = page*entries_per_page;
+    uint64_t n = std::min(entries_per_page, n_blocks - first);
+
+    co_return co_await flush_meta_page(io, mutex, waiters, page_flushing, page,
+        io.fuse_ring.backing_fd, map_offset + page*page_size, page_size,
+        [this, first, n](char* buf) {
+            // New slots in the page are referenced until the write finished
+            MapEntry* entries = reinterpret_cast<MapEntry*>(buf);
+            for(uint64_t i=0;i<n;++i)
+            {
+                uint64_t slot = mem_slot[first + i];
+                entries[i].slot = slot;
+                if(slot!=0)
+                {
+                    entries[i].hash[0] = slot_hash[slot - 1].h[0];
+                    entries[i].hash[1] = slot_hash[slot - 1].h[1];
+                    if(slot!=disk_slot[first + i])
+                        ++refs[slot - 1];
+                }
+            }
+        },
+        [this, first, n](int rc, const char* buf) {
+            const MapEntry* entries = reinterpret_cast<const MapEntry*>(buf);
+            for(uint64_t i=0;i<n;++i)
+            {
+                uint64_t slot = entries[i].slot;
+                if(slot==disk_slot[first + i])
+                    continue;
+
+                if(rc<0)
+                {
+                    release(slot);
+                }
+                else
+                {
+                    release(disk_slot[first + i]);
+                    disk_slot[first + i] = slot;
+                }
+            }
+        });
+}
+
+fuse_io_context::io_uring_task<int> DedupStore::write(fuse_io_context& io,
+    const char* buf, uint64_t offset, uint64_t len)
+{
+    const uint64_t first = offset / block_size;
+    const uint64_t last = (offset + len - 1) / block_size;
+    const size_t n = last - first + 1;
+
+    // Only one write per block at a time, so partial writes of the same
+    // block do not overwrite each other
+    {
+        std::unique_lock lock(mutex);
+        while(true)
+        {
+            bool busy = false;
+            for(uint64_t block=first;block<=last;++block)
+            {
+                if(locked.find(block)!=locked.end())
+                {
+                    busy = true;
+                    break;
+                }
+            }
+
+            if(!busy)
+            {
+                for(uint64_t block=first;block<=last;++block)
+                    locked.insert(block);
+                break;
+            }
+
+            ++lock_waits;
+            co_await waiters.wait(io, lock);
+        }
+    }
+
+    int rc = 0;
+    // Whole blocks with the write applied
+    std::unique_ptr<char, decltype(&free)> data(alloc_aligned(n*block_size), &free);
+    if(!data)
+        rc = -ENOMEM;
+
+    // Blocks the write does not cover completely are read first
+    std::vector<size_t> reads;
+    std::vector<uint64_t> old_slots;
+    if(rc==0)
+    {
+        pin(first, last, old_slots);
+        for(size_t i=0;i<n;++i)
+        {
+            uint64_t block_start = (first + i)*block_size;
+            char* block_buf = data.get() + i*block_size;
+            if(offset<=block_start &&
+                offset + len>=std::min(block_start + block_size, volume_size))
+            {
+                if(offset + len<block_start + block_size)
+                    memset(block_buf + (offset + len - block_start), 0, block_start + block_size - (offset + len));
+                continue;
+            }
+
+            if(old_slots[i]==0)
+                memset(block_buf, 0, block_size);
+            else
+                reads.push_back(i);
+        }
+    }
+
+    for(size_t i=0;rc==0 && i<reads.size();)
+    {
+        size_t nr = std::min(reads.size() - i, max_dedup_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(nr);
+        if(sqe==nullptr)
+        {
+            rc = -EIO;
+            break;
+        }
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<nr;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            size_t idx = reads[i+j];
+            io_uring_prep_read(sqe, io.fuse_ring.backing_fd, data.get() + idx*block_size,
+                block_size, slot_offset(old_slots[idx] - 1));
+            sqe->flags |= IOSQE_FIXED_FILE;
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+        for(size_t j=0;j<nr;++j)
+        {
+            if(rcs[j]<0)
+                rc = rcs[j];
+            else if(static_cast<uint64_t>(rcs[j])!=block_size)
+                rc = -EIO;
+        }
+
+        i+=nr;
+    }
+
+    if(!old_slots.empty())
+        unpin(old_slots);
+
+    if(rc==0)
+    {
+        for(size_t i=0;i<n;++i)
+        {
+            uint64_t block_start = (first + i)*block_size;
+            uint64_t write_start = std::max(offset, block_start);
+            uint64_t write_end = std::min(offset + len, block_start + block_size);
+            memcpy(data.get() + i*block_size + (write_start - block_start), buf + (write_start - offset),
+                write_end - write_start);
+        }
+    }
+
+    // Hashes on the hash threads
+    Batch batch;
+    batch.thread_idx = io.fuse_ring.thread_idx;
+    if(rc==0)
+    {
+        for(size_t i=0;i<n;++i)
+        {
+            batch.jobs.push_back(Job{&batch, data.get() + i*block_size, block_size, {}, false});
+        }
+
+        if(n_hash_threads==0)
+        {
+            for(Job& job: batch.jobs)
+                run_job(job);
+        }
+        else
+        {
+            co_await BatchAwaiter(*this, batch);
+        }
+
+        hashed_bytes+=n*block_size;
+    }
+
+    // Slot+1 of each block (0 for zeros), referenced for the block map in memory.
+    // Slots that are new have to be written
+    std::vector<uint64_t> new_slot(n);
+    std::vector<size_t> writes;
+    for(size_t i=0;rc==0 && i<n;++i)
+    {
+        const Job& job = batch.jobs[i];
+        if(job.zero)
+            continue;
+
+        // The reference keeps the slot from being reused while it is
+        // compared. It is dropped again if the data differs
+        uint64_t slot = 0;
+        {
+            std::scoped_lock lock(mutex);
+            auto it = index.find(job.hash);
+            if(it!=index.end())
+            {
+                slot = it->second + 1;
+                ++refs[slot - 1];
+            }
+        }
+
+        if(slot!=0 && verify)
+        {
+            std::unique_ptr<char, decltype(&free)> cmp(alloc_aligned(block_size), &free);
+            int vrc = -ENOMEM;
+            io_uring_sqe* sqe = cmp ? co_await io.get_backing_sqe() : nullptr;
+            if(sqe!=nullptr)
+            {
+                io_uring_prep_read(sqe, io.fuse_ring.backing_fd, cmp.get(), block_size,
+                    slot_offset(slot - 1));
+                sqe->flags |= IOSQE_FIXED_FILE;
+                vrc = co_await io.complete(sqe);
+            }
+
+            if(vrc<0 || static_cast<uint64_t>(vrc)!=block_size ||
+                memcmp(cmp.get(), job.data, block_size)!=0)
+            {
+                if(vrc>=0)
+                    ++verify_mismatches;
+
+                std::scoped_lock lock(mutex);
+                release(slot);
+                slot = 0;
+            }
+        }
+
+        if(slot!=0)
+        {
+            ++dedup_hits;
+            new_slot[i] = slot;
+            continue;
+        }
+
+        std::scoped_lock lock(mutex);
+        uint64_t alloc;
+        if(!alloc_slot(alloc))
+        {
+            rc = -ENOSPC;
+            break;
+        }
+
+        slot_hash[alloc] = job.hash;
+        new_slot[i] = alloc + 1;
+        writes.push_back(i);
+    }
+
+    for(size_t i=0;rc==0 && i<writes.size();)
+    {
+        size_t nw = std::min(writes.size() - i, max_dedup_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(nw);
+        if(sqe==nullptr)
+        {
+            rc = -EIO;
+            break;
+        }
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<nw;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            size_t idx = writes[i+j];
+            io_uring_prep_write(sqe, io.fuse_ring.backing_fd, data.get() + idx*block_size,
+                block_size, slot_offset(new_slot[idx] - 1));
+            // Has to be on disk before the block map points to the slot
+            sqe->rw_flags = RWF_DSYNC;
+            sqe->flags |= IOSQE_FIXED_FILE;
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+        for(size_t j=0;j<nw;++j)
+        {
+            if(rcs[j]<0)
+                rc = rcs[j];
+            else if(static_cast<uint64_t>(rcs[j])!=block_size)
+                rc = -EIO;
+        }
+
+        i+=nw;
+    }
+
+    {
+        std::scoped_lock lock(mutex);
+        if(rc<0)
+        {
+            for(uint64_t slot: new_slot)
+                release(slot);
+        }
+        else
+        {
+            // Duplicates of the new slots can use them from now on
+            for(size_t i: writes)
+            {
+                uint64_t slot = new_slot[i] - 1;
+                index.insert(std::make_pair(slot_hash[slot], slot));
+            }
+
+            for(size_t i=0;i<n;++i)
+            {
+                uint64_t block = first + i;
+                if(new_slot[i]==0 && mem_slot[block]!=0)
+                    ++zero_blocks;
+                else if(new_slot[i]!=0 && mem_slot[block]==0)
+                    --zero_blocks;
+
+                release(mem_slot[block]);
+                mem_slot[block] = new_slot[i];
+            }
+            new_slots+=writes.size();
+        }
+    }
+
+    // Until the block map in the file points to the new slots
+    for(uint64_t page=first/entries_per_page;rc==0 && page<=last/entries_per_page;)
+    {
+        bool flushed = true;
+        {
+            std::scoped_lock lock(mutex);
+            uint64_t page_first = std::max(first, page*entries_per_page);
+            uint64_t page_last = std::min(last, (page + 1)*entries_per_page - 1);
+            for(uint64_t block=page_first;block<=page_last;++block)
+            {
+                if(disk_slot[block]!=mem_slot[block])
+                {
+                    flushed = false;
+                    break;
+                }
+            }
+        }
+
+        if(flushed)
+        {
+            ++page;
+            continue;
+        }
+
+        int frc = co_await flush_map_page(io, page);
+        if(frc<0)
+        {
+            rc = frc;
+            break;
+        }
+
+        if(frc==1)
+        {
+            std::unique_lock lock(mutex);
+            while(page_flushing[page])
+            {
+                co_await waiters.wait(io, lock);
+            }
+        }
+    }
+
+    if(rc<0)
+    {
+        static bool erronce=true;
+        if(erronce)
+        {
+            std::cerr << "Writing to the dedup store failed rc=" << rc << std::endl;
+            erronce=false;
+        }
+    }
+
+    std::scoped_lock lock(mutex);
+    for(uint64_t block=first;block<=last;++block)
+    {
+        locked.erase(block);
+    }
+    waiters.notify_all();
+
+    co_return rc;
+}
+
+DedupStore::Stats DedupStore::get_stats() const
+{
+    Stats ret;
+    ret.used_slots = used_slots.load(std::memory_order_relaxed);
+    ret.zero_blocks = zero_blocks.load(std::memory_order_relaxed);
+    ret.dedup_hits = dedup_hits.load(std::memory_order_relaxed);
+    ret.new_slots = new_slots.load(std::memory_order_relaxed);
+    ret.verify_mismatches = verify_mismatches.load(std::memory_order_relaxed);
+    ret.hashed_bytes = hashed_bytes.load(std::memory_order_relaxed);
+    ret.lock_waits = lock_waits.load(std::memory_order_relaxed);
+    return ret;
+}
+
+fuse_io_context::io_uring_task<int> dedup_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios)
+{
+    DedupStore* store = io.fuse_ring.dedup;
+    const uint64_t block_size = store->get_block_size();
+
+    struct Piece
+    {
+        size_t req;
+        uint64_t file_offset;
+        uint64_t len;
+        uint64_t req_offset;
+    };
+
+    std::vector<Piece> pieces;
+    std::vector<uint64_t> req_len(ios.size());
+    std::vector<uint64_t> slots;
+    for(size_t i=0;i<ios.size();++i)
+    {
+        BlockIo& req = ios[i];
+        req.res = 0;
+        req_len[i] = block_io_len(req, store->get_size());
+
+        if(write)
+        {
+            if(req_len[i]==0)
+                req.res = -ENOSPC;
+            else
+                req.res = co_await store->write(io, req.buf, req.offset, req_len[i]);
+            continue;
+        }
+
+        if(req_len[i]==0)
+            continue;
+
+        const uint64_t req_end = req.offset + req_len[i];
+        const uint64_t first = req.offset / block_size;
+        size_t slot_idx = slots.size();
+        store->pin(first, (req_end - 1) / block_size, slots);
+
+        for(uint64_t off=req.offset;off<req_end;)
+        {
+            uint64_t block = off / block_size;
+            uint64_t end = std::min(req_end, (block + 1)*block_size);
+            uint64_t slot = slots[slot_idx + (block - first)];
+
+            if(slot==0)
+            {
+                memset(req.buf + (off - req.offset), 0, end - off);
+            }
+            else
+            {
+                Piece piece = {i, store->slot_offset(slot - 1) + (off - block*block_size),
+                    end - off, off - req.offset};
+
+                if(!pieces.empty() &&
+                    pieces.back().req==i &&
+                    pieces.back().file_offset + pieces.back().len==piece.file_offset &&
+                    pieces.back().req_offset + pieces.back().len==piece.req_offset)
+                    pieces.back().len+=piece.len;
+                else
+                    pieces.push_back(piece);
+            }
+
+            off = end;
+        }
+    }
+
+    for(size_t i=0;i<pieces.size();)
+    {
+        size_t n = std::min(pieces.size() - i, max_dedup_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+        if(sqe==nullptr)
+        {
+            store->unpin(slots);
+            co_return -1;
+        }
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            const Piece& piece = pieces[i+j];
+            const BlockIo& req = ios[piece.req];
+            char* buf = req.buf + piece.req_offset;
+            uint64_t len = piece.len;
+            // Reads of the end of the request in whole pages for O_DIRECT. Request
+            // buffers are whole pages
+            if(io.fuse_ring.direct_io &&
+                piece.req_offset + piece.len==req_len[piece.req])
+                len = round_up(len, page_size);
+
+            if(req.buf_idx>=0)
+                io_uring_prep_read_fixed(sqe, io.fuse_ring.backing_fd, buf, len, piece.file_offset, req.buf_idx);
+            else
+                io_uring_prep_read(sqe, io.fuse_ring.backing_fd, buf, len, piece.file_offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+
+        for(size_t j=0;j<n;++j)
+        {
+            const Piece& piece = pieces[i+j];
+            BlockIo& req = ios[piece.req];
+            if(req.res<0)
+                continue;
+
+            // Slots are always there completely
+            req.res = block_io_piece_res(rcs[j], piece.len);
+        }
+
+        i+=n;
+    }
+
+    if(!slots.empty())
+        store->unpin(slots);
+
+    for(size_t i=0;i<ios.size();++i)
+    {
+        if(ios[i].res>=0)
+            ios[i].res = static_cast<int>(req_len[i]);
+    }
+
+    co_return 0;
+}
+
+void DedupBackend::start(fuse_io_context& io)
+{
+    dedup->completions(io);
+}
+
+fuse_io_context::io_uring_task<int> DedupBackend::flush(fuse_io_context& io,
+    bool datasync)
+{
+    std::vector<int> fds = {io.fuse_ring.backing_fd};
+    std::vector<int> rcs;
+    if(co_await sync_files(io, fds, datasync, rcs)!=0)
+        co_return -1;
+
+    int ret = 0;
+    for(int rc: rcs)
+    {
+        if(rc<0)
+            ret = rc;
+    }
+
+    co_return ret;
+}
+
+std::string DedupBackend::get_stats() const
+{
+    DedupStore::Stats dedup_stats = dedup->get_stats();
+    std::ostringstream ret;
+    ret << "Dedup: used slots=" << dedup_stats.used_slots
+        << " zero blocks=" << dedup_stats.zero_blocks
+        << " dedup hits=" << dedup_stats.dedup_hits
+        << " new slots=" << dedup_stats.new_slots
+        << " verify mismatches=" << dedup_stats.verify_mismatches
+        << " hashed MB=" << dedup_stats.hashed_bytes/(1024*1024)
+        << " lock waits=" << dedup_stats.lock_waits;
+    return ret.str();
+}
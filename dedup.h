@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include "backend.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+
+// Backing file in dedup store format: the volume in blocks of a fixed
+// size, each mapped to a data slot via a block map. Blocks with the same
+// contents share a slot, blocks of zeros have none.
+//
+// Written blocks are hashed (128 bit, see dedup_hash()) by a pool of hash
+// threads, which wake up the worker thread via its eventfd like the
+// decompression threads of the chunk store. The fingerprint index from
+// hash to slot and the reference counts of the slots are only in memory
+// and rebuilt from the block map, which has the slot and hash of every
+// block, when the store is opened.
+//
+// Slots are never overwritten while referenced. A write stores new data
+// in a free slot (O_DSYNC) before the block map points to it. A slot is
+// referenced by the block map in memory and by the block map in the file,
+// and is only reused once neither points to it anymore.
+class DedupStore
+{
+public:
+    struct Hash
+    {
+        uint64_t h[2];
+
+        bool operator==(const Hash& other) const
+        {
+            return h[0]==other.h[0] && h[1]==other.h[1];
+        }
+    };
+
+    struct Stats
+    {
+        uint64_t used_slots;
+        uint64_t zero_blocks;
+        uint64_t dedup_hits;
+        uint64_t new_slots;
+        uint64_t verify_mismatches;
+        uint64_t hashed_bytes;
+        uint64_t lock_waits;
+    };
+
+    // n_hash_threads 0 hashes on the worker threads. n_threads is the
+    // number of worker threads. With verify, blocks are compared with the
+    // slot they would be deduplicated to before they share it. Without it a
+    // collision of the (non-cryptographic) hash silently corrupts data
+    DedupStore(size_t n_hash_threads, size_t n_threads, bool verify);
+    ~DedupStore();
+
+    // Reads header and block map from fd, or creates a new store of
+    // volume_size with block_size if fd is empty. Starts the hash threads
+    bool open(int fd, uint64_t volume_size, uint32_t block_size);
+
+    uint64_t get_size() const
+    {
+        return volume_size;
+    }
+
+    uint32_t get_block_size() const
+    {
+        return block_size;
+    }
+
+    std::string describe() const;
+
+    // Resumes the coroutines of this worker thread whose blocks were
+    // hashed. Runs on every worker thread
+    fuse_io_context::io_uring_task_discard<int> completions(fuse_io_context& io);
+
+    // Slot+1 of every block of [first, last], 0 for zeros. The slots are
+    // pinned until unpin() is called with the result
+    void pin(uint64_t first, uint64_t last, std::vector<uint64_t>& slots);
+    void unpin(const std::vector<uint64_t>& slots);
+
+    // File offset of slot
+    uint64_t slot_offset(uint64_t slot) const
+    {
+        return data_offset + slot*block_size;
+    }
+
+    // Writes [offset, offset+len) from buf. Blocks the write does not cover
+    // completely are read first. Returns 0 or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> write(fuse_io_context& io,
+        const char* buf, uint64_t offset, uint64_t len);
+
+    Stats get_stats() const;
+
+private:
+    struct Batch;
+
+    struct Job
+    {
+        Batch* batch;
+        const char* data;
+        size_t len;
+        Hash hash;
+        bool zero;
+    };
+
+    // Blocks a coroutine waits for
+    struct Batch
+    {
+        std::vector<Job> jobs;
+        std::atomic<size_t> pending;
+        size_t thread_idx;
+        std::coroutine_handle<> awaiter;
+    };
+
+    struct BatchAwaiter
+    {
+        BatchAwaiter(DedupStore& store, Batch& batch) noexcept
+            : store(store), batch(batch) {}
+
+        bool await_ready() const noexcept
+        {
+            return batch.jobs.empty();
+        }
+
+        void await_suspend(std::coroutine_handle<> p_awaiter) noexcept;
+
+        void await_resume() const noexcept
+        {
+        }
+
+    private:
+        DedupStore& store;
+        Batch& batch;
+    };
+
+    struct ThreadQueue
+    {
+        std::mutex mutex;
+        std::vector<Batch*> done;
+        int eventfd;
+        uint64_t eventfd_val;
+    };
+
+    struct HashHasher
+    {
+        size_t operator()(const Hash& hash) const
+        {
+            return static_cast<size_t>(hash.h[0]);
+        }
+    };
+
+    void hash_thread();
+    static void run_job(Job& job);
+    void job_done(Job& job);
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush_map_page(fuse_io_context& io, uint64_t page);
+    // Drops a reference to slot+1 (0 is no slot). Has to be called with mutex held
+    void release(uint64_t slot);
+    bool alloc_slot(uint64_t& slot);
+
+    int fd;
+    uint32_t block_size;
+    uint64_t volume_size;
+    uint64_t n_blocks;
+    uint64_t n_slots;
+    uint64_t map_offset;
+    uint64_t data_offset;
+    bool verify;
+
+    // Hash threads and their queue
+    size_t n_hash_threads;
+    std::vector<std::thread> hash_threads;
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_cond;
+    std::deque<Job*> jobs;
+    bool stop;
+    std::vector<std::unique_ptr<ThreadQueue> > thread_queues;
+
+    // Slot+1 of each block in memory and in the file. refs counts both,
+    // plus pins of reads
+    std::mutex mutex;
+    std::vector<uint64_t> mem_slot;
+    std::vector<uint64_t> disk_slot;
+    std::vector<uint32_t> refs;
+    std::vector<Hash> slot_hash;
+    std::unordered_map<Hash, uint64_t, HashHasher> index;
+    std::vector<uint64_t> free_slots;
+    uint64_t next_slot;
+    std::unordered_set<uint64_t> locked;
+    std::vector<bool> page_flushing;
+    // Writes waiting for locked blocks and block map page writes
+    fuse_io_context::SharedWaitQueue waiters;
+
+    std::atomic<uint64_t> used_slots;
+    std::atomic<uint64_t> zero_blocks;
+    std::atomic<uint64_t> dedup_hits;
+    std::atomic<uint64_t> new_slots;
+    std::atomic<uint64_t> verify_mismatches;
+    std::atomic<uint64_t> hashed_bytes;
+    std::atomic<uint64_t> lock_waits;
+};
+
+// 128 bit hash of data. Uses AVX2 if the CPU has it, with the same result
+// as without
+DedupStore::Hash dedup_hash(const char* data, size_t len);
+
+// Reads resolve the blocks via the block map, writes go through
+// DedupStore::write()
+[[nodiscard]] fuse_io_context::io_uring_task<int> dedup_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios);
+
+// The dedup store as backend
+class DedupBackend : public Backend
+{
+public:
+    explicit DedupBackend(DedupStore* dedup)
+        : dedup(dedup) {}
+
+    std::string describe() const override
+    {
+        return dedup->describe();
+    }
+
+    uint64_t get_size() const override
+    {
+        return dedup->get_size();
+    }
+
+    // Hash completions on every worker thread
+    void start(fuse_io_context& io) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io,
+        bool write, std::vector<BlockIo>& ios) override
+    {
+        return dedup_io(io, write, ios);
+    }
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush(fuse_io_context& io,
+        bool datasync) override;
+
+    std::string get_stats() const override;
+
+private:
+    DedupStore* dedup;
+};
@@ -0,0 +1,720 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "encryption.h"
+#include "io_util.h"
+#include <iostream>
+#include <sstream>
+#include <memory>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    const uint64_t page_size = 4096;
+    // Requests of a batch are submitted this many at a time
+    const size_t max_crypt_batch = 64;
+    const size_t aes_block_size = 16;
+    const size_t sector_blocks = Encryption::sector_size / aes_block_size;
+    // Tweaks of this many sectors are computed at once
+    const size_t tweak_batch = 8;
+
+#if defined(__x86_64__)
+    __m128i expand_xor(__m128i key)
+    {
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        return _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    }
+
+    template<int rcon>
+    __attribute__((target("aes"))) __m128i expand_128_step(__m128i key)
+    {
+        __m128i t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(key, rcon), 0xff);
+        return _mm_xor_si128(expand_xor(key), t);
+    }
+
+    __attribute__((target("aes"))) void expand_key_128(const unsigned char* key, __m128i* rk)
+    {
+        rk[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+        rk[1] = expand_128_step<0x01>(rk[0]);
+        rk[2] = expand_128_step<0x02>(rk[1]);
+        rk[3] = expand_128_step<0x04>(rk[2]);
+        rk[4] = expand_128_step<0x08>(rk[3]);
+        rk[5] = expand_128_step<0x10>(rk[4]);
+        rk[6] = expand_128_step<0x20>(rk[5]);
+        rk[7] = expand_128_step<0x40>(rk[6]);
+        rk[8] = expand_128_step<0x80>(rk[7]);
+        rk[9] = expand_128_step<0x1b>(rk[8]);
+        rk[10] = expand_128_step<0x36>(rk[9]);
+    }
+
+    // Round keys 2*i+2 and 2*i+3 from 2*i and 2*i+1
+    template<int rcon>
+    __attribute__((target("aes"))) void expand_256_step(__m128i* rk, int i, bool last)
+    {
+        __m128i t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[2*i+1], rcon), 0xff);
+        rk[2*i+2] = _mm_xor_si128(expand_xor(rk[2*i]), t);
+        if(last)
+            return;
+
+        t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[2*i+2], 0), 0xaa);
+        rk[2*i+3] = _mm_xor_si128(expand_xor(rk[2*i+1]), t);
+    }
+
+    __attribute__((target("aes"))) void expand_key_256(const unsigned char* key, __m128i* rk)
+    {
+        rk[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+        rk[1] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key + 16));
+        expand_256_step<0x01>(rk, 0, false);
+        expand_256_step<0x02>(rk, 1, false);
+        expand_256_step<0x04>(rk, 2, false);
+        expand_256_step<0x08>(rk, 3, false);
+        expand_256_step<0x10>(rk, 4, false);
+        expand_256_step<0x20>(rk, 5, false);
+        expand_256_step<0x40>(rk, 6, true);
+    }
+
+    // Round keys for aesdec (equivalent inverse cipher)
+    __attribute__((target("aes"))) void inverse_keys(const __m128i* rk, __m128i* dk, int rounds)
+    {
+        dk[0] = rk[rounds];
+        for(int i=1;i<rounds;++i)
+        {
+            dk[i] = _mm_aesimc_si128(rk[rounds - i]);
+        }
+        dk[rounds] = rk[0];
+    }
+
+    // Tweak of the next block: multiplication with x in GF(2^128)
+    __m128i mul_alpha(__m128i t)
+    {
+        __m128i carry = _mm_srai_epi32(t, 31);
+        carry = _mm_shuffle_epi32(carry, 0x93);
+        carry = _mm_and_si128(carry, _mm_set_epi32(1, 1, 1, 0x87));
+        return _mm_xor_si128(_mm_add_epi32(t, t), carry);
+    }
+
+    // Initial tweaks of n sectors, encrypted together
+    __attribute__((target("aes"))) void sector_tweaks(const __m128i* tk, int rounds, uint64_t sector,
+        size_t n, __m128i* tweaks)
+    {
+        __m128i b[tweak_batch];
+        #pragma GCC unroll 8
+        for(size_t i=0;i<tweak_batch;++i)
+        {
+            b[i] = _mm_xor_si128(_mm_set_epi64x(0, static_cast<long long>(sector + i)), tk[0]);
+        }
+
+        for(int r=1;r<rounds;++r)
+        {
+            #pragma GCC unroll 8
+            for(size_t i=0;i<tweak_batch;++i)
+                b[i] = _mm_aesenc_si128(b[i], tk[r]);
+        }
+
+        for(size_t i=0;i<n;++i)
+        {
+            tweaks[i] = _mm_aesenclast_si128(b[i], tk[rounds]);
+        }
+    }
+
+    void block_tweaks(__m128i tweak, __m128i* tweaks)
+    {
+        tweaks[0] = tweak;
+        for(size_t i=1;i<sector_blocks;++i)
+        {
+            tweaks[i] = mul_alpha(tweaks[i-1]);
+        }
+    }
+
+    // Eight blocks at a time, so the aesenc/aesdec of different blocks overlap
+    template<bool enc>
+    __attribute__((target("aes"))) void xts_aesni(const __m128i* keys, const __m128i* tk, int rounds,
+        char* data, size_t n_sectors, uint64_t sector)
+    {
+        __m128i sector_tweak[tweak_batch];
+        __m128i tweaks[sector_blocks];
+        for(size_t s=0;s<n_sectors;++s)
+        {
+            if(s % tweak_batch==0)
+                sector_tweaks(tk, rounds, sector + s, std::min(tweak_batch, n_sectors - s), sector_tweak);
+
+            block_tweaks(sector_tweak[s % tweak_batch], tweaks);
+
+            __m128i* p = reinterpret_cast<__m128i*>(data + s*Encryption::sector_size);
+            for(size_t g=0;g<sector_blocks;g+=8)
+            {
+                __m128i b[8];
+                #pragma GCC unroll 8
+                for(size_t i=0;i<8;++i)
+                {
+                    b[i] = _mm_xor_si128(_mm_loadu_si128(p + g + i), tweaks[g + i]);
+                    b[i] = _mm_xor_si128(b[i], keys[0]);
+                }
+
+                for(int r=1;r<rounds;++r)
+                {
+                    #pragma GCC unroll 8
+                    for(size_t i=0;i<8;++i)
+                        b[i] = enc ? _mm_aesenc_si128(b[i], keys[r]) : _mm_aesdec_si128(b[i], keys[r]);
+                }
+
+                #pragma GCC unroll 8
+                for(size_t i=0;i<8;++i)
+                {
+                    b[i] = enc ? _mm_aesenclast_si128(b[i], keys[rounds]) : _mm_aesdeclast_si128(b[i], keys[rounds]);
+                    _mm_storeu_si128(p + g + i, _mm_xor_si128(b[i], tweaks[g + i]));
+                }
+            }
+        }
+    }
+
+    // Same with two blocks per register
+    template<bool enc>
+    __attribute__((target("aes,vaes,avx2"))) void xts_vaes(const __m128i* keys, const __m128i* tk, int rounds,
+        char* data, size_t n_sectors, uint64_t sector)
+    {
+        __m256i k[15];
+        for(int r=0;r<=rounds;++r)
+        {
+            k[r] = _mm256_broadcastsi128_si256(keys[r]);
+        }
+
+        __m128i sector_tweak[tweak_batch];
+        alignas(32) __m128i tweaks[sector_blocks];
+        const __m256i* tw = reinterpret_cast<const __m256i*>(tweaks);
+        for(size_t s=0;s<n_sectors;++s)
+        {
+            if(s % tweak_batch==0)
+                sector_tweaks(tk, rounds, sector + s, std::min(tweak_batch, n_sectors - s), sector_tweak);
+
+            block_tweaks(sector_tweak[s % tweak_batch], tweaks);
+
+            __m256i* p = reinterpret_cast<__m256i*>(data + s*Encryption::sector_size);
+            for(size_t g=0;g<sector_blocks/2;g+=8)
+            {
+                __m256i b[8];
+                #pragma GCC unroll 8
+                for(size_t i=0;i<8;++i)
+                {
+                    b[i] = _mm256_xor_si256(_mm256_loadu_si256(p + g + i), _mm256_load_si256(tw + g + i));
+                    b[i] = _mm256_xor_si256(b[i], k[0]);
+                }
+
+                for(int r=1;r<rounds;++r)
+                {
+                    #pragma GCC unroll 8
+                    for(size_t i=0;i<8;++i)
+                        b[i] = enc ? _mm256_aesenc_epi128(b[i], k[r]) : _mm256_aesdec_epi128(b[i], k[r]);
+                }
+
+                #pragma GCC unroll 8
+                for(size_t i=0;i<8;++i)
+                {
+                    b[i] = enc ? _mm256_aesenclast_epi128(b[i], k[rounds]) : _mm256_aesdeclast_epi128(b[i], k[rounds]);
+                    _mm256_storeu_si256(p + g + i, _mm256_xor_si256(b[i], _mm256_load_si256(tw + g + i)));
+                }
+            }
+        }
+    }
+#endif
+
+    // Reads n sectors from sector into buf. buf is a registered buffer if
+    // buf_idx>=0, in whole pages. Returns 0 or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> read_sectors(fuse_io_context& io, char* buf,
+        int buf_idx, uint64_t sector, uint64_t n)
+    {
+        uint64_t offset = sector*Encryption::sector_size;
+        uint64_t len = n*Encryption::sector_size;
+        uint64_t done = 0;
+        while(done<len)
+        {
+            io_uring_sqe* sqe = co_await io.get_backing_sqe();
+            if(sqe==nullptr)
+                co_return -EIO;
+
+            // Whole pages for O_DIRECT
+            uint64_t read_len = round_up(len - done, page_size);
+            if(buf_idx>=0)
+                io_uring_prep_read_fixed(sqe, io.fuse_ring.backing_fd, buf + done, read_len, offset + done, buf_idx);
+            else
+                io_uring_prep_read(sqe, io.fuse_ring.backing_fd, buf + done, read_len, offset + done);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            int rc = co_await io.complete(sqe);
+            if(rc<0)
+                co_return rc;
+
+            // The volume is a multiple of the sector size
+            if(rc==0)
+                co_return -EIO;
+
+            done+=rc;
+        }
+
+        co_return 0;
+    }
+}
+
+Encryption::Encryption()
+    : rounds(0), have_vaes(false), encrypted_bytes(0), decrypted_bytes(0),
+        partial_writes(0), lock_waits(0)
+{
+}
+
+Encryption::~Encryption()
+{
+    explicit_bzero(enc_keys, sizeof(enc_keys));
+    explicit_bzero(dec_keys, sizeof(dec_keys));
+    explicit_bzero(tweak_keys, sizeof(tweak_keys));
+}
+
+bool Encryption::load_key(const std::string& key_path)
+{
+#if defined(__x86_64__)
+    if(!__builtin_cpu_supports("aes"))
+#endif
+    {
+        std::cerr << "Encryption needs a CPU with AES-NI" << std::endl;
+        return false;
+    }
+
+#if defined(__x86_64__)
+    int fd = ::open(key_path.c_str(), O_RDONLY|O_CLOEXEC);
+    if(fd==-1)
+    {
+        perror(("Error opening key file "+key_path).c_str());
+        return false;
+    }
+
+    unsigned char key[65];
+    size_t key_size = 0;
+    while(key_size<sizeof(key))
+    {
+        ssize_t rc = ::read(fd, key + key_size, sizeof(key) - key_size);
+        if(rc<0)
+        {
+            perror("Error reading key file");
+            close(fd);
+            return false;
+        }
+        if(rc==0)
+            break;
+        key_size+=rc;
+    }
+    close(fd);
+
+    if(key_size!=32 && key_size!=64)
+    {
+        explicit_bzero(key, sizeof(key));
+        std::cerr << "Key file has to have 32 (AES-128-XTS) or 64 bytes (AES-256-XTS), not " << key_size << std::endl;
+        return false;
+    }
+
+    size_t half = key_size/2;
+    if(memcmp(key, key + half, half)==0)
+    {
+        explicit_bzero(key, sizeof(key));
+        std::cerr << "Both halves of the XTS key are the same" << std::endl;
+        return false;
+    }
+
+    __m128i* ek = reinterpret_cast<__m128i*>(enc_keys);
+    __m128i* tk = reinterpret_cast<__m128i*>(tweak_keys);
+    if(half==16)
+    {
+        rounds = 10;
+        expand_key_128(key, ek);
+        expand_key_128(key + half, tk);
+    }
+    else
+    {
+        rounds = 14;
+        expand_key_256(key, ek);
+        expand_key_256(key + half, tk);
+    }
+    inverse_keys(ek, reinterpret_cast<__m128i*>(dec_keys), rounds);
+    explicit_bzero(key, sizeof(key));
+
+    have_vaes = __builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx2");
+    return true;
+#endif
+}
+
+std::string Encryption::describe() const
+{
+    return std::string(rounds==10 ? "AES-128-XTS" : "AES-256-XTS") +
+        (have_vaes ? " with VAES" : " with AES-NI");
+}
+
+void Encryption::encrypt(char* data, size_t len, uint64_t sector)
+{
+#if defined(__x86_64__)
+    const __m128i* ek = reinterpret_cast<const __m128i*>(enc_keys);
+    const __m128i* tk = reinterpret_cast<const __m128i*>(tweak_keys);
+    if(have_vaes)
+        xts_vaes<true>(ek, tk, rounds, data, len / sector_size, sector);
+    else
+        xts_aesni<true>(ek, tk, rounds, data, len / sector_size, sector);
+#endif
+    encrypted_bytes+=len;
+}
+
+void Encryption::decrypt(char* data, size_t len, uint64_t sector)
+{
+#if defined(__x86_64__)
+    const __m128i* dk = reinterpret_cast<const __m128i*>(dec_keys);
+    const __m128i* tk = reinterpret_cast<const __m128i*>(tweak_keys);
+    if(have_vaes)
+        xts_vaes<false>(dk, tk, rounds, data, len / sector_size, sector);
+    else
+        xts_aesni<false>(dk, tk, rounds, data, len / sector_size, sector);
+#endif
+    decrypted_bytes+=len;
+}
+
+fuse_io_context::io_uring_task<int> Encryption::lock_sectors(fuse_io_context& io,
+    uint64_t first, uint64_t last)
+{
+    std::unique_lock lock(mutex);
+    while(true)
+    {
+        // Locked ranges do not overlap, so only the one starting last at or
+        // before last can overlap
+        auto it = writing.upper_bound(last);
+        if(it==writing.begin())
+            break;
+
+        --it;
+        if(it->second.last<first)
+            break;
+
+        ++lock_waits;
+        co_await it->second.waiters.wait(io, lock);
+    }
+
+    writing.try_emplace(first).first->second.last = last;
+    co_return 0;
+}
+
+void Encryption::unlock_sectors(uint64_t first)
+{
+    std::scoped_lock lock(mutex);
+    auto it = writing.find(first);
+    if(it!=writing.end())
+    {
+        it->second.waiters.notify_all();
+        writing.erase(it);
+    }
+}
+
+fuse_io_context::io_uring_task<int> Encryption::read(fuse_io_context& io,
+    char* buf, int buf_idx, uint64_t offset, uint64_t len)
+{
+    const uint64_t first = offset / sector_size;
+    const uint64_t n = (offset + len + sector_size - 1) / sector_size - first;
+
+    if(offset % sector_size==0 &&
+        len % sector_size==0)
+    {
+        int rc = co_await read_sectors(io, buf, buf_idx, first, n);
+        if(rc<0)
+            co_return rc;
+
+        decrypt(buf, len, first);
+        co_return static_cast<int>(len);
+    }
+
+    std::unique_ptr<char, decltype(&free)> tmp(alloc_aligned(round_up(n*sector_size, page_size)), &free);
+    if(!tmp)
+        co_return -ENOMEM;
+
+    int rc = co_await read_sectors(io, tmp.get(), -1, first, n);
+    if(rc<0)
+        co_return rc;
+
+    decrypt(tmp.get(), n*sector_size, first);
+    memcpy(buf, tmp.get() + (offset - first*sector_size), len);
+    co_return static_cast<int>(len);
+}
+
+fuse_io_context::io_uring_task<int> Encryption::write(fuse_io_context& io,
+    char* buf, int buf_idx, uint64_t offset, uint64_t len)
+{
+    const uint64_t first = offset / sector_size;
+    const uint64_t n = (offset + len + sector_size - 1) / sector_size - first;
+    const uint64_t last = first + n - 1;
+
+    if(co_await lock_sectors(io, first, last)!=0)
+        co_return -EIO;
+
+    int rc;
+    if(offset % sector_size==0 &&
+        len % sector_size==0)
+    {
+        encrypt(buf, len, first);
+
+        rc = -EIO;
+        io_uring_sqe* sqe = co_await io.get_backing_sqe();
+        if(sqe!=nullptr)
+        {
+            if(buf_idx>=0)
+                io_uring_prep_write_fixed(sqe, io.fuse_ring.backing_fd, buf, len, offset, buf_idx);
+            else
+                io_uring_prep_write(sqe, io.fuse_ring.backing_fd, buf, len, offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            rc = block_io_piece_res(co_await io.complete(sqe), len);
+        }
+
+        unlock_sectors(first);
+        co_return rc;
+    }
+
+    // The sectors at the start and end the write only covers partially
+    // are read and decrypted first
+    ++partial_writes;
+    // The last sector is read in a whole page as well
+    std::unique_ptr<char, decltype(&free)> tmp(alloc_aligned(round_up(n*sector_size, page_size) + page_size), &free);
+    if(!tmp)
+    {
+        unlock_sectors(first);
+        co_return -ENOMEM;
+    }
+
+    rc = 0;
+    if(offset % sector_size!=0)
+    {
+        rc = co_await read_sectors(io, tmp.get(), -1, first, 1);
+        if(rc==0)
+            decrypt(tmp.get(), sector_size, first);
+    }
+
+    if(rc==0 &&
+        (offset + len) % sector_size!=0 &&
+        (last!=first || offset % sector_size==0))
+    {
+        char* last_buf = tmp.get() + (n - 1)*sector_size;
+        rc = co_await read_sectors(io, last_buf, -1, last, 1);
+        if(rc==0)
+            decrypt(last_buf, sector_size, last);
+    }
+
+    if(rc==0)
+    {
+        memcpy(tmp.get() + (offset - first*sector_size), buf, len);
+        encrypt(tmp.get(), n*sector_size, first);
+
+        rc = -EIO;
+        io_uring_sqe* sqe = co_await io.get_backing_sqe();
+        if(sqe!=nullptr)
+        {
+            io_uring_prep_write(sqe, io.fuse_ring.backing_fd, tmp.get(), n*sector_size,
+                first*sector_size);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            rc = block_io_piece_res(co_await io.complete(sqe), n*sector_size);
+            if(rc>=0)
+                rc = static_cast<int>(len);
+        }
+    }
+
+    unlock_sectors(first);
+    co_return rc;
+}
+
+fuse_io_context::io_uring_task<int> Encryption::transfer(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios)
+{
+    // Requests covering whole sectors, with their length inside the volume
+    std::vector<std::pair<size_t, uint64_t> > whole;
+    for(size_t i=0;i<ios.size();++i)
+    {
+        BlockIo& req = ios[i];
+        uint64_t len = block_io_len(req, io.fuse_ring.backing_f_size);
+        if(len==0)
+        {
+            req.res = write ? -ENOSPC : 0;
+            continue;
+        }
+
+        if(req.offset % sector_size==0 &&
+            len % sector_size==0)
+        {
+            whole.push_back(std::make_pair(i, len));
+            continue;
+        }
+
+        if(write)
+            req.res = co_await this->write(io, req.buf, req.buf_idx, req.offset, len);
+        else
+            req.res = co_await read(io, req.buf, req.buf_idx, req.offset, len);
+    }
+
+    if(whole.empty())
+        co_return 0;
+
+    // Writes lock the sectors of all requests before the first one is
+    // submitted. The ranges are locked in ascending order, so batches
+    // cannot deadlock, and overlapping requests share a range
+    std::vector<uint64_t> locked;
+    if(write)
+    {
+        std::vector<std::pair<uint64_t, uint64_t> > ranges;
+        for(const std::pair<size_t, uint64_t>& w: whole)
+        {
+            const BlockIo& req = ios[w.first];
+            ranges.push_back(std::make_pair(req.offset / sector_size,
+                (req.offset + w.second) / sector_size - 1));
+        }
+        std::sort(ranges.begin(), ranges.end());
+
+        for(size_t i=0;i<ranges.size();)
+        {
+            uint64_t first = ranges[i].first;
+            uint64_t last = ranges[i].second;
+            for(++i;i<ranges.size() && ranges[i].first<=last;++i)
+                last = std::max(last, ranges[i].second);
+
+            if(co_await lock_sectors(io, first, last)!=0)
+            {
+                for(uint64_t locked_first: locked)
+                    unlock_sectors(locked_first);
+                co_return -EIO;
+            }
+            locked.push_back(first);
+        }
+
+        for(const std::pair<size_t, uint64_t>& w: whole)
+        {
+            BlockIo& req = ios[w.first];
+            encrypt(req.buf, w.second, req.offset / sector_size);
+        }
+    }
+
+    for(size_t i=0;i<whole.size();)
+    {
+        size_t n = std::min(whole.size() - i, max_crypt_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+        if(sqe==nullptr)
+        {
+            for(;i<whole.size();++i)
+                ios[whole[i].first].res = -EIO;
+            break;
+        }
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            const BlockIo& req = ios[whole[i+j].first];
+            uint64_t len = whole[i+j].second;
+            if(write && req.buf_idx>=0)
+                io_uring_prep_write_fixed(sqe, io.fuse_ring.backing_fd, req.buf, len, req.offset, req.buf_idx);
+            else if(write)
+                io_uring_prep_write(sqe, io.fuse_ring.backing_fd, req.buf, len, req.offset);
+            // Whole pages for O_DIRECT
+            else if(req.buf_idx>=0)
+                io_uring_prep_read_fixed(sqe, io.fuse_ring.backing_fd, req.buf, round_up(len, page_size),
+                    req.offset, req.buf_idx);
+            else
+                io_uring_prep_read(sqe, io.fuse_ring.backing_fd, req.buf, round_up(len, page_size), req.offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+
+        for(size_t j=0;j<n;++j)
+        {
+            BlockIo& req = ios[whole[i+j].first];
+            uint64_t len = whole[i+j].second;
+            int rc = rcs[j];
+            if(!write && rc>=0)
+            {
+                // Rest of a short read, from the last whole page read
+                uint64_t done = std::min(static_cast<uint64_t>(rc), len) / page_size * page_size;
+                rc = 0;
+                if(done<len)
+                    rc = co_await read_sectors(io, req.buf + done, req.buf_idx,
+                        (req.offset + done) / sector_size, (len - done) / sector_size);
+
+                if(rc==0)
+                {
+                    decrypt(req.buf, len, req.offset / sector_size);
+                    rc = static_cast<int>(len);
+                }
+            }
+            else if(rc>=0)
+            {
+                rc = block_io_piece_res(rc, len);
+            }
+            req.res = rc;
+        }
+
+        i+=n;
+    }
+
+    for(uint64_t first: locked)
+        unlock_sectors(first);
+
+    co_return 0;
+}
+
+Encryption::Stats Encryption::get_stats() const
+{
+    Stats ret;
+    ret.encrypted_bytes = encrypted_bytes.load(std::memory_order_relaxed);
+    ret.decrypted_bytes = decrypted_bytes.load(std::memory_order_relaxed);
+    ret.partial_writes = partial_writes.load(std::memory_order_relaxed);
+    ret.lock_waits = lock_waits.load(std::memory_order_relaxed);
+    return ret;
+}
+
+fuse_io_context::io_uring_task<int> crypt_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios)
+{
+    co_return co_await io.fuse_ring.encryption->transfer(io, write, ios);
+}
+
+fuse_io_context::io_uring_task<int> EncryptionBackend::flush(fuse_io_context& io,
+    bool datasync)
+{
+    std::vector<int> fds = {io.fuse_ring.backing_fd};
+    std::vector<int> rcs;
+    if(co_await sync_files(io, fds, datasync, rcs)!=0)
+        co_return -1;
+
+    int ret = 0;
+    for(int rc: rcs)
+    {
+        if(rc<0)
+            ret = rc;
+    }
+
+    co_return ret;
+}
+
+std::string EncryptionBackend::get_stats() const
+{
+    Encryption::Stats encryption_stats = encryption->get_stats();
+    std::ostringstream ret;
+    ret << "Encryption: encrypted MB=" << encryption_stats.encrypted_bytes/(1024*1024)
+        << " decrypted MB=" << encryption_stats.decrypted_bytes/(1024*1024)
+        << " partial writes=" << encryption_stats.partial_writes
+        << " lock waits=" << encryption_stats.lock_waits;
+    return ret.str();
+}
@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include "backend.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <stdint.h>
+
+// XTS-AES encryption of the backing file in 512 byte sectors, with the
+// sector number (little endian) as tweak like aes-xts-plain64 of dm-crypt.
+// The key file has both XTS keys, 32 bytes for AES-128 or 64 bytes for
+// AES-256.
+//
+// Requests are encrypted/decrypted in place in the buffer they are read
+// into or written from, eight blocks (or 16 with VAES) at a time. Only
+// requests that do not cover whole sectors use a temporary buffer, and
+// writes of them read the partial sectors first. Writes to overlapping
+// sectors are serialized for that.
+//
+// The requests of a batch that cover whole sectors are en-/decrypted and
+// submitted together before the first completion is awaited.
+class Encryption
+{
+public:
+    static const uint32_t sector_size = 512;
+
+    struct Stats
+    {
+        uint64_t encrypted_bytes;
+        uint64_t decrypted_bytes;
+        uint64_t partial_writes;
+        uint64_t lock_waits;
+    };
+
+    Encryption();
+    ~Encryption();
+
+    // Loads the keys from key_path. Fails if the CPU does not have AES-NI
+    bool load_key(const std::string& key_path);
+
+    std::string describe() const;
+
+    // En-/decrypts len bytes (a multiple of sector_size) of data in place.
+    // sector is the number of the first sector
+    void encrypt(char* data, size_t len, uint64_t sector);
+    void decrypt(char* data, size_t len, uint64_t sector);
+
+    // Reads [offset, offset+len) into buf and decrypts it. buf is a registered
+    // buffer if buf_idx>=0, in whole pages. Returns the number of bytes read or
+    // a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> read(fuse_io_context& io,
+        char* buf, int buf_idx, uint64_t offset, uint64_t len);
+
+    // Encrypts buf and writes it to [offset, offset+len). buf contains the
+    // encrypted data afterwards. Returns the number of bytes written or a
+    // negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> write(fuse_io_context& io,
+        char* buf, int buf_idx, uint64_t offset, uint64_t len);
+
+    // Reads or writes all of ios. Sets the res of the requests
+    [[nodiscard]] fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io, bool write,
+        std::vector<BlockIo>& ios);
+
+    Stats get_stats() const;
+
+private:
+    // Sector range being written. Writes to overlapping sectors wait on it
+    struct SectorLock
+    {
+        uint64_t last;
+        fuse_io_context::SharedWaitQueue waiters;
+    };
+
+    // Waits until no range overlapping [first, last] is locked and locks it
+    [[nodiscard]] fuse_io_context::io_uring_task<int> lock_sectors(fuse_io_context& io,
+        uint64_t first, uint64_t last);
+    void unlock_sectors(uint64_t first);
+
+    // Round keys of the data key (encryption and decryption) and the tweak key
+    alignas(16) unsigned char enc_keys[15][16];
+    alignas(16) unsigned char dec_keys[15][16];
+    alignas(16) unsigned char tweak_keys[15][16];
+    int rounds;
+    bool have_vaes;
+
+    // Sector ranges being written, by first sector
+    std::mutex mutex;
+    std::map<uint64_t, SectorLock> writing;
+
+    std::atomic<uint64_t> encrypted_bytes;
+    std::atomic<uint64_t> decrypted_bytes;
+    std::atomic<uint64_t> partial_writes;
+    std::atomic<uint64_t> lock_waits;
+};
+
+[[nodiscard]] fuse_io_context::io_uring_task<int> crypt_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios);
+
+// The encrypted volume as backend
+class EncryptionBackend : public Backend
+{
+public:
+    EncryptionBackend(Encryption* encryption, uint64_t size)
+        : encryption(encryption), size(size) {}
+
+    std::string describe() const override
+    {
+        return encryption->describe();
+    }
+
+    uint64_t get_size() const override
+    {
+        return size;
+    }
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io,
+        bool write, std::vector<BlockIo>& ios) override
+    {
+        return crypt_io(io, write, ios);
+    }
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush(fuse_io_context& io,
+        bool datasync) override;
+
+    std::string get_stats() const override;
+
+private:
+    Encryption* encryption;
+    uint64_t size;
+};
@@ -1,14 +1,187 @@
 // SPDX-License-Identifier: LGPL-3.0-or-later
 // Copyright (C) Martin Raiber
 #include "fuse_io_context.h"
+#include "block_cache.h"
+#include "ssd_cache.h"
+#include "journal.h"
+#include "io_scheduler.h"
+#include "qos.h"
+#include "change_tracker.h"
+#include "mirror.h"
+#include "backend.h"
+#include "readahead.h"
 #include <liburing.h>
 #include <iostream>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <stdio.h>
+
+namespace
+{
+    int64_t get_monotonic_ms()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<int64_t>(ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+    }
+
+    void cpu_relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
 
 thread_local fuse_io_context::MallocItem* fuse_io_context::malloc_cache_head = nullptr;
+thread_local fuse_io_context* fuse_io_context::running = nullptr;
 
 fuse_io_context::fuse_io_context(FuseRing fuse_ring)
- : fuse_ring(std::move(fuse_ring)), last_rc(0)
+ : fuse_ring(std::move(fuse_ring)), last_rc(0),
+    backing_eventfd_val(0), posted_eventfd(eventfd(0, EFD_CLOEXEC)),
+    posted_eventfd_val(0),
+    cq_tail_seen(0), last_stats_time(get_monotonic_ms())
+{
+    fuse_sq.ring = this->fuse_ring.ring;
+    backing_sq.ring = this->fuse_ring.backing_ring;
+
+    for(DataBuf& data_buf: this->fuse_ring.data_bufs)
+    {
+        free_data_bufs.push_back(&data_buf);
+    }
+}
+
+fuse_io_context::~fuse_io_context()
 {
+    if(posted_eventfd!=-1)
+        close(posted_eventfd);
+}
+
+void fuse_io_context::post_resume(std::coroutine_handle<> p_awaiter) noexcept
+{
+    if(running==this)
+    {
+        posted_local.push_back(p_awaiter);
+        return;
+    }
+
+    bool wakeup;
+    {
+        std::scoped_lock lock(posted_mutex);
+        wakeup = posted.empty();
+        posted.push_back(p_awaiter);
+    }
+
+    // The run loop takes everything that is posted once it wakes up
+    if(wakeup)
+    {
+        uint64_t val = 1;
+        if(write(posted_eventfd, &val, sizeof(val))!=sizeof(val))
+            perror("Error signalling worker eventfd");
+    }
+}
+
+fuse_io_context::io_uring_task<int> fuse_io_context::SharedWaitQueue::wait_until(fuse_io_context& io,
+    std::mutex& mutex, std::function<bool()> done)
+{
+    std::unique_lock lock(mutex);
+    ++n_waiting;
+    while(!done())
+    {
+        co_await wait(io, lock);
+    }
+    --n_waiting;
+    co_return 0;
+}
+
+void fuse_io_context::resume_posted()
+{
+    std::vector<std::coroutine_handle<> > remote;
+    {
+        std::scoped_lock lock(posted_mutex);
+        if(!posted.empty())
+            remote.swap(posted);
+    }
+
+    // Posted while resuming are resumed after the next batch
+    std::vector<std::coroutine_handle<> > local;
+    local.swap(posted_local);
+
+    for(std::coroutine_handle<> awaiter: remote)
+    {
+        awaiter.resume();
+    }
+    for(std::coroutine_handle<> awaiter: local)
+    {
+        awaiter.resume();
+    }
+}
+
+int64_t fuse_io_context::get_monotonic_us() noexcept
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+io_uring_sqe* fuse_io_context::get_reserved_sqe(SqQueue& sq) noexcept
+{
+    sq.submit=true;
+    ++sq.inflight;
+    io_uring_sqe* ret = io_uring_get_sqe(sq.ring);
+    assert(ret!=nullptr);
+    return ret;
+}
+
+int fuse_io_context::try_reserve_sqes(SqQueue& sq, unsigned int n) noexcept
+{
+    assert(n<=*sq.ring->sq.kring_entries);
+
+    if(io_uring_sq_space_left(sq.ring)>=n)
+        return 1;
+
+    // Flushing the SQ frees the space right away, unless
+    // there is a SQ poll thread
+    bool is_fuse_ring = &sq==&fuse_sq;
+    if(is_fuse_ring)
+        enter_begin(false);
+    int rc = io_uring_submit(sq.ring);
+    if(is_fuse_ring)
+        enter_end();
+
+    if(rc==-EBUSY || rc==-EAGAIN)
+    {
+        // CQ ring is full or kernel is out of memory. Wait for
+        // the run loop to reap completions
+        ++stats.submit_busy;
+        return 0;
+    }
+    else if(rc<0)
+    {
+        errno = -rc;
+        perror("io_uring_submit failed in get_sqe");
+        return -1;
+    }
+
+    return io_uring_sq_space_left(sq.ring)>=n ? 1 : 0;
+}
+
+int fuse_io_context::resume_sqe_waiters(SqQueue& sq) noexcept
+{
+    while(!sq.waiters.empty())
+    {
+        int rc = try_reserve_sqes(sq, sq.waiters.front()->n);
+        if(rc<0)
+            return rc;
+        else if(rc==0)
+            break;
+
+        Waiter* waiter = sq.waiters.pop();
+
+        DBG_PRINT(std::cout << "Resume sqe waiter..." << std::endl);
+        waiter->awaiter.resume();
+    }
+    return 0;
 }
 
 int fuse_io_context::fuseuring_handle_cqe(struct io_uring_cqe *cqe)
@@ -32,41 +205,99 @@ int fuse_io_context::fuseuring_handle_cqe(struct io_uring_cqe *cqe)
     return 0;    
 }
 
-int fuse_io_context::fuseuring_submit(bool block)
+int fuse_io_context::submit_and_wait()
 {
-    if(fuse_ring.ring_submit)
+    if(fuse_ring.wait_nr>1)
     {
-        while(true)
+        // Needs IORING_FEAT_EXT_ARG (Linux 5.11), otherwise liburing
+        // would queue an internal timeout SQE
+        struct __kernel_timespec ts;
+        ts.tv_sec = fuse_ring.wait_usec/1000000;
+        ts.tv_nsec = (fuse_ring.wait_usec%1000000)*1000;
+        struct io_uring_cqe* cqe;
+        int rc = io_uring_submit_and_wait_timeout(fuse_ring.ring, &cqe,
+                    fuse_ring.wait_nr, &ts, nullptr);
+        if(rc==-ETIME)
+            return 0;
+        return rc;
+    }
+
+    return io_uring_submit_and_wait(fuse_ring.ring, 1);
+}
+
+bool fuse_io_context::spin_cq()
+{
+    int64_t spin_start = get_monotonic_us();
+    do
+    {
+        for(size_t i=0;i<64;++i)
         {
-            int rc;
-            if(block)
-                rc = io_uring_submit_and_wait(fuse_ring.ring, 1);
-            else
-                rc = io_uring_submit(fuse_ring.ring);
+            if(io_uring_cq_ready(fuse_ring.ring)>0)
+                return true;
+            cpu_relax();
+        }
+    } while(get_monotonic_us()-spin_start<fuse_ring.spin_usec);
 
-            if(rc<0 && errno!=EBUSY)
-            {
-                perror("Error submitting to fuse io_uring.");
-                return 18;
-            }
-            else if(rc<0)
-            {
-                std::cout << "io_uring_submit(2): EBUSY" << std::endl;
-            }
-            else
-            {
-                break;
-            }
+    return io_uring_cq_ready(fuse_ring.ring)>0;
+}
+
+int fuse_io_context::fuseuring_submit(bool block)
+{
+    if(block &&
+        (fuse_ring.ring->flags & IORING_SETUP_SQPOLL) &&
+        io_uring_cq_ready(fuse_ring.ring)>0)
+    {
+        // The SQ poll thread picks up new entries, so there is
+        // no need to enter the kernel if there already are completions.
+        // io_uring_submit() only enters if the poll thread needs a wakeup.
+        block = false;
+
+        if(!fuse_sq.submit)
+            return 0;
+    }
+
+    if(block && fuse_ring.spin_usec>0)
+    {
+        if(int rc; (rc=fuseuring_submit(false))!=0)
+            return rc;
+
+        if(spin_cq())
+            return 0;
+    }
 
-            sleep(0);
+    if(fuse_sq.submit)
+    {
+        int rc;
+        enter_begin(block);
+        if(block)
+            rc = submit_and_wait();
+        else
+            rc = io_uring_submit(fuse_ring.ring);
+        enter_end();
+
+        if(rc==-EBUSY || rc==-EAGAIN)
+        {
+            // CQ ring is full. Reap completions first. The SQ
+            // is submitted again in the next run loop iteration
+            ++stats.submit_busy;
+            return 0;
         }
-        fuse_ring.ring_submit=false;
+        else if(rc<0)
+        {
+            errno = -rc;
+            perror("Error submitting to fuse io_uring.");
+            return 18;
+        }
+        fuse_sq.submit=false;
     }
     else if(block)
     {
-        int rc = io_uring_submit_and_wait(fuse_ring.ring, 1);
+        enter_begin(true);
+        int rc = submit_and_wait();
+        enter_end();
         if(rc<0)
         {
+            errno = -rc;
             perror("Error submitting to fuse io_uring (2).");
             return 18;
         }
@@ -74,9 +305,261 @@ int fuse_io_context::fuseuring_submit(bool block)
     return 0;
 }
 
+void fuse_io_context::print_stats()
+{
+    int64_t now = get_monotonic_ms();
+    int64_t passed_ms = now - last_stats_time;
+    if(passed_ms<=0)
+        return;
+
+    auto per_s = [passed_ms](uint64_t curr, uint64_t last) {
+        return ((curr-last)*1000)/passed_ms;
+    };
+
+    uint64_t backing_writes = stats.backing_writes - last_stats.backing_writes;
+    double merge_ratio = backing_writes>0 ?
+            static_cast<double>(stats.coalesced_writes - last_stats.coalesced_writes)/backing_writes : 0;
+
+    std::cout << "Thread " << fuse_ring.thread_idx << ":"
+        << " waits/s=" << per_s(stats.waits, last_stats.waits)
+        << " submits/s=" << per_s(stats.submits, last_stats.submits)
+        << " cqes/s=" << per_s(stats.cqes, last_stats.cqes)
+        << " sqe stalls/s=" << per_s(stats.sqe_stalls, last_stats.sqe_stalls)
+        << " sqe stall ms/s=" << per_s(stats.sqe_stall_us, last_stats.sqe_stall_us)/1000
+        << " submit busy/s=" << per_s(stats.submit_busy, last_stats.submit_busy)
+        << " data buf stalls/s=" << per_s(stats.data_buf_stalls, last_stats.data_buf_stalls)
+        << " write merge ratio=" << merge_ratio
+        << " task work interruptions/s=" << per_s(stats.taskwork_interrupts, last_stats.taskwork_interrupts)
+        << std::endl;
+
+    if(fuse_ring.scheduler!=nullptr)
+    {
+        IoScheduler::Stats sched_stats = fuse_ring.scheduler->get_stats();
+        const char* class_names[IoScheduler::n_classes] = {"read", "sync write", "async write"};
+        std::cout << "Thread " << fuse_ring.thread_idx << " scheduler:";
+        for(size_t i=0;i<IoScheduler::n_classes;++i)
+        {
+            std::cout << " " << class_names[i] << " dispatched=" << sched_stats.dispatched[i]
+                << " queued=" << sched_stats.queued[i]
+                << " avg queue us=" << (sched_stats.queued[i]>0 ? sched_stats.wait_us[i]/sched_stats.queued[i] : 0);
+        }
+        std::cout << " expired=" << sched_stats.expired << std::endl;
+    }
+
+    if(fuse_ring.block_cache!=nullptr &&
+        fuse_ring.thread_idx==0)
+    {
+        BlockCache::Stats cache_stats = fuse_ring.block_cache->get_stats();
+        uint64_t lookups = cache_stats.hits + cache_stats.misses;
+        std::cout << "Block cache: hits=" << cache_stats.hits
+            << " misses=" << cache_stats.misses
+            << " hit rate=" << (lookups>0 ? (cache_stats.hits*100)/lookups : 0) << "%"
+            << " evictions=" << cache_stats.evictions
+            << " invalidations=" << cache_stats.invalidations
+            << std::endl;
+    }
+
+    if(fuse_ring.ssd_cache!=nullptr &&
+        fuse_ring.thread_idx==0)
+    {
+        SsdCache::Stats cache_stats = fuse_ring.ssd_cache->get_stats();
+        uint64_t lookups = cache_stats.hits + cache_stats.misses;
+        std::cout << "SSD cache: hits=" << cache_stats.hits
+            << " misses=" << cache_stats.misses
+            << " hit rate=" << (lookups>0 ? (cache_stats.hits*100)/lookups : 0) << "%"
+            << " fills=" << cache_stats.fills
+            << " evictions=" << cache_stats.evictions
+            << " invalidations=" << cache_stats.invalidations
+            << std::endl;
+    }
+
+    if(fuse_ring.stream_detector!=nullptr &&
+        fuse_ring.thread_idx==0)
+    {
+        StreamDetector::Stats ra_stats = fuse_ring.stream_detector->get_stats();
+        std::cout << "Readahead: sequential streams=" << ra_stats.streams
+            << " readaheads=" << ra_stats.readaheads
+            << " readahead MB=" << ra_stats.readahead_bytes/(1024*1024)
+            << std::endl;
+    }
+
+    if(fuse_ring.qos!=nullptr &&
+        fuse_ring.thread_idx==0)
+    {
+        QosLimiter::Stats qos_stats = fuse_ring.qos->get_stats();
+        std::cout << "QoS: throttled reads=" << qos_stats.throttled_reads
+            << " throttled read ms=" << qos_stats.throttled_read_us/1000
+            << " throttled writes=" << qos_stats.throttled_writes
+            << " throttled write ms=" << qos_stats.throttled_write_us/1000
+            << std::endl;
+    }
+
+    if(fuse_ring.thread_idx==0)
+    {
+        std::string volume_stats = fuse_ring.volume->get_stats();
+        if(!volume_stats.empty())
+            std::cout << volume_stats << std::endl;
+    }
+
+    if(fuse_ring.mirror!=nullptr)
+    {
+        std::cout << "Mirror thread " << fuse_ring.thread_idx << ":";
+        for(size_t leg=0;leg<2;++leg)
+        {
+            Mirror::LegLatency latency = fuse_ring.mirror->get_latency(fuse_ring.thread_idx, leg);
+            std::cout << " leg " << leg << " avg read us=" << latency.avg_us
+                << " hedge us=" << latency.hedge_us;
+        }
+        std::cout << std::endl;
+    }
+
+    if(fuse_ring.cbt!=nullptr &&
+        fuse_ring.thread_idx==0)
+    {
+        ChangeTracker::Stats cbt_stats = fuse_ring.cbt->get_stats();
+        std::cout << "Changed block tracking: epoch=" << cbt_stats.epoch
+            << " bitmap flushes=" << cbt_stats.flushes
+            << " flush waits=" << cbt_stats.flush_waits
+            << " reset waits=" << cbt_stats.reset_waits
+            << std::endl;
+    }
+
+    if(fuse_ring.journal!=nullptr &&
+        fuse_ring.thread_idx==0)
+    {
+        WriteJournal::Stats journal_stats = fuse_ring.journal->get_stats();
+        std::cout << "Write journal: used MB=" << journal_stats.used_bytes/(1024*1024)
+            << " extents=" << journal_stats.extents
+            << " writes=" << journal_stats.writes
+            << " written MB=" << journal_stats.write_bytes/(1024*1024)
+            << " overwritten MB=" << journal_stats.overwritten_bytes/(1024*1024)
+            << " destaged MB=" << journal_stats.destaged_bytes/(1024*1024)
+            << " destage runs=" << journal_stats.destage_runs
+            << " full waits=" << journal_stats.space_waits
+            << std::endl;
+    }
+
+    last_stats = stats;
+    last_stats_time = now;
+}
+
+int fuse_io_context::submit_backing()
+{
+    // With IOPOLL completions are only found when entering the kernel.
+    // io_uring_submit() enters with IORING_ENTER_GETEVENTS on IOPOLL rings.
+    bool iopoll = (backing_sq.ring->flags & IORING_SETUP_IOPOLL)!=0;
+    if(!backing_sq.submit &&
+        !(iopoll && backing_sq.inflight>0))
+        return 0;
+
+    int rc = io_uring_submit(backing_sq.ring);
+    if(rc==-EBUSY || rc==-EAGAIN)
+    {
+        ++stats.submit_busy;
+        return 0;
+    }
+    else if(rc<0)
+    {
+        errno = -rc;
+        perror("Error submitting to backing io_uring.");
+        return 18;
+    }
+    backing_sq.submit=false;
+    return 0;
+}
+
+int fuse_io_context::reap_cqes(struct io_uring* ring, size_t& count)
+{
+    unsigned head;
+    count=0;
+    struct io_uring_cqe *cqe;
+    io_uring_for_each_cqe(ring, head, cqe)
+    {
+        int rc = fuseuring_handle_cqe(cqe);
+        if(rc<0)
+        {
+            std::cerr << "Error handling cqe rc=" << rc << std::endl;
+            return 17;
+        }
+        ++count;
+    }
+    io_uring_cq_advance(ring, count);
+    stats.cqes+=count;
+    return 0;
+}
+
+fuse_io_context::io_uring_task_discard<int> fuse_io_context::backing_eventfd_wakeup()
+{
+    // Keeps a read of the backing ring's eventfd queued on the fuse
+    // ring, so that waiting on the fuse ring wakes up on backing completions
+    while(true)
+    {
+        io_uring_sqe* sqe = co_await get_sqe();
+        if(sqe==nullptr)
+        {
+            last_rc = 20;
+            co_return -1;
+        }
+
+        io_uring_prep_read(sqe, fuse_ring.backing_eventfd, &backing_eventfd_val,
+            sizeof(backing_eventfd_val), 0);
+
+        int rc = co_await complete(sqe);
+        if(rc<0 && rc!=-EINTR && rc!=-EAGAIN)
+        {
+            std::cerr << "Error reading backing ring eventfd rc=" << rc << std::endl;
+            last_rc = 20;
+            co_return -1;
+        }
+    }
+}
+
+fuse_io_context::io_uring_task_discard<int> fuse_io_context::posted_eventfd_wakeup()
+{
+    // Keeps a read of posted_eventfd queued, so that waiting on the fuse
+    // ring wakes up if another thread posted a coroutine to resume
+    while(true)
+    {
+        io_uring_sqe* sqe = co_await get_sqe();
+        if(sqe==nullptr)
+        {
+            last_rc = 21;
+            co_return -1;
+        }
+
+        io_uring_prep_read(sqe, posted_eventfd, &posted_eventfd_val,
+            sizeof(posted_eventfd_val), 0);
+
+        int rc = co_await complete(sqe);
+        if(rc<0 && rc!=-EINTR && rc!=-EAGAIN)
+        {
+            std::cerr << "Error reading worker eventfd rc=" << rc << std::endl;
+            last_rc = 21;
+            co_return -1;
+        }
+    }
+}
+
 int fuse_io_context::run(queue_fuse_read_t queue_read)
 {
-    fuse_ring.ring_submit = false;
+    if(posted_eventfd==-1)
+    {
+        perror("Error creating worker eventfd");
+        return 21;
+    }
+
+    running = this;
+    posted_eventfd_wakeup();
+
+    enter_end();
+
+    bool backing_iopoll = false;
+    if(has_backing_ring())
+    {
+        backing_iopoll = (backing_sq.ring->flags & IORING_SETUP_IOPOLL)!=0;
+        if(!backing_iopoll)
+            backing_eventfd_wakeup();
+    }
 
     while(true)
     {
@@ -85,24 +568,65 @@ int fuse_io_context::run(queue_fuse_read_t queue_read)
             queue_read_set_rc(queue_read);
         }
 
-        if(int rc; (rc=fuseuring_submit(true))!=0)
+        if(has_backing_ring())
+        {
+            if(int rc; (rc=submit_backing())!=0)
+                return rc;
+        }
+
+        // Busy poll while there is IOPOLL backing I/O in flight. Do not wait
+        // if coroutines were queued for resumption during the last batch
+        bool block = !(backing_iopoll && backing_sq.inflight>0) &&
+            batch_end_waiters.empty() && data_buf_ready.empty() &&
+            posted_local.empty();
+
+        if(int rc; (rc=fuseuring_submit(block))!=0)
             return rc;
 
+        size_t count;
+        if(int rc; (rc=reap_cqes(fuse_ring.ring, count))!=0)
+            return rc;
+        fuse_sq.inflight-=std::min(fuse_sq.inflight, count);
 
-        unsigned head;
-        unsigned count=0;
-        struct io_uring_cqe *cqe;
-        io_uring_for_each_cqe(fuse_ring.ring, head, cqe)
+        if(has_backing_ring())
         {
-            int rc = fuseuring_handle_cqe(cqe);
-            if(rc<0)
+            if(backing_iopoll)
             {
-                std::cerr << "Error handling cqe rc=" << rc << std::endl;
-                return 17;
+                if(int rc; (rc=submit_backing())!=0)
+                    return rc;
             }
-            ++count;
+
+            if(int rc; (rc=reap_cqes(backing_sq.ring, count))!=0)
+                return rc;
+            backing_sq.inflight-=std::min(backing_sq.inflight, count);
+        }
+
+        while(!data_buf_ready.empty())
+        {
+            data_buf_ready.pop()->awaiter.resume();
+        }
+
+        if(resume_sqe_waiters(fuse_sq)<0 ||
+            (has_backing_ring() && resume_sqe_waiters(backing_sq)<0) )
+        {
+            std::cerr << "Error resuming coroutines waiting for SQ space" << std::endl;
+            return 18;
+        }
+
+        // Waiters added while resuming are resumed after the next batch
+        WaitQueue batch_end = std::exchange(batch_end_waiters, WaitQueue());
+        while(!batch_end.empty())
+        {
+            batch_end.pop()->awaiter.resume();
+        }
+
+        resume_posted();
+
+        if(fuse_ring.stats_interval_s>0 &&
+            get_monotonic_ms() - last_stats_time >= fuse_ring.stats_interval_s*1000)
+        {
+            print_stats();
         }
-        io_uring_cq_advance(fuse_ring.ring, count);
 
         if(last_rc)
         {
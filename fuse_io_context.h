@@ -9,9 +9,31 @@
 #include <iostream>
 #include <unistd.h>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
 
 #define DBG_PRINT(x)
 
+class BlockCache;
+class SsdCache;
+class StreamDetector;
+class WriteCoalescer;
+class WriteJournal;
+class IoScheduler;
+class QosLimiter;
+class ChangeTracker;
+class HeatMap;
+class StripeLayout;
+class Mirror;
+class VhdChain;
+class ChunkStore;
+class Snapshot;
+class DedupStore;
+class Integrity;
+class Encryption;
+class Backend;
+
 /*
 //for clang and libc++
 namespace std
@@ -120,65 +142,309 @@ struct fuse_io_context
         return IoUringAwaiter<std::pair<io_uring_sqe*, io_uring_sqe*> >({sqes.first, sqes.second});
     }
 
-    io_uring_sqe* get_sqe(unsigned int peek=1) noexcept
+    struct Waiter
     {
-        if(peek>1)
+        Waiter* next;
+        std::coroutine_handle<> awaiter;
+        unsigned int n;
+        void* res;
+    };
+
+    struct WaitQueue
+    {
+        WaitQueue()
+            : head(nullptr), tail(nullptr) {}
+
+        bool empty() const noexcept
         {
-            while(true)
-            {
-                struct io_uring_sq *sq = &fuse_ring.ring->sq;
-                unsigned int head = io_uring_smp_load_acquire(sq->khead);        
-                unsigned int tail = sq->sqe_tail;
-                struct io_uring_sqe *__sqe = NULL;
+            return head==nullptr;
+        }
 
-                if (tail - head < *sq->kring_entries &&
-                    *sq->kring_entries - (tail - head) >= peek)
-                {
-                    io_uring_sqe* sqe = &sq->sqes[sq->sqe_tail & *sq->kring_mask];
-		            sq->sqe_tail = tail + 1;
-                    return sqe;
-                }
+        Waiter* front() const noexcept
+        {
+            return head;
+        }
 
-                int rc = io_uring_submit(fuse_ring.ring);
-                if(rc<0 && errno!=EBUSY)
-                {
-                    perror("io_uring_submit failed in get_sqe");
-                    return nullptr;
-                }
-                else if(rc<0)
-                {
-                    std::cout << "io_uring_submit: EBUSY" << std::endl;
-                    sleep(0);
-                }                
-            }
+        void push(Waiter* waiter) noexcept
+        {
+            waiter->next = nullptr;
+            if(tail==nullptr)
+                head = waiter;
+            else
+                tail->next = waiter;
+            tail = waiter;
+        }
+
+        Waiter* pop() noexcept
+        {
+            Waiter* ret = head;
+            head = ret->next;
+            if(head==nullptr)
+                tail = nullptr;
+            return ret;
+        }
+
+    private:
+        Waiter* head;
+        Waiter* tail;
+    };
+
+    struct SqQueue
+    {
+        SqQueue()
+            : ring(nullptr), submit(false), inflight(0) {}
+
+        struct io_uring* ring;
+        bool submit;
+        size_t inflight;
+        WaitQueue waiters;
+    };
+
+    struct SqeAwaiter
+    {
+        SqeAwaiter(fuse_io_context& io, SqQueue& sq, unsigned int n) noexcept
+            : io(io), sq(sq), failed(false), stall_start(0)
+        {
+            waiter.n = n;
         }
 
-        fuse_ring.ring_submit=true;
-        auto ret = io_uring_get_sqe(fuse_ring.ring);
-        if(ret==nullptr)
+        SqeAwaiter(SqeAwaiter const&) = delete;
+	    SqeAwaiter(SqeAwaiter&& other) = delete;
+	    SqeAwaiter& operator=(SqeAwaiter&&) = delete;
+	    SqeAwaiter& operator=(SqeAwaiter const&) = delete;
+
+        bool await_ready() noexcept
         {
-            /* Needs newer Linux 5.10
-            int rc = io_uring_sqring_wait(fuse_ring.ring);
+            // Keep FIFO order if others are already waiting
+            if(!sq.waiters.empty())
+                return false;
+
+            int rc = io.try_reserve_sqes(sq, waiter.n);
             if(rc<0)
             {
+                failed = true;
+                return true;
+            }
+            return rc>0;
+        }
+
+        void await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+        {
+            DBG_PRINT(std::cout << "Await sqes "<< waiter.n << " " << handle_v(p_awaiter) << std::endl);
+            waiter.awaiter = p_awaiter;
+            sq.waiters.push(&waiter);
+            ++io.stats.sqe_stalls;
+            stall_start = get_monotonic_us();
+        }
+
+        io_uring_sqe* await_resume() noexcept
+        {
+            if(stall_start!=0)
+                io.stats.sqe_stall_us += get_monotonic_us() - stall_start;
+
+            if(failed)
                 return nullptr;
+
+            return io.get_reserved_sqe(sq);
+        }
+
+    private:
+        fuse_io_context& io;
+        SqQueue& sq;
+        Waiter waiter;
+        bool failed;
+        int64_t stall_start;
+    };
+
+    // Reserves n SQEs for one submission (e.g. a linked chain). Suspends the
+    // coroutine in a FIFO queue if the SQ is full. It is resumed from the run
+    // loop once completions were reaped and there is space again.
+    // Returns the first SQE, get the rest via get_reserved_sqe() before
+    // suspending again. n may be at most max_sqe_batch.
+    [[nodiscard]] SqeAwaiter get_sqe(unsigned int n=1) noexcept
+    {
+        return SqeAwaiter(*this, fuse_sq, n);
+    }
+
+    io_uring_sqe* get_reserved_sqe() noexcept
+    {
+        return get_reserved_sqe(fuse_sq);
+    }
+
+    // Same for I/O to the backing file. Uses the dedicated
+    // backing ring if there is one
+    [[nodiscard]] SqeAwaiter get_backing_sqe(unsigned int n=1) noexcept
+    {
+        return SqeAwaiter(*this, backing_sq.ring!=nullptr ? backing_sq : fuse_sq, n);
+    }
+
+    io_uring_sqe* get_reserved_backing_sqe() noexcept
+    {
+        return get_reserved_sqe(backing_sq.ring!=nullptr ? backing_sq : fuse_sq);
+    }
+
+    // Most SQEs one get_sqe()/get_backing_sqe() may reserve. Both rings
+    // have at least that many entries
+    static const unsigned int max_sqe_batch = 64;
+
+    bool has_backing_ring() const noexcept
+    {
+        return backing_sq.ring!=nullptr;
+    }
+
+    static int64_t get_monotonic_us() noexcept;
+
+    struct DataBuf
+    {
+        char* buf;
+        int buf_idx;
+    };
+
+    struct DataBufVal
+    {
+        DataBufVal(fuse_io_context& io_service, DataBuf* data_buf)
+         : io_service(io_service), data_buf(data_buf)
+        {
+
+        }
+
+        DataBufVal(DataBufVal&& other) noexcept
+            : io_service(other.io_service), 
+                data_buf(std::exchange(other.data_buf, nullptr))
+        {
+
+        }
+
+        DataBufVal(DataBufVal const&) = delete;
+	    DataBufVal& operator=(DataBufVal&&) = delete;
+	    DataBufVal& operator=(DataBufVal const&) = delete;
+
+        ~DataBufVal()
+        {
+            if(data_buf!=nullptr)
+                io_service.release_data_buf(data_buf);
+        }
+
+        DataBuf* operator->() const noexcept
+        {
+            return data_buf;
+        }
+
+    private:
+        fuse_io_context& io_service;
+        DataBuf* data_buf;
+    };
+
+    struct DataBufAwaiter
+    {
+        DataBufAwaiter(fuse_io_context& io) noexcept
+            : io(io), data_buf(nullptr)
+        {
+            waiter.n = 1;
+            waiter.res = nullptr;
+        }
+
+        DataBufAwaiter(DataBufAwaiter const&) = delete;
+	    DataBufAwaiter(DataBufAwaiter&& other) = delete;
+	    DataBufAwaiter& operator=(DataBufAwaiter&&) = delete;
+	    DataBufAwaiter& operator=(DataBufAwaiter const&) = delete;
+
+        bool await_ready() noexcept
+        {
+            if(io.data_buf_waiters.empty() &&
+                !io.free_data_bufs.empty())
+            {
+                data_buf = io.free_data_bufs.back();
+                io.free_data_bufs.pop_back();
+                return true;
             }
-            else if(rc==0)
-            {*/
-                int rc = io_uring_submit(fuse_ring.ring);
-                if(rc<0)
-                {
-                    perror("io_uring_submit failed in get_sqe");
-                    return nullptr;
-                }
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+        {
+            DBG_PRINT(std::cout << "Await data buf " << handle_v(p_awaiter) << std::endl);
+            waiter.awaiter = p_awaiter;
+            io.data_buf_waiters.push(&waiter);
+            ++io.stats.data_buf_stalls;
+        }
+
+        DataBufVal await_resume() noexcept
+        {
+            if(data_buf==nullptr)
+                data_buf = static_cast<DataBuf*>(waiter.res);
+
+            return DataBufVal(io, data_buf);
+        }
+
+    private:
+        fuse_io_context& io;
+        Waiter waiter;
+        DataBuf* data_buf;
+    };
+
+    // Registered (and page aligned) buffer of fuse_ring.data_buf_size bytes
+    // for copying data between fuse and the backing file. Waits in a FIFO
+    // queue if all buffers are in use.
+    [[nodiscard]] DataBufAwaiter get_data_buf() noexcept
+    {
+        return DataBufAwaiter(*this);
+    }
+
+    void release_data_buf(DataBuf* data_buf) noexcept
+    {
+        if(!data_buf_waiters.empty())
+        {
+            // Resumed from the run loop
+            Waiter* waiter = data_buf_waiters.pop();
+            waiter->res = data_buf;
+            data_buf_ready.push(waiter);
+        }
+        else
+        {
+            free_data_bufs.push_back(data_buf);
+        }
+    }
+
+    struct BatchEndAwaiter
+    {
+        BatchEndAwaiter(fuse_io_context& io) noexcept
+            : io(io)
+        {
+            waiter.n = 0;
+            waiter.res = nullptr;
+        }
+
+        BatchEndAwaiter(BatchEndAwaiter const&) = delete;
+	    BatchEndAwaiter(BatchEndAwaiter&& other) = delete;
+	    BatchEndAwaiter& operator=(BatchEndAwaiter&&) = delete;
+	    BatchEndAwaiter& operator=(BatchEndAwaiter const&) = delete;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
 
-                do
-                { 
-                    ret = io_uring_get_sqe(fuse_ring.ring);
-                } while (ret==nullptr);
-            //}
+        void await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+        {
+            waiter.awaiter = p_awaiter;
+            io.batch_end_waiters.push(&waiter);
         }
-        return ret;
+
+        void await_resume() const noexcept
+        {
+        }
+
+    private:
+        fuse_io_context& io;
+        Waiter waiter;
+    };
+
+    // Suspends until all completions of the current batch of CQEs
+    // were handled
+    [[nodiscard]] BatchEndAwaiter batch_end() noexcept
+    {
+        return BatchEndAwaiter(*this);
     }
 
     struct MallocItem
@@ -444,12 +710,51 @@ struct fuse_io_context
         std::unique_ptr<FuseIo> fuse_io;
     };
 
+    // Fixed file indices of the files of the volume layers. Set up by
+    // fuseuring_run, -1 (or empty) if the layer is not used
+    struct FixedFileLayout
+    {
+        FixedFileLayout()
+            : mirror_legs{-1, -1}, chunk_overlay(-1),
+                snapshot_overlay(-1), snapshot_base(-1),
+                integrity_sums(-1), backend_conn(-1)
+                {}
+
+        // Stripe file i of StripeLayout. File 0 is the backing file
+        std::vector<int> stripe_files;
+        // Leg 0 is the backing file
+        int mirror_legs[2];
+        // Chain level i of the VHD chain. Level 0 is the backing file
+        std::vector<int> vhd_images;
+        int chunk_overlay;
+        int snapshot_overlay;
+        // The base again, for reading the snapshot
+        int snapshot_base;
+        int integrity_sums;
+        // Connection of the worker thread to the backend, if it has one
+        int backend_conn;
+    };
+
     struct FuseRing
     {
         FuseRing()
-            : ring(nullptr), ring_submit(false),
+            : ring(nullptr), backing_ring(nullptr),
+                backing_eventfd(-1),
                 max_bufsize(1*1024*1024), backing_fd(-1),
-                backing_fd_orig(-1), backing_f_size(0)
+                backing_fd_orig(-1), backing_f_size(0),
+                thread_idx(0), stats_interval_s(0),
+                wait_nr(1), wait_usec(0), spin_usec(0),
+                copy_mode(false), data_buf_size(0),
+                block_cache(nullptr), block_cache_buf_idx(0),
+                ssd_cache(nullptr), ssd_cache_fd(-1), ssd_fills(0),
+                stream_detector(nullptr), direct_io(false),
+                write_coalescer(nullptr), journal(nullptr),
+                journal_fd(-1), scheduler(nullptr), qos(nullptr),
+                cbt(nullptr), cbt_fd(-1), heat_map(nullptr),
+                stripes(nullptr), mirror(nullptr), vhd(nullptr),
+                chunk_store(nullptr), snapshot(nullptr),
+                dedup(nullptr), integrity(nullptr), encryption(nullptr),
+                backend(nullptr), volume(nullptr)
                 {}
 
         FuseRing(FuseRing&&) = default;
@@ -459,16 +764,119 @@ struct fuse_io_context
 
         std::vector<std::unique_ptr<FuseIo> > ios;
         struct io_uring* ring;
-        bool ring_submit;
+        // Optional dedicated ring for backing file I/O. If it is not an
+        // IOPOLL ring, completions are signalled via backing_eventfd
+        struct io_uring* backing_ring;
+        int backing_eventfd;
         size_t max_bufsize;
         int backing_fd;
         int backing_fd_orig;
         uint64_t backing_f_size;
+        size_t thread_idx;
+        unsigned int stats_interval_s;
+        unsigned int wait_nr;
+        unsigned int wait_usec;
+        unsigned int spin_usec;
+        // Read/write backing file data via data_bufs instead of splicing
+        bool copy_mode;
+        size_t data_buf_size;
+        std::vector<DataBuf> data_bufs;
+        // Shared by all worker threads. Cache memory is registered
+        // starting at block_cache_buf_idx
+        BlockCache* block_cache;
+        int block_cache_buf_idx;
+        // Shared by all worker threads. ssd_cache_fd is the fixed file
+        // index of the cache file. ssd_fills is the number of running
+        // (detached) cache fills of this thread
+        SsdCache* ssd_cache;
+        int ssd_cache_fd;
+        size_t ssd_fills;
+        // Shared by all worker threads
+        StreamDetector* stream_detector;
+        // Backing file is opened with O_DIRECT
+        bool direct_io;
+        // Merges backing writes in copy mode
+        WriteCoalescer* write_coalescer;
+        // Shared by all worker threads. journal_fd is the fixed
+        // file index of the journal file
+        WriteJournal* journal;
+        int journal_fd;
+        // Limits and orders backing I/O of this thread
+        IoScheduler* scheduler;
+        // Shared by all worker threads
+        QosLimiter* qos;
+        // Shared by all worker threads. cbt_fd is the fixed file
+        // index of the bitmap file
+        ChangeTracker* cbt;
+        int cbt_fd;
+        // Shared by all worker threads
+        HeatMap* heat_map;
+        // Shared by all worker threads. Set if the volume is striped
+        // across multiple backing files
+        StripeLayout* stripes;
+        // Shared by all worker threads. Set if the volume is mirrored
+        // on two backing files
+        Mirror* mirror;
+        // Shared by all worker threads. Set if the backing file is a VHD image
+        VhdChain* vhd;
+        // Shared by all worker threads. Set if the backing file is a
+        // compressed chunk store
+        ChunkStore* chunk_store;
+        // Shared by all worker threads. Set if writes can be redirected
+        // to a snapshot overlay
+        Snapshot* snapshot;
+        // Shared by all worker threads. Set if the backing file is a
+        // dedup store
+        DedupStore* dedup;
+        // Shared by all worker threads. Set if blocks are checksummed
+        // in a side file
+        Integrity* integrity;
+        // Shared by all worker threads. Set if the backing file is
+        // encrypted
+        Encryption* encryption;
+        // Shared by all worker threads. Set if the volume is stored in
+        // a backend instead of the backing file
+        Backend* backend;
+        // Shared by all worker threads. The storage of the volume: the
+        // volume layer, the backend or the backing file. Always set
+        Backend* volume;
+        FixedFileLayout files;
+    };
+
+    struct Stats
+    {
+        Stats()
+            : waits(0), submits(0), cqes(0),
+                sqe_stalls(0), sqe_stall_us(0), data_buf_stalls(0),
+                coalesced_writes(0), backing_writes(0),
+                submit_busy(0), taskwork_interrupts(0)
+                {}
+
+        uint64_t waits;
+        uint64_t submits;
+        uint64_t cqes;
+        // Coroutines suspended because the SQ was full
+        uint64_t sqe_stalls;
+        uint64_t sqe_stall_us;
+        // Coroutines waiting for a copy mode data buffer
+        uint64_t data_buf_stalls;
+        // FUSE writes that went through write coalescing and the
+        // number of backing writes they were merged into
+        uint64_t coalesced_writes;
+        uint64_t backing_writes;
+        // Submissions rejected with EBUSY (CQ overflow)
+        uint64_t submit_busy;
+        // Number of times completions were posted to the CQ while this
+        // thread was running in user space, i.e. task work interrupted
+        // the thread. Stays zero with IORING_SETUP_DEFER_TASKRUN.
+        uint64_t taskwork_interrupts;
     };
 
     FuseRing fuse_ring;
+    Stats stats;
 
     fuse_io_context(FuseRing fuse_ring);
+    ~fuse_io_context();
     fuse_io_context(fuse_io_context const&) = delete;
 	fuse_io_context(fuse_io_context&& other) = delete;
 	fuse_io_context& operator=(fuse_io_context&&) = delete;
@@ -490,8 +898,7 @@ struct fuse_io_context
         fuse_ring.ios.push_back(std::move(fuse_io));
     }
 
-private:
-
+    // Return type for coroutines that run detached (not awaited)
     template<typename T>
     struct io_uring_task_discard : io_uring_task<T>
     {
@@ -501,12 +908,174 @@ private:
         }
     };
 
+    // Coroutines waiting for a condition on state that is shared by the
+    // worker threads and protected by a mutex of the caller. Works like a
+    // condition variable: wait() releases the lock while suspended and
+    // takes it again before returning, notify_all() is called with the
+    // lock held and resumes every waiter on the thread it runs on (from
+    // that thread's run loop)
+    struct SharedWaitQueue
+    {
+        struct Entry
+        {
+            Entry* next;
+            fuse_io_context* io;
+            std::coroutine_handle<> awaiter;
+        };
+
+        struct Awaiter
+        {
+            Awaiter(SharedWaitQueue& queue, fuse_io_context& io, std::unique_lock<std::mutex>& lock) noexcept
+                : queue(queue), lock(lock)
+            {
+                entry.io = &io;
+            }
+
+            Awaiter(Awaiter const&) = delete;
+            Awaiter(Awaiter&& other) = delete;
+            Awaiter& operator=(Awaiter&&) = delete;
+            Awaiter& operator=(Awaiter const&) = delete;
+
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+            {
+                entry.awaiter = p_awaiter;
+                entry.next = nullptr;
+                if(queue.tail==nullptr)
+                    queue.head = &entry;
+                else
+                    queue.tail->next = &entry;
+                queue.tail = &entry;
+                // Resumption is always deferred to the run loop, so this
+                // coroutine is suspended before anybody can resume it
+                lock.unlock();
+            }
+
+            void await_resume() noexcept
+            {
+                lock.lock();
+            }
+
+        private:
+            SharedWaitQueue& queue;
+            std::unique_lock<std::mutex>& lock;
+            Entry entry;
+        };
+
+        SharedWaitQueue()
+            : head(nullptr), tail(nullptr), n_waiting(0) {}
+
+        // Re-check the condition after it returns, like with
+        // std::condition_variable
+        [[nodiscard]] Awaiter wait(fuse_io_context& io, std::unique_lock<std::mutex>& lock) noexcept
+        {
+            return Awaiter(*this, io, lock);
+        }
+
+        bool empty() const noexcept
+        {
+            return head==nullptr;
+        }
+
+        // For conditions on state that is changed without holding the
+        // mutex (e.g. atomic counters): Waits until done (called with
+        // mutex held) returns true. The state change has to be followed by
+        // notify_changed()
+        [[nodiscard]] io_uring_task<int> wait_until(fuse_io_context& io, std::mutex& mutex,
+            std::function<bool()> done);
+
+        // Takes the mutex and resumes the waiters if there are any in
+        // wait_until(). Either they see the new state or this sees them
+        void notify_changed(std::mutex& mutex) noexcept
+        {
+            if(n_waiting.load()>0)
+            {
+                std::scoped_lock lock(mutex);
+                notify_all();
+            }
+        }
+
+        void notify_all() noexcept
+        {
+            Entry* entry = std::exchange(head, nullptr);
+            tail = nullptr;
+            while(entry!=nullptr)
+            {
+                Entry* next = entry->next;
+                entry->io->post_resume(entry->awaiter);
+                entry = next;
+            }
+        }
+
+    private:
+        Entry* head;
+        Entry* tail;
+        std::atomic<size_t> n_waiting;
+    };
+
+    // Resumes p_awaiter from the run loop of this context. Can be called
+    // from any thread
+    void post_resume(std::coroutine_handle<> p_awaiter) noexcept;
+
+private:
+
     fuse_io_context::io_uring_task_discard<int> queue_read_set_rc(queue_fuse_read_t queue_read);
 
     int fuseuring_handle_cqe(struct io_uring_cqe *cqe);
     int fuseuring_submit(bool block);
+    int submit_and_wait();
+    bool spin_cq();
+    void print_stats();
+
+    int try_reserve_sqes(SqQueue& sq, unsigned int n) noexcept;
+    int resume_sqe_waiters(SqQueue& sq) noexcept;
+    io_uring_sqe* get_reserved_sqe(SqQueue& sq) noexcept;
+    int submit_backing();
+    int reap_cqes(struct io_uring* ring, size_t& count);
+    fuse_io_context::io_uring_task_discard<int> backing_eventfd_wakeup();
+    fuse_io_context::io_uring_task_discard<int> posted_eventfd_wakeup();
+    void resume_posted();
+
+    void enter_begin(bool wait) noexcept
+    {
+        if(io_uring_smp_load_acquire(fuse_ring.ring->cq.ktail)!=cq_tail_seen)
+            ++stats.taskwork_interrupts;
+
+        if(wait)
+            ++stats.waits;
+        else
+            ++stats.submits;
+    }
+
+    void enter_end() noexcept
+    {
+        cq_tail_seen = io_uring_smp_load_acquire(fuse_ring.ring->cq.ktail);
+    }
     
     int last_rc;
+    SqQueue fuse_sq;
+    SqQueue backing_sq;
+    std::vector<DataBuf*> free_data_bufs;
+    WaitQueue data_buf_waiters;
+    WaitQueue data_buf_ready;
+    WaitQueue batch_end_waiters;
+    uint64_t backing_eventfd_val;
+    // Coroutines to resume from the run loop. posted_eventfd wakes up the
+    // run loop if they were posted from another thread
+    std::mutex posted_mutex;
+    std::vector<std::coroutine_handle<> > posted;
+    std::vector<std::coroutine_handle<> > posted_local;
+    int posted_eventfd;
+    // Context whose run loop runs on this thread
+    static thread_local fuse_io_context* running;
+    uint64_t posted_eventfd_val;
+    unsigned cq_tail_seen;
+    Stats last_stats;
+    int64_t last_stats_time;
 };
 
 template<>
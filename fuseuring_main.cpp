@@ -13,8 +13,31 @@
 #include <memory.h>
 #include <thread>
 #include <iostream>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include "fuse_io_context.h"
 #include "fuseuring_main.h"
+#include "block_cache.h"
+#include "ssd_cache.h"
+#include "readahead.h"
+#include "write_coalescer.h"
+#include "journal.h"
+#include "io_scheduler.h"
+#include "qos.h"
+#include "change_tracker.h"
+#include "heat_map.h"
+#include "stripe.h"
+#include "mirror.h"
+#include "vhd.h"
+#include "chunk_store.h"
+#include "snapshot.h"
+#include "dedup.h"
+#include "integrity.h"
+#include "encryption.h"
+#include "nbd.h"
+#include "s3.h"
+#include <signal.h>
+#include <linux/falloc.h>
 
 namespace
 {
@@ -27,6 +50,25 @@ namespace
                         sizeof(fuse_out_header)+sizeof(fuse_entry_out)),
                         sizeof(fuse_out_header)+sizeof(fuse_write_out));
 
+    // Returned by handle_read_cached if the request has to be served without the cache
+    const int read_cache_bypass = 1;
+    // Maximum number of cache block reads to wait for at once
+    const size_t max_cache_fill_batch = 64;
+    // Maximum number of concurrent SSD cache fills per worker thread
+    const size_t max_ssd_fills = 4;
+    // Node ids of the files exposing changed block tracking. The epoch
+    // file contains the epoch as fixed width decimal number
+    const uint64_t cbt_bitmap_nodeid = 5;
+    const uint64_t cbt_epoch_nodeid = 6;
+    const uint64_t cbt_epoch_file_size = 21;
+    // Node ids of the heat map snapshot and summary
+    const uint64_t heat_map_nodeid = 7;
+    const uint64_t heat_top_nodeid = 8;
+    // Node ids of the snapshot (read-only base) and the file to
+    // create/delete it
+    const uint64_t snapshot_nodeid = 9;
+    const uint64_t snapshot_ctl_nodeid = 10;
+
     template<typename T>
     auto round_up(T numToRound, T multiple)
 	{
@@ -72,7 +114,7 @@ namespace
         size_t read_done = init_read;
         do
         {
-            io_uring_sqe *sqe = io.get_sqe();
+            io_uring_sqe *sqe = co_await io.get_sqe();
             if(sqe==nullptr)
                 co_return nullptr;
 
@@ -122,7 +164,7 @@ namespace
 [[nodiscard]] fuse_io_context::io_uring_task<int> send_reply(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io)
 {
     struct io_uring_sqe *sqe;
-    sqe = io.get_sqe(2);
+    sqe = co_await io.get_sqe(2);
     if(sqe==nullptr)
         co_return -1;
 
@@ -133,7 +175,7 @@ namespace
             0, fuse_io->scratch_buf_idx);
     sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
 
-    io_uring_sqe *sqe2 = io.get_sqe();
+    io_uring_sqe *sqe2 = io.get_reserved_sqe();
 
     io_uring_prep_splice(sqe2, fuse_io->pipe[0],
         -1, fuse_io->fuse_fd, -1, reply_size,
@@ -157,7 +199,7 @@ namespace
     const std::vector<char>& buf)
 {
     struct io_uring_sqe *sqe;
-    sqe = io.get_sqe(2);
+    sqe = co_await io.get_sqe(2);
     if(sqe==nullptr)
         co_return -1;
 
@@ -167,9 +209,7 @@ namespace
             0);
     sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
 
-    io_uring_sqe *sqe2 = io.get_sqe();
-    if(sqe2==nullptr)
-        co_return -1;
+    io_uring_sqe *sqe2 = io.get_reserved_sqe();
 
     io_uring_prep_splice(sqe2, fuse_io->pipe[0],
         -1, fuse_io->fuse_fd, -1, buf.size(),
@@ -201,6 +241,70 @@ namespace
     co_return co_await send_reply(io, fuse_io);
 }
 
+bool is_cbt_node(fuse_io_context& io, uint64_t nodeid)
+{
+    return io.fuse_ring.cbt!=nullptr &&
+        (nodeid==cbt_bitmap_nodeid || nodeid==cbt_epoch_nodeid);
+}
+
+void fill_cbt_attr(fuse_io_context& io, uint64_t nodeid, fuse_attr& attr)
+{
+    attr.ino = nodeid;
+    if(nodeid==cbt_bitmap_nodeid)
+    {
+        attr.mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+        attr.size = io.fuse_ring.cbt->get_file_size();
+    }
+    else
+    {
+        attr.mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+        attr.size = cbt_epoch_file_size;
+    }
+    attr.blocks = round_up<off_t>(attr.size, 512);
+    attr.blksize = getpagesize();
+}
+
+bool is_heat_node(fuse_io_context& io, uint64_t nodeid)
+{
+    return io.fuse_ring.heat_map!=nullptr &&
+        (nodeid==heat_map_nodeid || nodeid==heat_top_nodeid);
+}
+
+// The summary is generated when it is read, so it has no size. Files
+// are opened with direct I/O, so it is read until EOF anyway
+void fill_heat_attr(fuse_io_context& io, uint64_t nodeid, fuse_attr& attr)
+{
+    attr.ino = nodeid;
+    attr.mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+    if(nodeid==heat_map_nodeid)
+        attr.size = io.fuse_ring.heat_map->get_snapshot_size();
+    attr.blocks = round_up<off_t>(attr.size, 512);
+    attr.blksize = getpagesize();
+}
+
+bool is_snapshot_node(fuse_io_context& io, uint64_t nodeid)
+{
+    return io.fuse_ring.snapshot!=nullptr &&
+        (nodeid==snapshot_nodeid || nodeid==snapshot_ctl_nodeid);
+}
+
+// The control file is generated when it is read, so it has no size
+void fill_snapshot_attr(fuse_io_context& io, uint64_t nodeid, fuse_attr& attr)
+{
+    attr.ino = nodeid;
+    if(nodeid==snapshot_nodeid)
+    {
+        attr.mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+        attr.size = io.fuse_ring.backing_f_size;
+    }
+    else
+    {
+        attr.mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    }
+    attr.blocks = round_up<off_t>(attr.size, 512);
+    attr.blksize = getpagesize();
+}
+
 [[nodiscard]] fuse_io_context::io_uring_task<int> send_attr(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
     uint64_t unique, uint64_t nodeid)
 {
@@ -228,6 +332,18 @@ namespace
         attr_out->attr.blocks = round_up<off_t>(attr_out->attr.size, 512);
         attr_out->attr.blksize = getpagesize();
     }
+    else if(is_cbt_node(io, nodeid))
+    {
+        fill_cbt_attr(io, nodeid, attr_out->attr);
+    }
+    else if(is_heat_node(io, nodeid))
+    {
+        fill_heat_attr(io, nodeid, attr_out->attr);
+    }
+    else if(is_snapshot_node(io, nodeid))
+    {
+        fill_snapshot_attr(io, nodeid, attr_out->attr);
+    }
     else
     {
         out_header->error = -EACCES;
@@ -308,6 +424,27 @@ namespace
         entry_out->attr.blocks = round_up<off_t>(entry_out->attr.size, 512);
         entry_out->attr.blksize = getpagesize();
     }
+    else if(io.fuse_ring.cbt!=nullptr &&
+        (lname=="changed_blocks" || lname=="changed_blocks_epoch"))
+    {
+        entry_out->nodeid = lname=="changed_blocks" ? cbt_bitmap_nodeid : cbt_epoch_nodeid;
+        entry_out->attr = {};
+        fill_cbt_attr(io, entry_out->nodeid, entry_out->attr);
+    }
+    else if(io.fuse_ring.heat_map!=nullptr &&
+        (lname=="heat_map" || lname=="heat_map_top"))
+    {
+        entry_out->nodeid = lname=="heat_map" ? heat_map_nodeid : heat_top_nodeid;
+        entry_out->attr = {};
+        fill_heat_attr(io, entry_out->nodeid, entry_out->attr);
+    }
+    else if(io.fuse_ring.snapshot!=nullptr &&
+        (lname=="snapshot" || lname=="snapshot_ctl"))
+    {
+        entry_out->nodeid = lname=="snapshot" ? snapshot_nodeid : snapshot_ctl_nodeid;
+        entry_out->attr = {};
+        fill_snapshot_attr(io, entry_out->nodeid, entry_out->attr);
+    }
     else
     {
         entry_out->nodeid = 1;
@@ -353,229 +490,1213 @@ namespace
     out_header->unique = fheader->unique;
 
     fuse_open_out* open_out = reinterpret_cast<fuse_open_out*>(fuse_io->scratch_buf + sizeof(fuse_out_header));
-    open_out->fh = 3;
+    open_out->fh = fheader->nodeid;
     open_out->open_flags = open_in->flags | FOPEN_KEEP_CACHE | FOPEN_DIRECT_IO;
     
     co_return co_await send_reply(io, fuse_io);
 }
 
-[[nodiscard]] fuse_io_context::io_uring_task<int> handle_read(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
-    char* rbytes_buf)
+fuse_io_context::io_uring_task_discard<int> fill_ssd_cache(fuse_io_context& io, uint64_t chunk)
 {
-    fuse_in_header* fheader = reinterpret_cast<fuse_in_header*>(fuse_io->header_buf);
-    uint64_t read_offset;
-    uint32_t read_size;
+    SsdCache* ssd_cache = io.fuse_ring.ssd_cache;
+    size_t slot;
+    if(!ssd_cache->reserve(chunk, slot))
+        co_return 0;
+
+    SsdCachePin pin;
+    pin.set(ssd_cache, slot);
+    ++io.fuse_ring.ssd_fills;
+
+    uint64_t chunk_size = ssd_cache->get_chunk_size();
+    uint64_t chunk_offset = chunk*chunk_size;
+    size_t len = std::min(chunk_size, io.fuse_ring.backing_f_size - chunk_offset);
+    size_t aligned_len = round_up<size_t>(len, 4096);
+
+    bool ok = false;
+    void* buf_p;
+    if(posix_memalign(&buf_p, 4096, aligned_len)!=0)
     {
-        fuse_read_in* read_in = reinterpret_cast<fuse_read_in*>(rbytes_buf);
+        ssd_cache->fill_done(slot, false);
+        --io.fuse_ring.ssd_fills;
+        co_return -1;
+    }
+    std::unique_ptr<char, decltype(&free)> buf(static_cast<char*>(buf_p), &free);
 
-        DBG_PRINT(std::cout << "read nodeid " << fheader->nodeid << " off: " << read_in->offset << " size: "<<read_in->size << std::endl);
+    io_uring_sqe* sqe = co_await io.get_backing_sqe();
+    if(sqe!=nullptr)
+    {
+        io_uring_prep_read(sqe, io.fuse_ring.backing_fd, buf.get(), aligned_len, chunk_offset);
+        sqe->flags |= IOSQE_FIXED_FILE;
 
-        if(fheader->nodeid!=3)
+        int rc = co_await io.complete(sqe);
+        if(rc>=0 && static_cast<size_t>(rc)>=len)
         {
-            fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
-            out_header->error = 0;
-            out_header->unique = fheader->unique;
-            out_header->error = -ENOENT;
-            co_return co_await send_reply(io, fuse_io);
+            memset(buf.get() + len, 0, aligned_len - len);
+
+            sqe = co_await io.get_backing_sqe();
+            if(sqe!=nullptr)
+            {
+                io_uring_prep_write(sqe, io.fuse_ring.ssd_cache_fd, buf.get(), aligned_len,
+                        ssd_cache->slot_offset(slot));
+                sqe->flags |= IOSQE_FIXED_FILE;
+
+                rc = co_await io.complete(sqe);
+                ok = rc>=0 && static_cast<size_t>(rc)==aligned_len;
+            }
         }
 
-        if(read_in->offset + read_in->size > io.fuse_ring.backing_f_size)
+        if(!ok)
         {
-            read_in->size = io.fuse_ring.backing_f_size - read_in->offset;
-            DBG_PRINT(std::cout << "Reading less: " << read_in->size << std::endl);
+            static bool erronce=true;
+            if(erronce)
+            {
+                std::cerr << "Filling SSD cache chunk " << chunk << " failed rc=" << rc << std::endl;
+                erronce=false;
+            }
         }
+    }
 
-        read_offset = read_in->offset;
-        read_size = read_in->size;
+    ssd_cache->fill_done(slot, ok);
+    --io.fuse_ring.ssd_fills;
+    co_return 0;
+}
+
+void start_ssd_cache_fills(fuse_io_context& io, uint64_t offset, uint64_t len)
+{
+    uint64_t chunk_size = io.fuse_ring.ssd_cache->get_chunk_size();
+    uint64_t last_chunk = (offset + len - 1) / chunk_size;
+    for(uint64_t chunk=offset/chunk_size;chunk<=last_chunk;++chunk)
+    {
+        if(io.fuse_ring.ssd_fills>=max_ssd_fills)
+            return;
+
+        fill_ssd_cache(io, chunk);
     }
+}
 
-    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
-    out_header->error = 0;
-    out_header->len = sizeof(fuse_out_header) + read_size;
-    out_header->unique = fheader->unique;
+// If [offset, offset+len) of the backing file is inside a chunk in the SSD cache, pins
+// the chunk and returns the fixed file and offset to read it from instead. Otherwise
+// starts filling the SSD cache with the chunks in the background
+void lookup_ssd_cache(fuse_io_context& io, uint64_t offset, uint64_t len,
+    SsdCachePin& pin, int& fd, uint64_t& src_offset)
+{
+    fd = io.fuse_ring.backing_fd;
+    src_offset = offset;
+
+    SsdCache* ssd_cache = io.fuse_ring.ssd_cache;
+    if(ssd_cache==nullptr || len==0)
+        return;
+
+    uint64_t chunk_size = ssd_cache->get_chunk_size();
+    uint64_t chunk = offset / chunk_size;
+    size_t slot;
+    if(chunk==(offset + len - 1) / chunk_size &&
+        ssd_cache->lookup(chunk, slot))
+    {
+        pin.set(ssd_cache, slot);
+        fd = io.fuse_ring.ssd_cache_fd;
+        src_offset = ssd_cache->slot_offset(slot) + offset - chunk*chunk_size;
+        return;
+    }
 
-    io_uring_sqe* sqe1 = io.get_sqe(3);
-    if(sqe1==nullptr)
-        co_return -1;
+    start_ssd_cache_fills(io, offset, len);
+}
 
-    io_uring_prep_write_fixed(sqe1, fuse_io->pipe[1],
-            fuse_io->scratch_buf, sizeof(fuse_out_header),
-            -1, fuse_io->scratch_buf_idx);
-    sqe1->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+bool has_read_cache(fuse_io_context& io)
+{
+    return io.fuse_ring.block_cache!=nullptr ||
+        io.fuse_ring.ssd_cache!=nullptr;
+}
 
-    io_uring_sqe *sqe2 = io.get_sqe();
-    if(sqe2==nullptr)
-        co_return -1;
+void invalidate_read_caches(fuse_io_context& io, uint64_t offset, uint64_t len)
+{
+    if(io.fuse_ring.block_cache!=nullptr)
+        io.fuse_ring.block_cache->invalidate(offset, len);
 
-    io_uring_prep_splice(sqe2, io.fuse_ring.backing_fd,
-        read_offset, fuse_io->pipe[1], -1, read_size,
-        SPLICE_F_MOVE| SPLICE_F_FD_IN_FIXED | SPLICE_F_NONBLOCK);
-    sqe2->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    if(io.fuse_ring.ssd_cache!=nullptr)
+        io.fuse_ring.ssd_cache->invalidate(offset, len);
+}
 
-    io_uring_sqe *sqe3 = io.get_sqe();
-    if(sqe3==nullptr)
-        co_return -1;
+void release_cache_slots(BlockCache* cache, const std::vector<size_t>& slots,
+    const std::vector<size_t>& fill_idx)
+{
+    for(size_t idx: fill_idx)
+    {
+        cache->fill_done(slots[idx], false);
+    }
 
-    io_uring_prep_splice(sqe3, fuse_io->pipe[0],
-        -1, fuse_io->fuse_fd, -1, out_header->len,
-        SPLICE_F_MOVE | SPLICE_F_FD_IN_FIXED | SPLICE_F_NONBLOCK);
-    sqe3->flags |= IOSQE_FIXED_FILE;
-    
-    std::vector<int> rcs = co_await io.complete({sqe1, sqe2, sqe3});
+    for(size_t slot: slots)
+    {
+        cache->unpin(slot);
+    }
+}
 
-    for(int rc: rcs)
+// Reads the blocks slots[fill_idx[...]] (block number first_block + fill_idx[...])
+// directly into cache memory, from the SSD cache or the volume. I/O errors are
+// returned in err
+[[nodiscard]] fuse_io_context::io_uring_task<int> fill_cache_blocks(fuse_io_context& io, uint64_t first_block,
+    const std::vector<size_t>& slots, const std::vector<size_t>& fill_idx, int& err)
+{
+    BlockCache* cache = io.fuse_ring.block_cache;
+    const uint64_t block_size = cache->get_block_size();
+    err = 0;
+
+    std::vector<BlockIo> ios;
+    // Offsets of ssd_ios are in the SSD cache file
+    std::vector<BlockIo> ssd_ios;
+    std::vector<SsdCachePin> ssd_pins(fill_idx.size());
+    for(size_t i=0;i<fill_idx.size();++i)
     {
-        if(rc<0)
+        size_t slot = slots[fill_idx[i]];
+        BlockIo req{cache->slot_buf(slot),
+            static_cast<int>(io.fuse_ring.block_cache_buf_idx + cache->slot_reg_idx(slot)),
+            (first_block + fill_idx[i])*block_size, block_size, 0};
+
+        int read_fd;
+        uint64_t src_offset;
+        uint64_t avail = block_io_len(req, io.fuse_ring.backing_f_size);
+        lookup_ssd_cache(io, req.offset, avail, ssd_pins[i], read_fd, src_offset);
+        if(read_fd==io.fuse_ring.backing_fd)
         {
-            std::cerr << "handle_read failed. rcs=" << 
-                rcs[0] << ", " << rcs[1] << ", " <<
-                rcs[2] << std::endl;
-            co_return -1;
+            ios.push_back(req);
+        }
+        else
+        {
+            req.offset = src_offset;
+            req.len = avail;
+            ssd_ios.push_back(req);
         }
     }
 
-    if(rcs[0]<sizeof(fuse_out_header))
-    {
+    if(!ios.empty() &&
+        co_await backend_io(io, false, ios)!=0)
         co_return -1;
-    }
 
-    if(rcs[1]<read_size)
-    {
+    if(!ssd_ios.empty() &&
+        co_await file_io(io, false, io.fuse_ring.ssd_cache_fd, ssd_ios)!=0)
         co_return -1;
-    }
 
-    if(rcs[2]<out_header->len)
+    ios.insert(ios.end(), ssd_ios.begin(), ssd_ios.end());
+    for(const BlockIo& req: ios)
     {
-        co_return -1;
+        if(req.res<0)
+            err = req.res;
+        else
+            memset(req.buf + req.res, 0, block_size - req.res);
     }
 
     co_return 0;
 }
 
-[[nodiscard]] fuse_io_context::io_uring_task<int> handle_write(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
-    char* rbytes_buf)
+fuse_io_context::io_uring_task_discard<int> readahead_block_cache(fuse_io_context& io, uint64_t offset, uint64_t len)
 {
-    fuse_in_header* fheader = reinterpret_cast<fuse_in_header*>(fuse_io->header_buf);
-    uint64_t write_offset;
-    uint32_t write_size;
+    BlockCache* cache = io.fuse_ring.block_cache;
+    const uint64_t block_size = cache->get_block_size();
+    const uint64_t first_block = offset / block_size;
+    const uint64_t last_block = (offset + len - 1) / block_size;
+
+    // Only fills blocks that are not cached (or being filled) yet
+    std::vector<size_t> slots;
+    std::vector<size_t> fill_idx;
+    for(uint64_t block=first_block;block<=last_block;++block)
     {
-        fuse_write_in* write_in = reinterpret_cast<fuse_write_in*>(rbytes_buf);
+        size_t slot;
+        BlockCache::LookupRes res = cache->lookup(block, slot);
+        if(res==BlockCache::LookupRes::Busy)
+            break;
 
-        DBG_PRINT(std::cout << "write nodeid " << fheader->nodeid << " off: " << write_in->offset << " size: "<< write_in->size << std::endl);
+        if(res==BlockCache::LookupRes::Hit)
+            cache->unpin(slot);
+        else
+            fill_idx.push_back(slots.size());
 
-        if(fheader->nodeid!=3)
-        {
-            fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
-            out_header->unique = fheader->unique;
-            out_header->error = -ENOENT;
-            out_header->len = sizeof(fuse_out_header);
-            co_return co_await send_reply(io, fuse_io);
-        }
+        slots.push_back(slot);
+    }
 
-        write_offset = write_in->offset;
-        write_size = write_in->size;
+    if(fill_idx.empty())
+        co_return 0;
 
-        /*if(write_offset + write_size > io.fuse_ring.backing_f_size)
-        {
-            write_size = io.fuse_ring.backing_f_size - write_offset;
-            std::cout << "Writing less: " << write_size << std::endl;
-        }*/
+    int err;
+    int rc = co_await fill_cache_blocks(io, first_block, slots, fill_idx, err);
 
-        if(fheader->len!=sizeof(fuse_in_header)+sizeof(fuse_write_in)+write_size)
-        {
-            fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
-            out_header->unique = fheader->unique;
-            out_header->error = -EINVAL;
-            out_header->len = sizeof(fuse_out_header);
-            co_return co_await send_reply(io, fuse_io);
-        }
+    for(size_t idx: fill_idx)
+    {
+        cache->fill_done(slots[idx], rc==0 && err==0);
+        cache->unpin(slots[idx]);
     }
 
-    /*if(write_size<=4096)
+    co_return rc;
+}
+
+fuse_io_context::io_uring_task_discard<int> readahead_fadvise(fuse_io_context& io, uint64_t offset, uint64_t len)
+{
+    std::vector<FileRange> pieces;
+    if(io.fuse_ring.stripes!=nullptr)
     {
-        io_uring_sqe* sqe1 = co_await io.get_sqe();
-        io_uring_prep_read_fixed(sqe1, fuse_io->pipe[0], fuse_io->scratch_buf,
-                write_size, 0, fuse_io->scratch_buf_idx);
-        sqe1->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        std::vector<StripeLayout::Piece> stripe_pieces;
+        io.fuse_ring.stripes->map(offset, len, stripe_pieces);
+        for(const StripeLayout::Piece& piece: stripe_pieces)
+            pieces.push_back(FileRange{io.fuse_ring.files.stripe_files[piece.file], piece.file_offset, piece.len});
+    }
+    else if(io.fuse_ring.mirror!=nullptr)
+        pieces.push_back(FileRange{io.fuse_ring.files.mirror_legs[io.fuse_ring.mirror->pick_read_leg(
+                                io.fuse_ring.thread_idx, offset, len, -1)], offset, len});
+    else if(io.fuse_ring.vhd!=nullptr)
+    {
+        std::vector<VhdChain::Piece> vhd_pieces;
+        io.fuse_ring.vhd->map_read(offset, len, vhd_pieces);
+        for(const VhdChain::Piece& piece: vhd_pieces)
+        {
+            if(piece.file>=0)
+                pieces.push_back(FileRange{io.fuse_ring.files.vhd_images[piece.file], piece.file_offset, piece.len});
+        }
 
-        io_uring_sqe* sqe2 = co_await io.get_sqe();
-        io_uring_prep_write(sqe2, io.fuse_ring.backing_fd, fuse_io->scratch_buf,
-                write_size, write_offset);
-        sqe2->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        if(pieces.empty())
+            co_return 0;
+    }
+    else
+        pieces.push_back(FileRange{io.fuse_ring.backing_fd, offset, len});
 
-        uint64_t header_unique = fheader->unique;
+    // Only a hint. Pieces beyond one batch are skipped
+    pieces.resize(std::min(pieces.size(), max_cache_fill_batch));
 
-        fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->header_buf);
-        out_header->error = 0;
-        out_header->len = sizeof(fuse_out_header) + sizeof(fuse_write_out);
-        out_header->unique = header_unique;
+    io_uring_sqe* sqe = co_await io.get_sqe(pieces.size());
+    if(sqe==nullptr)
+        co_return -1;
 
-        fuse_write_out* write_out = reinterpret_cast<fuse_write_out*>(fuse_io->header_buf + sizeof(fuse_out_header));
-        write_out->size = write_size;
-        write_out->padding = 0;
+    std::vector<io_uring_sqe*> sqes;
+    for(const FileRange& piece: pieces)
+    {
+        if(!sqes.empty())
+            sqe = io.get_reserved_sqe();
 
-        io_uring_sqe* sqe3 = co_await io.get_sqe();
-        io_uring_prep_write(sqe3, fuse_io->pipe[1],
-            fuse_io->header_buf, out_header->len,
-            0);
-        sqe3->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
-        
-        io_uring_sqe* sqe4 = co_await io.get_sqe();
-        io_uring_prep_splice(sqe4, fuse_io->pipe[0],
-                -1, io.fuse_ring.fd, -1, out_header->len,
-                SPLICE_F_MOVE| SPLICE_F_FD_IN_FIXED | SPLICE_F_NONBLOCK);
-        sqe4->flags |= IOSQE_FIXED_FILE;
+        io_uring_prep_fadvise(sqe, piece.fd, piece.offset, piece.len, POSIX_FADV_WILLNEED);
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqes.push_back(sqe);
+    }
 
-        std::vector<int> rcs = co_await io.complete({sqe1, sqe2, sqe3, sqe4});
+    std::vector<int> rcs = co_await io.complete(sqes);
+    int rc = 0;
+    for(int piece_rc: rcs)
+    {
+        if(piece_rc<0)
+            rc = piece_rc;
+    }
 
-        for(int rc: rcs)
+    if(rc<0)
+    {
+        static bool erronce=true;
+        if(erronce)
         {
-            if(rc<0)
-                co_return -1;
+            std::cerr << "Readahead via fadvise failed rc=" << rc << std::endl;
+            erronce=false;
         }
-
-        co_return 0;
     }
 
-    std::cout << "Splice ... write size " << write_size << std::endl;*/
+    co_return 0;
+}
 
-    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
-    out_header->error = 0;
-    out_header->len = sizeof(fuse_out_header) + sizeof(fuse_write_out);
-    out_header->unique = fheader->unique;
+// Parks the request until the QoS limits of the volume allow it
+[[nodiscard]] fuse_io_context::io_uring_task<int> qos_throttle(fuse_io_context& io, bool write, uint64_t len)
+{
+    int64_t delay_us = io.fuse_ring.qos->admit(write, len, fuse_io_context::get_monotonic_us());
+    if(delay_us<=0)
+        co_return 0;
 
-    fuse_write_out* write_out = reinterpret_cast<fuse_write_out*>(fuse_io->scratch_buf + sizeof(fuse_out_header));
-    write_out->size = write_size;
-    write_out->padding = 0;
+    struct __kernel_timespec ts;
+    ts.tv_sec = delay_us / 1000000;
+    ts.tv_nsec = (delay_us % 1000000)*1000;
 
-    io_uring_sqe* sqe1 = io.get_sqe(3);
-    if(sqe1==nullptr)
+    io_uring_sqe* sqe = co_await io.get_sqe();
+    if(sqe==nullptr)
         co_return -1;
 
-    io_uring_prep_splice(sqe1, fuse_io->pipe[0],
-        -1, io.fuse_ring.backing_fd, write_offset, write_size,
-            SPLICE_F_MOVE| SPLICE_F_FD_IN_FIXED | SPLICE_F_NONBLOCK);            
-    sqe1->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
-
-    io_uring_sqe* sqe2 = io.get_sqe();
-    if(sqe2==nullptr)
-        co_return -1;
+    io_uring_prep_timeout(sqe, &ts, 0, 0);
+    co_await io.complete(sqe);
+    co_return 0;
+}
 
-    io_uring_prep_write_fixed(sqe2, fuse_io->pipe[1],
-            fuse_io->scratch_buf, out_header->len,
-            0, fuse_io->scratch_buf_idx);
-    sqe2->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+// Waits for the I/O scheduler (if enabled) before backing file I/O
+IoScheduler::AdmitAwaiter schedule_backing_io(fuse_io_context& io, IoScheduler::IoClass io_class, uint64_t offset)
+{
+    return IoScheduler::AdmitAwaiter(io.fuse_ring.scheduler, io, io_class, offset);
+}
 
-    io_uring_sqe *sqe3 = io.get_sqe();
+// Feeds the read to the stream detector and reads ahead of sequential streams.
+// Into the block cache if there is one, otherwise into the SSD cache or the
+// page cache of the backing file
+void start_readahead(fuse_io_context& io, uint64_t offset, uint64_t len)
+{
+    StreamDetector* stream_detector = io.fuse_ring.stream_detector;
+    if(stream_detector==nullptr)
+        return;
+
+    uint64_t ra_offset;
+    uint64_t ra_len;
+    if(!stream_detector->on_read(offset, len, fuse_io_context::get_monotonic_us(),
+            ra_offset, ra_len))
+        return;
+
+    if(ra_offset>=io.fuse_ring.backing_f_size)
+        return;
+
+    ra_len = std::min(ra_len, io.fuse_ring.backing_f_size - ra_offset);
+
+    DBG_PRINT(std::cout << "Readahead off: " << ra_offset << " len: " << ra_len << std::endl);
+
+    if(io.fuse_ring.block_cache!=nullptr)
+        readahead_block_cache(io, ra_offset, ra_len);
+    else if(io.fuse_ring.chunk_store!=nullptr)
+        io.fuse_ring.chunk_store->prefetch(io, ra_offset, ra_len);
+    else if(io.fuse_ring.ssd_cache!=nullptr)
+        start_ssd_cache_fills(io, ra_offset, ra_len);
+    // Backends have no page cache to read ahead into. Use the block cache
+    else if(!io.fuse_ring.direct_io &&
+        io.fuse_ring.backend==nullptr)
+        readahead_fadvise(io, ra_offset, ra_len);
+}
+
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_read_cached(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    uint64_t read_offset, uint32_t read_size)
+{
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+    BlockCache* cache = io.fuse_ring.block_cache;
+    const uint64_t block_size = cache->get_block_size();
+    const uint64_t first_block = read_offset / block_size;
+    const uint64_t last_block = (read_offset + read_size - 1) / block_size;
+
+    std::vector<size_t> slots;
+    std::vector<size_t> fill_idx;
+    for(uint64_t block=first_block;block<=last_block;++block)
+    {
+        size_t slot;
+        BlockCache::LookupRes res = cache->lookup(block, slot);
+        if(res==BlockCache::LookupRes::Busy)
+        {
+            release_cache_slots(cache, slots, fill_idx);
+            co_return read_cache_bypass;
+        }
+
+        if(res==BlockCache::LookupRes::Fill)
+            fill_idx.push_back(slots.size());
+
+        slots.push_back(slot);
+    }
+
+    int err;
+    if(co_await fill_cache_blocks(io, first_block, slots, fill_idx, err)!=0)
+    {
+        release_cache_slots(cache, slots, fill_idx);
+        co_return -1;
+    }
+
+    if(err!=0)
+    {
+        release_cache_slots(cache, slots, fill_idx);
+        out_header->error = err;
+        out_header->len = sizeof(fuse_out_header);
+        co_return co_await send_reply(io, fuse_io);
+    }
+
+    for(size_t idx: fill_idx)
+    {
+        cache->fill_done(slots[idx], true);
+    }
+
+    std::vector<struct iovec> iovs(slots.size()+1);
+    iovs[0].iov_base = fuse_io->scratch_buf;
+    iovs[0].iov_len = sizeof(fuse_out_header);
+    size_t done = 0;
+    for(size_t i=0;i<slots.size();++i)
+    {
+        uint64_t start = i==0 ? read_offset - first_block*block_size : 0;
+        size_t len = std::min(block_size - start, static_cast<uint64_t>(read_size - done));
+        iovs[i+1].iov_base = cache->slot_buf(slots[i]) + start;
+        iovs[i+1].iov_len = len;
+        done+=len;
+    }
+
+    io_uring_sqe* sqe = co_await io.get_sqe();
+    if(sqe==nullptr)
+    {
+        release_cache_slots(cache, slots, std::vector<size_t>());
+        co_return -1;
+    }
+
+    io_uring_prep_writev(sqe, fuse_io->fuse_fd, iovs.data(), iovs.size(), 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+
+    int rc = co_await io.complete(sqe);
+
+    release_cache_slots(cache, slots, std::vector<size_t>());
+
+    if(rc<0 || static_cast<uint32_t>(rc)!=out_header->len)
+    {
+        std::cerr << "handle_read_cached reply failed rc=" << rc << std::endl;
+        co_return -1;
+    }
+
+    co_return 0;
+}
+
+// Reads via a data buffer. read_fd is the backing file for reads from the volume,
+// other fds (SSD cache, snapshot base) are read as they are. Extents in journal_ref
+// are read from the write journal on top of the volume data
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_read_copy(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    int read_fd, uint64_t read_offset, uint32_t read_size,
+    const WriteJournal::ReadRef* journal_ref = nullptr)
+{
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+
+    fuse_io_context::DataBufVal data_buf = co_await io.get_data_buf();
+
+    std::vector<BlockIo> ios = {BlockIo{data_buf->buf, static_cast<int>(data_buf->buf_idx),
+                                    read_offset, read_size, 0}};
+    if(read_fd==io.fuse_ring.backing_fd)
+    {
+        if(co_await backend_io(io, false, ios)!=0)
+            co_return -1;
+    }
+    else if(co_await file_io(io, false, read_fd, ios)!=0)
+    {
+        co_return -1;
+    }
+
+    if(ios[0].res<0)
+    {
+        out_header->error = ios[0].res;
+        out_header->len = sizeof(fuse_out_header);
+        co_return co_await send_reply(io, fuse_io);
+    }
+
+    memset(data_buf->buf + ios[0].res, 0, read_size - ios[0].res);
+
+    if(journal_ref!=nullptr)
+    {
+        int rc = co_await io.fuse_ring.journal->read(io, io.fuse_ring.journal_fd,
+                    *journal_ref, data_buf->buf, read_offset);
+        if(rc<0)
+        {
+            out_header->error = rc;
+            out_header->len = sizeof(fuse_out_header);
+            co_return co_await send_reply(io, fuse_io);
+        }
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = fuse_io->scratch_buf;
+    iov[0].iov_len = sizeof(fuse_out_header);
+    iov[1].iov_base = data_buf->buf;
+    iov[1].iov_len = read_size;
+
+    io_uring_sqe* sqe = co_await io.get_sqe();
+    if(sqe==nullptr)
+        co_return -1;
+
+    io_uring_prep_writev(sqe, fuse_io->fuse_fd, iov, 2, 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+
+    int rc = co_await io.complete(sqe);
+    if(rc<0 || static_cast<uint32_t>(rc)!=out_header->len)
+    {
+        std::cerr << "handle_read_copy reply failed rc=" << rc << std::endl;
+        co_return -1;
+    }
+
+    co_return 0;
+}
+
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_read_backing_ring(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    int read_fd, uint64_t read_offset, uint32_t read_size)
+{
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+
+    io_uring_sqe* sqe1 = co_await io.get_backing_sqe(2);
+    if(sqe1==nullptr)
+        co_return -1;
+
+    io_uring_prep_write_fixed(sqe1, fuse_io->pipe[1],
+            fuse_io->scratch_buf, sizeof(fuse_out_header),
+            -1, fuse_io->scratch_buf_idx);
+    sqe1->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    io_uring_sqe* sqe2 = io.get_reserved_backing_sqe();
+
+    io_uring_prep_splice(sqe2, read_fd,
+        read_offset, fuse_io->pipe[1], -1, read_size,
+        SPLICE_F_MOVE| SPLICE_F_FD_IN_FIXED | SPLICE_F_NONBLOCK);
+    sqe2->flags |= IOSQE_FIXED_FILE;
+
+    auto [rc1, rc2] = co_await io.complete(std::make_pair(sqe1, sqe2));
+
+    if(rc1<0 || rc2<0 ||
+        static_cast<size_t>(rc1)<sizeof(fuse_out_header) ||
+        static_cast<uint32_t>(rc2)<read_size)
+    {
+        std::cerr << "handle_read backing ring failed. rcs=" << 
+                rc1 << ", " << rc2 << std::endl;
+        co_return -1;
+    }
+
+    io_uring_sqe* sqe3 = co_await io.get_sqe();
     if(sqe3==nullptr)
         co_return -1;
 
+    io_uring_prep_splice(sqe3, fuse_io->pipe[0],
+        -1, fuse_io->fuse_fd, -1, out_header->len,
+        SPLICE_F_MOVE | SPLICE_F_FD_IN_FIXED | SPLICE_F_NONBLOCK);
+    sqe3->flags |= IOSQE_FIXED_FILE;
+
+    int rc3 = co_await io.complete(sqe3);
+    if(rc3<0 || static_cast<uint32_t>(rc3)<out_header->len)
+    {
+        std::cerr << "handle_read reply failed rc=" << rc3 << std::endl;
+        co_return -1;
+    }
+
+    co_return 0;
+}
+
+// Reads the heat map snapshot or summary
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_read_heat(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    uint64_t read_offset, uint32_t read_size)
+{
+    fuse_in_header* fheader = reinterpret_cast<fuse_in_header*>(fuse_io->header_buf);
+
+    std::vector<char> out_buf(sizeof(fuse_out_header) + read_size);
+    size_t data_size = io.fuse_ring.heat_map->read_snapshot(fheader->nodeid==heat_top_nodeid,
+                            read_offset, out_buf.data() + sizeof(fuse_out_header), read_size,
+                            fuse_io_context::get_monotonic_us());
+    out_buf.resize(sizeof(fuse_out_header) + data_size);
+
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(out_buf.data());
+    out_header->error = 0;
+    out_header->len = out_buf.size();
+    out_header->unique = fheader->unique;
+
+    co_return co_await send_reply(io, fuse_io, out_buf);
+}
+
+// Reads the changed block bitmap or the epoch file
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_read_cbt(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    uint64_t read_offset, uint32_t read_size)
+{
+    fuse_in_header* fheader = reinterpret_cast<fuse_in_header*>(fuse_io->header_buf);
+
+    std::vector<char> out_buf(sizeof(fuse_out_header) + read_size);
+    char* data = out_buf.data() + sizeof(fuse_out_header);
+    size_t data_size = 0;
+    if(fheader->nodeid==cbt_bitmap_nodeid)
+    {
+        data_size = io.fuse_ring.cbt->read_file(read_offset, data, read_size);
+    }
+    else if(read_offset<cbt_epoch_file_size)
+    {
+        char epoch_str[cbt_epoch_file_size+1];
+        snprintf(epoch_str, sizeof(epoch_str), "%020llu\n",
+            static_cast<unsigned long long>(io.fuse_ring.cbt->get_epoch()));
+        data_size = std::min(static_cast<uint64_t>(read_size), cbt_epoch_file_size - read_offset);
+        memcpy(data, epoch_str + read_offset, data_size);
+    }
+    out_buf.resize(sizeof(fuse_out_header) + data_size);
+
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(out_buf.data());
+    out_header->error = 0;
+    out_header->len = out_buf.size();
+    out_header->unique = fheader->unique;
+
+    co_return co_await send_reply(io, fuse_io, out_buf);
+}
+
+// Reads the state from the control file ("<state> <generation> <overlay blocks>")
+// or the snapshot. The snapshot is the backing file, which is read via its
+// second fixed file index, so it does not go through the overlay
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_read_snapshot(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    uint64_t read_offset, uint32_t read_size)
+{
+    fuse_in_header* fheader = reinterpret_cast<fuse_in_header*>(fuse_io->header_buf);
+
+    if(fheader->nodeid==snapshot_ctl_nodeid)
+    {
+        Snapshot::Stats stats = io.fuse_ring.snapshot->get_stats();
+        std::string state = std::string(Snapshot::state_name(stats.state)) + " " +
+            std::to_string(stats.generation) + " " + std::to_string(stats.overlay_blocks) + "\n";
+
+        std::vector<char> out_buf(sizeof(fuse_out_header));
+        if(read_offset<state.size())
+        {
+            size_t data_size = std::min(static_cast<size_t>(read_size), state.size() - read_offset);
+            out_buf.insert(out_buf.end(), state.begin() + read_offset, state.begin() + read_offset + data_size);
+        }
+
+        fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(out_buf.data());
+        out_header->error = 0;
+        out_header->len = out_buf.size();
+        out_header->unique = fheader->unique;
+
+        co_return co_await send_reply(io, fuse_io, out_buf);
+    }
+
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+    out_header->unique = fheader->unique;
+
+    // The merge of a deleted snapshot waits for this read
+    Snapshot::IoGuard guard;
+    io.fuse_ring.snapshot->begin_io(guard);
+    if(guard.get_state()!=Snapshot::State::Active)
+    {
+        out_header->error = -ENOENT;
+        out_header->len = sizeof(fuse_out_header);
+        co_return co_await send_reply(io, fuse_io);
+    }
+
+    if(read_offset>=io.fuse_ring.backing_f_size)
+        read_size = 0;
+    else if(read_offset + read_size > io.fuse_ring.backing_f_size)
+        read_size = io.fuse_ring.backing_f_size - read_offset;
+
+    out_header->error = 0;
+    out_header->len = sizeof(fuse_out_header) + read_size;
+
+    IoScheduler::Slot sched_slot = co_await schedule_backing_io(io, IoScheduler::IoClass::Read, read_offset);
+    co_return co_await handle_read_copy(io, fuse_io, io.fuse_ring.files.snapshot_base, read_offset, read_size);
+}
+
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_read(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    char* rbytes_buf)
+{
+    fuse_in_header* fheader = reinterpret_cast<fuse_in_header*>(fuse_io->header_buf);
+    uint64_t read_offset;
+    uint32_t read_size;
+    {
+        fuse_read_in* read_in = reinterpret_cast<fuse_read_in*>(rbytes_buf);
+
+        DBG_PRINT(std::cout << "read nodeid " << fheader->nodeid << " off: " << read_in->offset << " size: "<<read_in->size << std::endl);
+
+        if(is_cbt_node(io, fheader->nodeid))
+        {
+            co_return co_await handle_read_cbt(io, fuse_io, read_in->offset, read_in->size);
+        }
+
+        if(is_heat_node(io, fheader->nodeid))
+        {
+            co_return co_await handle_read_heat(io, fuse_io, read_in->offset, read_in->size);
+        }
+
+        if(is_snapshot_node(io, fheader->nodeid))
+        {
+            co_return co_await handle_read_snapshot(io, fuse_io, read_in->offset, read_in->size);
+        }
+
+        if(fheader->nodeid!=3)
+        {
+            fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+            out_header->error = 0;
+            out_header->unique = fheader->unique;
+            out_header->error = -ENOENT;
+            co_return co_await send_reply(io, fuse_io);
+        }
+
+        if(read_in->offset + read_in->size > io.fuse_ring.backing_f_size)
+        {
+            read_in->size = io.fuse_ring.backing_f_size - read_in->offset;
+            DBG_PRINT(std::cout << "Reading less: " << read_in->size << std::endl);
+        }
+
+        read_offset = read_in->offset;
+        read_size = read_in->size;
+    }
+
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+    out_header->error = 0;
+    out_header->len = sizeof(fuse_out_header) + read_size;
+    out_header->unique = fheader->unique;
+
+    if(io.fuse_ring.heat_map!=nullptr)
+        io.fuse_ring.heat_map->add(io.fuse_ring.thread_idx, false, read_offset, read_size);
+
+    if(io.fuse_ring.qos!=nullptr &&
+        co_await qos_throttle(io, false, read_size)!=0)
+        co_return -1;
+
+    if(read_size>0)
+        start_readahead(io, read_offset, read_size);
+
+    // Before any cache lookup. Caches only get invalidated once
+    // journal extents were applied to the backing file
+    WriteJournal::ReadRef journal_ref;
+    if(io.fuse_ring.journal!=nullptr &&
+        io.fuse_ring.journal->get_read_extents(read_offset, read_size, journal_ref))
+    {
+        IoScheduler::Slot sched_slot = co_await schedule_backing_io(io, IoScheduler::IoClass::Read, read_offset);
+        co_return co_await handle_read_copy(io, fuse_io, io.fuse_ring.backing_fd,
+                    read_offset, read_size, &journal_ref);
+    }
+
+    if(io.fuse_ring.block_cache!=nullptr && read_size>0)
+    {
+        int rc = co_await handle_read_cached(io, fuse_io, read_offset, read_size);
+        if(rc!=read_cache_bypass)
+            co_return rc;
+    }
+
+    IoScheduler::Slot sched_slot = co_await schedule_backing_io(io, IoScheduler::IoClass::Read, read_offset);
+
+    int read_fd;
+    uint64_t src_offset;
+    SsdCachePin ssd_pin;
+    lookup_ssd_cache(io, read_offset, read_size, ssd_pin, read_fd, src_offset);
+
+    if(io.fuse_ring.copy_mode)
+    {
+        co_return co_await handle_read_copy(io, fuse_io, read_fd, src_offset, read_size);
+    }
+
+    if(io.has_backing_ring())
+    {
+        co_return co_await handle_read_backing_ring(io, fuse_io, read_fd, src_offset, read_size);
+    }
+
+    io_uring_sqe* sqe1 = co_await io.get_sqe(3);
+    if(sqe1==nullptr)
+        co_return -1;
+
+    io_uring_prep_write_fixed(sqe1, fuse_io->pipe[1],
+            fuse_io->scratch_buf, sizeof(fuse_out_header),
+            -1, fuse_io->scratch_buf_idx);
+    sqe1->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    io_uring_sqe* sqe2 = io.get_reserved_sqe();
+
+    io_uring_prep_splice(sqe2, read_fd,
+        src_offset, fuse_io->pipe[1], -1, read_size,
+        SPLICE_F_MOVE| SPLICE_F_FD_IN_FIXED | SPLICE_F_NONBLOCK);
+    sqe2->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    io_uring_sqe* sqe3 = io.get_reserved_sqe();
+
+    io_uring_prep_splice(sqe3, fuse_io->pipe[0],
+        -1, fuse_io->fuse_fd, -1, out_header->len,
+        SPLICE_F_MOVE | SPLICE_F_FD_IN_FIXED | SPLICE_F_NONBLOCK);
+    sqe3->flags |= IOSQE_FIXED_FILE;
+    
+    std::vector<io_uring_sqe*> sqes = {sqe1, sqe2, sqe3};
+    std::vector<int> rcs = co_await io.complete(sqes);
+
+    for(int rc: rcs)
+    {
+        if(rc<0)
+        {
+            std::cerr << "handle_read failed. rcs=" << 
+                rcs[0] << ", " << rcs[1] << ", " <<
+                rcs[2] << std::endl;
+            co_return -1;
+        }
+    }
+
+    if(rcs[0]<sizeof(fuse_out_header))
+    {
+        co_return -1;
+    }
+
+    if(rcs[1]<read_size)
+    {
+        co_return -1;
+    }
+
+    if(rcs[2]<out_header->len)
+    {
+        co_return -1;
+    }
+
+    co_return 0;
+}
+
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_write_copy(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    uint64_t write_offset, uint32_t write_size)
+{
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+    fuse_write_out* write_out = reinterpret_cast<fuse_write_out*>(fuse_io->scratch_buf + sizeof(fuse_out_header));
+
+    fuse_io_context::DataBufVal data_buf = co_await io.get_data_buf();
+
+    size_t read_done = 0;
+    while(read_done<write_size)
+    {
+        io_uring_sqe* sqe = co_await io.get_sqe();
+        if(sqe==nullptr)
+            co_return -1;
+
+        io_uring_prep_read_fixed(sqe, fuse_io->pipe[0], data_buf->buf + read_done,
+                write_size - read_done, 0, data_buf->buf_idx);
+        sqe->flags |= IOSQE_FIXED_FILE;
+
+        int rc = co_await io.complete(sqe);
+        if(rc<=0)
+        {
+            std::cerr << "Reading write data from pipe failed rc=" << rc << std::endl;
+            co_return -1;
+        }
+
+        read_done+=rc;
+    }
+
+    int rc;
+    if(io.fuse_ring.journal!=nullptr)
+    {
+        rc = co_await io.fuse_ring.journal->write(io, io.fuse_ring.journal_fd,
+                data_buf->buf, write_offset, write_size);
+    }
+    else if(io.fuse_ring.write_coalescer!=nullptr)
+    {
+        rc = co_await io.fuse_ring.write_coalescer->write(io, data_buf->buf,
+                write_offset, write_size);
+    }
+    else
+    {
+        // Encryption encrypts the data buffer in place
+        std::vector<BlockIo> ios = {BlockIo{data_buf->buf, static_cast<int>(data_buf->buf_idx),
+                                        write_offset, write_size, 0}};
+        if(co_await backend_io(io, true, ios)!=0)
+            co_return -1;
+
+        rc = ios[0].res;
+    }
+
+    invalidate_read_caches(io, write_offset, write_size);
+
+    if(rc<0)
+    {
+        out_header->error = rc;
+        out_header->len = sizeof(fuse_out_header);
+    }
+    else if(static_cast<uint32_t>(rc)<write_size)
+    {
+        write_out->size = rc;
+    }
+
+    co_return co_await send_reply(io, fuse_io);
+}
+
+// Writes to the backing file and only then sends the reply. Needed if the write
+// goes to a different ring or cached blocks have to be invalidated before the reply
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_write_unlinked(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    uint64_t write_offset, uint32_t write_size)
+{
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+    fuse_write_out* write_out = reinterpret_cast<fuse_write_out*>(fuse_io->scratch_buf + sizeof(fuse_out_header));
+
+    io_uring_sqe* sqe = co_await io.get_backing_sqe();
+    if(sqe==nullptr)
+        co_return -1;
+
+    io_uring_prep_splice(sqe, fuse_io->pipe[0],
+        -1, io.fuse_ring.backing_fd, write_offset, write_size,
+            SPLICE_F_MOVE| SPLICE_F_FD_IN_FIXED | SPLICE_F_NONBLOCK);
+    sqe->flags |= IOSQE_FIXED_FILE;
+
+    int rc = co_await io.complete(sqe);
+
+    invalidate_read_caches(io, write_offset, write_size);
+
+    if(rc<0)
+    {
+        out_header->error = rc;
+        out_header->len = sizeof(fuse_out_header);
+    }
+    else if(static_cast<uint32_t>(rc)<write_size)
+    {
+        write_out->size = rc;
+    }
+
+    co_return co_await send_reply(io, fuse_io);
+}
+
+// Reads the data of a write request from the pipe into buf
+[[nodiscard]] fuse_io_context::io_uring_task<int> read_write_data(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    uint32_t write_size, std::vector<char>& buf)
+{
+    buf.resize(write_size);
+
+    size_t read_done = 0;
+    while(read_done<write_size)
+    {
+        io_uring_sqe* sqe = co_await io.get_sqe();
+        if(sqe==nullptr)
+            co_return -1;
+
+        io_uring_prep_read(sqe, fuse_io->pipe[0], buf.data() + read_done,
+                write_size - read_done, 0);
+        sqe->flags |= IOSQE_FIXED_FILE;
+
+        int rc = co_await io.complete(sqe);
+        if(rc<=0)
+        {
+            std::cerr << "Reading write data from pipe failed rc=" << rc << std::endl;
+            co_return -1;
+        }
+
+        read_done+=rc;
+    }
+
+    co_return 0;
+}
+
+// Writing the current epoch to the epoch file starts a new epoch
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_write_cbt_epoch(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    uint32_t write_size)
+{
+    fuse_in_header* fheader = reinterpret_cast<fuse_in_header*>(fuse_io->header_buf);
+
+    std::vector<char> data;
+    if(co_await read_write_data(io, fuse_io, write_size, data)!=0)
+        co_return -1;
+
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+    out_header->error = 0;
+    out_header->len = sizeof(fuse_out_header) + sizeof(fuse_write_out);
+    out_header->unique = fheader->unique;
+
+    fuse_write_out* write_out = reinterpret_cast<fuse_write_out*>(fuse_io->scratch_buf + sizeof(fuse_out_header));
+    write_out->size = write_size;
+    write_out->padding = 0;
+
+    std::string epoch_str(data.begin(), data.end());
+    char* end;
+    unsigned long long epoch = strtoull(epoch_str.c_str(), &end, 10);
+    while(*end!=0 && isspace(*end))
+        ++end;
+
+    int rc;
+    if(epoch_str.empty() || *end!=0)
+        rc = -EINVAL;
+    else
+        rc = co_await io.fuse_ring.cbt->reset(io, io.fuse_ring.cbt_fd, epoch);
+
+    if(rc<0)
+    {
+        out_header->error = rc;
+        out_header->len = sizeof(fuse_out_header);
+    }
+
+    co_return co_await send_reply(io, fuse_io);
+}
+
+// Writing "create" or "delete" to the snapshot control file creates or deletes the snapshot
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_write_snapshot_ctl(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    uint32_t write_size)
+{
+    fuse_in_header* fheader = reinterpret_cast<fuse_in_header*>(fuse_io->header_buf);
+
+    std::vector<char> data;
+    if(co_await read_write_data(io, fuse_io, write_size, data)!=0)
+        co_return -1;
+
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+    out_header->error = 0;
+    out_header->len = sizeof(fuse_out_header) + sizeof(fuse_write_out);
+    out_header->unique = fheader->unique;
+
+    fuse_write_out* write_out = reinterpret_cast<fuse_write_out*>(fuse_io->scratch_buf + sizeof(fuse_out_header));
+    write_out->size = write_size;
+    write_out->padding = 0;
+
+    std::string cmd(data.begin(), data.end());
+    while(!cmd.empty() && isspace(cmd.back()))
+        cmd.pop_back();
+
+    int rc;
+    if(cmd=="create")
+        rc = co_await io.fuse_ring.snapshot->create(io);
+    else if(cmd=="delete")
+        rc = co_await io.fuse_ring.snapshot->remove(io);
+    else
+        rc = -EINVAL;
+
+    if(rc<0)
+    {
+        out_header->error = rc;
+        out_header->len = sizeof(fuse_out_header);
+    }
+
+    co_return co_await send_reply(io, fuse_io);
+}
+
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_write(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    char* rbytes_buf)
+{
+    fuse_in_header* fheader = reinterpret_cast<fuse_in_header*>(fuse_io->header_buf);
+    uint64_t write_offset;
+    uint32_t write_size;
+    bool sync_write;
+    {
+        fuse_write_in* write_in = reinterpret_cast<fuse_write_in*>(rbytes_buf);
+
+        DBG_PRINT(std::cout << "write nodeid " << fheader->nodeid << " off: " << write_in->offset << " size: "<< write_in->size << std::endl);
+
+        if(io.fuse_ring.cbt!=nullptr &&
+            fheader->nodeid==cbt_epoch_nodeid)
+        {
+            co_return co_await handle_write_cbt_epoch(io, fuse_io, write_in->size);
+        }
+
+        if(io.fuse_ring.snapshot!=nullptr &&
+            fheader->nodeid==snapshot_ctl_nodeid)
+        {
+            co_return co_await handle_write_snapshot_ctl(io, fuse_io, write_in->size);
+        }
+
+        if(fheader->nodeid!=3)
+        {
+            fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+            out_header->unique = fheader->unique;
+            out_header->error = -ENOENT;
+            out_header->len = sizeof(fuse_out_header);
+            co_return co_await send_reply(io, fuse_io);
+        }
+
+        write_offset = write_in->offset;
+        write_size = write_in->size;
+        sync_write = (write_in->flags & (O_SYNC|O_DSYNC))!=0;
+
+        /*if(write_offset + write_size > io.fuse_ring.backing_f_size)
+        {
+            write_size = io.fuse_ring.backing_f_size - write_offset;
+            std::cout << "Writing less: " << write_size << std::endl;
+        }*/
+
+        if(fheader->len!=sizeof(fuse_in_header)+sizeof(fuse_write_in)+write_size)
+        {
+            fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+            out_header->unique = fheader->unique;
+            out_header->error = -EINVAL;
+            out_header->len = sizeof(fuse_out_header);
+            co_return co_await send_reply(io, fuse_io);
+        }
+    }
+
+    /*if(write_size<=4096)
+    {
+        io_uring_sqe* sqe1 = co_await io.get_sqe();
+        io_uring_prep_read_fixed(sqe1, fuse_io->pipe[0], fuse_io->scratch_buf,
+                write_size, 0, fuse_io->scratch_buf_idx);
+        sqe1->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+        io_uring_sqe* sqe2 = co_await io.get_sqe();
+        io_uring_prep_write(sqe2, io.fuse_ring.backing_fd, fuse_io->scratch_buf,
+                write_size, write_offset);
+        sqe2->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+        uint64_t header_unique = fheader->unique;
+
+        fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->header_buf);
+        out_header->error = 0;
+        out_header->len = sizeof(fuse_out_header) + sizeof(fuse_write_out);
+        out_header->unique = header_unique;
+
+        fuse_write_out* write_out = reinterpret_cast<fuse_write_out*>(fuse_io->header_buf + sizeof(fuse_out_header));
+        write_out->size = write_size;
+        write_out->padding = 0;
+
+        io_uring_sqe* sqe3 = co_await io.get_sqe();
+        io_uring_prep_write(sqe3, fuse_io->pipe[1],
+            fuse_io->header_buf, out_header->len,
+            0);
+        sqe3->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        
+        io_uring_sqe* sqe4 = co_await io.get_sqe();
+        io_uring_prep_splice(sqe4, fuse_io->pipe[0],
+                -1, io.fuse_ring.fd, -1, out_header->len,
+                SPLICE_F_MOVE| SPLICE_F_FD_IN_FIXED | SPLICE_F_NONBLOCK);
+        sqe4->flags |= IOSQE_FIXED_FILE;
+
+        std::vector<int> rcs = co_await io.complete({sqe1, sqe2, sqe3, sqe4});
+
+        for(int rc: rcs)
+        {
+            if(rc<0)
+                co_return -1;
+        }
+
+        co_return 0;
+    }
+
+    std::cout << "Splice ... write size " << write_size << std::endl;*/
+
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+    out_header->error = 0;
+    out_header->len = sizeof(fuse_out_header) + sizeof(fuse_write_out);
+    out_header->unique = fheader->unique;
+
+    fuse_write_out* write_out = reinterpret_cast<fuse_write_out*>(fuse_io->scratch_buf + sizeof(fuse_out_header));
+    write_out->size = write_size;
+    write_out->padding = 0;
+
+    if(io.fuse_ring.heat_map!=nullptr)
+        io.fuse_ring.heat_map->add(io.fuse_ring.thread_idx, true, write_offset, write_size);
+
+    if(io.fuse_ring.qos!=nullptr &&
+        co_await qos_throttle(io, true, write_size)!=0)
+        co_return -1;
+
+    // Kept until the write was applied, so an epoch reset does not
+    // start in between
+    ChangeTracker::WriteGuard cbt_guard;
+    if(io.fuse_ring.cbt!=nullptr)
+    {
+        int rc = co_await io.fuse_ring.cbt->begin_write(io, io.fuse_ring.cbt_fd,
+                    write_offset, write_size, cbt_guard);
+        if(rc<0)
+        {
+            std::vector<char> data;
+            if(co_await read_write_data(io, fuse_io, write_size, data)!=0)
+                co_return -1;
+
+            out_header->error = rc;
+            out_header->len = sizeof(fuse_out_header);
+            co_return co_await send_reply(io, fuse_io);
+        }
+    }
+
+    IoScheduler::Slot sched_slot = co_await schedule_backing_io(io,
+        sync_write ? IoScheduler::IoClass::SyncWrite : IoScheduler::IoClass::AsyncWrite, write_offset);
+
+    if(io.fuse_ring.copy_mode)
+    {
+        co_return co_await handle_write_copy(io, fuse_io, write_offset, write_size);
+    }
+
+    if(io.has_backing_ring() ||
+        has_read_cache(io))
+    {
+        co_return co_await handle_write_unlinked(io, fuse_io, write_offset, write_size);
+    }
+
+    io_uring_sqe* sqe1 = co_await io.get_sqe(3);
+    if(sqe1==nullptr)
+        co_return -1;
+
+    io_uring_prep_splice(sqe1, fuse_io->pipe[0],
+        -1, io.fuse_ring.backing_fd, write_offset, write_size,
+            SPLICE_F_MOVE| SPLICE_F_FD_IN_FIXED | SPLICE_F_NONBLOCK);            
+    sqe1->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    io_uring_sqe* sqe2 = io.get_reserved_sqe();
+
+    io_uring_prep_write_fixed(sqe2, fuse_io->pipe[1],
+            fuse_io->scratch_buf, out_header->len,
+            0, fuse_io->scratch_buf_idx);
+    sqe2->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    io_uring_sqe* sqe3 = io.get_reserved_sqe();
+
     io_uring_prep_splice(sqe3, fuse_io->pipe[0],
         -1, fuse_io->fuse_fd, -1, out_header->len,
         SPLICE_F_MOVE| SPLICE_F_FD_IN_FIXED | SPLICE_F_NONBLOCK);
     sqe3->flags |= IOSQE_FIXED_FILE;
 
-    std::vector<int> rcs = co_await io.complete({sqe1, sqe2, sqe3});
+    std::vector<io_uring_sqe*> sqes = {sqe1, sqe2, sqe3};
+    std::vector<int> rcs = co_await io.complete(sqes);
 
     if(rcs[0]<0)
     {
@@ -604,6 +1725,105 @@ namespace
     co_return 0;
 }
 
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_fsync(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    char* rbytes_buf)
+{
+    fuse_in_header* fheader = reinterpret_cast<fuse_in_header*>(fuse_io->header_buf);
+    fuse_fsync_in* fsync_in = reinterpret_cast<fuse_fsync_in*>(rbytes_buf);
+
+    DBG_PRINT(std::cout << "fsync nodeid " << fheader->nodeid << " flags " << fsync_in->fsync_flags << std::endl);
+
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+    out_header->error = 0;
+    out_header->len = sizeof(fuse_out_header);
+    out_header->unique = fheader->unique;
+
+    // Acknowledged writes are already durable in the write journal
+    if(fheader->nodeid!=3 ||
+        io.fuse_ring.journal!=nullptr)
+    {
+        co_return co_await send_reply(io, fuse_io);
+    }
+
+    IoScheduler::Slot sched_slot = co_await schedule_backing_io(io, IoScheduler::IoClass::SyncWrite, 0);
+
+    int rc = co_await io.fuse_ring.volume->flush(io,
+                (fsync_in->fsync_flags & FUSE_FSYNC_FDATASYNC)!=0);
+    if(rc<0)
+        out_header->error = rc;
+
+    co_return co_await send_reply(io, fuse_io);
+}
+
+[[nodiscard]] fuse_io_context::io_uring_task<int> handle_fallocate(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
+    char* rbytes_buf)
+{
+    fuse_in_header* fheader = reinterpret_cast<fuse_in_header*>(fuse_io->header_buf);
+    fuse_fallocate_in* fallocate_in = reinterpret_cast<fuse_fallocate_in*>(rbytes_buf);
+
+    DBG_PRINT(std::cout << "fallocate nodeid " << fheader->nodeid << " off: " << fallocate_in->offset <<
+        " len: " << fallocate_in->length << " mode: " << fallocate_in->mode << std::endl);
+
+    fuse_out_header* out_header = reinterpret_cast<fuse_out_header*>(fuse_io->scratch_buf);
+    out_header->error = 0;
+    out_header->len = sizeof(fuse_out_header);
+    out_header->unique = fheader->unique;
+
+    uint64_t offset = fallocate_in->offset;
+    uint64_t length = fallocate_in->length;
+    uint32_t mode = fallocate_in->mode;
+
+    // The volume size is fixed. Holes punched into the backing file
+    // would be overwritten by older data in the write journal
+    const uint32_t supported_modes = FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE;
+    if(fheader->nodeid!=3 ||
+        (mode & ~supported_modes)!=0 ||
+        io.fuse_ring.journal!=nullptr ||
+        (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > io.fuse_ring.backing_f_size))
+    {
+        out_header->error = -EOPNOTSUPP;
+        co_return co_await send_reply(io, fuse_io);
+    }
+
+    if(offset>=io.fuse_ring.backing_f_size)
+        co_return co_await send_reply(io, fuse_io);
+
+    length = std::min(length, io.fuse_ring.backing_f_size - offset);
+
+    // Allocating does not change the volume contents
+    bool changes_data = (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))!=0;
+
+    ChangeTracker::WriteGuard cbt_guard;
+    if(changes_data &&
+        io.fuse_ring.cbt!=nullptr)
+    {
+        int rc = co_await io.fuse_ring.cbt->begin_write(io, io.fuse_ring.cbt_fd,
+                    offset, length, cbt_guard);
+        if(rc<0)
+        {
+            out_header->error = rc;
+            co_return co_await send_reply(io, fuse_io);
+        }
+    }
+
+    IoScheduler::Slot sched_slot = co_await schedule_backing_io(io, IoScheduler::IoClass::AsyncWrite, offset);
+
+    int rc;
+    if(changes_data)
+        rc = co_await io.fuse_ring.volume->discard(io, offset, length,
+                (mode & FALLOC_FL_PUNCH_HOLE)!=0);
+    else
+        rc = co_await io.fuse_ring.volume->allocate(io, offset, length);
+
+    if(rc<0)
+        out_header->error = rc;
+
+    if(changes_data)
+        invalidate_read_caches(io, offset, length);
+
+    co_return co_await send_reply(io, fuse_io);
+}
+
 [[nodiscard]] fuse_io_context::io_uring_task<int> handle_releasedir(fuse_io_context& io, fuse_io_context::FuseIoVal& fuse_io,
     char* rbytes_buf)
 {
@@ -681,6 +1901,50 @@ void add_dir(std::vector<char>& buf, const std::string& name, size_t off, const
         stbuf.st_size = io.fuse_ring.backing_f_size;
         stbuf.st_blocks = round_up<off_t>(stbuf.st_size, 512);
         add_dir(out_buf, "volume", 3, stbuf);       
+
+        if(io.fuse_ring.cbt!=nullptr)
+        {
+            stbuf.st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+            stbuf.st_ino = cbt_bitmap_nodeid;
+            stbuf.st_size = io.fuse_ring.cbt->get_file_size();
+            stbuf.st_blocks = round_up<off_t>(stbuf.st_size, 512);
+            add_dir(out_buf, "changed_blocks", 4, stbuf);
+
+            stbuf.st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+            stbuf.st_ino = cbt_epoch_nodeid;
+            stbuf.st_size = cbt_epoch_file_size;
+            stbuf.st_blocks = round_up<off_t>(stbuf.st_size, 512);
+            add_dir(out_buf, "changed_blocks_epoch", 5, stbuf);
+        }
+
+        if(io.fuse_ring.heat_map!=nullptr)
+        {
+            stbuf.st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+            stbuf.st_ino = heat_map_nodeid;
+            stbuf.st_size = io.fuse_ring.heat_map->get_snapshot_size();
+            stbuf.st_blocks = round_up<off_t>(stbuf.st_size, 512);
+            add_dir(out_buf, "heat_map", 6, stbuf);
+
+            stbuf.st_ino = heat_top_nodeid;
+            stbuf.st_size = 0;
+            stbuf.st_blocks = 0;
+            add_dir(out_buf, "heat_map_top", 7, stbuf);
+        }
+
+        if(io.fuse_ring.snapshot!=nullptr)
+        {
+            stbuf.st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+            stbuf.st_ino = snapshot_nodeid;
+            stbuf.st_size = io.fuse_ring.backing_f_size;
+            stbuf.st_blocks = round_up<off_t>(stbuf.st_size, 512);
+            add_dir(out_buf, "snapshot", 8, stbuf);
+
+            stbuf.st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+            stbuf.st_ino = snapshot_ctl_nodeid;
+            stbuf.st_size = 0;
+            stbuf.st_blocks = 0;
+            add_dir(out_buf, "snapshot_ctl", 9, stbuf);
+        }
     }
 
     out_header = reinterpret_cast<fuse_out_header*>(out_buf.data());
@@ -694,10 +1958,10 @@ fuse_io_context::io_uring_task<int> queue_fuse_read(fuse_io_context& io)
     fuse_io_context::FuseIoVal fuse_io = io.get_fuse_io();
 
     DBG_PRINT(std::cout << "queue_fuse_read" << std::endl);
-    struct io_uring_sqe *sqe1 = io.get_sqe(2);
-    struct io_uring_sqe *sqe2 = io.get_sqe();
-    if(sqe1==nullptr || sqe2==nullptr)
+    struct io_uring_sqe *sqe1 = co_await io.get_sqe(2);
+    if(sqe1==nullptr)
         co_return -1;
+    struct io_uring_sqe *sqe2 = io.get_reserved_sqe();
 
     io_uring_prep_splice(sqe1, fuse_io->fuse_fd, -1, fuse_io->pipe[1],
         -1, io.fuse_ring.max_bufsize, SPLICE_F_MOVE|SPLICE_F_NONBLOCK|SPLICE_F_FD_IN_FIXED);      
@@ -724,7 +1988,9 @@ fuse_io_context::io_uring_task<int> queue_fuse_read(fuse_io_context& io)
     {
         do
         {
-            io_uring_sqe *sqe = io.get_sqe();
+            io_uring_sqe *sqe = co_await io.get_sqe();
+            if(sqe==nullptr)
+                co_return -1;
             io_uring_prep_read_fixed(sqe, fuse_io->pipe[0], fuse_io->header_buf + init_read,
                 sizeof(fuse_in_header)-init_read, 0, fuse_io->header_buf_idx);
             sqe->flags |= IOSQE_FIXED_FILE;
@@ -790,6 +2056,12 @@ fuse_io_context::io_uring_task<int> queue_fuse_read(fuse_io_context& io)
             req_read_rbytes = sizeof(fuse_write_in);
             req_allow_add_bytes=true;
             break;
+        case FUSE_FSYNC:
+            req_read_rbytes = sizeof(fuse_fsync_in);
+            break;
+        case FUSE_FALLOCATE:
+            req_read_rbytes = sizeof(fuse_fallocate_in);
+            break;
         default:
             req_read_rbytes = rbytes - sizeof(fuse_in_header);
     }
@@ -862,39 +2134,171 @@ fuse_io_context::io_uring_task<int> queue_fuse_read(fuse_io_context& io)
             DBG_PRINT(std::cout << "FUSE_WRITE" << std::endl);
             rc = co_await handle_write(io, fuse_io, rbytes_buf);
             break;
+        case FUSE_FSYNC:
+            DBG_PRINT(std::cout << "FUSE_FSYNC" << std::endl);
+            rc = co_await handle_fsync(io, fuse_io, rbytes_buf);
+            break;
+        case FUSE_FALLOCATE:
+            DBG_PRINT(std::cout << "FUSE_FALLOCATE" << std::endl);
+            rc = co_await handle_fallocate(io, fuse_io, rbytes_buf);
+            break;
         default:
             DBG_PRINT(std::cout << "## Unhandled opcode: " << fheader->opcode << std::endl);
             rc = co_await handle_unknown(io, fuse_io);
             break;
     }
-/*#undef DBG_PRINT
-#define DBG_PRINT(x)*/
+/*#undef DBG_PRINT
+#define DBG_PRINT(x)*/
+
+    DBG_PRINT(std::cout << "## handle fuse done" << std::endl);
+    co_return rc;
+}
+
+int clone_fuse_fd(int fuse_fd)
+{
+    int session_fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+    if(session_fd==-1)
+    {
+        perror("Error opening /dev/fuse -2.");
+        return -1;
+    }
+
+    int rc = ioctl(session_fd, FUSE_DEV_IOC_CLONE, &fuse_fd);
+    if(rc==-1)
+    {
+        perror("Error cloning fuse fd");
+        return -1;
+    }
+
+    return session_fd;
+}
+
+int setup_fuse_uring(unsigned int entries, struct io_uring* fuse_uring,
+    int uring_wq_fd, const FuseuringSettings& settings, bool worker_ring)
+{
+    struct io_uring_params p = {};
+
+    if(settings.sqpoll)
+    {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = settings.sqpoll_idle_ms;
+        if(settings.sqpoll_cpu>=0)
+        {
+            p.flags |= IORING_SETUP_SQ_AFF;
+            p.sq_thread_cpu = settings.sqpoll_cpu;
+        }
+    }
+
+    if(uring_wq_fd!=0)
+    {
+        // With SQPOLL this also shares the SQ poll thread (Linux 5.11)
+        p.flags |= IORING_SETUP_ATTACH_WQ;
+        p.flags &= ~IORING_SETUP_SQ_AFF;
+    }
+    p.wq_fd = uring_wq_fd;
+
+    // Worker rings are only submitted to from the thread that created them.
+    // Try the newest task work setup flags first and fall back if the kernel
+    // does not know about them (EINVAL).
+    std::vector<unsigned int> try_flags;
+    if(worker_ring && settings.taskrun_flags)
+    {
+#ifdef IORING_SETUP_DEFER_TASKRUN
+        // Linux 6.1. Not compatible with SQPOLL
+        if(!settings.sqpoll)
+            try_flags.push_back(IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+#endif
+#ifdef IORING_SETUP_COOP_TASKRUN
+        // Linux 5.19
+        try_flags.push_back(IORING_SETUP_COOP_TASKRUN);
+#endif
+    }
+    try_flags.push_back(0);
+
+    int rc;
+    unsigned int base_flags = p.flags;
+    for(unsigned int flags: try_flags)
+    {
+        p.flags = base_flags | flags;
+        rc = io_uring_queue_init_params(entries, fuse_uring, &p);
+        if(rc!=-EINVAL)
+            break;
+    }
 
-    DBG_PRINT(std::cout << "## handle fuse done" << std::endl);
-    co_return rc;
+    if(rc<0)
+    {
+        errno = -rc;
+        return rc;
+    }
+
+    if(worker_ring && settings.taskrun_flags)
+    {
+#ifdef IORING_SETUP_DEFER_TASKRUN
+        if(p.flags & IORING_SETUP_DEFER_TASKRUN)
+            std::cout << "Using io_uring SINGLE_ISSUER|DEFER_TASKRUN" << std::endl;
+        else
+#endif
+#ifdef IORING_SETUP_COOP_TASKRUN
+        if(p.flags & IORING_SETUP_COOP_TASKRUN)
+            std::cout << "Using io_uring COOP_TASKRUN" << std::endl;
+        else
+#endif
+            std::cout << "Kernel does not support io_uring task run setup flags" << std::endl;
+    }
+
+#ifdef IORING_SETUP_COOP_TASKRUN
+    // liburing >= 2.2. Registered ring fd avoids fdget/fdput on each io_uring_enter.
+    // It is per thread, so only register worker rings.
+    if(worker_ring)
+    {
+        rc = io_uring_register_ring_fd(fuse_uring);
+        if(rc<0)
+        {
+            static bool erronce=true;
+            if(erronce)
+            {
+                std::cout << "Registering io_uring ring fd not supported rc=" << rc << std::endl;
+                erronce=false;
+            }
+        }
+    }
+#endif
+
+    return 0;
 }
 
-int clone_fuse_fd(int fuse_fd)
+int setup_backing_uring(unsigned int entries, struct io_uring* backing_uring,
+    const FuseuringSettings& settings)
 {
-    int session_fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
-    if(session_fd==-1)
+    // Not attached to the fuse ring's io-wq and no task run setup flags.
+    // Completions either wake up the fuse ring via eventfd (which needs
+    // task work to run while the thread waits on the fuse ring) or are
+    // polled for with IOPOLL.
+    struct io_uring_params p = {};
+
+    // Batches reserve up to max_sqe_batch SQEs at once
+    if(entries<fuse_io_context::max_sqe_batch)
     {
-        perror("Error opening /dev/fuse -2.");
-        return -1;
+        errno = EINVAL;
+        return -EINVAL;
     }
 
-    int rc = ioctl(session_fd, FUSE_DEV_IOC_CLONE, &fuse_fd);
-    if(rc==-1)
+    if(settings.backing_iopoll)
+        p.flags |= IORING_SETUP_IOPOLL;
+
+    int rc = io_uring_queue_init_params(entries, backing_uring, &p);
+    if(rc<0)
     {
-        perror("Error cloning fuse fd");
-        return -1;
+        errno = -rc;
+        return rc;
     }
 
-    return session_fd;
+    return 0;
 }
 
 int fuseuring_main(int backing_fd, const std::string& mountpoint, int max_fuse_ios, 
-    int max_background, int congestion_threshold, size_t n_threads)
+    int max_background, int congestion_threshold, size_t n_threads,
+    const FuseuringSettings& settings)
 {
     umount(mountpoint.c_str());
 
@@ -1029,15 +2433,331 @@ int fuseuring_main(int backing_fd, const std::string& mountpoint, int max_fuse_i
         return 9;
     }
 
+    FuseuringShared shared;
+
+    std::unique_ptr<BlockCache> block_cache;
+    if(settings.block_cache_size>0)
+    {
+        block_cache = std::make_unique<BlockCache>(settings.block_cache_block_size,
+                            settings.block_cache_size, std::max(static_cast<size_t>(1), n_threads));
+        if(!block_cache->init())
+            return 16;
+
+        shared.block_cache = block_cache.get();
+    }
+
+    std::unique_ptr<SsdCache> ssd_cache;
+    if(!settings.ssd_cache_path.empty())
+    {
+        ssd_cache = std::make_unique<SsdCache>(settings.ssd_cache_path, settings.ssd_cache_size,
+                            settings.ssd_cache_chunk_size, backing_fd);
+        if(!ssd_cache->init(settings.direct_io))
+            return 16;
+
+        std::cout << "SSD cache: " << ssd_cache->get_loaded() << " chunks loaded from index" << std::endl;
+        shared.ssd_cache = ssd_cache.get();
+    }
+
+    std::unique_ptr<StreamDetector> stream_detector;
+    if(settings.readahead_max>0)
+    {
+        stream_detector = std::make_unique<StreamDetector>(settings.readahead_streams,
+                                std::min(static_cast<uint64_t>(128*1024), settings.readahead_max),
+                                settings.readahead_max);
+        shared.stream_detector = stream_detector.get();
+    }
+
+    std::unique_ptr<WriteJournal> journal;
+    if(!settings.journal_path.empty())
+    {
+        journal = std::make_unique<WriteJournal>(settings.journal_path, settings.journal_size,
+                        backing_fd);
+        if(!journal->init(settings.direct_io))
+            return 16;
+
+        shared.journal = journal.get();
+    }
+
+    struct stat bst;
+    if(fstat(backing_fd, &bst)!=0)
+    {
+        perror("Error getting backing file info");
+        return 15;
+    }
+
+    uint64_t volume_size = bst.st_size;
+    std::unique_ptr<StripeLayout> stripes;
+    if(!settings.stripe_paths.empty())
+    {
+        for(const std::string& path: settings.stripe_paths)
+        {
+            int fd = open(path.c_str(), O_CLOEXEC|O_CREAT|O_RDWR|(settings.direct_io ? O_DIRECT : 0), S_IRWXU);
+            if(fd==-1)
+            {
+                perror(("Error opening stripe file "+path).c_str());
+                return 16;
+            }
+
+            int rc = posix_fallocate(fd, 0, bst.st_size);
+            if(rc!=0)
+            {
+                errno = rc;
+                perror(("Error allocating stripe file "+path).c_str());
+                return 16;
+            }
+
+            shared.stripe_fds.push_back(fd);
+        }
+
+        stripes = std::make_unique<StripeLayout>(settings.stripe_size, shared.stripe_fds.size() + 1);
+        volume_size = bst.st_size*stripes->get_n_files();
+        shared.stripes = stripes.get();
+
+        std::cout << "Striping volume of " << volume_size/(1024*1024) << " MB across "
+            << stripes->get_n_files() << " files with stripe size "
+            << settings.stripe_size/1024 << " KB" << std::endl;
+    }
+
+    std::unique_ptr<VhdChain> vhd;
+    if(settings.vhd)
+    {
+        vhd = std::make_unique<VhdChain>(settings.vhd_path);
+        if(!vhd->open(settings.direct_io))
+            return 16;
+
+        volume_size = vhd->get_size();
+        shared.vhd = vhd.get();
+
+        std::cout << "VHD " << vhd->describe() << std::endl;
+    }
+
+    std::unique_ptr<ChunkStore> chunk_store;
+    if(settings.chunk_store)
+    {
+        size_t decompress_threads = settings.chunk_threads>0 ? settings.chunk_threads : std::thread::hardware_concurrency();
+        chunk_store = std::make_unique<ChunkStore>(settings.chunk_cache_size, decompress_threads,
+                            std::max(static_cast<size_t>(1), n_threads));
+        if(!chunk_store->open(backing_fd))
+            return 16;
+
+        if(!settings.chunk_overlay_path.empty() &&
+            !chunk_store->open_overlay(settings.chunk_overlay_path, settings.direct_io))
+            return 16;
+
+        volume_size = chunk_store->get_size();
+        shared.chunk_store = chunk_store.get();
+
+        std::cout << "Chunk store " << chunk_store->describe() << std::endl;
+    }
+
+    std::unique_ptr<DedupStore> dedup;
+    if(settings.dedup)
+    {
+        size_t hash_threads = settings.dedup_threads>0 ? settings.dedup_threads : std::thread::hardware_concurrency();
+        dedup = std::make_unique<DedupStore>(hash_threads, std::max(static_cast<size_t>(1), n_threads),
+                    settings.dedup_verify);
+        if(!dedup->open(backing_fd, settings.dedup_size, settings.dedup_block_size))
+            return 16;
+
+        volume_size = dedup->get_size();
+        shared.dedup = dedup.get();
+
+        std::cout << "Dedup store " << dedup->describe() << std::endl;
+    }
+
+    std::unique_ptr<Snapshot> snapshot;
+    if(!settings.snapshot_overlay_path.empty())
+    {
+        snapshot = std::make_unique<Snapshot>(settings.snapshot_overlay_path, volume_size,
+                        settings.snapshot_block_size);
+        if(!snapshot->init(settings.direct_io))
+            return 16;
+
+        shared.snapshot = snapshot.get();
+
+        std::cout << "Snapshot overlay " << snapshot->describe() << std::endl;
+    }
+
+    std::unique_ptr<Integrity> integrity;
+    if(!settings.integrity_path.empty())
+    {
+        integrity = std::make_unique<Integrity>(settings.integrity_path, volume_size,
+                        settings.integrity_block_size, settings.integrity_scrub_rate);
+        if(!integrity->init(backing_fd, settings.direct_io))
+            return 16;
+
+        shared.integrity = integrity.get();
+
+        std::cout << "Integrity checksums " << integrity->describe() << std::endl;
+    }
+
+    std::unique_ptr<Encryption> encryption;
+    if(!settings.encrypt_key_path.empty())
+    {
+        if(volume_size % Encryption::sector_size!=0)
+        {
+            std::cerr << "Size of encrypted backing file has to be a multiple of "
+                << Encryption::sector_size << " bytes" << std::endl;
+            return 16;
+        }
+
+        encryption = std::make_unique<Encryption>();
+        if(!encryption->load_key(settings.encrypt_key_path))
+            return 16;
+
+        shared.encryption = encryption.get();
+
+        std::cout << "Encryption " << encryption->describe() << std::endl;
+    }
+
+    std::unique_ptr<NbdBackend> nbd;
+    if(settings.nbd)
+    {
+        nbd = std::make_unique<NbdBackend>(settings.nbd_socket_path, settings.nbd_export);
+        if(!nbd->open(backing_fd, std::max(static_cast<size_t>(1), n_threads)))
+            return 16;
+
+        volume_size = nbd->get_size();
+        shared.backend = nbd.get();
+
+        std::cout << "NBD " << nbd->describe() << std::endl;
+    }
+
+    std::unique_ptr<S3Backend> s3;
+    if(settings.s3)
+    {
+        s3 = std::make_unique<S3Backend>(settings.s3_url, settings.s3_size, settings.s3_block_size,
+                    settings.s3_connections, settings.s3_region);
+        if(!s3->open(backing_fd, std::max(static_cast<size_t>(1), n_threads)))
+            return 16;
+
+        volume_size = s3->get_size();
+        shared.backend = s3.get();
+
+        std::cout << "S3 " << s3->describe() << std::endl;
+    }
+
+    std::unique_ptr<Mirror> mirror;
+    if(!settings.mirror_path.empty())
+    {
+        int fd = open(settings.mirror_path.c_str(), O_CLOEXEC|O_CREAT|O_RDWR|(settings.direct_io ? O_DIRECT : 0), S_IRWXU);
+        if(fd==-1)
+        {
+            perror(("Error opening mirror file "+settings.mirror_path).c_str());
+            return 16;
+        }
+
+        struct stat mst;
+        if(fstat(fd, &mst)!=0)
+        {
+            perror("Error getting mirror file info");
+            return 16;
+        }
+
+        int rc = posix_fallocate(fd, 0, bst.st_size);
+        if(rc!=0)
+        {
+            errno = rc;
+            perror(("Error allocating mirror file "+settings.mirror_path).c_str());
+            return 16;
+        }
+
+        mirror = std::make_unique<Mirror>(bst.st_size, settings.mirror_quorum,
+                        settings.mirror_hedge_percentile, std::max(static_cast<size_t>(1), n_threads));
+
+        // A new (or grown) mirror file does not have the data yet
+        if(settings.mirror_resync ||
+            mst.st_size<bst.st_size)
+        {
+            std::cout << "Copying backing file to mirror leg " << settings.mirror_path << " in the background" << std::endl;
+            mirror->resync_all(1);
+        }
+
+        shared.mirror = mirror.get();
+        shared.mirror_fd = fd;
+    }
+
+    // Volume features are mutually exclusive, so there is one of them
+    std::unique_ptr<Backend> volume;
+    if(stripes)
+        volume = std::make_unique<StripeBackend>(stripes.get(), volume_size);
+    else if(mirror)
+        volume = std::make_unique<MirrorBackend>(mirror.get(), volume_size);
+    else if(vhd)
+        volume = std::make_unique<VhdBackend>(vhd.get());
+    else if(chunk_store)
+        volume = std::make_unique<ChunkStoreBackend>(chunk_store.get());
+    else if(snapshot)
+        volume = std::make_unique<SnapshotBackend>(snapshot.get());
+    else if(dedup)
+        volume = std::make_unique<DedupBackend>(dedup.get());
+    else if(integrity)
+        volume = std::make_unique<IntegrityBackend>(integrity.get(), volume_size);
+    else if(encryption)
+        volume = std::make_unique<EncryptionBackend>(encryption.get(), volume_size);
+    else if(shared.backend==nullptr)
+        volume = std::make_unique<FileBackend>(volume_size);
+    shared.volume = volume ? volume.get() : shared.backend;
+
+    std::unique_ptr<ChangeTracker> cbt;
+    if(!settings.cbt_path.empty())
+    {
+        cbt = std::make_unique<ChangeTracker>(settings.cbt_path, volume_size,
+                        settings.cbt_block_size);
+        if(!cbt->init())
+            return 16;
+
+        shared.cbt = cbt.get();
+    }
+
+    std::unique_ptr<HeatMap> heat_map;
+    if(settings.heat_region_size>0)
+    {
+        heat_map = std::make_unique<HeatMap>(volume_size, settings.heat_region_size,
+                        settings.heat_half_life_s, std::max(static_cast<size_t>(1), n_threads),
+                        settings.heat_top_n);
+        shared.heat_map = heat_map.get();
+    }
+
+    std::unique_ptr<QosLimiter> qos;
+    if(!settings.qos_spec.empty() ||
+        !settings.qos_path.empty())
+    {
+        QosLimits limits;
+        if(!QosLimits::parse(settings.qos_spec, limits))
+            return 16;
+
+        qos = std::make_unique<QosLimiter>(limits, settings.qos_path);
+        if(!qos->init())
+            return 16;
+
+        if(!settings.qos_path.empty())
+        {
+            struct sigaction sa = {};
+            sa.sa_handler = [](int) { QosLimiter::request_reload(); };
+            sigemptyset(&sa.sa_mask);
+            sa.sa_flags = SA_RESTART;
+            if(sigaction(SIGHUP, &sa, nullptr)!=0)
+            {
+                perror("Error installing SIGHUP handler");
+                return 16;
+            }
+        }
+
+        shared.qos = qos.get();
+    }
+
     if(n_threads<=1)
     {
-        return fuseuring_run(max_background, max_write, backing_fd, fuse_fd, nullptr, 0);
+        return fuseuring_run(0, max_background, max_write, backing_fd, fuse_fd, 0, settings, shared);
     }
     else
     {
-        struct io_uring fuse_uring;
+        // Each worker thread sets up its own ring (required for SINGLE_ISSUER).
+        // They all attach to this ring to share the io-wq (and SQ poll thread).
+        struct io_uring wq_uring;
 
-        int rc = io_uring_queue_init(std::max(100, max_fuse_ios*2), &fuse_uring, 0);
+        int rc = setup_fuse_uring(4, &wq_uring, 0, settings, false);
 
         if(rc<0)
         {
@@ -1050,12 +2770,11 @@ int fuseuring_main(int backing_fd, const std::string& mountpoint, int max_fuse_i
         for(size_t i=0;i<n_threads;++i)
         {
             threads.push_back(std::thread( [max_fuse_ios, 
-                    max_write, backing_fd, fuse_fd, &thread_rc, i, &fuse_uring] () {
+                    max_write, backing_fd, fuse_fd, &thread_rc, i, &wq_uring, &settings, &shared] () {
 
-                int rc = fuseuring_run(max_fuse_ios, 
+                int rc = fuseuring_run(i, max_fuse_ios, 
                         max_write, backing_fd, fuse_fd,
-                        i==0 ? &fuse_uring : nullptr,
-                        i==0 ? 0 : fuse_uring.ring_fd);
+                        wq_uring.ring_fd, settings, shared);
                 if(rc!=0)
                     thread_rc=rc;
             }));
@@ -1065,44 +2784,96 @@ int fuseuring_main(int backing_fd, const std::string& mountpoint, int max_fuse_i
         {
             thread.join();
         }
+
+        io_uring_queue_exit(&wq_uring);
         return thread_rc;
     }
 }
 
-int fuseuring_run(int max_fuse_ios, size_t max_write, 
-    int backing_fd, int fuse_fd, struct io_uring* fuse_uring, int uring_wq_fd)
+int fuseuring_run(size_t thread_idx, int max_fuse_ios, size_t max_write, 
+    int backing_fd, int fuse_fd, int uring_wq_fd,
+    const FuseuringSettings& settings, FuseuringShared& shared)
 {
     struct io_uring fuse_uring_local;
+    struct io_uring* fuse_uring = &fuse_uring_local;
 
-    if(fuse_uring==nullptr)
     {
-        struct io_uring_params p = {};
-
-        //p.flags = IORING_SETUP_SQPOLL;
-        if(uring_wq_fd!=0)
-        {
-            p.flags = IORING_SETUP_ATTACH_WQ;
-        }
-        p.wq_fd = uring_wq_fd;
-
-        int rc = io_uring_queue_init_params(std::max(100, max_fuse_ios*2), &fuse_uring_local, &p);//IORING_SETUP_SQPOLL);
+        int rc = setup_fuse_uring(std::max(100, max_fuse_ios*2), fuse_uring,
+                    uring_wq_fd, settings, true);
 
         if(rc<0)
         {
             perror("Error setting up io_uring.");
             return 10;
         }
-
-        fuse_uring = &fuse_uring_local;
     }
     
     std::vector<int> fixed_fds;
     std::vector<struct iovec> reg_buffers;
 
     fuse_io_context::FuseRing fuse_ring;
+    fuse_io_context::FixedFileLayout& files = fuse_ring.files;
     fuse_ring.backing_fd = fixed_fds.size();
     fixed_fds.push_back(backing_fd);
     fuse_ring.backing_fd_orig = backing_fd;
+    if(shared.stripes!=nullptr)
+    {
+        files.stripe_files.push_back(fuse_ring.backing_fd);
+        for(int fd: shared.stripe_fds)
+        {
+            files.stripe_files.push_back(fixed_fds.size());
+            fixed_fds.push_back(fd);
+        }
+    }
+    fuse_ring.stripes = shared.stripes;
+    if(shared.vhd!=nullptr)
+    {
+        files.vhd_images.push_back(fuse_ring.backing_fd);
+        for(int fd: shared.vhd->get_parent_fds())
+        {
+            files.vhd_images.push_back(fixed_fds.size());
+            fixed_fds.push_back(fd);
+        }
+    }
+    fuse_ring.vhd = shared.vhd;
+    if(shared.chunk_store!=nullptr &&
+        shared.chunk_store->has_overlay())
+    {
+        files.chunk_overlay = fixed_fds.size();
+        fixed_fds.push_back(shared.chunk_store->get_overlay_fd());
+    }
+    fuse_ring.chunk_store = shared.chunk_store;
+    if(shared.snapshot!=nullptr)
+    {
+        files.snapshot_overlay = fixed_fds.size();
+        fixed_fds.push_back(shared.snapshot->get_fd());
+        files.snapshot_base = fixed_fds.size();
+        fixed_fds.push_back(backing_fd);
+    }
+    fuse_ring.snapshot = shared.snapshot;
+    fuse_ring.dedup = shared.dedup;
+    if(shared.integrity!=nullptr)
+    {
+        files.integrity_sums = fixed_fds.size();
+        fixed_fds.push_back(shared.integrity->get_fd());
+    }
+    fuse_ring.integrity = shared.integrity;
+    fuse_ring.encryption = shared.encryption;
+    if(shared.backend!=nullptr &&
+        shared.backend->get_thread_fd(thread_idx)!=-1)
+    {
+        files.backend_conn = fixed_fds.size();
+        fixed_fds.push_back(shared.backend->get_thread_fd(thread_idx));
+    }
+    fuse_ring.backend = shared.backend;
+    fuse_ring.volume = shared.volume;
+    if(shared.mirror_fd!=-1)
+    {
+        files.mirror_legs[0] = fuse_ring.backing_fd;
+        files.mirror_legs[1] = fixed_fds.size();
+        fixed_fds.push_back(shared.mirror_fd);
+    }
+    fuse_ring.mirror = shared.mirror;
 
     size_t max_bufsize = max_write + sizeof(fuse_in_header) + sizeof(fuse_write_in);
 
@@ -1122,6 +2893,71 @@ int fuseuring_run(int max_fuse_ios, size_t max_write,
     size_t scratch_buf_idx = reg_buffers.size();
     reg_buffers.push_back(iov);
 
+    char* data_bufs = nullptr;
+    size_t data_bufs_size = 0;
+    if(settings.copy_mode)
+    {
+        data_bufs_size = settings.copy_bufs*max_write;
+        data_bufs = static_cast<char*>(mmap(nullptr, data_bufs_size, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0));
+        if(data_bufs==MAP_FAILED)
+        {
+            perror("Error allocating copy mode data buffers.");
+            return 16;
+        }
+
+        iov.iov_base = data_bufs;
+        iov.iov_len = data_bufs_size;
+        size_t data_buf_idx = reg_buffers.size();
+        reg_buffers.push_back(iov);
+
+        for(size_t i=0;i<settings.copy_bufs;++i)
+        {
+            fuse_io_context::DataBuf data_buf;
+            data_buf.buf = data_bufs + i*max_write;
+            data_buf.buf_idx = data_buf_idx;
+            fuse_ring.data_bufs.push_back(data_buf);
+        }
+
+        fuse_ring.copy_mode = true;
+        fuse_ring.data_buf_size = max_write;
+    }
+
+    if(shared.block_cache!=nullptr)
+    {
+        fuse_ring.block_cache = shared.block_cache;
+        fuse_ring.block_cache_buf_idx = reg_buffers.size();
+        std::vector<struct iovec> cache_iovecs = shared.block_cache->reg_iovecs();
+        reg_buffers.insert(reg_buffers.end(), cache_iovecs.begin(), cache_iovecs.end());
+    }
+
+    if(shared.ssd_cache!=nullptr)
+    {
+        fuse_ring.ssd_cache = shared.ssd_cache;
+        fuse_ring.ssd_cache_fd = fixed_fds.size();
+        fixed_fds.push_back(shared.ssd_cache->get_fd());
+    }
+
+    if(shared.journal!=nullptr)
+    {
+        if(!settings.copy_mode)
+        {
+            std::cerr << "Write journal needs copy mode" << std::endl;
+            return 16;
+        }
+
+        fuse_ring.journal = shared.journal;
+        fuse_ring.journal_fd = fixed_fds.size();
+        fixed_fds.push_back(shared.journal->get_fd());
+    }
+
+    if(shared.cbt!=nullptr)
+    {
+        fuse_ring.cbt = shared.cbt;
+        fuse_ring.cbt_fd = fixed_fds.size();
+        fixed_fds.push_back(shared.cbt->get_fd());
+    }
+
     std::vector<int> pipe_fds;
 
     for(size_t i=0;i<max_fuse_ios;++i)
@@ -1181,21 +3017,124 @@ int fuseuring_run(int max_fuse_ios, size_t max_write,
         return 14;
     }
     
+    struct io_uring backing_uring_local;
+    struct io_uring* backing_uring = nullptr;
+    if(settings.backing_ring_entries>0)
+    {
+        if(settings.backing_iopoll && !settings.copy_mode)
+        {
+            std::cerr << "Backing ring with IOPOLL needs copy mode (splice is not supported with IOPOLL)" << std::endl;
+            return 16;
+        }
+
+        rc = setup_backing_uring(settings.backing_ring_entries, &backing_uring_local, settings);
+        if(rc<0)
+        {
+            perror("Error setting up backing io_uring.");
+            return 16;
+        }
+        backing_uring = &backing_uring_local;
+
+        rc = io_uring_register_files(backing_uring, &fixed_fds[0], fixed_fds.size());
+        if(rc<0)
+        {
+            errno = -rc;
+            perror("Error registering backing io_uring files.");
+            return 16;
+        }
+
+        rc = io_uring_register_buffers(backing_uring, &reg_buffers[0], reg_buffers.size());
+        if(rc<0)
+        {
+            errno = -rc;
+            perror("Error registering backing io_uring buffers.");
+            return 16;
+        }
+
+        if(!settings.backing_iopoll)
+        {
+            fuse_ring.backing_eventfd = eventfd(0, EFD_CLOEXEC);
+            if(fuse_ring.backing_eventfd==-1)
+            {
+                perror("Error creating backing io_uring eventfd.");
+                return 16;
+            }
+
+            rc = io_uring_register_eventfd(backing_uring, fuse_ring.backing_eventfd);
+            if(rc<0)
+            {
+                errno = -rc;
+                perror("Error registering backing io_uring eventfd.");
+                return 16;
+            }
+        }
+
+        fuse_ring.backing_ring = backing_uring;
+    }
+
     fuse_ring.ring = fuse_uring;
-    fuse_ring.ring_submit = false;
+    std::unique_ptr<WriteCoalescer> write_coalescer;
+    if(settings.write_coalesce)
+    {
+        write_coalescer = std::make_unique<WriteCoalescer>(settings.write_coalesce_window_us);
+        fuse_ring.write_coalescer = write_coalescer.get();
+    }
+
+    std::unique_ptr<IoScheduler> scheduler;
+    if(settings.sched_max_inflight>0)
+    {
+        scheduler = std::make_unique<IoScheduler>(settings.sched_max_inflight, settings.sched_expire_us);
+        fuse_ring.scheduler = scheduler.get();
+    }
+
+    fuse_ring.stream_detector = shared.stream_detector;
+    fuse_ring.qos = shared.qos;
+    fuse_ring.heat_map = shared.heat_map;
+    fuse_ring.direct_io = settings.direct_io;
     fuse_ring.max_bufsize = max_bufsize;
+    fuse_ring.thread_idx = thread_idx;
+    fuse_ring.stats_interval_s = settings.stats_interval_s;
 
-    struct stat bst;
-    if(fstat(backing_fd, &bst)!=0)
+    if(!settings.wait_policies.empty())
     {
-        perror("Error getting backing file info");
-        return 15;
+        const FuseuringWaitPolicy& wait_policy = settings.wait_policies[
+                    std::min(thread_idx, settings.wait_policies.size()-1)];
+        fuse_ring.wait_nr = wait_policy.wait_nr;
+        fuse_ring.wait_usec = wait_policy.wait_usec;
+        fuse_ring.spin_usec = wait_policy.spin_usec;
+
+        if(fuse_ring.wait_nr>1 &&
+            !(fuse_uring->features & IORING_FEAT_EXT_ARG))
+        {
+            std::cout << "Kernel does not support waiting for multiple completions "
+                "with timeout (IORING_FEAT_EXT_ARG). Waiting for one completion." << std::endl;
+            fuse_ring.wait_nr = 1;
+        }
+
+#ifdef IORING_SETUP_DEFER_TASKRUN
+        if(fuse_ring.spin_usec>0 &&
+            (fuse_uring->flags & IORING_SETUP_DEFER_TASKRUN))
+        {
+            std::cout << "Completions are only posted when entering the kernel with "
+                "DEFER_TASKRUN. Disabling completion queue spinning." << std::endl;
+            fuse_ring.spin_usec = 0;
+        }
+#endif
     }
 
-    fuse_ring.backing_f_size = bst.st_size;
+    fuse_ring.backing_f_size = fuse_ring.volume->get_size();
 
     std::cout << "Running..." << std::endl;
     fuse_io_context service(std::move(fuse_ring));
+
+    if(service.fuse_ring.journal!=nullptr &&
+        thread_idx==0)
+    {
+        service.fuse_ring.journal->destage(service, service.fuse_ring.journal_fd);
+    }
+
+    service.fuse_ring.volume->start(service);
+
     rc = service.run(queue_fuse_read);
 
     io_uring_unregister_buffers(fuse_uring);
@@ -1203,6 +3142,21 @@ int fuseuring_run(int max_fuse_ios, size_t max_write,
 
     io_uring_queue_exit(fuse_uring);
 
+    if(backing_uring!=nullptr)
+    {
+        io_uring_queue_exit(backing_uring);
+    }
+
+    if(service.fuse_ring.backing_eventfd!=-1)
+    {
+        close(service.fuse_ring.backing_eventfd);
+    }
+
+    if(data_bufs!=nullptr)
+    {
+        munmap(data_bufs, data_bufs_size);
+    }
+
     for(int p: pipe_fds)
     {
         close(p);
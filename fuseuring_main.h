@@ -2,10 +2,239 @@
 // Copyright (C) Martin Raiber
 #pragma once
 #include <string>
+#include <vector>
+
+struct FuseuringWaitPolicy
+{
+    FuseuringWaitPolicy()
+        : wait_nr(1), wait_usec(0), spin_usec(0)
+        {}
+
+    // Wait until wait_nr completions are available or wait_usec passed
+    unsigned int wait_nr;
+    unsigned int wait_usec;
+    // Poll the completion queue in user space for spin_usec before waiting
+    unsigned int spin_usec;
+};
+
+struct FuseuringSettings
+{
+    FuseuringSettings()
+        : sqpoll(false), sqpoll_idle_ms(1000),
+            sqpoll_cpu(-1), taskrun_flags(true),
+            stats_interval_s(0), backing_ring_entries(0),
+            backing_iopoll(false), direct_io(false), memfd(false),
+            memfd_huge_pages(false), copy_mode(false),
+            copy_bufs(64), block_cache_size(0),
+            block_cache_block_size(64*1024), ssd_cache_size(0),
+            ssd_cache_chunk_size(1024*1024), readahead_max(0),
+            readahead_streams(16), write_coalesce(false),
+            write_coalesce_window_us(0),
+            journal_size(1024*1024*1024), sched_max_inflight(0),
+            sched_expire_us({10000, 50000, 500000}),
+            cbt_block_size(64*1024), heat_region_size(0),
+            heat_half_life_s(3600), heat_top_n(20),
+            stripe_size(64*1024), mirror_quorum(2),
+            mirror_hedge_percentile(95), mirror_resync(false),
+            vhd(false), chunk_store(false),
+            chunk_cache_size(256*1024*1024), chunk_threads(0),
+            chunk_size(128*1024), chunk_algorithm("lz4"),
+            chunk_level(3), snapshot_block_size(64*1024),
+            dedup(false), dedup_size(0), dedup_block_size(64*1024),
+            dedup_threads(0), dedup_verify(true),
+            integrity_block_size(4096),
+            integrity_scrub_rate(16*1024*1024), nbd(false),
+            s3(false), s3_size(0), s3_block_size(64*1024),
+            s3_connections(16), s3_region("us-east-1")
+            {}
+
+    // Kernel side SQ polling. All worker rings attach
+    // to the SQ poll thread of the first ring
+    bool sqpoll;
+    unsigned int sqpoll_idle_ms;
+    int sqpoll_cpu;
+    // Setup worker rings with SINGLE_ISSUER|DEFER_TASKRUN or
+    // COOP_TASKRUN if the kernel supports it
+    bool taskrun_flags;
+    unsigned int stats_interval_s;
+    // Wait policy per worker thread. The last one is used for
+    // all remaining threads
+    std::vector<FuseuringWaitPolicy> wait_policies;
+    // Submit backing file I/O to a separate ring per worker thread
+    // with this many entries (0 disables it)
+    unsigned int backing_ring_entries;
+    // Setup the backing ring with IORING_SETUP_IOPOLL. Needs copy_mode
+    // and a backing file opened with O_DIRECT
+    bool backing_iopoll;
+    // Backing file is opened with O_DIRECT
+    bool direct_io;
+    // The backing file is a memfd in RAM, allocated as transparent
+    // huge pages with memfd_huge_pages
+    bool memfd;
+    bool memfd_huge_pages;
+    // Copy data between fuse and the backing file through registered
+    // buffers instead of splicing it
+    bool copy_mode;
+    size_t copy_bufs;
+    // In-process read cache in registered memory (0 disables it)
+    size_t block_cache_size;
+    size_t block_cache_block_size;
+    // Persistent read cache in a file on fast local storage
+    std::string ssd_cache_path;
+    uint64_t ssd_cache_size;
+    size_t ssd_cache_chunk_size;
+    // Maximum readahead window of sequential read streams (0 disables readahead)
+    uint64_t readahead_max;
+    size_t readahead_streams;
+    // Merge contiguous/overlapping writes (copy mode only). Without a window
+    // writes from the same batch of completions are merged
+    bool write_coalesce;
+    unsigned int write_coalesce_window_us;
+    // Write-back journal file (copy mode only). Writes are acknowledged
+    // once they are in the journal and applied to the backing file
+    // in the background
+    std::string journal_path;
+    uint64_t journal_size;
+    // Maximum backing operations in flight per worker thread
+    // (0 disables the scheduler) and deadline per class (read,
+    // synchronous write, asynchronous write)
+    size_t sched_max_inflight;
+    std::vector<int64_t> sched_expire_us;
+    // QoS limits of the volume (see QosLimits::parse). Limits in
+    // qos_path replace them and are re-read on SIGHUP
+    std::string qos_spec;
+    std::string qos_path;
+    // Changed block tracking bitmap file and tracked block size.
+    // Exposed as changed_blocks/changed_blocks_epoch in the mount
+    std::string cbt_path;
+    uint64_t cbt_block_size;
+    // Read/write heat per region of heat_region_size bytes (0 disables
+    // it), exposed as heat_map/heat_map_top in the mount
+    uint64_t heat_region_size;
+    unsigned int heat_half_life_s;
+    size_t heat_top_n;
+    // Additional backing files/devices. The volume is striped across
+    // the backing file and these in units of stripe_size bytes
+    std::vector<std::string> stripe_paths;
+    uint64_t stripe_size;
+    // Second backing file/device the volume is mirrored on. Writes are
+    // finished once they are on mirror_quorum legs. Reads are hedged after
+    // the mirror_hedge_percentile latency (0 disables hedged reads)
+    std::string mirror_path;
+    unsigned int mirror_quorum;
+    unsigned int mirror_hedge_percentile;
+    // Copy the backing file to the mirror leg completely at startup
+    bool mirror_resync;
+    // The backing file (vhd_path) is a VHD image
+    bool vhd;
+    std::string vhd_path;
+    // The backing file is a compressed chunk store. Decompressed chunks
+    // are cached in chunk_cache_size bytes. chunk_threads decompression
+    // threads (0 for one per CPU). Writes go to chunk_overlay_path
+    // if set
+    bool chunk_store;
+    uint64_t chunk_cache_size;
+    size_t chunk_threads;
+    std::string chunk_overlay_path;
+    // Compress chunk_pack_path into the backing file before mounting
+    std::string chunk_pack_path;
+    uint32_t chunk_size;
+    std::string chunk_algorithm;
+    int chunk_level;
+    // Copy-on-write snapshots of the backing file with the overlay
+    // snapshot_overlay_path, in blocks of snapshot_block_size
+    std::string snapshot_overlay_path;
+    uint32_t snapshot_block_size;
+    // The backing file is a dedup store, created with dedup_size and
+    // dedup_block_size if it is empty. dedup_threads hash threads (0 for
+    // one per CPU). With dedup_verify (default), duplicates are compared
+    // byte by byte before they share a slot
+    bool dedup;
+    uint64_t dedup_size;
+    uint32_t dedup_block_size;
+    size_t dedup_threads;
+    bool dedup_verify;
+    // CRC32C of every block of integrity_block_size in the side file
+    // integrity_path. The scrubber reads integrity_scrub_rate bytes/s
+    std::string integrity_path;
+    uint32_t integrity_block_size;
+    uint64_t integrity_scrub_rate;
+    // XTS-AES encryption of the backing file with the keys in the
+    // file encrypt_key_path
+    std::string encrypt_key_path;
+    // The backing file (nbd_socket_path) is the unix socket of an NBD
+    // server with the export nbd_export
+    bool nbd;
+    std::string nbd_socket_path;
+    std::string nbd_export;
+    // The backing file (s3_url) is the URL of an S3 bucket. The volume
+    // has s3_size and is stored in objects of s3_block_size. Every
+    // worker thread has up to s3_connections connections
+    bool s3;
+    std::string s3_url;
+    uint64_t s3_size;
+    uint32_t s3_block_size;
+    size_t s3_connections;
+    std::string s3_region;
+};
+
+class BlockCache;
+class SsdCache;
+class StreamDetector;
+class WriteJournal;
+class QosLimiter;
+class ChangeTracker;
+class HeatMap;
+class StripeLayout;
+class Mirror;
+class VhdChain;
+class ChunkStore;
+class Snapshot;
+class DedupStore;
+class Integrity;
+class Encryption;
+class Backend;
+
+// State shared by all worker threads
+struct FuseuringShared
+{
+    FuseuringShared()
+        : block_cache(nullptr), ssd_cache(nullptr),
+            stream_detector(nullptr), journal(nullptr),
+            qos(nullptr), cbt(nullptr), heat_map(nullptr),
+            stripes(nullptr), mirror(nullptr), mirror_fd(-1),
+            vhd(nullptr), chunk_store(nullptr), snapshot(nullptr),
+            dedup(nullptr), integrity(nullptr), encryption(nullptr),
+            backend(nullptr), volume(nullptr)
+        {}
+
+    BlockCache* block_cache;
+    SsdCache* ssd_cache;
+    StreamDetector* stream_detector;
+    WriteJournal* journal;
+    QosLimiter* qos;
+    ChangeTracker* cbt;
+    HeatMap* heat_map;
+    StripeLayout* stripes;
+    // Fds of the additional stripe files
+    std::vector<int> stripe_fds;
+    Mirror* mirror;
+    int mirror_fd;
+    VhdChain* vhd;
+    ChunkStore* chunk_store;
+    Snapshot* snapshot;
+    DedupStore* dedup;
+    Integrity* integrity;
+    Encryption* encryption;
+    Backend* backend;
+    // The volume layer, the backend or the backing file
+    Backend* volume;
+};
 
 int fuseuring_main(int backing_fd, const std::string& mountpoint, int max_fuse_ios, 
-    int max_background, int congestion_threshold, size_t n_threads);
+    int max_background, int congestion_threshold, size_t n_threads,
+    const FuseuringSettings& settings);
 
-struct fuse_uring;
-int fuseuring_run(int max_fuse_ios, size_t max_write, int backing_fd, 
-    int fuse_fd, struct io_uring* fuse_uring, int uring_wq_fd);
\ No newline at end of file
+int fuseuring_run(size_t thread_idx, int max_fuse_ios, size_t max_write, int backing_fd, 
+    int fuse_fd, int uring_wq_fd, const FuseuringSettings& settings,
+    FuseuringShared& shared);
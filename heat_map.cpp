@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "heat_map.h"
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <numeric>
+#include <sstream>
+#include <iomanip>
+
+namespace
+{
+    const char heat_map_magic[8] = {'F', 'U', 'S', 'H', 'E', 'A', 'T', '1'};
+    const uint32_t heat_map_version = 1;
+
+    struct HeatMapHeader
+    {
+        char magic[8];
+        uint32_t version;
+        // Offset of the region entries
+        uint32_t header_size;
+        uint64_t region_size;
+        uint64_t n_regions;
+        uint64_t half_life_s;
+        // Unix time the snapshot was taken at
+        int64_t time;
+    };
+}
+
+HeatMap::HeatMap(uint64_t volume_size, uint64_t region_size, unsigned int half_life_s,
+    size_t n_threads, size_t top_n)
+    : volume_size(volume_size), region_size(region_size),
+        half_life_s(half_life_s), top_n(top_n), last_merge_us(0)
+{
+    n_regions = std::max(static_cast<uint64_t>(1), (volume_size + region_size - 1) / region_size);
+
+    threads.resize(n_threads);
+    for(ThreadCounts& counts: threads)
+    {
+        counts.reads = std::make_unique<std::atomic<uint32_t>[]>(n_regions);
+        counts.writes = std::make_unique<std::atomic<uint32_t>[]>(n_regions);
+        for(uint64_t r=0;r<n_regions;++r)
+        {
+            counts.reads[r].store(0, std::memory_order_relaxed);
+            counts.writes[r].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    last_reads.resize(n_regions);
+    last_writes.resize(n_regions);
+    read_heat.resize(n_regions);
+    write_heat.resize(n_regions);
+}
+
+void HeatMap::merge(int64_t now_us)
+{
+    float decay = 1;
+    if(last_merge_us!=0 &&
+        half_life_s>0)
+    {
+        double elapsed_s = static_cast<double>(now_us - last_merge_us) / 1000000;
+        decay = static_cast<float>(exp2(-elapsed_s / half_life_s));
+    }
+    last_merge_us = now_us;
+
+    for(uint64_t r=0;r<n_regions;++r)
+    {
+        uint32_t reads = 0;
+        uint32_t writes = 0;
+        for(ThreadCounts& counts: threads)
+        {
+            reads += counts.reads[r].load(std::memory_order_relaxed);
+            writes += counts.writes[r].load(std::memory_order_relaxed);
+        }
+
+        // Counts only grow, so the difference is correct even
+        // if they wrapped around
+        read_heat[r] = read_heat[r]*decay + static_cast<uint32_t>(reads - last_reads[r]);
+        write_heat[r] = write_heat[r]*decay + static_cast<uint32_t>(writes - last_writes[r]);
+        last_reads[r] = reads;
+        last_writes[r] = writes;
+    }
+}
+
+uint64_t HeatMap::get_snapshot_size() const
+{
+    return sizeof(HeatMapHeader) + n_regions*2*sizeof(float);
+}
+
+void HeatMap::build_snapshot()
+{
+    snapshot.resize(get_snapshot_size());
+
+    HeatMapHeader header = {};
+    memcpy(header.magic, heat_map_magic, sizeof(heat_map_magic));
+    header.version = heat_map_version;
+    header.header_size = sizeof(HeatMapHeader);
+    header.region_size = region_size;
+    header.n_regions = n_regions;
+    header.half_life_s = half_life_s;
+    header.time = time(nullptr);
+    memcpy(snapshot.data(), &header, sizeof(header));
+
+    float* entries = reinterpret_cast<float*>(snapshot.data() + sizeof(header));
+    for(uint64_t r=0;r<n_regions;++r)
+    {
+        entries[r*2] = read_heat[r];
+        entries[r*2+1] = write_heat[r];
+    }
+}
+
+void HeatMap::build_top()
+{
+    double total_reads = 0;
+    double total_writes = 0;
+    for(uint64_t r=0;r<n_regions;++r)
+    {
+        total_reads += read_heat[r];
+        total_writes += write_heat[r];
+    }
+    double total = total_reads + total_writes;
+
+    std::vector<uint64_t> regions(n_regions);
+    std::iota(regions.begin(), regions.end(), 0);
+    size_t n = std::min(static_cast<uint64_t>(top_n), n_regions);
+    std::partial_sort(regions.begin(), regions.begin() + n, regions.end(),
+        [this](uint64_t a, uint64_t b) {
+            return read_heat[a] + write_heat[a] > read_heat[b] + write_heat[b];
+        });
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    out << "# region_size=" << region_size << " half_life_s=" << half_life_s
+        << " read_heat=" << total_reads << " write_heat=" << total_writes << "\n";
+    out << "# offset length read_heat write_heat cumulative_pct\n";
+
+    double cumulative = 0;
+    for(size_t i=0;i<n;++i)
+    {
+        uint64_t r = regions[i];
+        double heat = read_heat[r] + write_heat[r];
+        if(heat<=0)
+            break;
+
+        cumulative += heat;
+        out << r*region_size << " " << std::min(region_size, volume_size - r*region_size)
+            << " " << read_heat[r] << " " << write_heat[r]
+            << " " << (total>0 ? cumulative*100/total : 0) << "\n";
+    }
+
+    top = out.str();
+}
+
+size_t HeatMap::read_snapshot(bool p_top, uint64_t offset, char* buf, size_t size, int64_t now_us)
+{
+    std::scoped_lock lock(mutex);
+
+    if(offset==0)
+    {
+        merge(now_us);
+        if(p_top)
+            build_top();
+        else
+            build_snapshot();
+    }
+
+    const char* data = p_top ? top.data() : snapshot.data();
+    uint64_t data_size = p_top ? top.size() : snapshot.size();
+    if(offset>=data_size)
+        return 0;
+
+    size = std::min(static_cast<uint64_t>(size), data_size - offset);
+    memcpy(buf, data + offset, size);
+    return size;
+}
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+
+// Read and write heat of each region of the volume. Worker threads count
+// operations per region in their own arrays (one writer, no atomic
+// read-modify-write). The counts are merged into exponentially decayed
+// heat values when a snapshot is taken. Operations counted since the
+// previous snapshot are added without decay.
+class HeatMap
+{
+public:
+    HeatMap(uint64_t volume_size, uint64_t region_size, unsigned int half_life_s,
+        size_t n_threads, size_t top_n);
+
+    // Counts an operation on [offset, offset+len) in each region it touches
+    void add(size_t thread_idx, bool write, uint64_t offset, uint64_t len)
+    {
+        if(offset>=volume_size)
+            return;
+
+        uint64_t first = offset / region_size;
+        uint64_t last = len>0 ? std::min(n_regions - 1, (offset + len - 1) / region_size) : first;
+        std::atomic<uint32_t>* counts = write ? threads[thread_idx].writes.get() : threads[thread_idx].reads.get();
+        for(uint64_t r=first;r<=last;++r)
+        {
+            counts[r].store(counts[r].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+    }
+
+    // Size of the binary snapshot: A header (see HeatMapHeader in heat_map.cpp)
+    // followed by the read and write heat of each region as two floats
+    uint64_t get_snapshot_size() const;
+
+    // Reads the binary snapshot or the top-N summary. A new snapshot is
+    // taken for reads at offset 0
+    size_t read_snapshot(bool top, uint64_t offset, char* buf, size_t size, int64_t now_us);
+
+private:
+    struct ThreadCounts
+    {
+        std::unique_ptr<std::atomic<uint32_t>[]> reads;
+        std::unique_ptr<std::atomic<uint32_t>[]> writes;
+    };
+
+    void merge(int64_t now_us);
+    void build_snapshot();
+    void build_top();
+
+    uint64_t volume_size;
+    uint64_t region_size;
+    uint64_t n_regions;
+    unsigned int half_life_s;
+    size_t top_n;
+    std::vector<ThreadCounts> threads;
+
+    std::mutex mutex;
+    // Sum of the thread counts at the last merge (modulo 2^32)
+    std::vector<uint32_t> last_reads;
+    std::vector<uint32_t> last_writes;
+    std::vector<float> read_heat;
+    std::vector<float> write_heat;
+    int64_t last_merge_us;
+    std::vector<char> snapshot;
+    std::string top;
+};
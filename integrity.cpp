@@ -0,0 +1,1097 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "integrity.h"
+#include "io_util.h"
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    const char integrity_magic[8] = {'F', 'U', 'S', 'C', 'R', 'C', '0', '1'};
+    const uint32_t integrity_version = 1;
+    const uint64_t page_size = 4096;
+    // One page of checksums per region
+    const uint64_t sums_per_region = page_size / sizeof(uint32_t);
+    const uint64_t regions_per_bitmap_page = page_size*8;
+    // Reads that raced with a write to the same block are retried this often
+    const unsigned int max_read_retries = 100;
+    const unsigned int sync_interval_ms = 10000;
+    // Pause between full scrubber passes
+    const unsigned int scrub_pass_interval_ms = 24*3600*1000;
+    const uint64_t scrub_batch_size = 1024*1024;
+    // Size of the checksum reads when loading the side file
+    const uint64_t sums_read_size = 4*1024*1024;
+
+    struct IntegrityHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t block_size;
+        uint64_t volume_size;
+        uint64_t n_blocks;
+        uint64_t n_regions;
+        uint64_t checksum;
+    };
+
+    // CRC32C with the reflected polynomial. The functions below work on the
+    // CRC state, crc32c() inverts it before and after
+    const uint32_t crc32c_poly = 0x82F63B78;
+
+    struct Crc32cTable
+    {
+        Crc32cTable()
+        {
+            for(uint32_t i=0;i<256;++i)
+            {
+                uint32_t crc = i;
+                for(int j=0;j<8;++j)
+                    crc = (crc & 1) ? (crc >> 1) ^ crc32c_poly : crc >> 1;
+                table[i] = crc;
+            }
+        }
+
+        uint32_t table[256];
+    };
+
+    uint32_t crc32c_sw(uint32_t crc, const unsigned char* data, size_t len)
+    {
+        static const Crc32cTable table;
+        for(size_t i=0;i<len;++i)
+        {
+            crc = table.table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+#if defined(__x86_64__)
+    // The crc32 instruction has a latency of three cycles, so three streams
+    // are processed at once and combined with a carry-less multiplication
+    const size_t crc_stream_long = 8192;
+    const size_t crc_stream_short = 256;
+
+    // x^n mod P
+    uint32_t crc32c_xpow(uint64_t n)
+    {
+        uint32_t v = 0x80000000;
+        for(uint64_t i=0;i<n;++i)
+        {
+            v = (v & 1) ? (v >> 1) ^ crc32c_poly : v >> 1;
+        }
+        return v;
+    }
+
+    // State after appending len zero bytes, with k=x^(8*len-33) mod P: The product
+    // of the reflected values is one bit short, the crc32 of it multiplies with x^32
+    __attribute__((target("sse4.2,pclmul"))) uint32_t crc32c_shift(uint32_t crc, uint32_t k)
+    {
+        __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(static_cast<int>(crc)),
+                            _mm_cvtsi32_si128(static_cast<int>(k)), 0);
+        return static_cast<uint32_t>(_mm_crc32_u64(0, static_cast<uint64_t>(_mm_cvtsi128_si64(prod))));
+    }
+
+    __attribute__((target("sse4.2,pclmul"))) uint32_t crc32c_streams(uint32_t crc,
+        const unsigned char*& data, size_t& len, size_t stream_len, uint32_t k)
+    {
+        while(len>=3*stream_len)
+        {
+            uint64_t crc0 = crc;
+            uint64_t crc1 = 0;
+            uint64_t crc2 = 0;
+            const unsigned char* end = data + stream_len;
+            do
+            {
+                uint64_t d0, d1, d2;
+                memcpy(&d0, data, sizeof(d0));
+                memcpy(&d1, data + stream_len, sizeof(d1));
+                memcpy(&d2, data + 2*stream_len, sizeof(d2));
+                crc0 = _mm_crc32_u64(crc0, d0);
+                crc1 = _mm_crc32_u64(crc1, d1);
+                crc2 = _mm_crc32_u64(crc2, d2);
+                data+=sizeof(uint64_t);
+            } while(data<end);
+
+            crc = crc32c_shift(static_cast<uint32_t>(crc0), k) ^ static_cast<uint32_t>(crc1);
+            crc = crc32c_shift(crc, k) ^ static_cast<uint32_t>(crc2);
+            data+=2*stream_len;
+            len-=3*stream_len;
+        }
+        return crc;
+    }
+
+    __attribute__((target("sse4.2,pclmul"))) uint32_t crc32c_hw(uint32_t crc, const unsigned char* data, size_t len)
+    {
+        static const uint32_t long_k = crc32c_xpow(crc_stream_long*8 - 33);
+        static const uint32_t short_k = crc32c_xpow(crc_stream_short*8 - 33);
+
+        while(len>0 &&
+            (reinterpret_cast<uintptr_t>(data) & 7)!=0)
+        {
+            crc = _mm_crc32_u8(crc, *data);
+            ++data;
+            --len;
+        }
+
+        crc = crc32c_streams(crc, data, len, crc_stream_long, long_k);
+        crc = crc32c_streams(crc, data, len, crc_stream_short, short_k);
+
+        uint64_t crc64 = crc;
+        while(len>=sizeof(uint64_t))
+        {
+            uint64_t d;
+            memcpy(&d, data, sizeof(d));
+            crc64 = _mm_crc32_u64(crc64, d);
+            data+=sizeof(uint64_t);
+            len-=sizeof(uint64_t);
+        }
+        crc = static_cast<uint32_t>(crc64);
+
+        while(len>0)
+        {
+            crc = _mm_crc32_u8(crc, *data);
+            ++data;
+            --len;
+        }
+        return crc;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const char* data, size_t len)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+#if defined(__x86_64__)
+    static const bool have_hw = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+    if(have_hw)
+        return ~crc32c_hw(~crc, p, len);
+#endif
+    return ~crc32c_sw(~crc, p, len);
+}
+
+Integrity::Integrity(const std::string& path, uint64_t volume_size, uint32_t block_size,
+    uint64_t scrub_rate)
+    : path(path), fd(-1), backing_fd(-1), volume_size(volume_size), block_size(block_size),
+        n_blocks((volume_size + block_size - 1) / block_size),
+        n_regions((n_blocks + sums_per_region - 1) / sums_per_region),
+        bitmap_offset(page_size),
+        sums_offset(page_size + round_up(n_regions, regions_per_bitmap_page)/8),
+        scrub_rate(scrub_rate), verified_blocks(0), mismatches(0), read_retries(0),
+        unverified_regions(n_regions), bitmap_writes(0), lock_waits(0), scrubbed_bytes(0), scrub_errors(0),
+        scrub_passes(0)
+{
+}
+
+Integrity::~Integrity()
+{
+    if(fd==-1)
+        return;
+
+    // Like sync(), without the ring
+    std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(page_size), &free);
+    bool ok = buf && fdatasync(backing_fd)==0;
+
+    std::set<uint64_t> pages;
+    for(uint64_t region=0;ok && region<n_regions;++region)
+    {
+        Region& reg = regions[region];
+        if(reg.disk_valid || !reg.trusted)
+            continue;
+
+        if(reg.dirty)
+        {
+            memcpy(buf.get(), &sums[region*sums_per_region], page_size);
+            if(!pwrite_full(fd, buf.get(), page_size, sums_offset + region*page_size))
+            {
+                ok = false;
+                break;
+            }
+            reg.dirty = false;
+        }
+
+        reg.disk_valid = true;
+        pages.insert(region / regions_per_bitmap_page);
+    }
+
+    ok = ok && fdatasync(fd)==0;
+
+    for(uint64_t page: pages)
+    {
+        if(!ok)
+            break;
+
+        memset(buf.get(), 0, page_size);
+        uint64_t first = page*regions_per_bitmap_page;
+        for(uint64_t region=first;region<std::min(n_regions, first + regions_per_bitmap_page);++region)
+        {
+            if(regions[region].disk_valid)
+                buf.get()[(region - first)/8] |= 1 << ((region - first) % 8);
+        }
+
+        ok = pwrite_full(fd, buf.get(), page_size, bitmap_offset + page*page_size);
+    }
+
+    if(!ok || fdatasync(fd)!=0)
+        perror("Error syncing integrity checksums");
+
+    close(fd);
+}
+
+bool Integrity::init(int p_backing_fd, bool direct_io)
+{
+    backing_fd = p_backing_fd;
+    uint64_t file_size = sums_offset + n_regions*page_size;
+
+    fd = ::open(path.c_str(), O_RDWR|O_CREAT|O_CLOEXEC|(direct_io ? O_DIRECT : 0), S_IRUSR|S_IWUSR);
+    if(fd==-1)
+    {
+        perror(("Error opening integrity side file "+path).c_str());
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st)!=0)
+    {
+        perror("Error getting integrity side file size");
+        return false;
+    }
+
+    sums.resize(n_regions*sums_per_region);
+    regions.resize(n_regions, Region{false, false, false, false, 0, 0, 0});
+    uint64_t n_bitmap_pages = (n_regions + regions_per_bitmap_page - 1) / regions_per_bitmap_page;
+    bitmap_gen.resize(n_bitmap_pages);
+    bitmap_disk_gen.resize(n_bitmap_pages);
+    bitmap_flushing.resize(n_bitmap_pages);
+
+    std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(sums_read_size), &free);
+    if(!buf)
+    {
+        std::cerr << "Error allocating integrity buffer" << std::endl;
+        return false;
+    }
+
+    if(st.st_size==0)
+    {
+        IntegrityHeader header = {};
+        memcpy(header.magic, integrity_magic, sizeof(integrity_magic));
+        header.version = integrity_version;
+        header.block_size = block_size;
+        header.volume_size = volume_size;
+        header.n_blocks = n_blocks;
+        header.n_regions = n_regions;
+        header.checksum = hash_header(reinterpret_cast<const char*>(&header), offsetof(IntegrityHeader, checksum));
+
+        memset(buf.get(), 0, page_size);
+        memcpy(buf.get(), &header, sizeof(header));
+
+        if(ftruncate(fd, file_size)!=0 ||
+            !pwrite_full(fd, buf.get(), page_size, 0) ||
+            fdatasync(fd)!=0)
+        {
+            perror("Error creating integrity side file");
+            return false;
+        }
+
+        std::cout << "Created integrity side file \"" << path << "\"" << std::endl;
+        return true;
+    }
+
+    if(!pread_full(fd, buf.get(), page_size, 0))
+    {
+        perror("Error reading integrity side file header");
+        return false;
+    }
+
+    IntegrityHeader header;
+    memcpy(&header, buf.get(), sizeof(header));
+    if(memcmp(header.magic, integrity_magic, sizeof(integrity_magic))!=0 ||
+        header.version!=integrity_version ||
+        header.checksum!=hash_header(buf.get(), offsetof(IntegrityHeader, checksum)) ||
+        static_cast<uint64_t>(st.st_size)<file_size)
+    {
+        std::cerr << "\"" << path << "\" is not an integrity side file" << std::endl;
+        return false;
+    }
+
+    if(header.block_size!=block_size ||
+        header.volume_size!=volume_size ||
+        header.n_blocks!=n_blocks ||
+        header.n_regions!=n_regions)
+    {
+        std::cerr << "Integrity side file \"" << path << "\" has block size " << header.block_size
+            << " and volume size " << header.volume_size << ", not " << block_size
+            << " and " << volume_size << std::endl;
+        return false;
+    }
+
+    uint64_t n_valid = 0;
+    for(uint64_t page=0;page<n_bitmap_pages;++page)
+    {
+        if(!pread_full(fd, buf.get(), page_size, bitmap_offset + page*page_size))
+        {
+            perror("Error reading integrity bitmap");
+            return false;
+        }
+
+        uint64_t first = page*regions_per_bitmap_page;
+        for(uint64_t region=first;region<std::min(n_regions, first + regions_per_bitmap_page);++region)
+        {
+            if(buf.get()[(region - first)/8] & (1 << ((region - first) % 8)))
+            {
+                regions[region].trusted = true;
+                regions[region].disk_valid = true;
+                --unverified_regions;
+                ++n_valid;
+            }
+        }
+    }
+
+    uint64_t sums_size = n_regions*page_size;
+    for(uint64_t off=0;off<sums_size;off+=sums_read_size)
+    {
+        uint64_t len = std::min(sums_read_size, sums_size - off);
+        if(!pread_full(fd, buf.get(), len, sums_offset + off))
+        {
+            perror("Error reading integrity checksums");
+            return false;
+        }
+
+        memcpy(reinterpret_cast<char*>(sums.data()) + off, buf.get(), len);
+    }
+
+    std::cout << "Loaded integrity side file \"" << path << "\" with valid checksums for "
+        << n_valid << " of " << n_regions << " regions" << std::endl;
+    return true;
+}
+
+std::string Integrity::describe() const
+{
+    std::ostringstream ret;
+    ret << "\"" << path << "\": " << n_blocks << " blocks of " << block_size/1024
+        << " KB in " << n_regions << " regions of " << sums_per_region*block_size/(1024*1024) << " MB, ";
+    if(scrub_rate>0)
+        ret << "scrubbing at " << scrub_rate/(1024*1024) << " MB/s";
+    else
+        ret << "no scrubbing";
+    return ret.str();
+}
+
+bool Integrity::any_locked(uint64_t first, uint64_t last) const
+{
+    for(uint64_t block=first;block<=last;++block)
+    {
+        if(locked.find(block)!=locked.end())
+            return true;
+    }
+    return false;
+}
+
+fuse_io_context::io_uring_task<int> Integrity::lock_blocks(fuse_io_context& io,
+    uint64_t first, uint64_t last)
+{
+    std::unique_lock lock(mutex);
+    while(any_locked(first, last))
+    {
+        ++lock_waits;
+        co_await waiters.wait(io, lock);
+    }
+
+    for(uint64_t block=first;block<=last;++block)
+        locked.insert(block);
+    co_return 0;
+}
+
+void Integrity::unlock_blocks(uint64_t first, uint64_t last)
+{
+    std::scoped_lock lock(mutex);
+    for(uint64_t block=first;block<=last;++block)
+    {
+        locked.erase(block);
+    }
+    waiters.notify_all();
+}
+
+fuse_io_context::io_uring_task<int> Integrity::write_bitmap_page(fuse_io_context& io, uint64_t page)
+{
+    uint64_t want;
+    {
+        std::scoped_lock lock(mutex);
+        want = bitmap_gen[page];
+    }
+
+    while(true)
+    {
+        {
+            std::unique_lock lock(mutex);
+            while(bitmap_disk_gen[page]<want && bitmap_flushing[page])
+                co_await waiters.wait(io, lock);
+
+            if(bitmap_disk_gen[page]>=want)
+                co_return 0;
+        }
+
+        // Retries if another write of the page started in the meantime
+        uint64_t write_gen = 0;
+        int rc = co_await flush_meta_page(io, mutex, waiters, bitmap_flushing, page,
+            io.fuse_ring.files.integrity_sums, bitmap_offset + page*page_size, page_size,
+            [this, page, &write_gen](char* buf) {
+                write_gen = bitmap_gen[page];
+                uint64_t first = page*regions_per_bitmap_page;
+                for(uint64_t region=first;region<std::min(n_regions, first + regions_per_bitmap_page);++region)
+                {
+                    if(regions[region].disk_valid)
+                        buf[(region - first)/8] |= 1 << ((region - first) % 8);
+                }
+            },
+            [this, page, &write_gen](int rc, const char*) {
+                ++bitmap_writes;
+                if(rc==0)
+                    bitmap_disk_gen[page] = std::max(bitmap_disk_gen[page], write_gen);
+            });
+        if(rc<0)
+            co_return rc;
+    }
+}
+
+fuse_io_context::io_uring_task<int> Integrity::flush_region(fuse_io_context& io, uint64_t region,
+    bool& flushed)
+{
+    flushed = false;
+
+    std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(page_size), &free);
+    if(!buf)
+        co_return -ENOMEM;
+
+    {
+        std::scoped_lock lock(mutex);
+        Region& reg = regions[region];
+        if(reg.flushing)
+            co_return 1;
+
+        if(!reg.dirty)
+            co_return 0;
+
+        reg.flushing = true;
+        reg.dirty = false;
+        memcpy(buf.get(), &sums[region*sums_per_region], page_size);
+    }
+
+    int rc = -EIO;
+    io_uring_sqe* sqe = co_await io.get_backing_sqe();
+    if(sqe!=nullptr)
+    {
+        io_uring_prep_write(sqe, io.fuse_ring.files.integrity_sums, buf.get(), page_size,
+            sums_offset + region*page_size);
+        sqe->flags |= IOSQE_FIXED_FILE;
+
+        rc = co_await io.complete(sqe);
+        if(rc>=0 && static_cast<uint64_t>(rc)!=page_size)
+            rc = -EIO;
+    }
+
+    std::scoped_lock lock(mutex);
+    regions[region].flushing = false;
+    waiters.notify_all();
+    if(rc<0)
+    {
+        regions[region].dirty = true;
+        co_return rc;
+    }
+
+    flushed = true;
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> Integrity::read_blocks(fuse_io_context& io, char* buf,
+    int buf_idx, uint64_t first, uint64_t last)
+{
+    uint64_t offset = first*block_size;
+    uint64_t len = block_end(last) - offset;
+    uint64_t done = 0;
+    while(done<len)
+    {
+        io_uring_sqe* sqe = co_await io.get_backing_sqe();
+        if(sqe==nullptr)
+            co_return -EIO;
+
+        // Whole pages for O_DIRECT. Buffers are whole pages
+        uint64_t read_len = round_up(len - done, page_size);
+        if(buf_idx>=0)
+            io_uring_prep_read_fixed(sqe, io.fuse_ring.backing_fd, buf + done, read_len, offset + done, buf_idx);
+        else
+            io_uring_prep_read(sqe, io.fuse_ring.backing_fd, buf + done, read_len, offset + done);
+        sqe->flags |= IOSQE_FIXED_FILE;
+
+        int rc = co_await io.complete(sqe);
+        if(rc<0)
+            co_return rc;
+
+        // The volume is the backing file, so it does not end early
+        if(rc==0)
+            co_return -EIO;
+
+        done+=rc;
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> Integrity::read(fuse_io_context& io,
+    char* buf, int buf_idx, uint64_t offset, uint64_t len)
+{
+    const uint64_t first = offset / block_size;
+    const uint64_t last = (offset + len - 1) / block_size;
+    const size_t n = last - first + 1;
+
+    // Blocks are only checked completely. Reads of parts of blocks go
+    // to a temporary buffer
+    bool aligned = offset==first*block_size && offset + len==block_end(last);
+    std::unique_ptr<char, decltype(&free)> tmp(nullptr, &free);
+    if(!aligned)
+    {
+        tmp.reset(alloc_aligned(round_up(n*block_size, page_size)));
+        if(!tmp)
+            co_return -ENOMEM;
+    }
+    char* read_buf = aligned ? buf : tmp.get();
+
+    std::vector<uint32_t> expected(n);
+    std::vector<bool> check(n);
+    for(unsigned int attempt=0;;++attempt)
+    {
+        {
+            std::scoped_lock lock(mutex);
+            for(size_t i=0;i<n;++i)
+            {
+                check[i] = regions[(first + i) / sums_per_region].trusted;
+                expected[i] = sums[first + i];
+            }
+        }
+
+        int rc = co_await read_blocks(io, read_buf, aligned ? buf_idx : -1, first, last);
+        if(rc<0)
+            co_return rc;
+
+        bool retry = false;
+        for(size_t i=0;i<n;++i)
+        {
+            if(!check[i])
+                continue;
+
+            uint64_t block = first + i;
+            uint32_t crc = crc32c(0, read_buf + i*block_size, block_end(block) - block*block_size);
+            if(crc==expected[i])
+            {
+                ++verified_blocks;
+                continue;
+            }
+
+            // A write to the block may have changed the data but not the
+            // checksum yet, or the other way around
+            std::scoped_lock lock(mutex);
+            if(locked.find(block)!=locked.end() ||
+                sums[block]!=expected[i] ||
+                !regions[block / sums_per_region].trusted)
+            {
+                retry = true;
+                continue;
+            }
+
+            ++mismatches;
+            std::cerr << "Checksum mismatch in block " << block << " at offset " << block*block_size
+                << " len " << block_end(block) - block*block_size << ": expected " << std::hex
+                << expected[i] << " got " << crc << std::dec << std::endl;
+            rc = -EIO;
+        }
+
+        if(rc<0)
+            co_return rc;
+
+        if(!retry)
+            break;
+
+        ++read_retries;
+        if(attempt>=max_read_retries)
+        {
+            std::cerr << "Blocks " << first << " to " << last << " kept changing while being read" << std::endl;
+            co_return -EIO;
+        }
+
+        // Until the writes that changed the blocks finished
+        std::unique_lock lock(mutex);
+        while(any_locked(first, last))
+            co_await waiters.wait(io, lock);
+    }
+
+    if(!aligned)
+        memcpy(buf, tmp.get() + (offset - first*block_size), len);
+
+    co_return static_cast<int>(len);
+}
+
+fuse_io_context::io_uring_task<int> Integrity::write(fuse_io_context& io,
+    const char* buf, int buf_idx, uint64_t offset, uint64_t len)
+{
+    const uint64_t first = offset / block_size;
+    const uint64_t last = (offset + len - 1) / block_size;
+    const size_t n = last - first + 1;
+    const uint64_t first_region = first / sums_per_region;
+    const uint64_t last_region = last / sums_per_region;
+
+    if(co_await lock_blocks(io, first, last)!=0)
+        co_return -EIO;
+
+    // The bits of the regions have to be cleared in the file before the
+    // data changes
+    std::vector<uint64_t> bitmap_pages;
+    {
+        std::scoped_lock lock(mutex);
+        for(uint64_t region=first_region;region<=last_region;++region)
+        {
+            Region& reg = regions[region];
+            ++reg.writers;
+            ++reg.gen;
+            uint64_t page = region / regions_per_bitmap_page;
+            if(reg.disk_valid)
+            {
+                reg.disk_valid = false;
+                ++bitmap_gen[page];
+            }
+            unsynced.insert(region);
+
+            if(bitmap_pages.empty() || bitmap_pages.back()!=page)
+                bitmap_pages.push_back(page);
+        }
+    }
+
+    int rc = 0;
+    for(uint64_t page: bitmap_pages)
+    {
+        rc = co_await write_bitmap_page(io, page);
+        if(rc<0)
+            break;
+    }
+
+    // Checksums of the blocks after the write. Blocks the write does not
+    // cover completely are read (and checked) first
+    std::vector<uint32_t> new_sums(n);
+    std::unique_ptr<char, decltype(&free)> tmp(nullptr, &free);
+    for(size_t i=0;rc>=0 && i<n;++i)
+    {
+        uint64_t block = first + i;
+        uint64_t block_start = block*block_size;
+        uint64_t block_len = block_end(block) - block_start;
+        if(offset<=block_start &&
+            offset + len>=block_start + block_len)
+        {
+            new_sums[i] = crc32c(0, buf + (block_start - offset), block_len);
+            continue;
+        }
+
+        if(!tmp)
+        {
+            tmp.reset(alloc_aligned(round_up(static_cast<uint64_t>(block_size), page_size)));
+            if(!tmp)
+            {
+                rc = -ENOMEM;
+                break;
+            }
+        }
+
+        rc = co_await read_blocks(io, tmp.get(), -1, block, block);
+        if(rc<0)
+            break;
+
+        {
+            std::scoped_lock lock(mutex);
+            uint32_t crc = crc32c(0, tmp.get(), block_len);
+            if(regions[block / sums_per_region].trusted &&
+                crc!=sums[block])
+            {
+                ++mismatches;
+                std::cerr << "Checksum mismatch in block " << block << " at offset " << block_start
+                    << " len " << block_len << " before partial write: expected " << std::hex
+                    << sums[block] << " got " << crc << std::dec << std::endl;
+                rc = -EIO;
+                break;
+            }
+        }
+
+        uint64_t write_start = std::max(offset, block_start);
+        uint64_t write_end = std::min(offset + len, block_start + block_len);
+        memcpy(tmp.get() + (write_start - block_start), buf + (write_start - offset), write_end - write_start);
+        new_sums[i] = crc32c(0, tmp.get(), block_len);
+    }
+
+    bool written = false;
+    if(rc>=0)
+    {
+        io_uring_sqe* sqe = co_await io.get_backing_sqe();
+        if(sqe==nullptr)
+        {
+            rc = -EIO;
+        }
+        else
+        {
+            if(buf_idx>=0)
+                io_uring_prep_write_fixed(sqe, io.fuse_ring.backing_fd, buf, len, offset, buf_idx);
+            else
+                io_uring_prep_write(sqe, io.fuse_ring.backing_fd, buf, len, offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            rc = block_io_piece_res(co_await io.complete(sqe), len);
+            written = true;
+        }
+    }
+
+    {
+        std::scoped_lock lock(mutex);
+        bool ok = rc>=0;
+        if(ok)
+        {
+            for(size_t i=0;i<n;++i)
+                sums[first + i] = new_sums[i];
+        }
+
+        for(uint64_t region=first_region;region<=last_region;++region)
+        {
+            Region& reg = regions[region];
+            --reg.writers;
+            if(ok)
+            {
+                reg.dirty = true;
+            }
+            else if(written)
+            {
+                // Unknown what is in the backing file now. The scrubber
+                // computes the checksums again
+                if(reg.trusted)
+                    ++unverified_regions;
+                reg.trusted = false;
+                ++reg.failures;
+            }
+        }
+    }
+
+    unlock_blocks(first, last);
+
+    co_return rc;
+}
+
+fuse_io_context::io_uring_task<int> Integrity::sync(fuse_io_context& io, bool datasync)
+{
+    // Regions whose bit can be set if they are not written to until the sync
+    // finished
+    std::vector<std::pair<uint64_t, uint64_t> > candidates;
+    std::vector<uint64_t> dirty;
+    {
+        std::scoped_lock lock(mutex);
+        for(uint64_t region: unsynced)
+        {
+            const Region& reg = regions[region];
+            if(!reg.trusted)
+                continue;
+
+            if(reg.dirty || reg.flushing)
+                dirty.push_back(region);
+
+            if(reg.writers==0)
+                candidates.push_back(std::make_pair(region, reg.gen));
+        }
+    }
+
+    for(uint64_t region: dirty)
+    {
+        while(true)
+        {
+            bool flushed;
+            int rc = co_await flush_region(io, region, flushed);
+            if(rc<0)
+                co_return rc;
+
+            if(rc==0)
+                break;
+
+            // Flushed by another sync. Flush again once it finished, in case
+            // the region changed after it copied the checksums
+            std::unique_lock lock(mutex);
+            while(regions[region].flushing)
+                co_await waiters.wait(io, lock);
+        }
+    }
+
+    io_uring_sqe* sqe = co_await io.get_backing_sqe(2);
+    if(sqe==nullptr)
+        co_return -EIO;
+
+    std::vector<io_uring_sqe*> sqes;
+    for(int i=0;i<2;++i)
+    {
+        if(i>0)
+            sqe = io.get_reserved_backing_sqe();
+
+        io_uring_prep_fsync(sqe, i==0 ? io.fuse_ring.backing_fd : io.fuse_ring.files.integrity_sums,
+            (datasync || i>0) ? IORING_FSYNC_DATASYNC : 0);
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqes.push_back(sqe);
+    }
+
+    std::vector<int> rcs = co_await io.complete(sqes);
+    for(int rc: rcs)
+    {
+        if(rc<0)
+            co_return rc;
+    }
+
+    std::vector<uint64_t> bitmap_pages;
+    {
+        std::scoped_lock lock(mutex);
+        for(const std::pair<uint64_t, uint64_t>& candidate: candidates)
+        {
+            Region& reg = regions[candidate.first];
+            if(reg.gen!=candidate.second ||
+                reg.writers>0 ||
+                !reg.trusted ||
+                reg.dirty ||
+                reg.flushing ||
+                reg.disk_valid)
+                continue;
+
+            reg.disk_valid = true;
+            unsynced.erase(candidate.first);
+            uint64_t page = candidate.first / regions_per_bitmap_page;
+            ++bitmap_gen[page];
+            if(std::find(bitmap_pages.begin(), bitmap_pages.end(), page)==bitmap_pages.end())
+                bitmap_pages.push_back(page);
+        }
+    }
+
+    for(uint64_t page: bitmap_pages)
+    {
+        int rc = co_await write_bitmap_page(io, page);
+        if(rc<0)
+            co_return rc;
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task_discard<int> Integrity::sync_loop(fuse_io_context& io)
+{
+    while(true)
+    {
+        if(co_await sleep_ms(io, sync_interval_ms)!=0)
+            co_return -1;
+
+        bool empty;
+        {
+            std::scoped_lock lock(mutex);
+            empty = unsynced.empty();
+        }
+
+        if(empty)
+            continue;
+
+        int rc = co_await sync(io, true);
+        if(rc<0)
+        {
+            static bool erronce=true;
+            if(erronce)
+            {
+                std::cerr << "Syncing integrity checksums failed rc=" << rc << std::endl;
+                erronce=false;
+            }
+        }
+    }
+}
+
+fuse_io_context::io_uring_task_discard<int> Integrity::scrub(fuse_io_context& io)
+{
+    if(scrub_rate==0)
+        co_return 0;
+
+    const uint64_t batch_blocks = std::max(static_cast<uint64_t>(1), scrub_batch_size / block_size);
+    std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(round_up(batch_blocks*block_size, page_size)), &free);
+    if(!buf)
+    {
+        std::cerr << "Error allocating scrub buffer" << std::endl;
+        co_return -1;
+    }
+
+    std::vector<uint32_t> crcs(batch_blocks);
+    while(true)
+    {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t pass_bytes = 0;
+
+        for(uint64_t region=0;region<n_regions;++region)
+        {
+            bool was_trusted;
+            uint64_t failures;
+            {
+                std::scoped_lock lock(mutex);
+                was_trusted = regions[region].trusted;
+                failures = regions[region].failures;
+            }
+
+            const uint64_t region_first = region*sums_per_region;
+            const uint64_t region_last = std::min(n_blocks, region_first + sums_per_region) - 1;
+            int rc = 0;
+            for(uint64_t first=region_first;first<=region_last;first+=batch_blocks)
+            {
+                uint64_t last = std::min(region_last, first + batch_blocks - 1);
+                if(co_await lock_blocks(io, first, last)!=0)
+                    co_return -1;
+
+                rc = co_await read_blocks(io, buf.get(), -1, first, last);
+                if(rc<0)
+                {
+                    unlock_blocks(first, last);
+                    std::cerr << "Scrubbing blocks " << first << " to " << last << " failed rc=" << rc << std::endl;
+                    ++scrub_errors;
+                    break;
+                }
+
+                for(uint64_t block=first;block<=last;++block)
+                {
+                    crcs[block - first] = crc32c(0, buf.get() + (block - first)*block_size,
+                                            block_end(block) - block*block_size);
+                }
+
+                {
+                    std::scoped_lock lock(mutex);
+                    bool trusted = regions[region].trusted;
+                    for(uint64_t block=first;block<=last;++block)
+                    {
+                        uint32_t crc = crcs[block - first];
+                        if(!trusted)
+                        {
+                            sums[block] = crc;
+                        }
+                        else if(crc!=sums[block])
+                        {
+                            ++scrub_errors;
+                            std::cerr << "Scrubber found checksum mismatch in block " << block << " at offset "
+                                << block*block_size << ": expected " << std::hex << sums[block]
+                                << " got " << crc << std::dec << std::endl;
+                        }
+                    }
+                }
+
+                unlock_blocks(first, last);
+
+                uint64_t bytes = block_end(last) - first*block_size;
+                scrubbed_bytes+=bytes;
+                pass_bytes+=bytes;
+
+                // Throttled to scrub_rate over the pass
+                uint64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                        std::chrono::steady_clock::now() - start).count();
+                uint64_t target_ms = pass_bytes*1000 / scrub_rate;
+                if(target_ms>elapsed_ms &&
+                    co_await sleep_ms(io, static_cast<unsigned int>(target_ms - elapsed_ms))!=0)
+                    co_return -1;
+            }
+
+            if(!was_trusted && rc>=0)
+            {
+                std::scoped_lock lock(mutex);
+                Region& reg = regions[region];
+                if(!reg.trusted &&
+                    reg.failures==failures)
+                {
+                    reg.trusted = true;
+                    --unverified_regions;
+                    reg.dirty = true;
+                    unsynced.insert(region);
+                }
+            }
+        }
+
+        ++scrub_passes;
+
+        if(co_await sleep_ms(io, scrub_pass_interval_ms)!=0)
+            co_return -1;
+    }
+}
+
+Integrity::Stats Integrity::get_stats() const
+{
+    Stats ret;
+    ret.verified_blocks = verified_blocks.load(std::memory_order_relaxed);
+    ret.mismatches = mismatches.load(std::memory_order_relaxed);
+    ret.read_retries = read_retries.load(std::memory_order_relaxed);
+    ret.unverified_regions = unverified_regions.load(std::memory_order_relaxed);
+    ret.bitmap_writes = bitmap_writes.load(std::memory_order_relaxed);
+    ret.lock_waits = lock_waits.load(std::memory_order_relaxed);
+    ret.scrubbed_bytes = scrubbed_bytes.load(std::memory_order_relaxed);
+    ret.scrub_errors = scrub_errors.load(std::memory_order_relaxed);
+    ret.scrub_passes = scrub_passes.load(std::memory_order_relaxed);
+    return ret;
+}
+
+fuse_io_context::io_uring_task<int> integrity_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios)
+{
+    Integrity* integrity = io.fuse_ring.integrity;
+    for(BlockIo& req: ios)
+    {
+        uint64_t len = block_io_len(req, io.fuse_ring.backing_f_size);
+        if(len==0)
+        {
+            req.res = write ? -ENOSPC : 0;
+            continue;
+        }
+
+        if(write)
+            req.res = co_await integrity->write(io, req.buf, req.buf_idx, req.offset, len);
+        else
+            req.res = co_await integrity->read(io, req.buf, req.buf_idx, req.offset, len);
+    }
+
+    co_return 0;
+}
+
+void IntegrityBackend::start(fuse_io_context& io)
+{
+    if(io.fuse_ring.thread_idx==0)
+    {
+        integrity->sync_loop(io);
+        integrity->scrub(io);
+    }
+}
+
+fuse_io_context::io_uring_task<int> IntegrityBackend::flush(fuse_io_context& io,
+    bool datasync)
+{
+    co_return co_await integrity->sync(io, datasync);
+}
+
+std::string IntegrityBackend::get_stats() const
+{
+    Integrity::Stats integrity_stats = integrity->get_stats();
+    std::ostringstream ret;
+    ret << "Integrity: verified blocks=" << integrity_stats.verified_blocks
+        << " mismatches=" << integrity_stats.mismatches
+        << " read retries=" << integrity_stats.read_retries
+        << " unverified regions=" << integrity_stats.unverified_regions
+        << " bitmap writes=" << integrity_stats.bitmap_writes
+        << " lock waits=" << integrity_stats.lock_waits
+        << " scrubbed MB=" << integrity_stats.scrubbed_bytes/(1024*1024)
+        << " scrub errors=" << integrity_stats.scrub_errors
+        << " scrub passes=" << integrity_stats.scrub_passes;
+    return ret.str();
+}
@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include "backend.h"
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <stdint.h>
+
+// CRC32C of every block of the volume in a side file (fixed file index
+// files.integrity_sums of the ring). Checksums are computed on write and checked on read; a
+// mismatch fails the read with EIO and is logged with its offset.
+//
+// The side file has a header page, a bitmap with one bit per region (the
+// blocks of one page of checksums) and the checksums. Checksums are kept
+// in memory and written back on fsync and every few seconds. A set bit
+// means the checksums of the region in the file match the backing file.
+// The bit is cleared (O_DSYNC) before the first write to the region and
+// set again once the data and the checksums are synced, so after a crash
+// only the checksums of regions that were written to are recomputed.
+// Regions without valid checksums (e.g. on a new side file) are not
+// checked until the scrubber computed them.
+//
+// The scrubber reads the whole volume at a limited rate, checks the
+// blocks and computes the checksums of regions that have none.
+class Integrity
+{
+public:
+    struct Stats
+    {
+        uint64_t verified_blocks;
+        uint64_t mismatches;
+        uint64_t read_retries;
+        uint64_t unverified_regions;
+        uint64_t bitmap_writes;
+        uint64_t lock_waits;
+        uint64_t scrubbed_bytes;
+        uint64_t scrub_errors;
+        uint64_t scrub_passes;
+    };
+
+    // scrub_rate in bytes per second, 0 disables the scrubber
+    Integrity(const std::string& path, uint64_t volume_size, uint32_t block_size,
+        uint64_t scrub_rate);
+    // Syncs the checksums and sets the bits of the regions
+    ~Integrity();
+
+    // Loads the side file or creates a new one. backing_fd is synced before
+    // the side file on shutdown
+    bool init(int backing_fd, bool direct_io);
+
+    int get_fd() const
+    {
+        return fd;
+    }
+
+    uint32_t get_block_size() const
+    {
+        return block_size;
+    }
+
+    std::string describe() const;
+
+    // Reads [offset, offset+len) into buf and checks the checksums. buf is a
+    // registered buffer if buf_idx>=0, in whole pages. Returns the number of
+    // bytes read or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> read(fuse_io_context& io,
+        char* buf, int buf_idx, uint64_t offset, uint64_t len);
+
+    // Writes [offset, offset+len) from buf to the backing file and updates the
+    // checksums. Returns the number of bytes written or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> write(fuse_io_context& io,
+        const char* buf, int buf_idx, uint64_t offset, uint64_t len);
+
+    // Syncs the backing file and the checksums, then sets the bits of the
+    // synced regions. Returns 0 or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> sync(fuse_io_context& io, bool datasync);
+
+    // Syncs every few seconds. Runs on one worker thread
+    fuse_io_context::io_uring_task_discard<int> sync_loop(fuse_io_context& io);
+
+    // Checks the whole volume at scrub_rate. Runs on one worker thread
+    fuse_io_context::io_uring_task_discard<int> scrub(fuse_io_context& io);
+
+    Stats get_stats() const;
+
+private:
+    struct Region
+    {
+        // Checksums in memory match the backing file
+        bool trusted;
+        // Bit in the file is set
+        bool disk_valid;
+        // Checksums changed since written to the file
+        bool dirty;
+        bool flushing;
+        uint32_t writers;
+        // Incremented with every write to the region
+        uint64_t gen;
+        // Incremented if a write failed
+        uint64_t failures;
+    };
+
+    // Whether one of the blocks is locked. Called with mutex held
+    bool any_locked(uint64_t first, uint64_t last) const;
+    [[nodiscard]] fuse_io_context::io_uring_task<int> lock_blocks(fuse_io_context& io,
+        uint64_t first, uint64_t last);
+    void unlock_blocks(uint64_t first, uint64_t last);
+    // Writes the bitmap page until the file has all changes made before the call
+    [[nodiscard]] fuse_io_context::io_uring_task<int> write_bitmap_page(fuse_io_context& io, uint64_t page);
+    // Returns 1 if the region is being flushed by someone else
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush_region(fuse_io_context& io, uint64_t region,
+        bool& flushed);
+    [[nodiscard]] fuse_io_context::io_uring_task<int> read_blocks(fuse_io_context& io, char* buf,
+        int buf_idx, uint64_t first, uint64_t last);
+
+    uint64_t block_end(uint64_t block) const
+    {
+        return std::min((block + 1)*block_size, volume_size);
+    }
+
+    std::string path;
+    int fd;
+    int backing_fd;
+    uint64_t volume_size;
+    uint32_t block_size;
+    uint64_t n_blocks;
+    uint64_t n_regions;
+    uint64_t bitmap_offset;
+    uint64_t sums_offset;
+    uint64_t scrub_rate;
+
+    // Checksums, regions and blocks being written or scrubbed
+    std::mutex mutex;
+    std::vector<uint32_t> sums;
+    std::vector<Region> regions;
+    std::unordered_set<uint64_t> locked;
+    // Regions whose bit is not set
+    std::unordered_set<uint64_t> unsynced;
+    // Bitmap pages: changes in memory and changes in the file
+    std::vector<uint64_t> bitmap_gen;
+    std::vector<uint64_t> bitmap_disk_gen;
+    std::vector<bool> bitmap_flushing;
+    // Waiting for locked blocks, region flushes and bitmap page writes
+    fuse_io_context::SharedWaitQueue waiters;
+
+    std::atomic<uint64_t> verified_blocks;
+    std::atomic<uint64_t> mismatches;
+    std::atomic<uint64_t> read_retries;
+    std::atomic<uint64_t> unverified_regions;
+    std::atomic<uint64_t> bitmap_writes;
+    std::atomic<uint64_t> lock_waits;
+    std::atomic<uint64_t> scrubbed_bytes;
+    std::atomic<uint64_t> scrub_errors;
+    std::atomic<uint64_t> scrub_passes;
+};
+
+// CRC32C (Castagnoli) of data, continuing from crc. Uses SSE4.2 and
+// PCLMUL if the CPU has them
+uint32_t crc32c(uint32_t crc, const char* data, size_t len);
+
+[[nodiscard]] fuse_io_context::io_uring_task<int> integrity_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios);
+
+// The checksummed volume as backend. Flushing syncs the side file and
+// marks the synced regions (Integrity::sync())
+class IntegrityBackend : public Backend
+{
+public:
+    IntegrityBackend(Integrity* integrity, uint64_t size)
+        : integrity(integrity), size(size) {}
+
+    std::string describe() const override
+    {
+        return integrity->describe();
+    }
+
+    uint64_t get_size() const override
+    {
+        return size;
+    }
+
+    // Periodic sync and scrub on the first worker thread
+    void start(fuse_io_context& io) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io,
+        bool write, std::vector<BlockIo>& ios) override
+    {
+        return integrity_io(io, write, ios);
+    }
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush(fuse_io_context& io,
+        bool datasync) override;
+
+    std::string get_stats() const override;
+
+private:
+    Integrity* integrity;
+    uint64_t size;
+};
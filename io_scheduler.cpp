@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "io_scheduler.h"
+#include <algorithm>
+
+namespace
+{
+    const int64_t sched_deadline_granularity_us = 1000;
+}
+
+IoScheduler::IoScheduler(size_t max_inflight, const std::vector<int64_t>& expire)
+    : max_inflight(std::max(static_cast<size_t>(1), max_inflight)), inflight(0),
+        n_queued(0), next_seq(0), resume_scheduled(false)
+{
+    for(size_t i=0;i<n_classes;++i)
+    {
+        expire_us[i] = i<expire.size() ? expire[i] : expire.back();
+        stats.dispatched[i] = 0;
+        stats.queued[i] = 0;
+        stats.wait_us[i] = 0;
+    }
+    stats.expired = 0;
+}
+
+bool IoScheduler::try_dispatch(IoClass io_class)
+{
+    if(n_queued>0 ||
+        inflight>=max_inflight)
+        return false;
+
+    ++inflight;
+    ++stats.dispatched[static_cast<size_t>(io_class)];
+    return true;
+}
+
+void IoScheduler::enqueue(Request* request)
+{
+    int64_t now = fuse_io_context::get_monotonic_us();
+    size_t idx = static_cast<size_t>(request->io_class);
+    int64_t deadline = now + expire_us[idx];
+    request->deadline = ((deadline + sched_deadline_granularity_us - 1) / sched_deadline_granularity_us)
+                            * sched_deadline_granularity_us;
+    request->queued_us = now;
+    request->seq = next_seq++;
+    queues[idx].insert(request);
+    ++n_queued;
+    ++stats.queued[idx];
+}
+
+IoScheduler::Request* IoScheduler::pick(int64_t now)
+{
+    Request* expired = nullptr;
+    for(size_t i=0;i<n_classes;++i)
+    {
+        if(queues[i].empty())
+            continue;
+
+        Request* head = *queues[i].begin();
+        if(head->deadline<=now &&
+            (expired==nullptr || head->deadline<expired->deadline))
+            expired = head;
+    }
+
+    if(expired!=nullptr)
+    {
+        ++stats.expired;
+        return expired;
+    }
+
+    // Classes are in priority order
+    for(size_t i=0;i<n_classes;++i)
+    {
+        if(!queues[i].empty())
+            return *queues[i].begin();
+    }
+
+    return nullptr;
+}
+
+void IoScheduler::release(fuse_io_context& io)
+{
+    --inflight;
+
+    if(n_queued==0)
+        return;
+
+    int64_t now = fuse_io_context::get_monotonic_us();
+    Request* request = pick(now);
+    size_t idx = static_cast<size_t>(request->io_class);
+    queues[idx].erase(request);
+    --n_queued;
+
+    ++inflight;
+    ++stats.dispatched[idx];
+    stats.wait_us[idx] += now - request->queued_us;
+    ready.push_back(request);
+
+    if(!resume_scheduled)
+    {
+        resume_scheduled = true;
+        resume_ready(io);
+    }
+}
+
+fuse_io_context::io_uring_task_discard<int> IoScheduler::resume_ready(fuse_io_context& io)
+{
+    // Not from the destructor of the previous request's slot
+    co_await io.batch_end();
+
+    std::vector<Request*> curr;
+    curr.swap(ready);
+    resume_scheduled = false;
+
+    for(Request* request: curr)
+    {
+        request->awaiter.resume();
+    }
+
+    co_return 0;
+}
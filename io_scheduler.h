@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include <set>
+#include <vector>
+#include <stdint.h>
+
+// Limits the number of backing file operations one worker thread has in
+// flight. Requests over the limit wait in one queue per class (reads,
+// synchronous writes, asynchronous writes). When an operation finishes,
+// the waiting request with the earliest expired deadline is dispatched.
+// If no deadline expired, reads go first, then synchronous and then
+// asynchronous writes. Deadlines are rounded up to sched_deadline_granularity_us,
+// so requests queued close together are dispatched in offset order.
+class IoScheduler
+{
+public:
+    enum class IoClass
+    {
+        Read = 0,
+        SyncWrite = 1,
+        AsyncWrite = 2
+    };
+
+    static constexpr size_t n_classes = 3;
+
+    struct Stats
+    {
+        uint64_t dispatched[n_classes];
+        uint64_t queued[n_classes];
+        uint64_t wait_us[n_classes];
+        uint64_t expired;
+    };
+
+    IoScheduler(size_t max_inflight, const std::vector<int64_t>& expire_us);
+
+    // Permission to have one backing operation in flight. Released on destruction
+    class Slot
+    {
+    public:
+        Slot(IoScheduler* scheduler, fuse_io_context& io) noexcept
+            : scheduler(scheduler), io(io) {}
+
+        Slot(Slot&& other) noexcept
+            : scheduler(std::exchange(other.scheduler, nullptr)), io(other.io) {}
+
+        Slot(Slot const&) = delete;
+        Slot& operator=(Slot&&) = delete;
+        Slot& operator=(Slot const&) = delete;
+
+        ~Slot()
+        {
+            if(scheduler!=nullptr)
+                scheduler->release(io);
+        }
+
+    private:
+        IoScheduler* scheduler;
+        fuse_io_context& io;
+    };
+
+    struct Request
+    {
+        int64_t deadline;
+        uint64_t offset;
+        uint64_t seq;
+        int64_t queued_us;
+        IoClass io_class;
+        std::coroutine_handle<> awaiter;
+    };
+
+    // Waits until a backing operation of io_class at offset may be submitted.
+    // Without a scheduler it does not wait
+    struct AdmitAwaiter
+    {
+        AdmitAwaiter(IoScheduler* scheduler, fuse_io_context& io, IoClass io_class, uint64_t offset) noexcept
+            : scheduler(scheduler), io(io)
+        {
+            request.offset = offset;
+            request.io_class = io_class;
+        }
+
+        AdmitAwaiter(AdmitAwaiter const&) = delete;
+        AdmitAwaiter(AdmitAwaiter&& other) = delete;
+        AdmitAwaiter& operator=(AdmitAwaiter&&) = delete;
+        AdmitAwaiter& operator=(AdmitAwaiter const&) = delete;
+
+        bool await_ready() noexcept
+        {
+            return scheduler==nullptr ||
+                scheduler->try_dispatch(request.io_class);
+        }
+
+        void await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+        {
+            request.awaiter = p_awaiter;
+            scheduler->enqueue(&request);
+        }
+
+        Slot await_resume() noexcept
+        {
+            return Slot(scheduler, io);
+        }
+
+    private:
+        IoScheduler* scheduler;
+        fuse_io_context& io;
+        Request request;
+    };
+
+    Stats get_stats() const
+    {
+        return stats;
+    }
+
+private:
+    struct RequestCmp
+    {
+        bool operator()(const Request* a, const Request* b) const
+        {
+            if(a->deadline!=b->deadline)
+                return a->deadline < b->deadline;
+            if(a->offset!=b->offset)
+                return a->offset < b->offset;
+            return a->seq < b->seq;
+        }
+    };
+
+    bool try_dispatch(IoClass io_class);
+    void enqueue(Request* request);
+    void release(fuse_io_context& io);
+    Request* pick(int64_t now);
+    fuse_io_context::io_uring_task_discard<int> resume_ready(fuse_io_context& io);
+
+    size_t max_inflight;
+    size_t inflight;
+    size_t n_queued;
+    uint64_t next_seq;
+    int64_t expire_us[n_classes];
+    std::set<Request*, RequestCmp> queues[n_classes];
+    // Dispatched, resumed after the current batch of completions
+    std::vector<Request*> ready;
+    bool resume_scheduled;
+    Stats stats;
+};
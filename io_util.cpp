@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "io_util.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+
+char* alloc_aligned(size_t size)
+{
+    void* p;
+    if(posix_memalign(&p, 4096, size)!=0)
+        return nullptr;
+    return static_cast<char*>(p);
+}
+
+bool pread_full(int fd, char* buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+    while(done<len)
+    {
+        ssize_t rc = pread(fd, buf + done, len - done, off + done);
+        if(rc<=0)
+        {
+            if(rc==0)
+                errno = EIO;
+            return false;
+        }
+        done+=rc;
+    }
+    return true;
+}
+
+bool pwrite_full(int fd, const char* buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+    while(done<len)
+    {
+        ssize_t rc = pwrite(fd, buf + done, len - done, off + done);
+        if(rc<=0)
+        {
+            if(rc==0)
+                errno = EIO;
+            return false;
+        }
+        done+=rc;
+    }
+    return true;
+}
+
+fuse_io_context::io_uring_task<int> sleep_ms(fuse_io_context& io, unsigned int ms)
+{
+    struct __kernel_timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000)*1000000;
+
+    io_uring_sqe* sqe = co_await io.get_sqe();
+    if(sqe==nullptr)
+        co_return -1;
+
+    io_uring_prep_timeout(sqe, &ts, 0, 0);
+    co_await io.complete(sqe);
+    co_return 0;
+}
+
+uint64_t hash_header(const char* data, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i=0;i<len;++i)
+    {
+        h = (h ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+    }
+    return h;
+}
+
+fuse_io_context::io_uring_task<int> write_dsync(fuse_io_context& io, int fd,
+    const char* buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+    while(done<len)
+    {
+        io_uring_sqe* sqe = co_await io.get_backing_sqe();
+        if(sqe==nullptr)
+            co_return -EIO;
+
+        io_uring_prep_write(sqe, fd, buf + done, len - done, off + done);
+        sqe->rw_flags = RWF_DSYNC;
+        sqe->flags |= IOSQE_FIXED_FILE;
+
+        int rc = co_await io.complete(sqe);
+        if(rc<=0)
+            co_return rc<0 ? rc : -EIO;
+
+        done+=rc;
+    }
+
+    co_return 0;
+}
@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Helpers shared by the modules that keep metadata in files of their own
+
+template<typename T>
+T round_up(T numToRound, T multiple)
+{
+    return ((numToRound + multiple - 1) / multiple) * multiple;
+}
+
+// Page aligned buffer for O_DIRECT I/O. Free with free(). Returns nullptr
+// on failure
+char* alloc_aligned(size_t size);
+
+// Blocking pread()/pwrite() of all of len. Short transfers are retried,
+// end of file sets errno to EIO
+bool pread_full(int fd, char* buf, size_t len, uint64_t off);
+bool pwrite_full(int fd, const char* buf, size_t len, uint64_t off);
+
+// Timeout of ms on the ring. Returns 0 or -1 if there was no sqe. For
+// periodic background work and retry back-off
+[[nodiscard]] fuse_io_context::io_uring_task<int> sleep_ms(fuse_io_context& io, unsigned int ms);
+
+// FNV-1a over the bytes of a file header. Only has to detect torn headers
+uint64_t hash_header(const char* data, size_t len);
+
+// Writes all of len bytes of buf to the fixed file fd at off with
+// RWF_DSYNC on the backing ring. Returns 0 or a negative errno
+[[nodiscard]] fuse_io_context::io_uring_task<int> write_dsync(fuse_io_context& io, int fd,
+    const char* buf, size_t len, uint64_t off);
+
+// Writes page of an on-disk bitmap or map with write_dsync(), len bytes
+// at off. Only one write per page is in flight (flushing[page], guarded by
+// mutex), so the page in the file only ever gets newer. With mutex held,
+// fill(buf) fills the zeroed page aligned buffer, and done(rc, buf) is
+// called after the write before waiters are notified. Returns 0, 1 if the
+// page is already being written or a negative errno
+template<typename Fill, typename Done>
+[[nodiscard]] fuse_io_context::io_uring_task<int> flush_meta_page(fuse_io_context& io,
+    std::mutex& mutex, fuse_io_context::SharedWaitQueue& waiters, std::vector<bool>& flushing,
+    uint64_t page, int fd, uint64_t off, size_t len, Fill fill, Done done)
+{
+    std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(len), &free);
+    if(!buf)
+        co_return -ENOMEM;
+
+    memset(buf.get(), 0, len);
+
+    {
+        std::scoped_lock lock(mutex);
+        if(flushing[page])
+            co_return 1;
+
+        flushing[page] = true;
+        fill(buf.get());
+    }
+
+    int rc = co_await write_dsync(io, fd, buf.get(), len, off);
+
+    std::scoped_lock lock(mutex);
+    flushing[page] = false;
+    done(rc, static_cast<const char*>(buf.get()));
+    waiters.notify_all();
+    co_return rc;
+}
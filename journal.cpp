@@ -0,0 +1,999 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "journal.h"
+#include "io_util.h"
+#include "block_cache.h"
+#include "ssd_cache.h"
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <iostream>
+#include <algorithm>
+
+namespace
+{
+    const char super_magic[8] = {'F', 'U', 'S', 'J', 'R', 'N', 'L', '1'};
+    const char record_magic[8] = {'F', 'U', 'S', 'J', 'R', 'E', 'C', '1'};
+    const uint32_t journal_version = 1;
+    const uint64_t super_size = 4096;
+    const uint64_t record_header_size = 4096;
+    const uint64_t journal_page_size = 4096;
+    const uint64_t min_area_size = 16*1024*1024;
+    // Maximum number of journal/backing I/Os to wait for at once
+    const size_t max_journal_batch = 64;
+    // Amount of data applied to the backing file per destage run
+    const uint64_t destage_batch_size = 8*1024*1024;
+    // The destager runs if the journal is more than a quarter full, a writer
+    // waits for space or it did not run for destage_idle_ms. It waits for
+    // appends while the journal is empty
+    const int64_t destage_idle_ms = 1000;
+    // Amount of journal read at once during recovery
+    const size_t recovery_scan_size = 4*1024*1024;
+
+    struct JournalSuper
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t generation;
+        uint64_t area_size;
+        // Records starting at this position/sequence number have
+        // not been applied to the backing file
+        uint64_t replay_pos;
+        uint64_t replay_seq;
+        uint64_t checksum;
+    };
+
+    struct RecordHeader
+    {
+        char magic[8];
+        uint64_t generation;
+        uint64_t seq;
+        uint64_t offset;
+        uint32_t len;
+        uint32_t reserved;
+        uint64_t data_hash;
+        uint64_t header_hash;
+    };
+
+    struct RecoveryRecord
+    {
+        uint64_t seq;
+        uint64_t phys;
+        uint64_t offset;
+        uint32_t len;
+        uint64_t data_hash;
+    };
+
+    // FNV-1a over 64-bit words. Only has to detect torn records
+    uint64_t hash_data(const char* data, size_t len)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        size_t i = 0;
+        for(;i+sizeof(uint64_t)<=len;i+=sizeof(uint64_t))
+        {
+            uint64_t w;
+            memcpy(&w, data + i, sizeof(w));
+            h = (h ^ w) * 1099511628211ULL;
+            h ^= h >> 29;
+        }
+        for(;i<len;++i)
+        {
+            h = (h ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+        }
+        return h;
+    }
+
+    // Page aligned part of the journal containing [jpos, jpos+len). Record
+    // data is padded to whole pages, so this stays inside the record
+    void aligned_range(uint64_t jpos, uint64_t len, uint64_t& start, uint64_t& aligned_len)
+    {
+        start = (jpos / journal_page_size) * journal_page_size;
+        aligned_len = round_up(jpos + len, journal_page_size) - start;
+    }
+}
+
+WriteJournal::ReadRef::~ReadRef()
+{
+    if(journal!=nullptr)
+        journal->unpin(pin);
+}
+
+WriteJournal::WriteJournal(const std::string& path, uint64_t journal_size, int backing_fd)
+    : path(path), backing_fd(backing_fd), fd(-1), journal_size(journal_size),
+        area_size(0), generation(0), super_buf(nullptr),
+        head(0), tail(0), next_seq(1), durable_tail(0), destage_cursor(0),
+        space_wanted(false), idle_timer_running(false), writes(0), write_bytes(0),
+        overwritten_bytes(0), destaged_bytes(0), destage_runs(0), space_waits(0)
+{
+}
+
+WriteJournal::~WriteJournal()
+{
+    free(super_buf);
+
+    if(fd!=-1)
+        close(fd);
+}
+
+bool WriteJournal::init(bool direct_io)
+{
+    fd = open(path.c_str(), O_RDWR|O_CREAT|O_CLOEXEC|(direct_io ? O_DIRECT : 0), S_IRUSR|S_IWUSR);
+    if(fd==-1)
+    {
+        perror(("Error opening write journal \""+path+"\"").c_str());
+        return false;
+    }
+
+    super_buf = alloc_aligned(super_size);
+    if(super_buf==nullptr)
+    {
+        std::cerr << "Error allocating write journal superblock buffer" << std::endl;
+        return false;
+    }
+
+    uint64_t replay_seq;
+    if(read_super(replay_seq))
+    {
+        if(!recover(replay_seq))
+            return false;
+
+        ++generation;
+    }
+    else
+    {
+        struct timespec tp;
+        clock_gettime(CLOCK_REALTIME, &tp);
+        generation = static_cast<uint64_t>(tp.tv_sec)*1000000000 + tp.tv_nsec;
+    }
+
+    area_size = journal_size>super_size ?
+        ((journal_size - super_size) / journal_page_size) * journal_page_size : 0;
+    if(area_size<min_area_size)
+    {
+        std::cerr << "Write journal has to be at least " << (min_area_size + super_size)/(1024*1024)
+            << " MB" << std::endl;
+        return false;
+    }
+
+    int rc = posix_fallocate(fd, 0, super_size + area_size);
+    if(rc!=0)
+    {
+        errno = rc;
+        perror("Error allocating write journal");
+        return false;
+    }
+
+    head = 0;
+    tail = 0;
+    durable_tail = 0;
+    next_seq = 1;
+    return write_super_sync(0, 1);
+}
+
+void WriteJournal::fill_super(uint64_t replay_pos, uint64_t replay_seq)
+{
+    memset(super_buf, 0, super_size);
+    JournalSuper* super = reinterpret_cast<JournalSuper*>(super_buf);
+    memcpy(super->magic, super_magic, sizeof(super_magic));
+    super->version = journal_version;
+    super->generation = generation;
+    super->area_size = area_size;
+    super->replay_pos = replay_pos;
+    super->replay_seq = replay_seq;
+    super->checksum = hash_data(super_buf, offsetof(JournalSuper, checksum));
+}
+
+bool WriteJournal::read_super(uint64_t& replay_seq)
+{
+    struct stat st;
+    if(fstat(fd, &st)!=0 ||
+        static_cast<uint64_t>(st.st_size)<super_size)
+        return false;
+
+    if(!pread_full(fd, super_buf, super_size, 0))
+    {
+        perror("Error reading write journal superblock");
+        return false;
+    }
+
+    const JournalSuper* super = reinterpret_cast<const JournalSuper*>(super_buf);
+    if(memcmp(super->magic, super_magic, sizeof(super_magic))!=0 ||
+        super->checksum!=hash_data(super_buf, offsetof(JournalSuper, checksum)))
+    {
+        std::cout << "No valid write journal superblock. Initializing new journal." << std::endl;
+        return false;
+    }
+
+    if(super->version!=journal_version ||
+        super->area_size==0 ||
+        super->area_size%journal_page_size!=0 ||
+        super_size + super->area_size>static_cast<uint64_t>(st.st_size))
+    {
+        std::cout << "Unsupported write journal layout. Initializing new journal." << std::endl;
+        return false;
+    }
+
+    generation = super->generation;
+    area_size = super->area_size;
+    replay_seq = super->replay_seq;
+    return true;
+}
+
+bool WriteJournal::write_super_sync(uint64_t replay_pos, uint64_t replay_seq)
+{
+    fill_super(replay_pos, replay_seq);
+    if(!pwrite_full(fd, super_buf, super_size, 0))
+    {
+        perror("Error writing write journal superblock");
+        return false;
+    }
+
+    if(fdatasync(fd)!=0)
+    {
+        perror("Error syncing write journal");
+        return false;
+    }
+
+    return true;
+}
+
+bool WriteJournal::recover(uint64_t replay_seq)
+{
+    std::unique_ptr<char, decltype(&free)> scan_buf(alloc_aligned(recovery_scan_size), &free);
+    if(!scan_buf)
+    {
+        std::cerr << "Error allocating write journal recovery buffer" << std::endl;
+        return false;
+    }
+
+    // Records can start at any page. Valid headers in the data of
+    // other records would need the current random generation
+    std::vector<RecoveryRecord> records;
+    uint32_t max_len = 0;
+    for(uint64_t chunk_pos=0;chunk_pos<area_size;chunk_pos+=recovery_scan_size)
+    {
+        size_t n = std::min(static_cast<uint64_t>(recovery_scan_size), area_size - chunk_pos);
+        if(!pread_full(fd, scan_buf.get(), n, super_size + chunk_pos))
+        {
+            perror("Error reading write journal during recovery");
+            return false;
+        }
+
+        for(size_t off=0;off<n;off+=record_header_size)
+        {
+            const RecordHeader* header = reinterpret_cast<const RecordHeader*>(scan_buf.get() + off);
+            if(memcmp(header->magic, record_magic, sizeof(record_magic))!=0 ||
+                header->generation!=generation ||
+                header->seq<replay_seq ||
+                header->header_hash!=hash_data(scan_buf.get() + off, offsetof(RecordHeader, header_hash)))
+                continue;
+
+            uint64_t phys = chunk_pos + off;
+            if(header->len==0 ||
+                phys + record_header_size + round_up<uint64_t>(header->len, journal_page_size)>area_size)
+                continue;
+
+            RecoveryRecord rec;
+            rec.seq = header->seq;
+            rec.phys = phys;
+            rec.offset = header->offset;
+            rec.len = header->len;
+            rec.data_hash = header->data_hash;
+            records.push_back(rec);
+            max_len = std::max(max_len, header->len);
+        }
+    }
+
+    if(records.empty())
+        return true;
+
+    std::sort(records.begin(), records.end(), [](const RecoveryRecord& a, const RecoveryRecord& b) {
+        return a.seq < b.seq;
+    });
+
+    std::cout << "Applying " << records.size() << " write journal records to backing file..." << std::endl;
+
+    std::unique_ptr<char, decltype(&free)> data_buf(
+        alloc_aligned(round_up<uint64_t>(max_len, journal_page_size)), &free);
+    if(!data_buf)
+    {
+        std::cerr << "Error allocating write journal recovery buffer" << std::endl;
+        return false;
+    }
+
+    size_t torn = 0;
+    for(const RecoveryRecord& rec: records)
+    {
+        if(!pread_full(fd, data_buf.get(), round_up<uint64_t>(rec.len, journal_page_size),
+                super_size + rec.phys + record_header_size))
+        {
+            perror("Error reading write journal record during recovery");
+            return false;
+        }
+
+        // Not completely written. Was never acknowledged
+        if(hash_data(data_buf.get(), rec.len)!=rec.data_hash)
+        {
+            ++torn;
+            continue;
+        }
+
+        if(!pwrite_full(backing_fd, data_buf.get(), rec.len, rec.offset))
+        {
+            perror("Error applying write journal record to backing file");
+            return false;
+        }
+    }
+
+    if(fdatasync(backing_fd)!=0)
+    {
+        perror("Error syncing backing file after write journal recovery");
+        return false;
+    }
+
+    std::cout << "Write journal recovery done. Skipped " << torn << " incomplete records." << std::endl;
+    return true;
+}
+
+uint64_t WriteJournal::phys_pos(uint64_t pos) const
+{
+    return super_size + pos % area_size;
+}
+
+bool WriteJournal::reserve(uint64_t rec_size, uint64_t& pos, uint64_t& seq)
+{
+    uint64_t p = head;
+    if(p % area_size + rec_size > area_size)
+        p = round_up(p, area_size);
+
+    if(p + rec_size - tail > area_size)
+    {
+        space_wanted = true;
+        return false;
+    }
+
+    head = p + rec_size;
+    pos = p;
+    seq = next_seq++;
+
+    LiveRecord rec;
+    // Released once the record is in the index
+    rec.refs = 1;
+    rec.seq = seq;
+    live_records[pos] = rec;
+    return true;
+}
+
+void WriteJournal::abort_record(uint64_t rec_pos)
+{
+    std::scoped_lock lock(mutex);
+    release_record_ref(rec_pos);
+    // Might have moved the replay point
+    destage_waiters.notify_all();
+}
+
+void WriteJournal::add_record_ref(uint64_t rec_pos)
+{
+    auto it = live_records.find(rec_pos);
+    assert(it!=live_records.end());
+    ++it->second.refs;
+}
+
+void WriteJournal::release_record_ref(uint64_t rec_pos)
+{
+    auto it = live_records.find(rec_pos);
+    assert(it!=live_records.end());
+    --it->second.refs;
+    if(it->second.refs==0)
+        live_records.erase(it);
+}
+
+std::map<uint64_t, WriteJournal::Extent>::iterator WriteJournal::first_overlap(uint64_t offset)
+{
+    auto it = extents.upper_bound(offset);
+    if(it!=extents.begin())
+    {
+        auto prev = std::prev(it);
+        if(prev->first + prev->second.len > offset)
+            return prev;
+    }
+    return it;
+}
+
+std::map<uint64_t, WriteJournal::Extent>::iterator WriteJournal::remove_extent(std::map<uint64_t, Extent>::iterator it)
+{
+    release_record_ref(it->second.rec_pos);
+    return extents.erase(it);
+}
+
+void WriteJournal::insert(uint64_t offset, uint64_t len, uint64_t jpos, uint64_t rec_pos, uint64_t seq)
+{
+    std::scoped_lock lock(mutex);
+
+    bool was_empty = extents.empty();
+
+    // Records complete out of order. Only the parts not covered
+    // by newer records go into the index
+    uint64_t end = offset + len;
+    std::vector<std::pair<uint64_t, uint64_t> > pieces;
+    uint64_t curr = offset;
+    for(auto it=first_overlap(offset);it!=extents.end() && it->first<end;++it)
+    {
+        if(it->second.seq<seq)
+            continue;
+
+        if(it->first>curr)
+            pieces.push_back(std::make_pair(curr, it->first));
+
+        curr = std::max(curr, it->first + it->second.len);
+    }
+
+    if(curr<end)
+        pieces.push_back(std::make_pair(curr, end));
+
+    for(const auto& piece: pieces)
+    {
+        assign(piece.first, piece.second - piece.first,
+            jpos + (piece.first - offset), rec_pos, seq);
+    }
+
+    release_record_ref(rec_pos);
+
+    // The destager starts its idle timer once there is data
+    if(!destage_waiters.empty() &&
+        (was_empty || destage_urgent()))
+        destage_waiters.notify_all();
+}
+
+void WriteJournal::assign(uint64_t offset, uint64_t len, uint64_t jpos, uint64_t rec_pos, uint64_t seq)
+{
+    uint64_t end = offset + len;
+    auto it = first_overlap(offset);
+    while(it!=extents.end() && it->first<end)
+    {
+        uint64_t ext_start = it->first;
+        Extent ext = it->second;
+        uint64_t ext_end = ext_start + ext.len;
+
+        overwritten_bytes += std::min(end, ext_end) - std::max(offset, ext_start);
+
+        // Remaining pieces reference the record before the
+        // removed extent releases it
+        if(ext_start<offset)
+            add_record_ref(ext.rec_pos);
+        if(ext_end>end)
+            add_record_ref(ext.rec_pos);
+
+        it = remove_extent(it);
+
+        if(ext_start<offset)
+        {
+            Extent left = ext;
+            left.len = offset - ext_start;
+            extents[ext_start] = left;
+        }
+
+        if(ext_end>end)
+        {
+            Extent right = ext;
+            right.len = ext_end - end;
+            right.jpos = ext.jpos + (end - ext_start);
+            extents[end] = right;
+            break;
+        }
+    }
+
+    Extent ext;
+    ext.len = len;
+    ext.jpos = jpos;
+    ext.rec_pos = rec_pos;
+    ext.seq = seq;
+    extents[offset] = ext;
+    add_record_ref(rec_pos);
+}
+
+void WriteJournal::update_tail()
+{
+    uint64_t new_tail = durable_tail;
+    if(!read_pins.empty())
+        new_tail = std::min(new_tail, *read_pins.begin());
+
+    if(new_tail>tail)
+    {
+        tail = new_tail;
+        space_waiters.notify_all();
+    }
+}
+
+void WriteJournal::get_replay_point(uint64_t& replay_pos, uint64_t& replay_seq)
+{
+    if(live_records.empty())
+    {
+        replay_pos = head;
+        replay_seq = next_seq;
+    }
+    else
+    {
+        replay_pos = live_records.begin()->first;
+        replay_seq = live_records.begin()->second.seq;
+    }
+}
+
+void WriteJournal::unpin(std::multiset<uint64_t>::iterator pin)
+{
+    std::scoped_lock lock(mutex);
+    read_pins.erase(pin);
+    update_tail();
+}
+
+bool WriteJournal::get_read_extents(uint64_t offset, uint64_t len, ReadRef& ref)
+{
+    if(len==0)
+        return false;
+
+    uint64_t end = offset + len;
+    uint64_t min_rec_pos = UINT64_MAX;
+
+    std::scoped_lock lock(mutex);
+    for(auto it=first_overlap(offset);it!=extents.end() && it->first<end;++it)
+    {
+        uint64_t start = std::max(offset, it->first);
+        ReadRef::Extent ext;
+        ext.offset = start;
+        ext.len = std::min(end, it->first + it->second.len) - start;
+        ext.jpos = it->second.jpos + (start - it->first);
+        ref.extents.push_back(ext);
+        min_rec_pos = std::min(min_rec_pos, it->second.rec_pos);
+    }
+
+    if(ref.extents.empty())
+        return false;
+
+    ref.journal = this;
+    ref.pin = read_pins.insert(min_rec_pos);
+    return true;
+}
+
+fuse_io_context::io_uring_task<int> WriteJournal::write(fuse_io_context& io, int journal_fd,
+    const char* buf, uint64_t offset, uint32_t size)
+{
+    uint64_t rec_size = record_header_size + round_up<uint64_t>(size, journal_page_size);
+    if(size==0 || rec_size>area_size)
+        co_return -EINVAL;
+
+    uint64_t pos;
+    uint64_t seq;
+    {
+        std::unique_lock lock(mutex);
+        while(!reserve(rec_size, pos, seq))
+        {
+            ++space_waits;
+            destage_waiters.notify_all();
+            co_await space_waiters.wait(io, lock);
+        }
+    }
+
+    std::unique_ptr<char, decltype(&free)> header_buf(alloc_aligned(record_header_size), &free);
+    if(!header_buf)
+    {
+        abort_record(pos);
+        co_return -ENOMEM;
+    }
+
+    memset(header_buf.get(), 0, record_header_size);
+    RecordHeader* header = reinterpret_cast<RecordHeader*>(header_buf.get());
+    memcpy(header->magic, record_magic, sizeof(record_magic));
+    header->generation = generation;
+    header->seq = seq;
+    header->offset = offset;
+    header->len = size;
+    header->data_hash = hash_data(buf, size);
+    header->header_hash = hash_data(header_buf.get(), offsetof(RecordHeader, header_hash));
+
+    struct iovec iovs[2];
+    iovs[0].iov_base = header_buf.get();
+    iovs[0].iov_len = record_header_size;
+    iovs[1].iov_base = const_cast<char*>(buf);
+    iovs[1].iov_len = rec_size - record_header_size;
+
+    io_uring_sqe* sqe = co_await io.get_sqe();
+    if(sqe==nullptr)
+    {
+        abort_record(pos);
+        co_return -EIO;
+    }
+
+    io_uring_prep_writev2(sqe, journal_fd, iovs, 2, phys_pos(pos), RWF_DSYNC);
+    sqe->flags |= IOSQE_FIXED_FILE;
+
+    int rc = co_await io.complete(sqe);
+    if(rc<0 || static_cast<uint64_t>(rc)!=rec_size)
+    {
+        abort_record(pos);
+
+        static bool erronce=true;
+        if(erronce)
+        {
+            std::cerr << "Writing to write journal failed rc=" << rc << std::endl;
+            erronce=false;
+        }
+        co_return rc<0 ? rc : -EIO;
+    }
+
+    insert(offset, size, pos + record_header_size, pos, seq);
+
+    ++writes;
+    write_bytes += size;
+    co_return size;
+}
+
+fuse_io_context::io_uring_task<int> WriteJournal::read(fuse_io_context& io, int journal_fd,
+    const ReadRef& ref, char* buf, uint64_t offset)
+{
+    std::vector<size_t> buf_offs;
+    size_t total = 0;
+    for(const ReadRef::Extent& ext: ref.extents)
+    {
+        uint64_t start, aligned_len;
+        aligned_range(ext.jpos, ext.len, start, aligned_len);
+        buf_offs.push_back(total);
+        total += aligned_len;
+    }
+
+    std::unique_ptr<char, decltype(&free)> tmp_buf(alloc_aligned(total), &free);
+    if(!tmp_buf)
+        co_return -ENOMEM;
+
+    for(size_t i=0;i<ref.extents.size();)
+    {
+        size_t n = std::min(ref.extents.size() - i, max_journal_batch);
+
+        io_uring_sqe* sqe = co_await io.get_sqe(n);
+        if(sqe==nullptr)
+            co_return -EIO;
+
+        std::vector<io_uring_sqe*> sqes;
+        std::vector<uint64_t> expected;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_sqe();
+
+            const ReadRef::Extent& ext = ref.extents[i+j];
+            uint64_t start, aligned_len;
+            aligned_range(ext.jpos, ext.len, start, aligned_len);
+
+            io_uring_prep_read(sqe, journal_fd, tmp_buf.get() + buf_offs[i+j],
+                    aligned_len, phys_pos(start));
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            sqes.push_back(sqe);
+            expected.push_back(aligned_len);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+
+        for(size_t j=0;j<n;++j)
+        {
+            if(rcs[j]<0 || static_cast<uint64_t>(rcs[j])!=expected[j])
+                co_return rcs[j]<0 ? rcs[j] : -EIO;
+        }
+
+        i+=n;
+    }
+
+    for(size_t i=0;i<ref.extents.size();++i)
+    {
+        const ReadRef::Extent& ext = ref.extents[i];
+        memcpy(buf + (ext.offset - offset),
+            tmp_buf.get() + buf_offs[i] + ext.jpos % journal_page_size, ext.len);
+    }
+
+    co_return 0;
+}
+
+bool WriteJournal::destage_urgent() const
+{
+    return space_wanted ||
+        (head - tail)*4>=area_size;
+}
+
+bool WriteJournal::should_destage(int64_t idle_ms)
+{
+    if(extents.empty())
+    {
+        // Superblock still has to move past records that were overwritten
+        uint64_t replay_pos, replay_seq;
+        get_replay_point(replay_pos, replay_seq);
+        return replay_pos>durable_tail;
+    }
+
+    return destage_urgent() ||
+        idle_ms>=destage_idle_ms;
+}
+
+fuse_io_context::io_uring_task_discard<int> WriteJournal::idle_timer(fuse_io_context& io, int64_t ms)
+{
+    co_await sleep_ms(io, static_cast<unsigned int>(std::max(ms, static_cast<int64_t>(1))));
+
+    std::scoped_lock lock(mutex);
+    idle_timer_running = false;
+    destage_waiters.notify_all();
+    co_return 0;
+}
+
+void WriteJournal::get_destage_batch(uint64_t max_bytes, std::vector<DestageItem>& items)
+{
+    std::scoped_lock lock(mutex);
+    space_wanted = false;
+
+    // One pass over the volume in offset order, continued across runs
+    size_t buf_off = 0;
+    size_t n_extents = extents.size();
+    auto it = extents.lower_bound(destage_cursor);
+    for(size_t i=0;i<n_extents;++i)
+    {
+        if(it==extents.end())
+            it = extents.begin();
+
+        uint64_t start, aligned_len;
+        aligned_range(it->second.jpos, it->second.len, start, aligned_len);
+        if(buf_off + aligned_len>max_bytes)
+            break;
+
+        DestageItem item;
+        item.offset = it->first;
+        item.len = it->second.len;
+        item.jpos = it->second.jpos;
+        item.seq = it->second.seq;
+        item.buf_off = buf_off;
+        items.push_back(item);
+
+        buf_off += aligned_len;
+        destage_cursor = it->first + it->second.len;
+        ++it;
+    }
+
+    std::sort(items.begin(), items.end(), [](const DestageItem& a, const DestageItem& b) {
+        return a.offset < b.offset;
+    });
+}
+
+void WriteJournal::destage_done(const std::vector<DestageItem>& items,
+    uint64_t& replay_pos, uint64_t& replay_seq)
+{
+    std::scoped_lock lock(mutex);
+
+    // Extents that were overwritten in the meantime stay. Pieces of
+    // the same record are all inside the destaged range
+    for(const DestageItem& item: items)
+    {
+        uint64_t end = item.offset + item.len;
+        for(auto it=first_overlap(item.offset);it!=extents.end() && it->first<end;)
+        {
+            if(it->second.seq==item.seq)
+                it = remove_extent(it);
+            else
+                ++it;
+        }
+    }
+
+    get_replay_point(replay_pos, replay_seq);
+}
+
+void WriteJournal::set_durable_tail(uint64_t replay_pos)
+{
+    std::scoped_lock lock(mutex);
+    durable_tail = replay_pos;
+    update_tail();
+}
+
+fuse_io_context::io_uring_task_discard<int> WriteJournal::destage(fuse_io_context& io, int journal_fd)
+{
+    std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(destage_batch_size), &free);
+    if(!buf)
+    {
+        std::cerr << "Error allocating write journal destage buffer" << std::endl;
+        co_return -1;
+    }
+
+    int64_t last_destage_ms = fuse_io_context::get_monotonic_us()/1000;
+    uint64_t super_pos = 0;
+
+    while(true)
+    {
+        {
+            std::unique_lock lock(mutex);
+            while(true)
+            {
+                int64_t idle_ms = fuse_io_context::get_monotonic_us()/1000 - last_destage_ms;
+                if(should_destage(idle_ms))
+                    break;
+
+                // Woken up by appends that make destaging urgent, writers
+                // waiting for space or the idle timer. Without data there
+                // is no timer
+                if(!extents.empty() && !idle_timer_running)
+                {
+                    idle_timer_running = true;
+                    idle_timer(io, destage_idle_ms - idle_ms);
+                }
+
+                co_await destage_waiters.wait(io, lock);
+            }
+        }
+
+        last_destage_ms = fuse_io_context::get_monotonic_us()/1000;
+
+        std::vector<DestageItem> items;
+        get_destage_batch(destage_batch_size, items);
+
+        int err = 0;
+        for(size_t i=0;i<items.size() && err==0;)
+        {
+            size_t n = std::min(items.size() - i, max_journal_batch);
+
+            io_uring_sqe* sqe = co_await io.get_sqe(n);
+            if(sqe==nullptr)
+                co_return -1;
+
+            std::vector<io_uring_sqe*> sqes;
+            std::vector<uint64_t> expected;
+            for(size_t j=0;j<n;++j)
+            {
+                if(j>0)
+                    sqe = io.get_reserved_sqe();
+
+                const DestageItem& item = items[i+j];
+                uint64_t start, aligned_len;
+                aligned_range(item.jpos, item.len, start, aligned_len);
+
+                io_uring_prep_read(sqe, journal_fd, buf.get() + item.buf_off,
+                        aligned_len, phys_pos(start));
+                sqe->flags |= IOSQE_FIXED_FILE;
+
+                sqes.push_back(sqe);
+                expected.push_back(aligned_len);
+            }
+
+            std::vector<int> rcs = co_await io.complete(sqes);
+            for(size_t j=0;j<n;++j)
+            {
+                if(rcs[j]<0 || static_cast<uint64_t>(rcs[j])!=expected[j])
+                    err = rcs[j]<0 ? rcs[j] : -EIO;
+            }
+
+            i+=n;
+        }
+
+        for(size_t i=0;i<items.size() && err==0;)
+        {
+            size_t n = std::min(items.size() - i, max_journal_batch);
+
+            io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+            if(sqe==nullptr)
+                co_return -1;
+
+            std::vector<io_uring_sqe*> sqes;
+            for(size_t j=0;j<n;++j)
+            {
+                if(j>0)
+                    sqe = io.get_reserved_backing_sqe();
+
+                const DestageItem& item = items[i+j];
+                io_uring_prep_write(sqe, io.fuse_ring.backing_fd,
+                        buf.get() + item.buf_off + item.jpos % journal_page_size,
+                        item.len, item.offset);
+                sqe->flags |= IOSQE_FIXED_FILE;
+
+                sqes.push_back(sqe);
+            }
+
+            std::vector<int> rcs = co_await io.complete(sqes);
+            for(size_t j=0;j<n;++j)
+            {
+                if(rcs[j]<0 || static_cast<uint64_t>(rcs[j])!=items[i+j].len)
+                    err = rcs[j]<0 ? rcs[j] : -EIO;
+            }
+
+            i+=n;
+        }
+
+        if(!items.empty() && err==0)
+        {
+            // Not on the backing ring. It might be an IOPOLL ring
+            io_uring_sqe* sqe = co_await io.get_sqe();
+            if(sqe==nullptr)
+                co_return -1;
+
+            io_uring_prep_fsync(sqe, io.fuse_ring.backing_fd, IORING_FSYNC_DATASYNC);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            err = co_await io.complete(sqe);
+        }
+
+        if(err!=0)
+        {
+            static bool erronce=true;
+            if(erronce)
+            {
+                std::cerr << "Applying write journal to backing file failed rc=" << err
+                    << ". Retrying." << std::endl;
+                erronce=false;
+            }
+
+            co_await sleep_ms(io, destage_idle_ms);
+            continue;
+        }
+
+        for(const DestageItem& item: items)
+        {
+            if(io.fuse_ring.block_cache!=nullptr)
+                io.fuse_ring.block_cache->invalidate(item.offset, item.len);
+
+            if(io.fuse_ring.ssd_cache!=nullptr)
+                io.fuse_ring.ssd_cache->invalidate(item.offset, item.len);
+
+            destaged_bytes += item.len;
+        }
+
+        if(!items.empty())
+            ++destage_runs;
+
+        uint64_t replay_pos, replay_seq;
+        destage_done(items, replay_pos, replay_seq);
+
+        if(replay_pos==super_pos)
+            continue;
+
+        // Journal space is only reused once the superblock does not
+        // reference it anymore
+        fill_super(replay_pos, replay_seq);
+
+        io_uring_sqe* sqe = co_await io.get_sqe();
+        if(sqe==nullptr)
+            co_return -1;
+
+        io_uring_prep_write(sqe, journal_fd, super_buf, super_size, 0);
+        sqe->rw_flags = RWF_DSYNC;
+        sqe->flags |= IOSQE_FIXED_FILE;
+
+        int rc = co_await io.complete(sqe);
+        if(rc!=super_size)
+        {
+            static bool erronce=true;
+            if(erronce)
+            {
+                std::cerr << "Writing write journal superblock failed rc=" << rc << std::endl;
+                erronce=false;
+            }
+            continue;
+        }
+
+        super_pos = replay_pos;
+        set_durable_tail(replay_pos);
+    }
+}
+
+WriteJournal::Stats WriteJournal::get_stats()
+{
+    Stats ret;
+    {
+        std::scoped_lock lock(mutex);
+        ret.used_bytes = head - tail;
+        ret.extents = extents.size();
+    }
+    ret.writes = writes.load(std::memory_order_relaxed);
+    ret.write_bytes = write_bytes.load(std::memory_order_relaxed);
+    ret.overwritten_bytes = overwritten_bytes.load(std::memory_order_relaxed);
+    ret.destaged_bytes = destaged_bytes.load(std::memory_order_relaxed);
+    ret.destage_runs = destage_runs.load(std::memory_order_relaxed);
+    ret.space_waits = space_waits.load(std::memory_order_relaxed);
+    return ret;
+}
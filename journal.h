@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+
+// Write-back journal in a file on fast storage. Writes are appended to the
+// journal as records (4K header followed by the data) and are acknowledged
+// once the record is durable. An in-memory extent index maps volume ranges
+// to the newest journal data, so reads see it before it is applied to the
+// backing file. A background destager copies the indexed extents to the
+// backing file in offset order, syncs the backing file and then frees the
+// journal space.
+//
+// The journal is a ring buffer. Positions are logical (they only grow),
+// the record at position pos starts at super_size + pos % area_size in
+// the file. Records are not split at the end of the ring.
+//
+// Records are written concurrently and may complete out of order, so
+// recovery does not stop at the first invalid record. It applies all
+// valid records of the current generation starting at the persisted
+// replay sequence number in sequence order.
+class WriteJournal
+{
+public:
+    struct Stats
+    {
+        uint64_t used_bytes;
+        uint64_t extents;
+        uint64_t writes;
+        uint64_t write_bytes;
+        uint64_t overwritten_bytes;
+        uint64_t destaged_bytes;
+        uint64_t destage_runs;
+        uint64_t space_waits;
+    };
+
+    // Extents of a read that have to be read from the journal. Pins the
+    // journal space until released
+    struct ReadRef
+    {
+        struct Extent
+        {
+            uint64_t offset;
+            uint64_t len;
+            uint64_t jpos;
+        };
+
+        ReadRef()
+            : journal(nullptr) {}
+        ~ReadRef();
+        ReadRef(const ReadRef&) = delete;
+        ReadRef& operator=(const ReadRef&) = delete;
+
+        std::vector<Extent> extents;
+
+    private:
+        friend class WriteJournal;
+        WriteJournal* journal;
+        std::multiset<uint64_t>::iterator pin;
+    };
+
+    WriteJournal(const std::string& path, uint64_t journal_size, int backing_fd);
+    ~WriteJournal();
+
+    // Opens the journal file and applies records left over from an unclean
+    // shutdown to the backing file
+    bool init(bool direct_io);
+
+    int get_fd() const
+    {
+        return fd;
+    }
+
+    // Appends a record with size bytes at buf for volume offset to the journal.
+    // buf has to be readable up to the next multiple of 4096 bytes. journal_fd
+    // is the fixed file index of the journal file. Returns the number of bytes
+    // written or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> write(fuse_io_context& io, int journal_fd,
+        const char* buf, uint64_t offset, uint32_t size);
+
+    // Collects the journal extents of [offset, offset+len). Returns false if
+    // there are none. Has to be called before reading the backing file, as
+    // extents are removed once they are applied to it
+    bool get_read_extents(uint64_t offset, uint64_t len, ReadRef& ref);
+
+    // Reads the extents in ref into buf (which contains volume data starting at offset)
+    [[nodiscard]] fuse_io_context::io_uring_task<int> read(fuse_io_context& io, int journal_fd,
+        const ReadRef& ref, char* buf, uint64_t offset);
+
+    // Applies journal extents to the backing file until the program exits.
+    // Runs on one worker thread only
+    fuse_io_context::io_uring_task_discard<int> destage(fuse_io_context& io, int journal_fd);
+
+    Stats get_stats();
+
+private:
+    struct Extent
+    {
+        uint64_t len;
+        uint64_t jpos;
+        uint64_t rec_pos;
+        uint64_t seq;
+    };
+
+    struct LiveRecord
+    {
+        size_t refs;
+        uint64_t seq;
+    };
+
+    struct DestageItem
+    {
+        uint64_t offset;
+        uint64_t len;
+        uint64_t jpos;
+        uint64_t seq;
+        size_t buf_off;
+    };
+
+    uint64_t phys_pos(uint64_t pos) const;
+    bool reserve(uint64_t rec_size, uint64_t& pos, uint64_t& seq);
+    void abort_record(uint64_t rec_pos);
+    void insert(uint64_t offset, uint64_t len, uint64_t jpos, uint64_t rec_pos, uint64_t seq);
+    void assign(uint64_t offset, uint64_t len, uint64_t jpos, uint64_t rec_pos, uint64_t seq);
+    std::map<uint64_t, Extent>::iterator first_overlap(uint64_t offset);
+    std::map<uint64_t, Extent>::iterator remove_extent(std::map<uint64_t, Extent>::iterator it);
+    void add_record_ref(uint64_t rec_pos);
+    void release_record_ref(uint64_t rec_pos);
+    void update_tail();
+    void get_replay_point(uint64_t& replay_pos, uint64_t& replay_seq);
+    void unpin(std::multiset<uint64_t>::iterator pin);
+    void get_destage_batch(uint64_t max_bytes, std::vector<DestageItem>& items);
+    void destage_done(const std::vector<DestageItem>& items,
+        uint64_t& replay_pos, uint64_t& replay_seq);
+    void set_durable_tail(uint64_t replay_pos);
+    bool destage_urgent() const;
+    bool should_destage(int64_t idle_ms);
+    // Wakes up the destager after ms
+    fuse_io_context::io_uring_task_discard<int> idle_timer(fuse_io_context& io, int64_t ms);
+
+    void fill_super(uint64_t replay_pos, uint64_t replay_seq);
+    bool read_super(uint64_t& replay_seq);
+    bool write_super_sync(uint64_t replay_pos, uint64_t replay_seq);
+    bool recover(uint64_t replay_seq);
+
+    std::string path;
+    int backing_fd;
+    int fd;
+    uint64_t journal_size;
+    uint64_t area_size;
+    uint64_t generation;
+    // Aligned buffer for superblock writes
+    char* super_buf;
+
+    std::mutex mutex;
+    // Next record position, oldest position still in use
+    uint64_t head;
+    uint64_t tail;
+    uint64_t next_seq;
+    // Volume offset -> extent, non-overlapping
+    std::map<uint64_t, Extent> extents;
+    // Start position of records with data in the index or being written
+    std::map<uint64_t, LiveRecord> live_records;
+    // Oldest record position per running journal read
+    std::multiset<uint64_t> read_pins;
+    // Replay position in the superblock on disk. Space before it
+    // can be reused
+    uint64_t durable_tail;
+    // Elevator position of the destager
+    uint64_t destage_cursor;
+    bool space_wanted;
+    // Writers waiting for space, destager waiting for work
+    fuse_io_context::SharedWaitQueue space_waiters;
+    fuse_io_context::SharedWaitQueue destage_waiters;
+    bool idle_timer_running;
+
+    std::atomic<uint64_t> writes;
+    std::atomic<uint64_t> write_bytes;
+    std::atomic<uint64_t> overwritten_bytes;
+    std::atomic<uint64_t> destaged_bytes;
+    std::atomic<uint64_t> destage_runs;
+    std::atomic<uint64_t> space_waits;
+};
@@ -1,6 +1,12 @@
 // SPDX-License-Identifier: LGPL-3.0-or-later
 // Copyright (C) Martin Raiber 
 #include "fuseuring_main.h"
+#include "fuse_io_context.h"
+#include "qos.h"
+#include "chunk_store.h"
+#include "encryption.h"
+#include "nbd.h"
+#include "s3.h"
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,31 +17,773 @@
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string>
+#include <thread>
+#include <fstream>
 
 #ifndef PR_SET_IO_FLUSHER
 #define PR_SET_IO_FLUSHER 57
 #endif
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+namespace
+{
+    void print_usage()
+    {
+        std::cerr << "Usage: ./fuseuring [backing file path] [fuse mount path] [backing file size] [fuse max ios] [fuse max_background] [number of threads] [options...]" << std::endl;
+        std::cerr << "Options:" << std::endl;
+        std::cerr << "  --sqpoll                 Use kernel side SQ polling (one poll thread shared by all worker threads)" << std::endl;
+        std::cerr << "  --sqpoll-idle=MS         Idle time before the SQ poll thread sleeps (default 1000)" << std::endl;
+        std::cerr << "  --sqpoll-cpu=CPU         Pin the SQ poll thread to CPU" << std::endl;
+        std::cerr << "  --no-taskrun-flags       Do not setup rings with SINGLE_ISSUER|DEFER_TASKRUN or COOP_TASKRUN" << std::endl;
+        std::cerr << "  --stats-interval=S       Print per thread io_uring statistics every S seconds" << std::endl;
+        std::cerr << "  --wait-policy=NR:USEC[:SPIN_USEC][,...]" << std::endl;
+        std::cerr << "                           Wait for NR completions or USEC microseconds, optionally polling the" << std::endl;
+        std::cerr << "                           completion queue for SPIN_USEC first. One entry per worker thread," << std::endl;
+        std::cerr << "                           the last one is used for all remaining threads" << std::endl;
+        std::cerr << "  --backing-ring[=ENTRIES] Submit backing file I/O to a separate io_uring per worker thread (default 256, at least 64 entries)" << std::endl;
+        std::cerr << "  --backing-iopoll         Poll the backing ring for completions (IORING_SETUP_IOPOLL). Implies --backing-ring and --direct" << std::endl;
+        std::cerr << "  --direct                 Open the backing file with O_DIRECT. Implies --copy-mode" << std::endl;
+        std::cerr << "  --copy-mode              Copy data via registered buffers instead of splicing it to/from the backing file" << std::endl;
+        std::cerr << "  --memfd[=huge]           Keep the backing file in RAM (memfd) instead of at the backing file path," << std::endl;
+        std::cerr << "                           optionally in transparent huge pages" << std::endl;
+        std::cerr << "  --copy-bufs=N            Number of registered buffers per worker thread in copy mode (default 64)" << std::endl;
+        std::cerr << "  --cache-size=MB          Size of the in-process block read cache (default 0, disabled)" << std::endl;
+        std::cerr << "  --cache-block-size=KB    Block size of the read cache. Power of two, at least 4 (default 64)" << std::endl;
+        std::cerr << "  --ssd-cache=PATH         Persistent read cache file (index is stored in PATH.idx)" << std::endl;
+        std::cerr << "  --ssd-cache-size=MB      Size of the persistent read cache file (default 1024)" << std::endl;
+        std::cerr << "  --ssd-cache-chunk-size=KB" << std::endl;
+        std::cerr << "                           Chunk size of the persistent read cache. Power of two, at least" << std::endl;
+        std::cerr << "                           the read cache block size (default 1024)" << std::endl;
+        std::cerr << "  --readahead[=MAX_KB]     Read ahead of sequential read streams, with a window of up to MAX_KB (default 8192)" << std::endl;
+        std::cerr << "  --readahead-streams=N    Number of concurrent sequential streams to track (default 16)" << std::endl;
+        std::cerr << "  --write-coalesce[=USEC]  Merge contiguous or overlapping writes into one vectored backing write. Implies" << std::endl;
+        std::cerr << "                           --copy-mode. Collects writes for USEC microseconds if set, otherwise per completion batch" << std::endl;
+        std::cerr << "  --journal=PATH           Write-back journal file. Writes are acknowledged once they are in the journal" << std::endl;
+        std::cerr << "                           and applied to the backing file in the background. Implies --copy-mode" << std::endl;
+        std::cerr << "  --journal-size=MB        Size of the write-back journal (default 1024)" << std::endl;
+        std::cerr << "  --scheduler[=N]          Limit backing operations in flight per worker thread to N (default 32) and" << std::endl;
+        std::cerr << "                           dispatch waiting reads before writes, by deadline and offset" << std::endl;
+        std::cerr << "  --sched-deadlines=READ_MS:SYNC_WRITE_MS:ASYNC_WRITE_MS" << std::endl;
+        std::cerr << "                           Scheduler deadlines per request class (default 10:50:500)" << std::endl;
+        std::cerr << "  --qos=LIMITS             Volume IOPS/bandwidth limits, e.g. read_iops=1000,write_mbps=50,burst_s=2" << std::endl;
+        std::cerr << "                           (keys read_iops, write_iops, read_mbps, write_mbps, burst_s)" << std::endl;
+        std::cerr << "  --qos-file=PATH          Read the QoS limits from PATH instead. Re-read on SIGHUP" << std::endl;
+        std::cerr << "  --cbt=PATH               Track changed blocks for incremental backups in bitmap file PATH" << std::endl;
+        std::cerr << "  --cbt-block-size=KB      Block size of changed block tracking. Power of two, at least 4 (default 64)" << std::endl;
+        std::cerr << "  --heat-map[=REGION_KB]   Track read/write heat per volume region of REGION_KB (default 1024)" << std::endl;
+        std::cerr << "  --heat-half-life=SEC     Half-life of the heat values (default 3600)" << std::endl;
+        std::cerr << "  --heat-top=N             Number of regions in the heat map summary (default 20)" << std::endl;
+        std::cerr << "  --stripe=PATH[,PATH...]  Stripe the volume across the backing file and the files/devices PATH. Implies" << std::endl;
+        std::cerr << "                           --copy-mode. Each file has a size of SIZE divided by the number of files" << std::endl;
+        std::cerr << "  --stripe-size=KB         Stripe size. Power of two, at least 4 (default 64)" << std::endl;
+        std::cerr << "  --mirror=PATH            Mirror the volume on the backing file and file/device PATH. Implies --copy-mode" << std::endl;
+        std::cerr << "  --mirror-quorum=N        Number of mirror legs (1 or 2) a write has to be on before it is acknowledged (default 2)" << std::endl;
+        std::cerr << "  --mirror-hedge=P         Read from the other mirror leg too if a read takes longer than the P-th percentile" << std::endl;
+        std::cerr << "                           of recent reads (default 95, 0 disables hedged reads)" << std::endl;
+        std::cerr << "  --mirror-resync          Copy the backing file to the mirror leg completely after startup" << std::endl;
+        std::cerr << "  --vhd                    The backing file is a VHD image (fixed, dynamic or differencing). SIZE is" << std::endl;
+        std::cerr << "                           ignored. Implies --copy-mode" << std::endl;
+        std::cerr << "  --chunk-store            The backing file is a compressed chunk store. SIZE is ignored. Implies --copy-mode" << std::endl;
+        std::cerr << "  --chunk-cache=MB         Size of the decompressed chunk cache (default 256)" << std::endl;
+        std::cerr << "  --chunk-threads=N        Number of decompression threads (default one per CPU)" << std::endl;
+        std::cerr << "  --chunk-overlay=PATH     Write chunks to the uncompressed overlay file PATH. Read-only without it" << std::endl;
+        std::cerr << "  --chunk-pack=SRC         Compress file/device SRC into a new chunk store at the backing file path before" << std::endl;
+        std::cerr << "                           mounting. Implies --chunk-store" << std::endl;
+        std::cerr << "  --chunk-size=KB          Chunk size of --chunk-pack. Power of two, 4 to 65536 (default 128)" << std::endl;
+        std::cerr << "  --chunk-algo=ALGO        Compression of --chunk-pack, lz4 or zstd (default lz4)" << std::endl;
+        std::cerr << "  --chunk-level=N          zstd compression level of --chunk-pack (default 3)" << std::endl;
+        std::cerr << "  --snapshot=PATH          Copy-on-write snapshots with the overlay file PATH. Writing \"create\" or \"delete\"" << std::endl;
+        std::cerr << "                           to snapshot_ctl in the mount creates/deletes one. Implies --copy-mode" << std::endl;
+        std::cerr << "  --snapshot-block-size=KB Block size of the snapshot overlay. Power of two, 4 to 1024 (default 64)" << std::endl;
+        std::cerr << "  --dedup                  The backing file is a deduplicating block store. Created with SIZE if it is" << std::endl;
+        std::cerr << "                           empty, otherwise SIZE is ignored. Implies --copy-mode" << std::endl;
+        std::cerr << "  --dedup-block-size=KB    Block size of a new dedup store. Power of two, 4 to 1024 (default 64)" << std::endl;
+        std::cerr << "  --dedup-threads=N        Number of hash threads (default one per CPU)" << std::endl;
+        std::cerr << "  --dedup-no-verify        Trust the hash instead of comparing blocks with the data they are deduplicated to" << std::endl;
+        std::cerr << "  --integrity=PATH         Store a CRC32C of every block in the side file PATH and check it on read. Implies --copy-mode" << std::endl;
+        std::cerr << "  --integrity-block-size=KB" << std::endl;
+        std::cerr << "                           Block size of the checksums. Power of two, 4 to 1024 (default 4)" << std::endl;
+        std::cerr << "  --integrity-scrub-rate=MB" << std::endl;
+        std::cerr << "                           MB/s the scrubber reads and checks the volume with, 0 to disable (default 16)" << std::endl;
+        std::cerr << "  --encrypt-key=PATH       Encrypt the backing file with XTS-AES (needs AES-NI). PATH has 32 bytes of key for" << std::endl;
+        std::cerr << "                           AES-128 or 64 bytes for AES-256. Implies --copy-mode" << std::endl;
+        std::cerr << "  --nbd[=EXPORT]           The backing file is the unix socket of an NBD server (nbdkit, qemu-nbd). Serves" << std::endl;
+        std::cerr << "                           the export EXPORT (default \"\"). SIZE is ignored. Implies --copy-mode" << std::endl;
+        std::cerr << "  --s3                     The backing file is the URL http://HOST[:PORT]/BUCKET[/PREFIX] of an S3 bucket." << std::endl;
+        std::cerr << "                           Credentials are taken from AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY. Implies --copy-mode" << std::endl;
+        std::cerr << "  --s3-block-size=KB       Size of the S3 objects. Power of two, 4 to 65536 (default 64)" << std::endl;
+        std::cerr << "  --s3-connections=N       Connections per worker thread (default 16)" << std::endl;
+        std::cerr << "  --s3-region=REGION       Region the requests are signed for (default us-east-1)" << std::endl;
+    }
+
+    // Allocates the memory of the memfd fd with transparent huge pages.
+    // MFD_HUGETLB files cannot be written with write(), splice or io_uring,
+    // so the pages of the shmem file are faulted in through a MADV_HUGEPAGE
+    // mapping instead. Rounds size up to whole huge pages
+    bool populate_huge_pages(int fd, int64_t& size)
+    {
+        const int64_t huge_page_size = 2*1024*1024;
+        size = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+
+        std::ifstream shmem_enabled("/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+        std::string policy;
+        std::getline(shmem_enabled, policy);
+        if(policy.find("[never]")!=std::string::npos ||
+            policy.find("[deny]")!=std::string::npos)
+        {
+            std::cerr << "Transparent huge pages are disabled for shmem (" << policy
+                << "). The memfd has 4KB pages" << std::endl;
+        }
+
+        if(ftruncate(fd, size)!=0)
+        {
+            perror("Error resizing memfd");
+            return false;
+        }
+
+        void* mem = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if(mem==MAP_FAILED)
+        {
+            perror("Error mapping memfd");
+            return false;
+        }
+
+        if(madvise(mem, size, MADV_HUGEPAGE)!=0)
+            perror("Error enabling huge pages of memfd");
+
+        bool ret = true;
+        if(madvise(mem, size, MADV_POPULATE_WRITE)!=0)
+        {
+            perror("Error allocating memfd");
+            ret = false;
+        }
+
+        munmap(mem, size);
+        return ret;
+    }
+
+    bool parse_wait_policies(const std::string& val, std::vector<FuseuringWaitPolicy>& wait_policies)
+    {
+        size_t pos = 0;
+        while(pos<=val.size())
+        {
+            size_t next = val.find(',', pos);
+            if(next==std::string::npos)
+                next = val.size();
+
+            FuseuringWaitPolicy wait_policy;
+            int n = sscanf(val.substr(pos, next-pos).c_str(), "%u:%u:%u",
+                    &wait_policy.wait_nr, &wait_policy.wait_usec, &wait_policy.spin_usec);
+            if(n<2 || wait_policy.wait_nr==0)
+                return false;
+
+            if(wait_policy.wait_nr>1 && wait_policy.wait_usec==0)
+            {
+                std::cerr << "Waiting for more than one completion needs a timeout" << std::endl;
+                return false;
+            }
+
+            wait_policies.push_back(wait_policy);
+            pos = next+1;
+        }
+        return !wait_policies.empty();
+    }
+
+    bool parse_option(const std::string& arg, FuseuringSettings& settings)
+    {
+        std::string name = arg;
+        std::string val;
+        size_t eq = arg.find('=');
+        if(eq!=std::string::npos)
+        {
+            name = arg.substr(0, eq);
+            val = arg.substr(eq+1);
+        }
+
+        if(name=="--sqpoll")
+        {
+            settings.sqpoll = true;
+        }
+        else if(name=="--sqpoll-idle")
+        {
+            settings.sqpoll = true;
+            settings.sqpoll_idle_ms = static_cast<unsigned int>(atoi(val.c_str()));
+        }
+        else if(name=="--sqpoll-cpu")
+        {
+            settings.sqpoll = true;
+            settings.sqpoll_cpu = atoi(val.c_str());
+        }
+        else if(name=="--no-taskrun-flags")
+        {
+            settings.taskrun_flags = false;
+        }
+        else if(name=="--stats-interval")
+        {
+            settings.stats_interval_s = static_cast<unsigned int>(atoi(val.c_str()));
+        }
+        else if(name=="--wait-policy")
+        {
+            settings.wait_policies.clear();
+            return parse_wait_policies(val, settings.wait_policies);
+        }
+        else if(name=="--backing-ring")
+        {
+            if(val.empty())
+            {
+                settings.backing_ring_entries = 256;
+                return true;
+            }
+
+            char* end;
+            unsigned long entries = strtoul(val.c_str(), &end, 10);
+            if(*end!=0 || val[0]<'0' || val[0]>'9' ||
+                entries<fuse_io_context::max_sqe_batch ||
+                entries>32768)
+            {
+                std::cerr << "--backing-ring needs " << fuse_io_context::max_sqe_batch
+                    << " to 32768 entries" << std::endl;
+                return false;
+            }
+            settings.backing_ring_entries = static_cast<unsigned int>(entries);
+        }
+        else if(name=="--backing-iopoll")
+        {
+            settings.backing_iopoll = true;
+            if(settings.backing_ring_entries==0)
+                settings.backing_ring_entries = 256;
+            settings.direct_io = true;
+            settings.copy_mode = true;
+        }
+        else if(name=="--direct")
+        {
+            settings.direct_io = true;
+            settings.copy_mode = true;
+        }
+        else if(name=="--copy-mode")
+        {
+            settings.copy_mode = true;
+        }
+        else if(name=="--memfd")
+        {
+            if(!val.empty() && val!="huge")
+                return false;
+            settings.memfd = true;
+            settings.memfd_huge_pages = val=="huge";
+        }
+        else if(name=="--copy-bufs")
+        {
+            settings.copy_bufs = static_cast<size_t>(atoi(val.c_str()));
+            if(settings.copy_bufs==0)
+                return false;
+        }
+        else if(name=="--cache-size")
+        {
+            settings.block_cache_size = static_cast<size_t>(atoll(val.c_str()))*1024*1024;
+        }
+        else if(name=="--cache-block-size")
+        {
+            size_t block_size = static_cast<size_t>(atoll(val.c_str()))*1024;
+            if(block_size<4096 ||
+                (block_size & (block_size-1))!=0)
+            {
+                std::cerr << "Cache block size has to be a power of two and at least 4KB" << std::endl;
+                return false;
+            }
+            settings.block_cache_block_size = block_size;
+        }
+        else if(name=="--ssd-cache")
+        {
+            settings.ssd_cache_path = val;
+            if(settings.ssd_cache_size==0)
+                settings.ssd_cache_size = 1024ULL*1024*1024;
+        }
+        else if(name=="--ssd-cache-size")
+        {
+            settings.ssd_cache_size = static_cast<uint64_t>(atoll(val.c_str()))*1024*1024;
+        }
+        else if(name=="--ssd-cache-chunk-size")
+        {
+            size_t chunk_size = static_cast<size_t>(atoll(val.c_str()))*1024;
+            if(chunk_size<4096 ||
+                (chunk_size & (chunk_size-1))!=0)
+            {
+                std::cerr << "SSD cache chunk size has to be a power of two and at least 4KB" << std::endl;
+                return false;
+            }
+            settings.ssd_cache_chunk_size = chunk_size;
+        }
+        else if(name=="--readahead")
+        {
+            settings.readahead_max = val.empty() ? 8192*1024 : static_cast<uint64_t>(atoll(val.c_str()))*1024;
+        }
+        else if(name=="--readahead-streams")
+        {
+            settings.readahead_streams = static_cast<size_t>(atoi(val.c_str()));
+            if(settings.readahead_streams==0)
+                return false;
+        }
+        else if(name=="--write-coalesce")
+        {
+            settings.write_coalesce = true;
+            settings.copy_mode = true;
+            settings.write_coalesce_window_us = static_cast<unsigned int>(atoi(val.c_str()));
+        }
+        else if(name=="--journal")
+        {
+            settings.journal_path = val;
+            settings.copy_mode = true;
+        }
+        else if(name=="--journal-size")
+        {
+            settings.journal_size = static_cast<uint64_t>(atoll(val.c_str()))*1024*1024;
+        }
+        else if(name=="--scheduler")
+        {
+            settings.sched_max_inflight = val.empty() ? 32 : static_cast<size_t>(atoi(val.c_str()));
+            if(settings.sched_max_inflight==0)
+                return false;
+        }
+        else if(name=="--qos")
+        {
+            QosLimits limits;
+            if(!QosLimits::parse(val, limits))
+                return false;
+            settings.qos_spec = val;
+        }
+        else if(name=="--qos-file")
+        {
+            settings.qos_path = val;
+        }
+        else if(name=="--cbt")
+        {
+            settings.cbt_path = val;
+        }
+        else if(name=="--cbt-block-size")
+        {
+            uint64_t block_size = static_cast<uint64_t>(atoll(val.c_str()))*1024;
+            if(block_size<4096 ||
+                (block_size & (block_size-1))!=0)
+            {
+                std::cerr << "Changed block tracking block size has to be a power of two and at least 4KB" << std::endl;
+                return false;
+            }
+            settings.cbt_block_size = block_size;
+        }
+        else if(name=="--heat-map")
+        {
+            settings.heat_region_size = val.empty() ? 1024*1024 : static_cast<uint64_t>(atoll(val.c_str()))*1024;
+            if(settings.heat_region_size==0)
+                return false;
+        }
+        else if(name=="--heat-half-life")
+        {
+            settings.heat_half_life_s = static_cast<unsigned int>(atoi(val.c_str()));
+        }
+        else if(name=="--heat-top")
+        {
+            settings.heat_top_n = static_cast<size_t>(atoi(val.c_str()));
+        }
+        else if(name=="--stripe")
+        {
+            size_t start = 0;
+            while(start<=val.size())
+            {
+                size_t end = val.find(',', start);
+                if(end==std::string::npos)
+                    end = val.size();
+                if(end==start)
+                    return false;
+                settings.stripe_paths.push_back(val.substr(start, end-start));
+                start = end + 1;
+            }
+            settings.copy_mode = true;
+        }
+        else if(name=="--stripe-size")
+        {
+            uint64_t stripe_size = static_cast<uint64_t>(atoll(val.c_str()))*1024;
+            if(stripe_size<4096 ||
+                (stripe_size & (stripe_size-1))!=0)
+            {
+                std::cerr << "Stripe size has to be a power of two and at least 4KB" << std::endl;
+                return false;
+            }
+            settings.stripe_size = stripe_size;
+        }
+        else if(name=="--mirror")
+        {
+            settings.mirror_path = val;
+            settings.copy_mode = true;
+        }
+        else if(name=="--mirror-quorum")
+        {
+            settings.mirror_quorum = static_cast<unsigned int>(atoi(val.c_str()));
+            if(settings.mirror_quorum<1 || settings.mirror_quorum>2)
+                return false;
+        }
+        else if(name=="--mirror-hedge")
+        {
+            settings.mirror_hedge_percentile = static_cast<unsigned int>(atoi(val.c_str()));
+            if(settings.mirror_hedge_percentile>=100)
+                return false;
+        }
+        else if(name=="--mirror-resync")
+        {
+            settings.mirror_resync = true;
+        }
+        else if(name=="--vhd")
+        {
+            settings.vhd = true;
+            settings.copy_mode = true;
+        }
+        else if(name=="--chunk-store")
+        {
+            settings.chunk_store = true;
+            settings.copy_mode = true;
+        }
+        else if(name=="--chunk-cache")
+        {
+            settings.chunk_cache_size = static_cast<uint64_t>(atoll(val.c_str()))*1024*1024;
+        }
+        else if(name=="--chunk-threads")
+        {
+            settings.chunk_threads = static_cast<size_t>(atoi(val.c_str()));
+        }
+        else if(name=="--chunk-overlay")
+        {
+            settings.chunk_overlay_path = val;
+        }
+        else if(name=="--chunk-pack")
+        {
+            settings.chunk_pack_path = val;
+            settings.chunk_store = true;
+            settings.copy_mode = true;
+        }
+        else if(name=="--chunk-size")
+        {
+            uint64_t chunk_size = static_cast<uint64_t>(atoll(val.c_str()))*1024;
+            if(chunk_size<4096 || chunk_size>64*1024*1024 ||
+                (chunk_size & (chunk_size-1))!=0)
+            {
+                std::cerr << "Chunk size has to be a power of two between 4 and 65536 KB" << std::endl;
+                return false;
+            }
+            settings.chunk_size = static_cast<uint32_t>(chunk_size);
+        }
+        else if(name=="--chunk-algo")
+        {
+            ChunkStore::Algorithm algorithm;
+            if(!ChunkStore::parse_algorithm(val, algorithm))
+                return false;
+            settings.chunk_algorithm = val;
+        }
+        else if(name=="--chunk-level")
+        {
+            settings.chunk_level = atoi(val.c_str());
+        }
+        else if(name=="--snapshot")
+        {
+            settings.snapshot_overlay_path = val;
+            settings.copy_mode = true;
+        }
+        else if(name=="--snapshot-block-size")
+        {
+            uint64_t block_size = static_cast<uint64_t>(atoll(val.c_str()))*1024;
+            if(block_size<4096 || block_size>1024*1024 ||
+                (block_size & (block_size-1))!=0)
+            {
+                std::cerr << "Snapshot block size has to be a power of two between 4 and 1024 KB" << std::endl;
+                return false;
+            }
+            settings.snapshot_block_size = static_cast<uint32_t>(block_size);
+        }
+        else if(name=="--dedup")
+        {
+            settings.dedup = true;
+            settings.copy_mode = true;
+        }
+        else if(name=="--dedup-block-size")
+        {
+            uint64_t block_size = static_cast<uint64_t>(atoll(val.c_str()))*1024;
+            if(block_size<4096 || block_size>1024*1024 ||
+                (block_size & (block_size-1))!=0)
+            {
+                std::cerr << "Dedup block size has to be a power of two between 4 and 1024 KB" << std::endl;
+                return false;
+            }
+            settings.dedup_block_size = static_cast<uint32_t>(block_size);
+        }
+        else if(name=="--dedup-threads")
+        {
+            settings.dedup_threads = static_cast<size_t>(atoi(val.c_str()));
+        }
+        else if(name=="--dedup-no-verify")
+        {
+            settings.dedup_verify = false;
+        }
+        else if(name=="--integrity")
+        {
+            settings.integrity_path = val;
+            settings.copy_mode = true;
+        }
+        else if(name=="--integrity-block-size")
+        {
+            uint64_t block_size = static_cast<uint64_t>(atoll(val.c_str()))*1024;
+            if(block_size<4096 || block_size>1024*1024 ||
+                (block_size & (block_size-1))!=0)
+            {
+                std::cerr << "Integrity block size has to be a power of two between 4 and 1024 KB" << std::endl;
+                return false;
+            }
+            settings.integrity_block_size = static_cast<uint32_t>(block_size);
+        }
+        else if(name=="--integrity-scrub-rate")
+        {
+            settings.integrity_scrub_rate = static_cast<uint64_t>(atoll(val.c_str()))*1024*1024;
+        }
+        else if(name=="--encrypt-key")
+        {
+            settings.encrypt_key_path = val;
+            settings.copy_mode = true;
+        }
+        else if(name=="--nbd")
+        {
+            settings.nbd = true;
+            settings.nbd_export = val;
+            settings.copy_mode = true;
+        }
+        else if(name=="--s3")
+        {
+            settings.s3 = true;
+            settings.copy_mode = true;
+        }
+        else if(name=="--s3-block-size")
+        {
+            uint64_t block_size = static_cast<uint64_t>(atoll(val.c_str()))*1024;
+            if(block_size<4096 || block_size>64*1024*1024 ||
+                (block_size & (block_size-1))!=0)
+            {
+                std::cerr << "S3 block size has to be a power of two between 4 and 65536 KB" << std::endl;
+                return false;
+            }
+            settings.s3_block_size = static_cast<uint32_t>(block_size);
+        }
+        else if(name=="--s3-connections")
+        {
+            settings.s3_connections = static_cast<size_t>(atoi(val.c_str()));
+            if(settings.s3_connections==0)
+            {
+                std::cerr << "Need at least one S3 connection" << std::endl;
+                return false;
+            }
+        }
+        else if(name=="--s3-region")
+        {
+            settings.s3_region = val;
+        }
+        else if(name=="--sched-deadlines")
+        {
+            unsigned int read_ms, sync_write_ms, async_write_ms;
+            if(sscanf(val.c_str(), "%u:%u:%u", &read_ms, &sync_write_ms, &async_write_ms)!=3)
+                return false;
+
+            settings.sched_expire_us = {static_cast<int64_t>(read_ms)*1000,
+                static_cast<int64_t>(sync_write_ms)*1000, static_cast<int64_t>(async_write_ms)*1000};
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+}
+
 int main(int argc, char* argv[])
 {
-    if(argc<6)
+    if(argc<7)
+    {
+        std::cerr << "Not enough arguments" << std::endl;
+        print_usage();
+        return 101;
+    }
+
+    FuseuringSettings settings;
+    for(int i=7;i<argc;++i)
+    {
+        if(!parse_option(argv[i], settings))
+        {
+            std::cerr << "Unknown option " << argv[i] << std::endl;
+            print_usage();
+            return 101;
+        }
+    }
+
+    if(!settings.ssd_cache_path.empty() &&
+        settings.block_cache_size>0 &&
+        settings.ssd_cache_chunk_size<settings.block_cache_block_size)
+    {
+        std::cerr << "SSD cache chunk size has to be at least the read cache block size" << std::endl;
+        return 101;
+    }
+
+    // Features that provide the volume. At most one of them can be used, and
+    // not together with the features that hold back or redirect writes
+    struct Feature
+    {
+        const char* name;
+        bool enabled;
+    };
+
+    const Feature volume_features[] = {
+        {"striping", !settings.stripe_paths.empty()},
+        {"mirroring", !settings.mirror_path.empty()},
+        {"VHD images", settings.vhd},
+        {"chunk stores", settings.chunk_store},
+        {"snapshots", !settings.snapshot_overlay_path.empty()},
+        {"dedup stores", settings.dedup},
+        {"integrity checksums", !settings.integrity_path.empty()},
+        {"encryption", !settings.encrypt_key_path.empty()},
+        {"NBD", settings.nbd},
+        {"S3", settings.s3}
+    };
+
+    const Feature write_features[] = {
+        {"the SSD cache", !settings.ssd_cache_path.empty()},
+        {"write coalescing", settings.write_coalesce},
+        {"the write-back journal", !settings.journal_path.empty()}
+    };
+
+    const Feature* volume_feature = nullptr;
+    for(const Feature& feature: volume_features)
+    {
+        if(!feature.enabled)
+            continue;
+
+        if(volume_feature!=nullptr)
+        {
+            std::cerr << "Cannot combine " << volume_feature->name << " with " << feature.name << std::endl;
+            return 101;
+        }
+
+        volume_feature = &feature;
+    }
+
+    if(volume_feature!=nullptr)
+    {
+        for(const Feature& feature: write_features)
+        {
+            if(feature.enabled)
+            {
+                std::cerr << "Cannot combine " << volume_feature->name << " with " << feature.name << std::endl;
+                return 101;
+            }
+        }
+    }
+
+    // Writes go to the journal first, so the coalescer would never see them
+    if(settings.write_coalesce &&
+        !settings.journal_path.empty())
+    {
+        std::cerr << "Cannot combine write coalescing with the write-back journal" << std::endl;
+        return 101;
+    }
+
+    if(settings.memfd &&
+        (settings.direct_io || settings.vhd || settings.chunk_store ||
+            settings.nbd || settings.s3))
     {
-        std::cerr << "Not enough arguments ./fuseuring [backing file path] [fuse mount path] [backing file size] [fuse max ios] [fuse max_background] [number of threads]" << std::endl;
+        std::cerr << "A memfd backing file cannot be combined with O_DIRECT, VHD images, chunk stores, NBD or S3" << std::endl;
         return 101;
     }
 
-    int backing_fd = open(argv[1], O_CLOEXEC|O_CREAT|O_RDWR, S_IRWXU);
-    //int backing_fd = memfd_create("backing_file", MFD_CLOEXEC);
+    if(settings.vhd)
+        settings.vhd_path = argv[1];
+
+    if(settings.nbd)
+        settings.nbd_socket_path = argv[1];
+
+    if(settings.s3)
+        settings.s3_url = argv[1];
+
+    if(!settings.chunk_pack_path.empty())
+    {
+        ChunkStore::Algorithm algorithm;
+        ChunkStore::parse_algorithm(settings.chunk_algorithm, algorithm);
+        size_t pack_threads = settings.chunk_threads>0 ? settings.chunk_threads : std::thread::hardware_concurrency();
+        if(!ChunkStore::pack(settings.chunk_pack_path, argv[1], settings.chunk_size,
+                algorithm, settings.chunk_level, pack_threads))
+            return 1;
+    }
+
+    // VHD images and chunk stores have to exist. Chunk stores are never written
+    int backing_flags = O_CLOEXEC|(settings.direct_io ? O_DIRECT : 0);
+    if(settings.chunk_store)
+        backing_flags |= O_RDONLY;
+    else if(settings.vhd)
+        backing_flags |= O_RDWR;
+    else
+        backing_flags |= O_CREAT|O_RDWR;
+
+    // The first NBD connection is the backing file. With S3 it is a
+    // connection to the endpoint that is only used to check the bucket
+    int backing_fd;
+    if(settings.nbd)
+        backing_fd = NbdBackend::connect_socket(argv[1]);
+    else if(settings.s3)
+        backing_fd = S3Backend::connect_endpoint(argv[1]);
+    else if(settings.memfd)
+        backing_fd = memfd_create(argv[1], MFD_CLOEXEC);
+    else
+        backing_fd = open(argv[1], backing_flags, S_IRWXU);
 
     if(backing_fd==-1)
     {
-        perror("Error opening backing file");
+        if(settings.memfd)
+            perror("Error creating memfd");
+        else if(!settings.nbd && !settings.s3)
+            perror("Error opening backing file");
         return 1;
     }    
 
     int64_t backing_file_size = atoll(argv[3]);
 
-    int rc = posix_fallocate(backing_fd, 0, backing_file_size);
+    if(!settings.stripe_paths.empty())
+    {
+        // Each stripe file has the same size, a multiple of the stripe size
+        int64_t n_files = static_cast<int64_t>(settings.stripe_paths.size() + 1);
+        int64_t stripe_size = static_cast<int64_t>(settings.stripe_size);
+        backing_file_size = (backing_file_size + stripe_size*n_files - 1) / (stripe_size*n_files) * stripe_size;
+    }
+
+    // Encrypted files are whole sectors
+    if(!settings.encrypt_key_path.empty())
+        backing_file_size = (backing_file_size + Encryption::sector_size - 1) / Encryption::sector_size * Encryption::sector_size;
+
+    // S3 volumes are whole objects
+    if(settings.s3)
+    {
+        int64_t block_size = static_cast<int64_t>(settings.s3_block_size);
+        backing_file_size = (backing_file_size + block_size - 1) / block_size * block_size;
+        settings.s3_size = static_cast<uint64_t>(backing_file_size);
+    }
+
+    // New dedup stores are created with the size, existing ones have it in their header
+    if(settings.dedup)
+        settings.dedup_size = static_cast<uint64_t>(backing_file_size);
+
+    if(settings.memfd_huge_pages &&
+        !populate_huge_pages(backing_fd, backing_file_size))
+        return 1;
+
+    int rc = 0;
+    // The size of VHD images is in their footer, that of chunk and dedup stores in their header.
+    // NBD servers send it in the handshake. S3 volumes have the size SIZE
+    if(!settings.vhd && !settings.chunk_store && !settings.dedup && !settings.nbd && !settings.s3)
+        rc = posix_fallocate(backing_fd, 0, backing_file_size);
     if(rc!=0)
     {
         std::cerr << "Error allocating 1GB for backing file rc: " << rc << std::endl;
@@ -63,7 +811,8 @@ int main(int argc, char* argv[])
     size_t n_threads = static_cast<size_t>(atoi(argv[6]));
 
     rc = fuseuring_main(backing_fd, argv[2], fuse_max_ios, 
-        fuse_max_background, fuse_max_background+1000, n_threads);
+        fuse_max_background, fuse_max_background+1000, n_threads,
+        settings);
 
     close(backing_fd);
 
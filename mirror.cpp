@@ -0,0 +1,780 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "mirror.h"
+#include "io_util.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <limits>
+#include <utility>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+namespace
+{
+    // Unit of the dirty bitmap and of the resync
+    const uint64_t mirror_region_size = 1024*1024;
+    const uint64_t no_region = std::numeric_limits<uint64_t>::max();
+    // Number of recent read latencies per leg the hedge percentile is taken from
+    const size_t hedge_samples = 128;
+    const size_t hedge_update_interval = 32;
+    const int64_t min_hedge_us = 100;
+    // Every probe_interval-th read goes to the slower leg, to keep its average current
+    const uint64_t probe_interval = 64;
+    // The resync retries regions that had writes in flight or failed after this long
+    const unsigned int resync_retry_ms = 1000;
+}
+
+namespace
+{
+    // Per operation state shared by the coroutines of the legs, the hedge
+    // timer and the coroutine waiting for the result. All of them run on the
+    // same worker thread. Legs that may still run after the operation
+    // returned use buffers owned by the state
+    struct MirrorOpState
+    {
+        MirrorOpState()
+            : write(false), bufs{nullptr, nullptr}, res{-EIO, -EIO},
+                issued{false, false}, done{false, false}, pending(0),
+                timer_fired(false), hedged(false),
+                own_bufs{{nullptr, &free}, {nullptr, &free}} {}
+
+        bool write;
+        char* bufs[2];
+        int res[2];
+        bool issued[2];
+        bool done[2];
+        size_t pending;
+        bool timer_fired;
+        bool hedged;
+        std::coroutine_handle<> awaiter;
+        std::unique_ptr<char, decltype(&free)> own_bufs[2];
+    };
+
+    struct StateAwaiter
+    {
+        StateAwaiter(MirrorOpState& state) noexcept
+            : state(state) {}
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+        {
+            state.awaiter = p_awaiter;
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+
+    private:
+        MirrorOpState& state;
+    };
+
+    void wake(MirrorOpState& state)
+    {
+        if(state.awaiter)
+            std::exchange(state.awaiter, nullptr).resume();
+    }
+
+    fuse_io_context::io_uring_task_discard<int> leg_io(fuse_io_context& io, std::shared_ptr<MirrorOpState> state,
+        size_t leg, int buf_idx, uint64_t offset, uint64_t len)
+    {
+        Mirror* mirror = io.fuse_ring.mirror;
+        int64_t start_us = fuse_io_context::get_monotonic_us();
+
+        int rc = -EIO;
+        io_uring_sqe* sqe = co_await io.get_backing_sqe();
+        if(sqe!=nullptr)
+        {
+            int fd = io.fuse_ring.files.mirror_legs[leg];
+            char* buf = state->bufs[leg];
+            // Whole pages for O_DIRECT
+            uint64_t io_len = state->write ? len : round_up<uint64_t>(len, 4096);
+
+            if(state->write && buf_idx>=0)
+                io_uring_prep_write_fixed(sqe, fd, buf, io_len, offset, buf_idx);
+            else if(state->write)
+                io_uring_prep_write(sqe, fd, buf, io_len, offset);
+            else if(buf_idx>=0)
+                io_uring_prep_read_fixed(sqe, fd, buf, io_len, offset, buf_idx);
+            else
+                io_uring_prep_read(sqe, fd, buf, io_len, offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            rc = co_await io.complete(sqe);
+        }
+
+        // A leg shorter than the volume fails, so the other leg is used
+        if(rc>=0 && static_cast<uint64_t>(rc)<len)
+            rc = -EIO;
+        else if(rc>=0)
+            rc = static_cast<int>(len);
+
+        if(state->write)
+        {
+            mirror->write_done(leg, offset, len, rc>=0);
+        }
+        else
+        {
+            mirror->read_done(io.fuse_ring.thread_idx, leg, offset, len,
+                fuse_io_context::get_monotonic_us() - start_us, rc>=0);
+        }
+
+        state->res[leg] = rc;
+        state->done[leg] = true;
+        --state->pending;
+        wake(*state);
+        co_return 0;
+    }
+
+    fuse_io_context::io_uring_task_discard<int> hedge_timer(fuse_io_context& io, std::shared_ptr<MirrorOpState> state,
+        int64_t us)
+    {
+        struct __kernel_timespec ts;
+        ts.tv_sec = us / 1000000;
+        ts.tv_nsec = (us % 1000000)*1000;
+
+        io_uring_sqe* sqe = co_await io.get_sqe();
+        if(sqe==nullptr)
+            co_return -1;
+
+        io_uring_prep_timeout(sqe, &ts, 0, 0);
+        co_await io.complete(sqe);
+
+        state->timer_fired = true;
+        wake(*state);
+        co_return 0;
+    }
+
+    void start_leg(fuse_io_context& io, std::shared_ptr<MirrorOpState>& state, size_t leg,
+        char* buf, int buf_idx, uint64_t offset, uint64_t len)
+    {
+        state->bufs[leg] = buf;
+        state->issued[leg] = true;
+        ++state->pending;
+        leg_io(io, state, leg, buf_idx, offset, len);
+    }
+}
+
+Mirror::Mirror(uint64_t volume_size, unsigned int quorum, unsigned int hedge_percentile,
+    size_t n_threads)
+    : volume_size(volume_size),
+        n_regions(std::max(static_cast<uint64_t>(1), (volume_size + mirror_region_size - 1) / mirror_region_size)),
+        quorum(quorum), hedge_percentile(hedge_percentile), threads(n_threads),
+        n_dirty(0), resync_region(no_region), degraded(false), resynced_bytes(0),
+        hedged_reads(0), hedge_wins(0), read_errors(0), write_errors(0)
+{
+    for(size_t leg=0;leg<2;++leg)
+    {
+        pending[leg] = std::make_unique<std::atomic<uint32_t>[]>(n_regions);
+        for(uint64_t r=0;r<n_regions;++r)
+            pending[leg][r] = 0;
+        failed[leg] = false;
+    }
+
+    uint64_t n_words = (n_regions + 63) / 64;
+    dirty = std::make_unique<std::atomic<uint64_t>[]>(n_words);
+    for(uint64_t i=0;i<n_words;++i)
+        dirty[i] = 0;
+
+    for(ThreadState& ts: threads)
+    {
+        for(size_t leg=0;leg<2;++leg)
+        {
+            ts.avg_us[leg] = 0;
+            ts.hedge_us[leg] = 0;
+            ts.samples[leg].resize(hedge_samples);
+            ts.n_samples[leg] = 0;
+        }
+        ts.reads = 0;
+    }
+}
+
+void Mirror::set_dirty(uint64_t offset, uint64_t len)
+{
+    uint64_t first = std::min(n_regions - 1, offset / mirror_region_size);
+    uint64_t last = len>0 ? std::min(n_regions - 1, (offset + len - 1) / mirror_region_size) : first;
+    for(uint64_t r=first;r<=last;++r)
+    {
+        uint64_t bit = 1ULL << (r % 64);
+        if((dirty[r / 64].fetch_or(bit) & bit)==0)
+            ++n_dirty;
+    }
+}
+
+void Mirror::resync_all(size_t leg)
+{
+    std::scoped_lock lock(mutex);
+    set_dirty(0, volume_size);
+    failed[leg] = true;
+    degraded = true;
+    waiters.notify_all();
+}
+
+void Mirror::leg_failed(size_t leg, uint64_t offset, uint64_t len)
+{
+    std::scoped_lock lock(mutex);
+    if(!failed[leg])
+    {
+        std::cerr << "Mirror leg " << leg << " failed. Continuing on the other leg" << std::endl;
+    }
+
+    set_dirty(offset, len);
+    failed[leg] = true;
+    degraded = true;
+    waiters.notify_all();
+}
+
+bool Mirror::overlaps_resync(uint64_t first, uint64_t last) const
+{
+    uint64_t r = resync_region.load();
+    return r>=first && r<=last;
+}
+
+int Mirror::begin_write(uint64_t offset, uint64_t len, bool legs[2])
+{
+    uint64_t first = std::min(n_regions - 1, offset / mirror_region_size);
+    uint64_t last = len>0 ? std::min(n_regions - 1, (offset + len - 1) / mirror_region_size) : first;
+
+    // Pairs with the pending check in resync()
+    for(size_t leg=0;leg<2;++leg)
+    {
+        for(uint64_t r=first;r<=last;++r)
+            ++pending[leg][r];
+    }
+
+    if(overlaps_resync(first, last))
+    {
+        for(size_t leg=0;leg<2;++leg)
+        {
+            for(uint64_t r=first;r<=last;++r)
+                --pending[leg][r];
+        }
+        return -EAGAIN;
+    }
+
+    legs[0] = true;
+    legs[1] = true;
+
+    if(!degraded.load())
+        return 0;
+
+    std::scoped_lock lock(mutex);
+    for(size_t leg=0;leg<2;++leg)
+    {
+        if(failed[leg])
+        {
+            legs[leg] = false;
+            for(uint64_t r=first;r<=last;++r)
+                --pending[leg][r];
+        }
+    }
+
+    if(!legs[0] && !legs[1])
+        return -EIO;
+
+    if(!legs[0] || !legs[1])
+    {
+        set_dirty(offset, len);
+        waiters.notify_all();
+    }
+
+    return 0;
+}
+
+fuse_io_context::io_uring_task<int> Mirror::wait_resync_region(fuse_io_context& io,
+    uint64_t offset, uint64_t len)
+{
+    uint64_t first = std::min(n_regions - 1, offset / mirror_region_size);
+    uint64_t last = len>0 ? std::min(n_regions - 1, (offset + len - 1) / mirror_region_size) : first;
+
+    co_return co_await waiters.wait_until(io, mutex, [this, first, last]() {
+        return !overlaps_resync(first, last);
+    });
+}
+
+void Mirror::write_done(size_t leg, uint64_t offset, uint64_t len, bool ok)
+{
+    // Dirty before the region can be resynced
+    if(!ok)
+    {
+        ++write_errors;
+        leg_failed(leg, offset, len);
+    }
+
+    uint64_t first = std::min(n_regions - 1, offset / mirror_region_size);
+    uint64_t last = len>0 ? std::min(n_regions - 1, (offset + len - 1) / mirror_region_size) : first;
+    for(uint64_t r=first;r<=last;++r)
+        --pending[leg][r];
+}
+
+int Mirror::pick_read_leg(size_t thread_idx, uint64_t offset, uint64_t len, int exclude)
+{
+    bool usable[2];
+    for(size_t leg=0;leg<2;++leg)
+        usable[leg] = !failed[leg].load() && static_cast<int>(leg)!=exclude;
+
+    if(exclude>=0)
+        return usable[1-exclude] ? 1-exclude : -1;
+
+    if(!usable[0] && !usable[1])
+        return 0;
+    if(!usable[0])
+        return 1;
+    if(!usable[1])
+        return 0;
+
+    // With quorum 1 a write may be finished before the other leg has the data
+    uint64_t first = std::min(n_regions - 1, offset / mirror_region_size);
+    uint64_t last = len>0 ? std::min(n_regions - 1, (offset + len - 1) / mirror_region_size) : first;
+    uint32_t inflight[2] = {0, 0};
+    for(size_t leg=0;leg<2;++leg)
+    {
+        for(uint64_t r=first;r<=last;++r)
+            inflight[leg] += pending[leg][r].load();
+    }
+
+    if(inflight[0]==0 && inflight[1]>0)
+        return 0;
+    if(inflight[1]==0 && inflight[0]>0)
+        return 1;
+
+    ThreadState& ts = threads[thread_idx];
+    int fast = ts.avg_us[1]<ts.avg_us[0] ? 1 : 0;
+    if(++ts.reads % probe_interval==0)
+        return 1-fast;
+    return fast;
+}
+
+void Mirror::read_done(size_t thread_idx, size_t leg, uint64_t offset, uint64_t len,
+    int64_t latency_us, bool ok)
+{
+    if(!ok)
+    {
+        ++read_errors;
+        leg_failed(leg, offset, len);
+        return;
+    }
+
+    ThreadState& ts = threads[thread_idx];
+    if(ts.avg_us[leg]==0)
+        ts.avg_us[leg] = latency_us;
+    else
+        ts.avg_us[leg] += (latency_us - ts.avg_us[leg]) / 8;
+
+    if(hedge_percentile==0)
+        return;
+
+    ts.samples[leg][ts.n_samples[leg] % hedge_samples] = static_cast<uint32_t>(
+                std::min(latency_us, static_cast<int64_t>(std::numeric_limits<uint32_t>::max())));
+    ++ts.n_samples[leg];
+
+    if(ts.n_samples[leg]>=hedge_samples &&
+        ts.n_samples[leg] % hedge_update_interval==0)
+    {
+        std::vector<uint32_t> sorted = ts.samples[leg];
+        size_t idx = std::min(hedge_samples - 1, hedge_samples*hedge_percentile/100);
+        std::nth_element(sorted.begin(), sorted.begin() + idx, sorted.end());
+        ts.hedge_us[leg] = std::max(min_hedge_us, static_cast<int64_t>(sorted[idx]));
+    }
+}
+
+int Mirror::find_dirty(uint64_t start)
+{
+    uint64_t n_words = (n_regions + 63) / 64;
+    for(uint64_t i=start/64;i<n_words;++i)
+    {
+        uint64_t word = dirty[i].load(std::memory_order_relaxed);
+        if(i==start/64)
+            word &= ~((1ULL << (start % 64)) - 1);
+        if(word!=0)
+            return static_cast<int>(i*64 + __builtin_ctzll(word));
+    }
+    return -1;
+}
+
+fuse_io_context::io_uring_task_discard<int> Mirror::resync(fuse_io_context& io)
+{
+    std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(mirror_region_size), &free);
+    if(!buf)
+    {
+        std::cerr << "Error allocating mirror resync buffer" << std::endl;
+        co_return -1;
+    }
+
+    bool retry = false;
+    while(true)
+    {
+        if(retry &&
+            co_await sleep_ms(io, resync_retry_ms)!=0)
+            co_return -1;
+
+        // Both failed: Nothing to copy from
+        co_await waiters.wait_until(io, mutex, [this]() {
+            return (n_dirty.load()>0 || degraded.load()) &&
+                failed[0].load()!=failed[1].load();
+        });
+
+        bool copied = false;
+        bool failed0 = failed[0].load();
+
+        size_t dst = failed0 ? 0 : 1;
+        size_t src = 1 - dst;
+
+        int err = 0;
+        for(int r=find_dirty(0);r>=0 && err==0;r=find_dirty(r+1))
+        {
+            // Writes to the region wait until it is copied. Pairs with begin_write()
+            resync_region.store(r);
+            if(pending[0][r].load()!=0 ||
+                pending[1][r].load()!=0)
+            {
+                resync_region.store(no_region);
+                waiters.notify_changed(mutex);
+                continue;
+            }
+
+            uint64_t bit = 1ULL << (r % 64);
+            if((dirty[r / 64].fetch_and(~bit) & bit)==0)
+            {
+                resync_region.store(no_region);
+                waiters.notify_changed(mutex);
+                continue;
+            }
+            --n_dirty;
+
+            uint64_t offset = static_cast<uint64_t>(r)*mirror_region_size;
+            uint64_t len = std::min(mirror_region_size, volume_size - offset);
+
+            io_uring_sqe* sqe = co_await io.get_backing_sqe();
+            if(sqe==nullptr)
+                co_return -1;
+
+            io_uring_prep_read(sqe, io.fuse_ring.files.mirror_legs[src], buf.get(),
+                    round_up<uint64_t>(len, 4096), offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            int rc = co_await io.complete(sqe);
+            if(rc>=0 && static_cast<uint64_t>(rc)<len)
+                rc = -EIO;
+
+            if(rc>=0)
+            {
+                sqe = co_await io.get_backing_sqe();
+                if(sqe==nullptr)
+                    co_return -1;
+
+                io_uring_prep_write(sqe, io.fuse_ring.files.mirror_legs[dst], buf.get(),
+                        len, offset);
+                sqe->flags |= IOSQE_FIXED_FILE;
+
+                rc = co_await io.complete(sqe);
+                if(rc>=0 && static_cast<uint64_t>(rc)<len)
+                    rc = -EIO;
+            }
+
+            if(rc<0)
+            {
+                static bool erronce = false;
+                if(!erronce)
+                {
+                    erronce = true;
+                    errno = -rc;
+                    perror("Error resyncing mirror leg. Retrying");
+                }
+
+                if((dirty[r / 64].fetch_or(bit) & bit)==0)
+                    ++n_dirty;
+                err = rc;
+            }
+            else
+            {
+                resynced_bytes += len;
+                copied = true;
+            }
+
+            resync_region.store(no_region);
+            waiters.notify_changed(mutex);
+        }
+
+        // Regions with writes in flight are skipped
+        retry = err!=0 ||
+            (!copied && n_dirty.load()>0);
+        if(err!=0)
+            continue;
+
+        std::scoped_lock lock(mutex);
+        if(n_dirty.load()==0 && failed[dst])
+        {
+            failed[dst] = false;
+            degraded = failed[src].load();
+            std::cout << "Mirror leg " << dst << " is in sync" << std::endl;
+        }
+    }
+}
+
+Mirror::Stats Mirror::get_stats() const
+{
+    Stats ret;
+    ret.failed[0] = failed[0].load(std::memory_order_relaxed);
+    ret.failed[1] = failed[1].load(std::memory_order_relaxed);
+    ret.dirty_regions = n_dirty.load(std::memory_order_relaxed);
+    ret.resynced_bytes = resynced_bytes.load(std::memory_order_relaxed);
+    ret.hedged_reads = hedged_reads.load(std::memory_order_relaxed);
+    ret.hedge_wins = hedge_wins.load(std::memory_order_relaxed);
+    ret.read_errors = read_errors.load(std::memory_order_relaxed);
+    ret.write_errors = write_errors.load(std::memory_order_relaxed);
+    return ret;
+}
+
+namespace
+{
+    // Sets bio.res once the first leg read the data. If the read may be
+    // hedged, both legs read into buffers of the state and the data is
+    // copied, so the slower leg never writes into bio.buf after this returned
+    fuse_io_context::io_uring_task<int> mirror_read(fuse_io_context& io, BlockIo& bio)
+    {
+        Mirror* mirror = io.fuse_ring.mirror;
+        size_t thread_idx = io.fuse_ring.thread_idx;
+
+        std::shared_ptr<MirrorOpState> state = std::make_shared<MirrorOpState>();
+        bio.res = -EIO;
+        // Whole pages for O_DIRECT
+        uint64_t buf_len = round_up<uint64_t>(bio.len, 4096);
+
+        size_t first = static_cast<size_t>(mirror->pick_read_leg(thread_idx, bio.offset, bio.len, -1));
+        size_t second = 1 - first;
+
+        int64_t hedge_us = mirror->get_hedge_us(thread_idx, first);
+        if(hedge_us>0 &&
+            mirror->pick_read_leg(thread_idx, bio.offset, bio.len, static_cast<int>(first))>=0)
+            state->own_bufs[first].reset(alloc_aligned(buf_len));
+
+        if(state->own_bufs[first])
+        {
+            start_leg(io, state, first, state->own_bufs[first].get(), -1, bio.offset, bio.len);
+            hedge_timer(io, state, hedge_us);
+        }
+        else
+        {
+            start_leg(io, state, first, bio.buf, bio.buf_idx, bio.offset, bio.len);
+        }
+
+        while(true)
+        {
+            for(size_t leg: {first, second})
+            {
+                if(state->done[leg] && state->res[leg]>=0)
+                {
+                    if(state->hedged)
+                        mirror->add_hedged_read(leg==second);
+                    bio.res = state->res[leg];
+                    if(state->bufs[leg]!=bio.buf)
+                        memcpy(bio.buf, state->bufs[leg], bio.res);
+                    co_return 0;
+                }
+            }
+
+            bool first_failed = state->done[first];
+            if(!state->issued[second] &&
+                (first_failed || state->timer_fired) &&
+                mirror->pick_read_leg(thread_idx, bio.offset, bio.len, static_cast<int>(first))>=0)
+            {
+                if(first_failed)
+                {
+                    // Retry on the other leg. Nothing reads into bio.buf anymore
+                    start_leg(io, state, second, bio.buf, bio.buf_idx, bio.offset, bio.len);
+                    continue;
+                }
+
+                state->own_bufs[second].reset(alloc_aligned(buf_len));
+                if(state->own_bufs[second])
+                {
+                    state->hedged = true;
+                    start_leg(io, state, second, state->own_bufs[second].get(), -1, bio.offset, bio.len);
+                    continue;
+                }
+            }
+
+            if(state->pending==0)
+            {
+                bio.res = state->issued[second] ? state->res[second] : state->res[first];
+                co_return 0;
+            }
+
+            co_await StateAwaiter(*state);
+        }
+    }
+
+    // Sets bio.res once quorum legs wrote the data. With quorum 1 the legs
+    // write from a copy of the data, since the slower leg is still writing
+    // after this returned
+    fuse_io_context::io_uring_task<int> mirror_write(fuse_io_context& io, BlockIo& bio)
+    {
+        Mirror* mirror = io.fuse_ring.mirror;
+
+        std::shared_ptr<MirrorOpState> state = std::make_shared<MirrorOpState>();
+        state->write = true;
+
+        char* buf = bio.buf;
+        int buf_idx = bio.buf_idx;
+        if(mirror->get_quorum()<2)
+        {
+            state->own_bufs[0].reset(alloc_aligned(bio.len));
+            if(!state->own_bufs[0])
+            {
+                bio.res = -ENOMEM;
+                co_return 0;
+            }
+
+            memcpy(state->own_bufs[0].get(), bio.buf, bio.len);
+            buf = state->own_bufs[0].get();
+            buf_idx = -1;
+        }
+
+        bool legs[2];
+        while(true)
+        {
+            int rc = mirror->begin_write(bio.offset, bio.len, legs);
+            if(rc==-EAGAIN)
+            {
+                co_await mirror->wait_resync_region(io, bio.offset, bio.len);
+                continue;
+            }
+
+            if(rc<0)
+            {
+                bio.res = rc;
+                co_return 0;
+            }
+            break;
+        }
+
+        bio.res = -EIO;
+
+        size_t n_legs = 0;
+        for(size_t leg=0;leg<2;++leg)
+        {
+            if(legs[leg])
+            {
+                start_leg(io, state, leg, buf, buf_idx, bio.offset, bio.len);
+                ++n_legs;
+            }
+        }
+
+        while(true)
+        {
+            size_t n_ok = 0;
+            size_t n_failed = 0;
+            int err = -EIO;
+            for(size_t leg=0;leg<2;++leg)
+            {
+                if(!state->done[leg])
+                    continue;
+
+                if(state->res[leg]>=0)
+                {
+                    ++n_ok;
+                }
+                else
+                {
+                    ++n_failed;
+                    err = state->res[leg];
+                }
+            }
+
+            // A failed leg is resynced later, so it does not count for the quorum
+            if(n_ok>0 &&
+                n_ok>=std::min(static_cast<size_t>(mirror->get_quorum()), n_legs - n_failed))
+            {
+                bio.res = static_cast<int>(bio.len);
+                co_return 0;
+            }
+
+            if(state->pending==0)
+            {
+                bio.res = err;
+                co_return 0;
+            }
+
+            co_await StateAwaiter(*state);
+        }
+    }
+}
+
+std::string MirrorBackend::describe() const
+{
+    std::ostringstream ret;
+    ret << size/(1024*1024) << " MB on two legs with write quorum " << mirror->get_quorum();
+    return ret.str();
+}
+
+void MirrorBackend::start(fuse_io_context& io)
+{
+    if(io.fuse_ring.thread_idx==0)
+        mirror->resync(io);
+}
+
+fuse_io_context::io_uring_task<int> MirrorBackend::transfer(fuse_io_context& io,
+    bool write, std::vector<BlockIo>& ios)
+{
+    std::vector<fuse_io_context::io_uring_task<int> > started;
+    started.reserve(ios.size());
+    for(size_t i=0;i<ios.size();++i)
+        started.push_back(write ? mirror_write(io, ios[i]) : mirror_read(io, ios[i]));
+
+    int ret = 0;
+    for(size_t i=0;i<started.size();++i)
+    {
+        if(co_await std::move(started[i])!=0)
+            ret = -1;
+    }
+
+    co_return ret;
+}
+
+fuse_io_context::io_uring_task<int> MirrorBackend::flush(fuse_io_context& io,
+    bool datasync)
+{
+    const fuse_io_context::FixedFileLayout& files = io.fuse_ring.files;
+    std::vector<int> fds = {files.mirror_legs[0], files.mirror_legs[1]};
+    std::vector<int> rcs;
+    if(co_await sync_files(io, fds, datasync, rcs)!=0)
+        co_return -1;
+
+    int err = 0;
+    size_t n_failed = 0;
+    for(size_t leg=0;leg<rcs.size();++leg)
+    {
+        if(rcs[leg]<0)
+        {
+            // Data written since the last sync may be lost. Copy all of it again
+            mirror->leg_failed(leg, 0, size);
+            err = rcs[leg];
+            ++n_failed;
+        }
+    }
+
+    co_return n_failed<rcs.size() ? 0 : err;
+}
+
+std::string MirrorBackend::get_stats() const
+{
+    Mirror::Stats mirror_stats = mirror->get_stats();
+    std::ostringstream ret;
+    ret << "Mirror: leg 0 " << (mirror_stats.failed[0] ? "failed" : "ok")
+        << " leg 1 " << (mirror_stats.failed[1] ? "failed" : "ok")
+        << " dirty regions=" << mirror_stats.dirty_regions
+        << " resynced MB=" << mirror_stats.resynced_bytes/(1024*1024)
+        << " hedged reads=" << mirror_stats.hedged_reads
+        << " hedge wins=" << mirror_stats.hedge_wins
+        << " read errors=" << mirror_stats.read_errors
+        << " write errors=" << mirror_stats.write_errors;
+    return ret.str();
+}
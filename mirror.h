@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "backend.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+
+// Mirrors the volume on two backing files (legs), the backing file (leg 0)
+// and a second file or device (leg 1). Their fixed file indices are
+// files.mirror_legs of the ring.
+//
+// Writes go to both legs and are finished once quorum legs wrote the data.
+// Reads go to the leg with the lower average latency of the worker thread.
+// If a read takes longer than the hedge percentile of the recent reads of
+// that leg, the same read is issued on the other leg and the first one to
+// finish is used.
+//
+// A leg that fails a read or write is marked as failed. It is not read from
+// anymore and writes only go to the other leg. The regions written while a
+// leg is failed are marked in a dirty bitmap (in memory only) and copied
+// from the other leg by a background resync. Once all dirty regions are
+// copied the leg is used again.
+class Mirror
+{
+public:
+    struct Stats
+    {
+        bool failed[2];
+        uint64_t dirty_regions;
+        uint64_t resynced_bytes;
+        uint64_t hedged_reads;
+        uint64_t hedge_wins;
+        uint64_t read_errors;
+        uint64_t write_errors;
+    };
+
+    struct LegLatency
+    {
+        int64_t avg_us;
+        int64_t hedge_us;
+    };
+
+    // quorum is the number of legs (1 or 2) a write has to be on before it is
+    // finished. hedge_percentile 0 disables hedged reads
+    Mirror(uint64_t volume_size, unsigned int quorum, unsigned int hedge_percentile,
+        size_t n_threads);
+
+    // Marks leg as failed and all of it as dirty, so it is copied from the
+    // other leg completely
+    void resync_all(size_t leg);
+
+    // Registers a write to [offset, offset+len) and returns the legs it has
+    // to go to in legs. Returns -EAGAIN if the range is being resynced, -EIO
+    // if both legs failed. write_done() has to be called for every leg in legs
+    int begin_write(uint64_t offset, uint64_t len, bool legs[2]);
+    // Waits until no region of [offset, offset+len) is being resynced
+    [[nodiscard]] fuse_io_context::io_uring_task<int> wait_resync_region(fuse_io_context& io,
+        uint64_t offset, uint64_t len);
+    void write_done(size_t leg, uint64_t offset, uint64_t len, bool ok);
+
+    // Leg to read [offset, offset+len) from. With exclude>=0 only the other
+    // leg is considered and -1 is returned if it failed
+    int pick_read_leg(size_t thread_idx, uint64_t offset, uint64_t len, int exclude);
+    void read_done(size_t thread_idx, size_t leg, uint64_t offset, uint64_t len,
+        int64_t latency_us, bool ok);
+
+    // Read time after which the read is hedged, 0 if it should not be hedged
+    int64_t get_hedge_us(size_t thread_idx, size_t leg) const
+    {
+        return threads[thread_idx].hedge_us[leg];
+    }
+
+    // Counts a hedged read and whether it finished before the first read
+    void add_hedged_read(bool win)
+    {
+        ++hedged_reads;
+        if(win)
+            ++hedge_wins;
+    }
+
+    void leg_failed(size_t leg, uint64_t offset, uint64_t len);
+
+    unsigned int get_quorum() const
+    {
+        return quorum;
+    }
+
+    // Copies dirty regions to the failed leg. Runs on one worker thread
+    fuse_io_context::io_uring_task_discard<int> resync(fuse_io_context& io);
+
+    Stats get_stats() const;
+
+    // Latency of the legs as seen by the calling worker thread
+    LegLatency get_latency(size_t thread_idx, size_t leg) const
+    {
+        return LegLatency{threads[thread_idx].avg_us[leg], threads[thread_idx].hedge_us[leg]};
+    }
+
+private:
+    struct ThreadState
+    {
+        int64_t avg_us[2];
+        int64_t hedge_us[2];
+        std::vector<uint32_t> samples[2];
+        size_t n_samples[2];
+        uint64_t reads;
+    };
+
+    void set_dirty(uint64_t offset, uint64_t len);
+    bool overlaps_resync(uint64_t first, uint64_t last) const;
+    int find_dirty(uint64_t start);
+
+    uint64_t volume_size;
+    uint64_t n_regions;
+    unsigned int quorum;
+    unsigned int hedge_percentile;
+    std::vector<ThreadState> threads;
+
+    // Writes in flight per leg and region
+    std::unique_ptr<std::atomic<uint32_t>[]> pending[2];
+    std::unique_ptr<std::atomic<uint64_t>[]> dirty;
+    std::atomic<uint64_t> n_dirty;
+    std::atomic<uint64_t> resync_region;
+
+    std::mutex mutex;
+    std::atomic<bool> failed[2];
+    std::atomic<bool> degraded;
+    // Writes waiting for the resync of a region, resync waiting for
+    // dirty regions
+    fuse_io_context::SharedWaitQueue waiters;
+
+    std::atomic<uint64_t> resynced_bytes;
+    std::atomic<uint64_t> hedged_reads;
+    std::atomic<uint64_t> hedge_wins;
+    std::atomic<uint64_t> read_errors;
+    std::atomic<uint64_t> write_errors;
+};
+
+// The mirrored volume as backend. Reads return as soon as one leg has the
+// data and writes once quorum legs have it. Legs still running after that
+// use buffers of their own, never those of the request
+class MirrorBackend : public Backend
+{
+public:
+    MirrorBackend(Mirror* mirror, uint64_t size)
+        : mirror(mirror), size(size) {}
+
+    std::string describe() const override;
+
+    uint64_t get_size() const override
+    {
+        return size;
+    }
+
+    // Resync on the first worker thread
+    void start(fuse_io_context& io) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io,
+        bool write, std::vector<BlockIo>& ios) override;
+
+    // Fails only if both legs failed. A leg that fails is resynced
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush(fuse_io_context& io,
+        bool datasync) override;
+
+    std::string get_stats() const override;
+
+private:
+    Mirror* mirror;
+    uint64_t size;
+};
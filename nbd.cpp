@@ -0,0 +1,717 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "nbd.h"
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <endian.h>
+
+namespace
+{
+    const uint64_t nbd_magic = 0x4e42444d41474943ULL; // NBDMAGIC
+    const uint64_t nbd_opt_magic = 0x49484156454F5054ULL; // IHAVEOPT
+    const uint64_t nbd_rep_magic = 0x3e889045565a9ULL;
+    const uint32_t nbd_request_magic = 0x25609513;
+    const uint32_t nbd_simple_reply_magic = 0x67446698;
+
+    const uint16_t nbd_flag_fixed_newstyle = 1 << 0;
+    const uint16_t nbd_flag_no_zeroes = 1 << 1;
+    const uint32_t nbd_flag_c_fixed_newstyle = 1 << 0;
+    const uint32_t nbd_flag_c_no_zeroes = 1 << 1;
+
+    const uint32_t nbd_opt_export_name = 1;
+    const uint32_t nbd_opt_go = 7;
+    const uint32_t nbd_rep_ack = 1;
+    const uint32_t nbd_rep_info = 3;
+    const uint32_t nbd_rep_flag_error = 1U << 31;
+    const uint32_t nbd_rep_err_unsup = nbd_rep_flag_error | 1;
+    const uint16_t nbd_info_export = 0;
+
+    const uint16_t nbd_flag_read_only = 1 << 1;
+    const uint16_t nbd_flag_send_flush = 1 << 2;
+    const uint16_t nbd_flag_send_write_zeroes = 1 << 6;
+    const uint16_t nbd_flag_can_multi_conn = 1 << 8;
+
+    const uint16_t nbd_cmd_read = 0;
+    const uint16_t nbd_cmd_write = 1;
+    const uint16_t nbd_cmd_disc = 2;
+    const uint16_t nbd_cmd_flush = 3;
+    const uint16_t nbd_cmd_write_zeroes = 6;
+    const uint16_t nbd_cmd_flag_no_hole = 1 << 1;
+
+    // Largest NBD_CMD_WRITE_ZEROES request
+    const uint64_t max_zero_len = 1024*1024*1024;
+
+    struct __attribute__((packed)) NbdRequest
+    {
+        uint32_t magic;
+        uint16_t flags;
+        uint16_t type;
+        uint64_t cookie;
+        uint64_t offset;
+        uint32_t length;
+    };
+
+    struct __attribute__((packed)) NbdReply
+    {
+        uint32_t magic;
+        uint32_t error;
+        uint64_t cookie;
+    };
+
+    struct __attribute__((packed)) NbdOptionReply
+    {
+        uint64_t magic;
+        uint32_t option;
+        uint32_t type;
+        uint32_t length;
+    };
+
+    bool read_full(int fd, void* buf, size_t len)
+    {
+        size_t done = 0;
+        while(done<len)
+        {
+            ssize_t rc = read(fd, static_cast<char*>(buf) + done, len - done);
+            if(rc<=0)
+                return false;
+            done+=rc;
+        }
+        return true;
+    }
+
+    bool write_full(int fd, const void* buf, size_t len)
+    {
+        size_t done = 0;
+        while(done<len)
+        {
+            ssize_t rc = send(fd, static_cast<const char*>(buf) + done, len - done, MSG_NOSIGNAL);
+            if(rc<=0)
+                return false;
+            done+=rc;
+        }
+        return true;
+    }
+
+    bool send_option(int fd, uint32_t option, const std::string& data)
+    {
+        std::string msg(16, '\0');
+        uint64_t magic = htobe64(nbd_opt_magic);
+        uint32_t be_option = htobe32(option);
+        uint32_t be_len = htobe32(static_cast<uint32_t>(data.size()));
+        memcpy(&msg[0], &magic, sizeof(magic));
+        memcpy(&msg[8], &be_option, sizeof(be_option));
+        memcpy(&msg[12], &be_len, sizeof(be_len));
+        msg += data;
+        return write_full(fd, msg.data(), msg.size());
+    }
+
+    // Receives len bytes into buf. buf is a registered buffer if buf_idx>=0.
+    // Returns 0 or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> recv_full(fuse_io_context& io, int fd,
+        char* buf, size_t len, int buf_idx)
+    {
+        size_t done = 0;
+        while(done<len)
+        {
+            io_uring_sqe* sqe = co_await io.get_sqe();
+            if(sqe==nullptr)
+                co_return -EIO;
+
+            if(buf_idx>=0)
+                io_uring_prep_read_fixed(sqe, fd, buf + done, len - done, 0, buf_idx);
+            else
+                io_uring_prep_recv(sqe, fd, buf + done, len - done, MSG_WAITALL);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            int rc = co_await io.complete(sqe);
+            if(rc<0)
+                co_return rc;
+            if(rc==0)
+                co_return -ECONNRESET;
+
+            done+=rc;
+        }
+
+        co_return 0;
+    }
+}
+
+NbdBackend::NbdBackend(const std::string& socket_path, const std::string& export_name)
+    : socket_path(socket_path), export_name(export_name), size(0),
+        transmission_flags(0), reads(0), writes(0), flushes(0), zero_requests(0),
+        read_bytes(0), written_bytes(0), errors(0), max_inflight(0)
+{
+}
+
+NbdBackend::~NbdBackend()
+{
+    NbdRequest req = {};
+    req.magic = htobe32(nbd_request_magic);
+    req.type = htobe16(nbd_cmd_disc);
+    for(size_t i=0;i<fds.size();++i)
+    {
+        // Only connections that were negotiated
+        if(i<conns.size())
+            write_full(fds[i], &req, sizeof(req));
+        if(i>0)
+            close(fds[i]);
+    }
+}
+
+int NbdBackend::connect_socket(const std::string& path)
+{
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if(path.size()>=sizeof(addr.sun_path))
+    {
+        std::cerr << "NBD socket path " << path << " is too long" << std::endl;
+        return -1;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if(fd==-1)
+    {
+        perror("Error creating NBD socket");
+        return -1;
+    }
+
+    if(connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))!=0)
+    {
+        perror(("Error connecting to NBD server at "+path).c_str());
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool NbdBackend::handshake(int fd, uint64_t& export_size, uint16_t& export_flags)
+{
+    char greeting[18];
+    if(!read_full(fd, greeting, sizeof(greeting)))
+    {
+        std::cerr << "Error reading NBD greeting" << std::endl;
+        return false;
+    }
+
+    uint64_t magic;
+    uint64_t opt_magic;
+    uint16_t handshake_flags;
+    memcpy(&magic, greeting, sizeof(magic));
+    memcpy(&opt_magic, greeting + 8, sizeof(opt_magic));
+    memcpy(&handshake_flags, greeting + 16, sizeof(handshake_flags));
+    handshake_flags = be16toh(handshake_flags);
+
+    if(be64toh(magic)!=nbd_magic)
+    {
+        std::cerr << "Not an NBD server" << std::endl;
+        return false;
+    }
+
+    if(be64toh(opt_magic)!=nbd_opt_magic ||
+        !(handshake_flags & nbd_flag_fixed_newstyle))
+    {
+        std::cerr << "NBD server does not support the fixed newstyle handshake" << std::endl;
+        return false;
+    }
+
+    bool no_zeroes = (handshake_flags & nbd_flag_no_zeroes)!=0;
+    uint32_t client_flags = htobe32(nbd_flag_c_fixed_newstyle | (no_zeroes ? nbd_flag_c_no_zeroes : 0));
+    if(!write_full(fd, &client_flags, sizeof(client_flags)))
+    {
+        std::cerr << "Error sending NBD client flags" << std::endl;
+        return false;
+    }
+
+    // Export name and no information requests
+    std::string go_data(4, '\0');
+    uint32_t name_len = htobe32(static_cast<uint32_t>(export_name.size()));
+    memcpy(&go_data[0], &name_len, sizeof(name_len));
+    go_data += export_name;
+    go_data.append(2, '\0');
+    if(!send_option(fd, nbd_opt_go, go_data))
+    {
+        std::cerr << "Error sending NBD_OPT_GO" << std::endl;
+        return false;
+    }
+
+    bool have_info = false;
+    while(true)
+    {
+        NbdOptionReply reply;
+        if(!read_full(fd, &reply, sizeof(reply)) ||
+            be64toh(reply.magic)!=nbd_rep_magic)
+        {
+            std::cerr << "Error reading NBD option reply" << std::endl;
+            return false;
+        }
+
+        uint32_t type = be32toh(reply.type);
+        std::string data(be32toh(reply.length), '\0');
+        if(!data.empty() &&
+            !read_full(fd, &data[0], data.size()))
+        {
+            std::cerr << "Error reading NBD option reply" << std::endl;
+            return false;
+        }
+
+        if(type==nbd_rep_info)
+        {
+            uint16_t info_type;
+            if(data.size()>=12)
+            {
+                memcpy(&info_type, data.data(), sizeof(info_type));
+                if(be16toh(info_type)==nbd_info_export)
+                {
+                    memcpy(&export_size, data.data() + 2, sizeof(export_size));
+                    memcpy(&export_flags, data.data() + 10, sizeof(export_flags));
+                    export_size = be64toh(export_size);
+                    export_flags = be16toh(export_flags);
+                    have_info = true;
+                }
+            }
+        }
+        else if(type==nbd_rep_ack)
+        {
+            if(!have_info)
+            {
+                std::cerr << "NBD server did not send the export size" << std::endl;
+                return false;
+            }
+            return true;
+        }
+        else if(type==nbd_rep_err_unsup)
+        {
+            break;
+        }
+        else if(type & nbd_rep_flag_error)
+        {
+            std::cerr << "NBD server refused export \"" << export_name << "\" error=" << (type & ~nbd_rep_flag_error);
+            if(!data.empty())
+                std::cerr << " " << data;
+            std::cerr << std::endl;
+            return false;
+        }
+    }
+
+    // Servers without NBD_OPT_GO
+    if(!send_option(fd, nbd_opt_export_name, export_name))
+    {
+        std::cerr << "Error sending NBD_OPT_EXPORT_NAME" << std::endl;
+        return false;
+    }
+
+    char export_info[10 + 124];
+    if(!read_full(fd, export_info, no_zeroes ? 10 : sizeof(export_info)))
+    {
+        std::cerr << "NBD server refused export \"" << export_name << "\"" << std::endl;
+        return false;
+    }
+
+    memcpy(&export_size, export_info, sizeof(export_size));
+    memcpy(&export_flags, export_info + 8, sizeof(export_flags));
+    export_size = be64toh(export_size);
+    export_flags = be16toh(export_flags);
+    return true;
+}
+
+bool NbdBackend::open(int fd, size_t n_conns)
+{
+    if(!handshake(fd, size, transmission_flags))
+        return false;
+
+    fds.push_back(fd);
+
+    if(n_conns>1 &&
+        !(transmission_flags & nbd_flag_can_multi_conn))
+    {
+        std::cerr << "NBD server does not allow multiple connections (NBD_FLAG_CAN_MULTI_CONN). "
+            "Use one worker thread" << std::endl;
+        return false;
+    }
+
+    for(size_t i=1;i<n_conns;++i)
+    {
+        int conn_fd = connect_socket(socket_path);
+        if(conn_fd==-1)
+            return false;
+
+        fds.push_back(conn_fd);
+
+        uint64_t conn_size;
+        uint16_t conn_flags;
+        if(!handshake(conn_fd, conn_size, conn_flags))
+            return false;
+
+        if(conn_size!=size)
+        {
+            std::cerr << "NBD export size differs between connections" << std::endl;
+            return false;
+        }
+    }
+
+    for(size_t i=0;i<n_conns;++i)
+    {
+        std::unique_ptr<Connection> conn = std::make_unique<Connection>();
+        conn->failed = false;
+        conn->sending = false;
+        conn->next_cookie = 1;
+        conn->resume_scheduled = false;
+        conns.push_back(std::move(conn));
+    }
+
+    return true;
+}
+
+std::string NbdBackend::describe() const
+{
+    std::ostringstream ret;
+    ret << "export \"" << export_name << "\" of " << size/(1024*1024) << " MB on " << socket_path
+        << " with " << fds.size() << " connection(s)";
+    if(transmission_flags & nbd_flag_read_only)
+        ret << ", read-only";
+    if(transmission_flags & nbd_flag_send_flush)
+        ret << ", flush";
+    if(transmission_flags & nbd_flag_send_write_zeroes)
+        ret << ", write zeroes";
+    if(transmission_flags & nbd_flag_can_multi_conn)
+        ret << ", multi-conn";
+    return ret.str();
+}
+
+int NbdBackend::get_thread_fd(size_t thread_idx) const
+{
+    return fds[thread_idx];
+}
+
+void NbdBackend::start(fuse_io_context& io)
+{
+    receive_loop(io, get_conn(io));
+}
+
+void NbdBackend::wake(fuse_io_context& io, Connection& conn, std::coroutine_handle<> awaiter)
+{
+    conn.ready.push_back(awaiter);
+    if(!conn.resume_scheduled)
+    {
+        conn.resume_scheduled = true;
+        resume_ready(io, conn);
+    }
+}
+
+fuse_io_context::io_uring_task_discard<int> NbdBackend::resume_ready(fuse_io_context& io, Connection& conn)
+{
+    // Not from the receive loop, which may still use the request
+    co_await io.batch_end();
+
+    std::vector<std::coroutine_handle<> > curr;
+    curr.swap(conn.ready);
+    conn.resume_scheduled = false;
+
+    for(std::coroutine_handle<> awaiter: curr)
+    {
+        awaiter.resume();
+    }
+
+    co_return 0;
+}
+
+void NbdBackend::unlock_send(fuse_io_context& io, Connection& conn)
+{
+    if(conn.send_waiters.empty())
+    {
+        conn.sending = false;
+        return;
+    }
+
+    // Stays locked for the next one
+    std::coroutine_handle<> next = conn.send_waiters.front();
+    conn.send_waiters.pop_front();
+    wake(io, conn, next);
+}
+
+void NbdBackend::complete(fuse_io_context& io, Connection& conn, Request& req, int res)
+{
+    req.res = res;
+    req.done = true;
+    if(req.awaiter)
+        wake(io, conn, req.awaiter);
+}
+
+fuse_io_context::io_uring_task<int> NbdBackend::send_request(fuse_io_context& io,
+    Request& req, uint64_t cookie)
+{
+    NbdRequest header;
+    header.magic = htobe32(nbd_request_magic);
+    header.flags = htobe16(req.flags);
+    header.type = htobe16(req.type);
+    header.cookie = cookie;
+    header.offset = htobe64(req.offset);
+    header.length = htobe32(req.len);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = req.buf;
+    iov[1].iov_len = req.type==nbd_cmd_write ? req.len : 0;
+
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov[1].iov_len>0 ? 2 : 1;
+
+    size_t left = iov[0].iov_len + iov[1].iov_len;
+    while(left>0)
+    {
+        io_uring_sqe* sqe = co_await io.get_sqe();
+        if(sqe==nullptr)
+            co_return -EIO;
+
+        io_uring_prep_sendmsg(sqe, io.fuse_ring.files.backend_conn, &msg, MSG_NOSIGNAL|MSG_WAITALL);
+        sqe->flags |= IOSQE_FIXED_FILE;
+
+        int rc = co_await io.complete(sqe);
+        if(rc<0)
+            co_return rc;
+        if(rc==0)
+            co_return -ECONNRESET;
+
+        left-=rc;
+
+        // Continue after what was sent
+        size_t sent = rc;
+        while(sent>0)
+        {
+            size_t n = std::min(sent, msg.msg_iov[0].iov_len);
+            msg.msg_iov[0].iov_base = static_cast<char*>(msg.msg_iov[0].iov_base) + n;
+            msg.msg_iov[0].iov_len -= n;
+            sent -= n;
+            if(msg.msg_iov[0].iov_len==0 && msg.msg_iovlen>1)
+            {
+                ++msg.msg_iov;
+                --msg.msg_iovlen;
+            }
+        }
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> NbdBackend::submit(fuse_io_context& io,
+    std::vector<Request>& reqs)
+{
+    Connection& conn = get_conn(io);
+
+    co_await SendLockAwaiter{conn};
+
+    for(Request& req: reqs)
+    {
+        req.done = false;
+        req.awaiter = nullptr;
+
+        if(conn.failed)
+        {
+            req.done = true;
+            req.res = -EIO;
+            continue;
+        }
+
+        uint64_t cookie = conn.next_cookie++;
+        conn.inflight[cookie] = &req;
+        max_inflight = std::max(max_inflight.load(std::memory_order_relaxed),
+                            static_cast<uint64_t>(conn.inflight.size()));
+
+        int rc = co_await send_request(io, req, cookie);
+        if(rc<0)
+        {
+            // The stream is out of sync. The receive loop fails the
+            // requests in flight once the connection is shut down
+            std::cerr << "Error sending NBD request rc=" << rc << std::endl;
+            if(!conn.failed)
+            {
+                conn.failed = true;
+                shutdown(fds[io.fuse_ring.thread_idx], SHUT_RDWR);
+            }
+        }
+    }
+
+    unlock_send(io, conn);
+
+    for(Request& req: reqs)
+    {
+        co_await RequestAwaiter{req};
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task_discard<int> NbdBackend::receive_loop(fuse_io_context& io, Connection& conn)
+{
+    const int fd = io.fuse_ring.files.backend_conn;
+    while(true)
+    {
+        NbdReply reply;
+        int rc = co_await recv_full(io, fd, reinterpret_cast<char*>(&reply), sizeof(reply), -1);
+        if(rc<0)
+        {
+            if(!conn.failed)
+                std::cerr << "Error receiving NBD reply rc=" << rc << std::endl;
+            break;
+        }
+
+        if(be32toh(reply.magic)!=nbd_simple_reply_magic)
+        {
+            std::cerr << "Unexpected NBD reply magic " << std::hex << be32toh(reply.magic) << std::dec << std::endl;
+            break;
+        }
+
+        auto it = conn.inflight.find(reply.cookie);
+        if(it==conn.inflight.end())
+        {
+            std::cerr << "NBD reply to unknown request " << reply.cookie << std::endl;
+            break;
+        }
+
+        Request* req = it->second;
+        conn.inflight.erase(it);
+
+        uint32_t error = be32toh(reply.error);
+        if(error!=0)
+        {
+            ++errors;
+            complete(io, conn, *req, -static_cast<int>(error));
+            continue;
+        }
+
+        if(req->type==nbd_cmd_read)
+        {
+            rc = co_await recv_full(io, fd, req->buf, req->len, req->buf_idx);
+            if(rc<0)
+            {
+                std::cerr << "Error receiving NBD read data rc=" << rc << std::endl;
+                complete(io, conn, *req, -EIO);
+                break;
+            }
+        }
+
+        complete(io, conn, *req, static_cast<int>(req->len));
+    }
+
+    conn.failed = true;
+    for(auto& it: conn.inflight)
+    {
+        complete(io, conn, *it.second, -EIO);
+    }
+    conn.inflight.clear();
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> NbdBackend::transfer(fuse_io_context& io,
+    bool write, std::vector<BlockIo>& ios)
+{
+    if(write &&
+        (transmission_flags & nbd_flag_read_only))
+    {
+        for(BlockIo& req: ios)
+            req.res = -EROFS;
+        co_return 0;
+    }
+
+    std::vector<Request> reqs;
+    reqs.reserve(ios.size());
+    for(BlockIo& req: ios)
+    {
+        reqs.push_back(Request{write ? nbd_cmd_write : nbd_cmd_read, 0, req.offset,
+                static_cast<uint32_t>(req.len), req.buf, req.buf_idx, false, 0, nullptr});
+    }
+
+    if(co_await submit(io, reqs)!=0)
+        co_return -1;
+
+    for(size_t i=0;i<ios.size();++i)
+    {
+        ios[i].res = reqs[i].res;
+        if(reqs[i].res>0)
+        {
+            if(write)
+            {
+                ++writes;
+                written_bytes += reqs[i].res;
+            }
+            else
+            {
+                ++reads;
+                read_bytes += reqs[i].res;
+            }
+        }
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> NbdBackend::flush(fuse_io_context& io, bool)
+{
+    // Writes are durable once they complete
+    if(!(transmission_flags & nbd_flag_send_flush))
+        co_return 0;
+
+    std::vector<Request> reqs = {Request{nbd_cmd_flush, 0, 0, 0, nullptr, -1, false, 0, nullptr}};
+    if(co_await submit(io, reqs)!=0)
+        co_return -1;
+
+    ++flushes;
+    co_return std::min(reqs[0].res, 0);
+}
+
+fuse_io_context::io_uring_task<int> NbdBackend::discard(fuse_io_context& io,
+    uint64_t offset, uint64_t len, bool punch)
+{
+    if(!(transmission_flags & nbd_flag_send_write_zeroes))
+        co_return -EOPNOTSUPP;
+
+    if(transmission_flags & nbd_flag_read_only)
+        co_return -EROFS;
+
+    std::vector<Request> reqs;
+    for(uint64_t done=0;done<len;done+=max_zero_len)
+    {
+        reqs.push_back(Request{nbd_cmd_write_zeroes, punch ? static_cast<uint16_t>(0) : nbd_cmd_flag_no_hole,
+                offset + done, static_cast<uint32_t>(std::min(max_zero_len, len - done)),
+                nullptr, -1, false, 0, nullptr});
+    }
+
+    if(co_await submit(io, reqs)!=0)
+        co_return -1;
+
+    zero_requests += reqs.size();
+    for(const Request& req: reqs)
+    {
+        if(req.res<0)
+            co_return req.res;
+    }
+
+    co_return 0;
+}
+
+std::string NbdBackend::get_stats() const
+{
+    std::ostringstream ret;
+    ret << "NBD: reads=" << reads.load(std::memory_order_relaxed)
+        << " writes=" << writes.load(std::memory_order_relaxed)
+        << " flushes=" << flushes.load(std::memory_order_relaxed)
+        << " write zeroes=" << zero_requests.load(std::memory_order_relaxed)
+        << " read MB=" << read_bytes.load(std::memory_order_relaxed)/(1024*1024)
+        << " written MB=" << written_bytes.load(std::memory_order_relaxed)/(1024*1024)
+        << " errors=" << errors.load(std::memory_order_relaxed)
+        << " max in flight=" << max_inflight.load(std::memory_order_relaxed);
+    return ret.str();
+}
@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "backend.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <atomic>
+#include <coroutine>
+#include <stdint.h>
+
+// Client of an NBD server on a unix socket, e.g. nbdkit or qemu-nbd to
+// serve qcow2 and other image formats. The export is negotiated with
+// NBD_OPT_GO (NBD_OPT_EXPORT_NAME with older servers) at startup.
+//
+// Every worker thread has its own connection (fixed file index
+// files.backend_conn of the ring). The first connection is the backing file. More than one
+// connection needs a server that allows it (NBD_FLAG_CAN_MULTI_CONN), so
+// a flush on one connection covers the writes of all of them.
+//
+// Requests are pipelined: the requests of a transfer are sent back to
+// back, and a receive loop per connection completes them by cookie in the
+// order the server replies. Read data is received directly into the
+// (registered) buffer of the request. FUSE_FALLOCATE uses
+// NBD_CMD_WRITE_ZEROES, since NBD_CMD_TRIM does not guarantee zeros.
+class NbdBackend : public Backend
+{
+public:
+    NbdBackend(const std::string& socket_path, const std::string& export_name);
+    // Disconnects all connections. fd of open() is not closed
+    ~NbdBackend();
+
+    // Connects to the unix socket path. Returns the fd or -1
+    static int connect_socket(const std::string& path);
+
+    // Negotiates the export on fd and opens n_conns-1 more connections
+    bool open(int fd, size_t n_conns);
+
+    std::string describe() const override;
+
+    uint64_t get_size() const override
+    {
+        return size;
+    }
+
+    int get_thread_fd(size_t thread_idx) const override;
+
+    // Starts the receive loop of the connection of the worker thread
+    void start(fuse_io_context& io) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io,
+        bool write, std::vector<BlockIo>& ios) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush(fuse_io_context& io,
+        bool datasync) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> discard(fuse_io_context& io,
+        uint64_t offset, uint64_t len, bool punch) override;
+
+    // Space is allocated on demand
+    [[nodiscard]] fuse_io_context::io_uring_task<int> allocate(fuse_io_context&,
+        uint64_t, uint64_t) override
+    {
+        co_return 0;
+    }
+
+    std::string get_stats() const override;
+
+private:
+    struct Request
+    {
+        uint16_t type;
+        uint16_t flags;
+        uint64_t offset;
+        uint32_t len;
+        char* buf;
+        int buf_idx;
+        bool done;
+        int res;
+        std::coroutine_handle<> awaiter;
+    };
+
+    // Only used by its worker thread
+    struct Connection
+    {
+        bool failed;
+        // A coroutine is sending requests. The others wait in send_waiters
+        bool sending;
+        std::deque<std::coroutine_handle<> > send_waiters;
+        uint64_t next_cookie;
+        std::unordered_map<uint64_t, Request*> inflight;
+        // Coroutines resumed at the end of the completion batch
+        std::vector<std::coroutine_handle<> > ready;
+        bool resume_scheduled;
+    };
+
+    struct SendLockAwaiter
+    {
+        Connection& conn;
+
+        bool await_ready() noexcept
+        {
+            if(conn.sending)
+                return false;
+            conn.sending = true;
+            return true;
+        }
+
+        void await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+        {
+            conn.send_waiters.push_back(p_awaiter);
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    struct RequestAwaiter
+    {
+        Request& req;
+
+        bool await_ready() noexcept
+        {
+            return req.done;
+        }
+
+        void await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+        {
+            req.awaiter = p_awaiter;
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    bool handshake(int fd, uint64_t& export_size, uint16_t& export_flags);
+
+    Connection& get_conn(fuse_io_context& io)
+    {
+        return *conns[io.fuse_ring.thread_idx];
+    }
+
+    // Sends reqs back to back and waits for their replies. Sets the res of reqs
+    [[nodiscard]] fuse_io_context::io_uring_task<int> submit(fuse_io_context& io,
+        std::vector<Request>& reqs);
+    [[nodiscard]] fuse_io_context::io_uring_task<int> send_request(fuse_io_context& io,
+        Request& req, uint64_t cookie);
+    void unlock_send(fuse_io_context& io, Connection& conn);
+    void complete(fuse_io_context& io, Connection& conn, Request& req, int res);
+    void wake(fuse_io_context& io, Connection& conn, std::coroutine_handle<> awaiter);
+    fuse_io_context::io_uring_task_discard<int> resume_ready(fuse_io_context& io, Connection& conn);
+    fuse_io_context::io_uring_task_discard<int> receive_loop(fuse_io_context& io, Connection& conn);
+
+    std::string socket_path;
+    std::string export_name;
+    uint64_t size;
+    uint16_t transmission_flags;
+    // fds[0] is the backing file
+    std::vector<int> fds;
+    std::vector<std::unique_ptr<Connection> > conns;
+
+    std::atomic<uint64_t> reads;
+    std::atomic<uint64_t> writes;
+    std::atomic<uint64_t> flushes;
+    std::atomic<uint64_t> zero_requests;
+    std::atomic<uint64_t> read_bytes;
+    std::atomic<uint64_t> written_bytes;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> max_inflight;
+};
@@ -0,0 +1,271 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "qos.h"
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+std::atomic<int> QosLimiter::reload_eventfd(-1);
+
+bool QosLimits::parse(const std::string& spec, QosLimits& limits)
+{
+    std::string norm = spec;
+    std::replace(norm.begin(), norm.end(), ',', ' ');
+
+    std::istringstream in(norm);
+    std::string item;
+    while(in >> item)
+    {
+        size_t eq = item.find('=');
+        if(eq==std::string::npos)
+        {
+            std::cerr << "QoS limit \"" << item << "\" is not key=value" << std::endl;
+            return false;
+        }
+
+        std::string key = item.substr(0, eq);
+        std::string val = item.substr(eq+1);
+        char* end;
+        double num = strtod(val.c_str(), &end);
+        if(val.empty() || *end!=0 || num<0)
+        {
+            std::cerr << "Invalid value for QoS limit \"" << key << "\"" << std::endl;
+            return false;
+        }
+
+        if(key=="read_iops")
+            limits.read_iops = static_cast<uint64_t>(num);
+        else if(key=="write_iops")
+            limits.write_iops = static_cast<uint64_t>(num);
+        else if(key=="read_mbps")
+            limits.read_bps = static_cast<uint64_t>(num*1024*1024);
+        else if(key=="write_mbps")
+            limits.write_bps = static_cast<uint64_t>(num*1024*1024);
+        else if(key=="burst_s")
+            limits.burst_s = num;
+        else
+        {
+            std::cerr << "Unknown QoS limit \"" << key << "\"" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+QosLimiter::QosLimiter(const QosLimits& limits, const std::string& path)
+    : path(path), limits(limits), stop(false), throttled_reads(0),
+        throttled_writes(0), throttled_read_us(0), throttled_write_us(0)
+{
+    for(Bucket* bucket: {&read_iops, &write_iops, &read_bw, &write_bw})
+    {
+        bucket->rate = 0;
+        bucket->capacity = 0;
+        bucket->tokens = 0;
+        bucket->last_us = 0;
+    }
+}
+
+QosLimiter::~QosLimiter()
+{
+    if(reloader.joinable())
+    {
+        stop = true;
+        request_reload();
+        reloader.join();
+    }
+
+    int fd = reload_eventfd.exchange(-1);
+    if(fd!=-1)
+        close(fd);
+}
+
+bool QosLimiter::init()
+{
+    QosLimits new_limits = limits;
+    if(!path.empty() &&
+        !load_file(new_limits))
+        return false;
+
+    {
+        std::scoped_lock lock(mutex);
+        apply(new_limits);
+    }
+
+    if(!path.empty())
+    {
+        int fd = eventfd(0, EFD_CLOEXEC);
+        if(fd==-1)
+        {
+            perror("Error creating QoS reload eventfd");
+            return false;
+        }
+
+        reload_eventfd = fd;
+        reloader = std::thread(&QosLimiter::reload_thread, this);
+    }
+
+    return true;
+}
+
+void QosLimiter::request_reload()
+{
+    int fd = reload_eventfd.load();
+    if(fd==-1)
+        return;
+
+    int prev_errno = errno;
+    uint64_t val = 1;
+    if(write(fd, &val, sizeof(val))!=sizeof(val))
+    {
+        // The counter is already non-zero, the reload is pending
+    }
+    errno = prev_errno;
+}
+
+void QosLimiter::reload_thread()
+{
+    int fd = reload_eventfd.load();
+    while(true)
+    {
+        uint64_t val;
+        if(read(fd, &val, sizeof(val))!=sizeof(val))
+        {
+            if(errno==EINTR)
+                continue;
+
+            perror("Error reading QoS reload eventfd");
+            return;
+        }
+
+        if(stop)
+            return;
+
+        // Requests keep using the old limits while the file is read
+        QosLimits new_limits;
+        if(!load_file(new_limits))
+            continue;
+
+        {
+            std::scoped_lock lock(mutex);
+            apply(new_limits);
+        }
+
+        std::cout << "Reloaded QoS limits from \"" << path << "\"" << std::endl;
+    }
+}
+
+bool QosLimiter::load_file(QosLimits& new_limits)
+{
+    std::ifstream in(path);
+    if(!in)
+    {
+        std::cerr << "Error opening QoS limits file \"" << path << "\"" << std::endl;
+        return false;
+    }
+
+    std::stringstream spec;
+    spec << in.rdbuf();
+
+    // Keys that are not in the file are unlimited
+    new_limits = QosLimits();
+    return QosLimits::parse(spec.str(), new_limits);
+}
+
+void QosLimiter::set_bucket(Bucket& bucket, uint64_t rate, double burst_s)
+{
+    bucket.rate = static_cast<double>(rate);
+    // At least one second worth of tokens, so a request of the
+    // maximum size does not always go into debt
+    bucket.capacity = bucket.rate*std::max(1.0, burst_s);
+    bucket.tokens = std::min(bucket.tokens, bucket.capacity);
+}
+
+void QosLimiter::apply(const QosLimits& new_limits)
+{
+    limits = new_limits;
+    set_bucket(read_iops, limits.read_iops, limits.burst_s);
+    set_bucket(write_iops, limits.write_iops, limits.burst_s);
+    set_bucket(read_bw, limits.read_bps, limits.burst_s);
+    set_bucket(write_bw, limits.write_bps, limits.burst_s);
+}
+
+int64_t QosLimiter::take(Bucket& bucket, double amount, int64_t now_us)
+{
+    if(bucket.rate<=0)
+        return 0;
+
+    if(bucket.last_us==0)
+    {
+        // Start with full burst credits
+        bucket.tokens = bucket.capacity;
+    }
+    else if(now_us>bucket.last_us)
+    {
+        bucket.tokens = std::min(bucket.capacity,
+            bucket.tokens + bucket.rate*(now_us - bucket.last_us)/1000000);
+    }
+    bucket.last_us = std::max(bucket.last_us, now_us);
+
+    bucket.tokens -= amount;
+    if(bucket.tokens>=0)
+        return 0;
+
+    return static_cast<int64_t>((-bucket.tokens*1000000)/bucket.rate);
+}
+
+int64_t QosLimiter::admit(bool write, uint64_t len, int64_t now_us)
+{
+    int64_t delay_us;
+    {
+        std::scoped_lock lock(mutex);
+
+        if(write)
+        {
+            delay_us = std::max(take(write_iops, 1, now_us),
+                take(write_bw, static_cast<double>(len), now_us));
+        }
+        else
+        {
+            delay_us = std::max(take(read_iops, 1, now_us),
+                take(read_bw, static_cast<double>(len), now_us));
+        }
+    }
+
+    if(delay_us>0)
+    {
+        if(write)
+        {
+            ++throttled_writes;
+            throttled_write_us += delay_us;
+        }
+        else
+        {
+            ++throttled_reads;
+            throttled_read_us += delay_us;
+        }
+    }
+
+    return delay_us;
+}
+
+QosLimiter::Stats QosLimiter::get_stats() const
+{
+    Stats ret;
+    ret.throttled_reads = throttled_reads.load(std::memory_order_relaxed);
+    ret.throttled_writes = throttled_writes.load(std::memory_order_relaxed);
+    ret.throttled_read_us = throttled_read_us.load(std::memory_order_relaxed);
+    ret.throttled_write_us = throttled_write_us.load(std::memory_order_relaxed);
+    return ret;
+}
+
+QosLimits QosLimiter::get_limits()
+{
+    std::scoped_lock lock(mutex);
+    return limits;
+}
@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <stdint.h>
+
+// IOPS and bandwidth limits of the volume. 0 means unlimited
+struct QosLimits
+{
+    QosLimits()
+        : read_iops(0), write_iops(0), read_bps(0), write_bps(0),
+            burst_s(1)
+        {}
+
+    uint64_t read_iops;
+    uint64_t write_iops;
+    uint64_t read_bps;
+    uint64_t write_bps;
+    // Unused capacity of up to this many seconds at the limit
+    // can be used for bursts
+    double burst_s;
+
+    // Parses "key=value" pairs separated by commas or white space. Keys are
+    // read_iops, write_iops, read_mbps, write_mbps and burst_s
+    static bool parse(const std::string& spec, QosLimits& limits);
+};
+
+// Token buckets for read/write IOPS and bandwidth of the volume, shared
+// by all worker threads. Requests take their tokens right away and may
+// put a bucket into debt. The returned delay is the time until the debt
+// is paid back, so requests are throttled in the order they arrive.
+class QosLimiter
+{
+public:
+    struct Stats
+    {
+        uint64_t throttled_reads;
+        uint64_t throttled_writes;
+        uint64_t throttled_read_us;
+        uint64_t throttled_write_us;
+    };
+
+    // If path is not empty, limits are read from that file and re-read
+    // after request_reload()
+    QosLimiter(const QosLimits& limits, const std::string& path);
+    ~QosLimiter();
+
+    // Reads the limits file and starts the reload thread
+    bool init();
+
+    // Takes the tokens for a request of len bytes. Returns the number of
+    // microseconds the request has to wait
+    int64_t admit(bool write, uint64_t len, int64_t now_us);
+
+    // Wakes the reload thread, which reads the file and swaps the new
+    // limits in, so admit() never waits for file I/O. Async signal safe
+    static void request_reload();
+
+    Stats get_stats() const;
+    QosLimits get_limits();
+
+private:
+    struct Bucket
+    {
+        double rate;
+        double capacity;
+        double tokens;
+        int64_t last_us;
+    };
+
+    static void set_bucket(Bucket& bucket, uint64_t rate, double burst_s);
+    static int64_t take(Bucket& bucket, double amount, int64_t now_us);
+    bool load_file(QosLimits& new_limits);
+    void apply(const QosLimits& new_limits);
+    void reload_thread();
+
+    std::string path;
+    std::mutex mutex;
+    QosLimits limits;
+    Bucket read_iops;
+    Bucket write_iops;
+    Bucket read_bw;
+    Bucket write_bw;
+
+    std::thread reloader;
+    std::atomic<bool> stop;
+    // Written by request_reload()
+    static std::atomic<int> reload_eventfd;
+
+    std::atomic<uint64_t> throttled_reads;
+    std::atomic<uint64_t> throttled_writes;
+    std::atomic<uint64_t> throttled_read_us;
+    std::atomic<uint64_t> throttled_write_us;
+};
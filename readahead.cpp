@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "readahead.h"
+#include <algorithm>
+
+namespace
+{
+    // Reads that start at most this far after the end of a stream continue it
+    const uint64_t max_stream_gap = 256*1024;
+    // Number of sequential reads before a stream gets readahead
+    const unsigned int seq_threshold = 3;
+    // Amount of reading the readahead window should cover
+    const int64_t readahead_horizon_us = 200*1000;
+    // Minimum interval to measure the consumption rate over
+    const int64_t rate_interval_us = 10*1000;
+}
+
+StreamDetector::StreamDetector(size_t n_streams, uint64_t min_window, uint64_t max_window)
+    : min_window(min_window), max_window(std::max(min_window, max_window)),
+        n_detected(0), readaheads(0), readahead_bytes(0)
+{
+    streams.resize(std::max(static_cast<size_t>(1), n_streams));
+    for(Stream& stream: streams)
+    {
+        stream.last_offset = 0;
+        stream.next_offset = 0;
+        stream.ra_end = 0;
+        stream.window = min_window;
+        stream.seq_count = 0;
+        stream.last_access_us = 0;
+        stream.rate_start_us = 0;
+        stream.rate_bytes = 0;
+        stream.rate = 0;
+    }
+}
+
+StreamDetector::Stats StreamDetector::get_stats() const
+{
+    Stats ret;
+    ret.streams = n_detected.load(std::memory_order_relaxed);
+    ret.readaheads = readaheads.load(std::memory_order_relaxed);
+    ret.readahead_bytes = readahead_bytes.load(std::memory_order_relaxed);
+    return ret;
+}
+
+bool StreamDetector::on_read(uint64_t offset, uint64_t len, int64_t now_us,
+    uint64_t& ra_offset, uint64_t& ra_len)
+{
+    if(len==0)
+        return false;
+
+    std::scoped_lock lock(mutex);
+
+    Stream* stream = nullptr;
+    Stream* lru = &streams[0];
+    for(Stream& curr: streams)
+    {
+        if(curr.seq_count>0 &&
+            offset>=curr.last_offset &&
+            offset<=curr.next_offset + max_stream_gap)
+        {
+            stream = &curr;
+            break;
+        }
+
+        if(curr.last_access_us<lru->last_access_us)
+            lru = &curr;
+    }
+
+    if(stream==nullptr)
+    {
+        stream = lru;
+        stream->last_offset = offset;
+        stream->next_offset = offset + len;
+        stream->ra_end = offset + len;
+        stream->window = min_window;
+        stream->seq_count = 1;
+        stream->last_access_us = now_us;
+        stream->rate_start_us = now_us;
+        stream->rate_bytes = 0;
+        stream->rate = 0;
+        return false;
+    }
+
+    stream->last_offset = offset;
+    stream->next_offset = std::max(stream->next_offset, offset + len);
+    stream->last_access_us = now_us;
+    stream->rate_bytes += len;
+    ++stream->seq_count;
+
+    if(now_us - stream->rate_start_us >= rate_interval_us)
+    {
+        uint64_t curr_rate = (stream->rate_bytes*1000000) / (now_us - stream->rate_start_us);
+        stream->rate = stream->rate==0 ? curr_rate : (stream->rate*3 + curr_rate)/4;
+        stream->rate_start_us = now_us;
+        stream->rate_bytes = 0;
+    }
+
+    if(stream->seq_count<seq_threshold)
+        return false;
+
+    if(stream->seq_count==seq_threshold)
+        ++n_detected;
+
+    stream->ra_end = std::max(stream->ra_end, stream->next_offset);
+
+    // Only issue more readahead once half of the window was consumed
+    if(stream->ra_end - stream->next_offset >= stream->window/2)
+        return false;
+
+    uint64_t target = (stream->rate*readahead_horizon_us)/1000000;
+    target = std::clamp(target, min_window, max_window);
+    stream->window = std::min(target, stream->window*2);
+
+    ra_offset = stream->ra_end;
+    ra_len = stream->next_offset + stream->window - stream->ra_end;
+    stream->ra_end += ra_len;
+
+    ++readaheads;
+    readahead_bytes += ra_len;
+    return true;
+}
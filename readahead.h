@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+
+// Detects sequential read streams on the volume and decides how much
+// to read ahead of each of them. Reads can arrive out of order (multiple
+// requests in flight), so a read continues a stream if it starts anywhere
+// between the start of the stream's last read and a small gap after its end.
+// The readahead window follows the rate the stream is consumed at, so that
+// it covers readahead_horizon_us of reading, growing at most by a factor of two
+// each time readahead is issued.
+class StreamDetector
+{
+public:
+    struct Stats
+    {
+        uint64_t streams;
+        uint64_t readaheads;
+        uint64_t readahead_bytes;
+    };
+
+    StreamDetector(size_t n_streams, uint64_t min_window, uint64_t max_window);
+
+    // Records a read of [offset, offset+len). Returns true if [ra_offset, ra_offset+ra_len)
+    // should be read ahead
+    bool on_read(uint64_t offset, uint64_t len, int64_t now_us,
+        uint64_t& ra_offset, uint64_t& ra_len);
+
+    Stats get_stats() const;
+
+private:
+    struct Stream
+    {
+        uint64_t last_offset;
+        uint64_t next_offset;
+        uint64_t ra_end;
+        uint64_t window;
+        unsigned int seq_count;
+        int64_t last_access_us;
+        int64_t rate_start_us;
+        uint64_t rate_bytes;
+        // Consumption rate in bytes per second
+        uint64_t rate;
+    };
+
+    std::mutex mutex;
+    std::vector<Stream> streams;
+    uint64_t min_window;
+    uint64_t max_window;
+
+    std::atomic<uint64_t> n_detected;
+    std::atomic<uint64_t> readaheads;
+    std::atomic<uint64_t> readahead_bytes;
+};
@@ -0,0 +1,1326 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "s3.h"
+#include "io_util.h"
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <string_view>
+#include <utility>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+namespace
+{
+    // Attempts of a request before it fails
+    const size_t max_attempts = 4;
+    const unsigned int retry_wait_ms = 10;
+    // Largest response header and largest error body that is read
+    const size_t max_header_size = 16*1024;
+    const int64_t max_error_body = 64*1024;
+    // DELETEs issued together by a discard
+    const uint64_t max_delete_batch = 1024;
+    const char* const unsigned_payload = "UNSIGNED-PAYLOAD";
+    const char* const method_names[] = {"GET", "PUT", "DELETE"};
+
+    const uint32_t sha256_k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    uint32_t rotr(uint32_t x, int n)
+    {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void sha256_block(uint32_t h[8], const unsigned char* p)
+    {
+        uint32_t w[64];
+        for(size_t i=0;i<16;++i)
+        {
+            w[i] = (static_cast<uint32_t>(p[i*4]) << 24) | (static_cast<uint32_t>(p[i*4+1]) << 16)
+                | (static_cast<uint32_t>(p[i*4+2]) << 8) | p[i*4+3];
+        }
+        for(size_t i=16;i<64;++i)
+        {
+            uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        uint32_t e = h[4], f = h[5], g = h[6], hh = h[7];
+        for(size_t i=0;i<64;++i)
+        {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    // Returns the 32 byte digest of data
+    std::string sha256(std::string_view data)
+    {
+        uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+        size_t i = 0;
+        for(;i+64<=data.size();i+=64)
+            sha256_block(h, reinterpret_cast<const unsigned char*>(data.data()) + i);
+
+        // Padding with the length in bits
+        unsigned char tail[128] = {};
+        size_t rest = data.size() - i;
+        memcpy(tail, data.data() + i, rest);
+        tail[rest] = 0x80;
+        size_t tail_len = rest + 9 > 64 ? 128 : 64;
+        uint64_t bits = static_cast<uint64_t>(data.size())*8;
+        for(size_t j=0;j<8;++j)
+            tail[tail_len - 1 - j] = static_cast<unsigned char>(bits >> (j*8));
+
+        for(size_t j=0;j<tail_len;j+=64)
+            sha256_block(h, tail + j);
+
+        std::string ret(32, '\0');
+        for(size_t j=0;j<8;++j)
+        {
+            ret[j*4] = static_cast<char>(h[j] >> 24);
+            ret[j*4+1] = static_cast<char>(h[j] >> 16);
+            ret[j*4+2] = static_cast<char>(h[j] >> 8);
+            ret[j*4+3] = static_cast<char>(h[j]);
+        }
+        return ret;
+    }
+
+    std::string hmac_sha256(std::string_view key, std::string_view msg)
+    {
+        std::string block_key = key.size()>64 ? sha256(key) : std::string(key);
+        block_key.resize(64, '\0');
+
+        std::string inner(64, '\0');
+        std::string outer(64, '\0');
+        for(size_t i=0;i<64;++i)
+        {
+            inner[i] = static_cast<char>(block_key[i] ^ 0x36);
+            outer[i] = static_cast<char>(block_key[i] ^ 0x5c);
+        }
+
+        inner += msg;
+        outer += sha256(inner);
+        return sha256(outer);
+    }
+
+    std::string to_hex(const std::string& data)
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string ret;
+        ret.reserve(data.size()*2);
+        for(char ch: data)
+        {
+            ret += digits[static_cast<unsigned char>(ch) >> 4];
+            ret += digits[static_cast<unsigned char>(ch) & 0xf];
+        }
+        return ret;
+    }
+
+    // URI encoding of a path as SigV4 wants it: everything except the
+    // unreserved characters and '/' as %XX with upper case hex digits
+    std::string uri_encode_path(const std::string& path)
+    {
+        static const char digits[] = "0123456789ABCDEF";
+        std::string ret;
+        ret.reserve(path.size());
+        for(char ch: path)
+        {
+            if(isalnum(static_cast<unsigned char>(ch)) ||
+                (ch!=0 && strchr("-_.~/", ch)!=nullptr))
+            {
+                ret += ch;
+            }
+            else
+            {
+                ret += '%';
+                ret += digits[static_cast<unsigned char>(ch) >> 4];
+                ret += digits[static_cast<unsigned char>(ch) & 0xf];
+            }
+        }
+        return ret;
+    }
+
+    // Splits http://HOST[:PORT]/BUCKET[/PREFIX]
+    bool split_url(const std::string& url, std::string& host, std::string& port,
+        std::string& bucket, std::string& prefix)
+    {
+        const std::string scheme = "http://";
+        if(url.compare(0, 8, "https://")==0)
+        {
+            std::cerr << "S3 over HTTPS is not supported. Use http:// (e.g. with a local TLS proxy)" << std::endl;
+            return false;
+        }
+
+        if(url.compare(0, scheme.size(), scheme)!=0)
+        {
+            std::cerr << "S3 URL " << url << " does not start with " << scheme << std::endl;
+            return false;
+        }
+
+        size_t slash = url.find('/', scheme.size());
+        if(slash==std::string::npos)
+        {
+            std::cerr << "S3 URL " << url << " has no bucket" << std::endl;
+            return false;
+        }
+
+        std::string host_port = url.substr(scheme.size(), slash - scheme.size());
+        size_t colon = host_port.rfind(':');
+        if(colon!=std::string::npos)
+        {
+            host = host_port.substr(0, colon);
+            port = host_port.substr(colon + 1);
+        }
+        else
+        {
+            host = host_port;
+            port = "80";
+        }
+
+        std::string path = url.substr(slash + 1);
+        size_t bucket_end = path.find('/');
+        bucket = path.substr(0, bucket_end);
+        prefix = bucket_end==std::string::npos ? std::string() : path.substr(bucket_end + 1);
+
+        if(host.empty() || port.empty() || bucket.empty())
+        {
+            std::cerr << "S3 URL " << url << " has no host or bucket" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool resolve(const std::string& host, const std::string& port,
+        struct sockaddr_storage& addr, socklen_t& addr_len)
+    {
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        struct addrinfo* res;
+        int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+        if(rc!=0)
+        {
+            std::cerr << "Error resolving " << host << ":" << port << ": " << gai_strerror(rc) << std::endl;
+            return false;
+        }
+
+        memcpy(&addr, res->ai_addr, res->ai_addrlen);
+        addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+        return true;
+    }
+
+    int new_socket(const struct sockaddr_storage& addr)
+    {
+        int fd = socket(addr.ss_family, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if(fd==-1)
+            return -1;
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return fd;
+    }
+
+    bool write_full(int fd, const void* buf, size_t len)
+    {
+        size_t done = 0;
+        while(done<len)
+        {
+            ssize_t rc = send(fd, static_cast<const char*>(buf) + done, len - done, MSG_NOSIGNAL);
+            if(rc<=0)
+                return false;
+            done+=rc;
+        }
+        return true;
+    }
+
+    // Parses the status line and headers of a response (without the empty
+    // line at the end). content_length is -1 if it is unknown
+    bool parse_response(std::string_view header, int& status, int64_t& content_length,
+        bool& keep_alive)
+    {
+        if(header.size()<12 ||
+            header.compare(0, 5, "HTTP/")!=0)
+            return false;
+
+        size_t space = header.find(' ');
+        if(space==std::string_view::npos)
+            return false;
+
+        status = atoi(std::string(header.substr(space + 1, 3)).c_str());
+        content_length = -1;
+        keep_alive = header.compare(0, 8, "HTTP/1.1")==0;
+
+        // No body
+        if(status==204 || status==304)
+            content_length = 0;
+
+        size_t pos = header.find("\r\n");
+        while(pos!=std::string_view::npos)
+        {
+            pos += 2;
+            size_t end = header.find("\r\n", pos);
+            std::string_view line = header.substr(pos, end==std::string_view::npos ? std::string_view::npos : end - pos);
+            pos = end;
+
+            size_t colon = line.find(':');
+            if(colon==std::string_view::npos)
+                continue;
+
+            std::string name(line.substr(0, colon));
+            std::string_view value = line.substr(colon + 1);
+            while(!value.empty() && value[0]==' ')
+                value.remove_prefix(1);
+
+            if(strcasecmp(name.c_str(), "Content-Length")==0)
+            {
+                content_length = atoll(std::string(value).c_str());
+            }
+            else if(strcasecmp(name.c_str(), "Transfer-Encoding")==0)
+            {
+                // Only for error bodies, which are not read then
+                content_length = -1;
+                keep_alive = false;
+            }
+            else if(strcasecmp(name.c_str(), "Connection")==0)
+            {
+                keep_alive = strncasecmp(value.data(), "close", 5)!=0;
+            }
+        }
+
+        return true;
+    }
+
+    // Error code of an S3 error body
+    std::string error_code(const std::string& body)
+    {
+        size_t start = body.find("<Code>");
+        size_t end = body.find("</Code>");
+        if(start==std::string::npos || end==std::string::npos || end<start)
+            return std::string();
+        return body.substr(start + 6, end - start - 6);
+    }
+
+    // Sends all of iov (modified). Returns 0 or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> send_all(fuse_io_context& io, int fd,
+        std::vector<struct iovec>& iov)
+    {
+        struct msghdr msg = {};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = iov.size();
+
+        size_t left = 0;
+        for(const struct iovec& vec: iov)
+            left += vec.iov_len;
+
+        while(left>0)
+        {
+            io_uring_sqe* sqe = co_await io.get_sqe();
+            if(sqe==nullptr)
+                co_return -EIO;
+
+            io_uring_prep_sendmsg(sqe, fd, &msg, MSG_NOSIGNAL|MSG_WAITALL);
+
+            int rc = co_await io.complete(sqe);
+            if(rc<0)
+                co_return rc;
+            if(rc==0)
+                co_return -ECONNRESET;
+
+            left-=rc;
+
+            // Continue after what was sent
+            size_t sent = rc;
+            while(sent>0)
+            {
+                size_t n = std::min(sent, msg.msg_iov[0].iov_len);
+                msg.msg_iov[0].iov_base = static_cast<char*>(msg.msg_iov[0].iov_base) + n;
+                msg.msg_iov[0].iov_len -= n;
+                sent -= n;
+                if(msg.msg_iov[0].iov_len==0 && msg.msg_iovlen>1)
+                {
+                    ++msg.msg_iov;
+                    --msg.msg_iovlen;
+                }
+            }
+        }
+
+        co_return 0;
+    }
+
+    // Receives up to len bytes. Returns the number of bytes or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> recv_some(fuse_io_context& io, int fd,
+        char* buf, size_t len)
+    {
+        io_uring_sqe* sqe = co_await io.get_sqe();
+        if(sqe==nullptr)
+            co_return -EIO;
+
+        io_uring_prep_recv(sqe, fd, buf, len, 0);
+
+        int rc = co_await io.complete(sqe);
+        if(rc==0)
+            co_return -ECONNRESET;
+        co_return rc;
+    }
+
+    // Receives len bytes into buf. buf is a registered buffer if buf_idx>=0.
+    // Returns 0 or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> recv_full(fuse_io_context& io, int fd,
+        char* buf, size_t len, int buf_idx)
+    {
+        size_t done = 0;
+        while(done<len)
+        {
+            io_uring_sqe* sqe = co_await io.get_sqe();
+            if(sqe==nullptr)
+                co_return -EIO;
+
+            if(buf_idx>=0)
+                io_uring_prep_read_fixed(sqe, fd, buf + done, len - done, 0, buf_idx);
+            else
+                io_uring_prep_recv(sqe, fd, buf + done, len - done, MSG_WAITALL);
+
+            int rc = co_await io.complete(sqe);
+            if(rc<0)
+                co_return rc;
+            if(rc==0)
+                co_return -ECONNRESET;
+
+            done+=rc;
+        }
+
+        co_return 0;
+    }
+}
+
+S3Backend::Latency::Latency()
+    : count(0), total_us(0), max_us(0)
+{
+    for(size_t i=0;i<n_buckets;++i)
+        buckets[i] = 0;
+}
+
+void S3Backend::Latency::add(int64_t us)
+{
+    us = std::max(us, static_cast<int64_t>(0));
+    size_t bucket = us<=1 ? 0 : 64 - __builtin_clzll(static_cast<uint64_t>(us - 1));
+    bucket = std::min(bucket, n_buckets - 1);
+
+    ++buckets[bucket];
+    ++count;
+    total_us += us;
+
+    int64_t curr_max = max_us.load(std::memory_order_relaxed);
+    while(us>curr_max &&
+        !max_us.compare_exchange_weak(curr_max, us, std::memory_order_relaxed))
+    {
+    }
+}
+
+int64_t S3Backend::Latency::percentile(unsigned int p) const
+{
+    uint64_t n = count.load(std::memory_order_relaxed);
+    if(n==0)
+        return 0;
+
+    uint64_t target = (n*p + 99) / 100;
+    uint64_t seen = 0;
+    for(size_t i=0;i<n_buckets;++i)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if(seen>=target)
+            return static_cast<int64_t>(1) << i;
+    }
+
+    return static_cast<int64_t>(1) << (n_buckets - 1);
+}
+
+S3Backend::S3Backend(const std::string& url, uint64_t size, uint32_t block_size,
+    size_t n_conns, const std::string& region)
+    : url(url), size(size), block_size(block_size), n_conns(n_conns), region(region),
+        addr{}, addr_len(0), read_bytes(0), written_bytes(0), merged_reads(0),
+        packed_writes(0), partial_writes(0), missing_blocks(0), retries(0),
+        errors(0), connects(0)
+{
+}
+
+S3Backend::~S3Backend()
+{
+    for(std::unique_ptr<Pool>& pool: pools)
+    {
+        for(int fd: pool->idle)
+            close(fd);
+    }
+}
+
+int S3Backend::connect_endpoint(const std::string& url)
+{
+    std::string host, port, bucket, prefix;
+    if(!split_url(url, host, port, bucket, prefix))
+        return -1;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    if(!resolve(host, port, addr, addr_len))
+        return -1;
+
+    int fd = new_socket(addr);
+    if(fd==-1)
+    {
+        perror("Error creating S3 socket");
+        return -1;
+    }
+
+    if(connect(fd, reinterpret_cast<struct sockaddr*>(&addr), addr_len)!=0)
+    {
+        perror(("Error connecting to S3 endpoint "+host+":"+port).c_str());
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool S3Backend::open(int fd, size_t n_threads)
+{
+    if(!split_url(url, host, port, bucket, prefix) ||
+        !resolve(host, port, addr, addr_len))
+        return false;
+
+    if(size==0 ||
+        size % block_size!=0)
+    {
+        std::cerr << "S3 volume size has to be a multiple of the block size " << block_size << std::endl;
+        return false;
+    }
+
+    const char* env_key = getenv("AWS_ACCESS_KEY_ID");
+    const char* env_secret = getenv("AWS_SECRET_ACCESS_KEY");
+    if(env_key!=nullptr && env_secret!=nullptr)
+    {
+        access_key = env_key;
+        secret_key = env_secret;
+    }
+    else
+    {
+        std::cerr << "AWS_ACCESS_KEY_ID or AWS_SECRET_ACCESS_KEY not set. Sending unsigned S3 requests" << std::endl;
+    }
+
+    int status = bucket_request(fd, "HEAD");
+    if(status==404)
+    {
+        status = bucket_request(fd, "PUT");
+        if(status==200)
+            std::cout << "Created S3 bucket " << bucket << std::endl;
+    }
+
+    if(status!=200)
+    {
+        std::cerr << "Error accessing S3 bucket " << bucket << " on " << host << ":" << port;
+        if(status>0)
+            std::cerr << ". HTTP status " << status;
+        std::cerr << std::endl;
+        return false;
+    }
+
+    for(size_t i=0;i<n_threads;++i)
+    {
+        std::unique_ptr<Pool> pool = std::make_unique<Pool>();
+        pool->n_open = 0;
+        pools.push_back(std::move(pool));
+    }
+
+    return true;
+}
+
+int S3Backend::bucket_request(int fd, const char* method)
+{
+    std::string header = request_header(method, "/" + bucket, 0, 0, 0);
+    if(!write_full(fd, header.data(), header.size()))
+    {
+        perror("Error sending S3 request");
+        return -1;
+    }
+
+    // Response without body (HEAD), or with its body ignored. The
+    // connection is not used afterwards
+    std::string resp;
+    char buf[4096];
+    while(resp.find("\r\n\r\n")==std::string::npos)
+    {
+        if(resp.size()>max_header_size)
+            return -1;
+
+        ssize_t rc = recv(fd, buf, sizeof(buf), 0);
+        if(rc<=0)
+        {
+            std::cerr << "Error receiving S3 response" << std::endl;
+            return -1;
+        }
+        resp.append(buf, rc);
+    }
+
+    int status;
+    int64_t content_length;
+    bool keep_alive;
+    if(!parse_response(std::string_view(resp).substr(0, resp.find("\r\n\r\n")),
+            status, content_length, keep_alive))
+    {
+        std::cerr << "Invalid S3 response" << std::endl;
+        return -1;
+    }
+
+    return status;
+}
+
+std::string S3Backend::object_path(uint64_t block) const
+{
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(block));
+    return "/" + bucket + "/" + prefix + name;
+}
+
+std::string S3Backend::request_header(const char* method, const std::string& path,
+    uint64_t range_offset, uint64_t range_len, uint64_t content_len)
+{
+    time_t now = time(nullptr);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    char amz_date[32];
+    strftime(amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &tm);
+    const std::string date(amz_date, 8);
+
+    const std::string host_header = port=="80" ? host : host + ":" + port;
+    std::string range;
+    if(range_len>0)
+        range = "bytes=" + std::to_string(range_offset) + "-" + std::to_string(range_offset + range_len - 1);
+
+    // Sent and signed URI encoded
+    const std::string uri = uri_encode_path(path);
+
+    std::string ret = std::string(method) + " " + uri + " HTTP/1.1\r\n"
+        "Host: " + host_header + "\r\n";
+    if(!range.empty())
+        ret += "Range: " + range + "\r\n";
+    if(strcmp(method, "PUT")==0)
+        ret += "Content-Length: " + std::to_string(content_len) + "\r\n";
+    ret += std::string("x-amz-content-sha256: ") + unsigned_payload + "\r\n"
+        "x-amz-date: " + amz_date + "\r\n";
+
+    if(!access_key.empty())
+    {
+        // AWS signature version 4 of the method, path and the headers above
+        std::string signed_headers = range.empty() ? "host;x-amz-content-sha256;x-amz-date"
+                                        : "host;range;x-amz-content-sha256;x-amz-date";
+        std::string canonical = std::string(method) + "\n" + uri + "\n\n"
+            "host:" + host_header + "\n";
+        if(!range.empty())
+            canonical += "range:" + range + "\n";
+        canonical += std::string("x-amz-content-sha256:") + unsigned_payload + "\n"
+            "x-amz-date:" + amz_date + "\n\n" +
+            signed_headers + "\n" + unsigned_payload;
+
+        const std::string scope = date + "/" + region + "/s3/aws4_request";
+        const std::string string_to_sign = std::string("AWS4-HMAC-SHA256\n") + amz_date + "\n" +
+            scope + "\n" + to_hex(sha256(canonical));
+
+        std::string key;
+        {
+            std::scoped_lock lock(signing_mutex);
+            if(signing_date!=date)
+            {
+                signing_key = hmac_sha256(hmac_sha256(hmac_sha256(hmac_sha256("AWS4" + secret_key,
+                                    date), region), "s3"), "aws4_request");
+                signing_date = date;
+            }
+            key = signing_key;
+        }
+
+        ret += "Authorization: AWS4-HMAC-SHA256 Credential=" + access_key + "/" + scope +
+            ", SignedHeaders=" + signed_headers +
+            ", Signature=" + to_hex(hmac_sha256(key, string_to_sign)) + "\r\n";
+    }
+
+    ret += "\r\n";
+    return ret;
+}
+
+std::string S3Backend::describe() const
+{
+    std::ostringstream ret;
+    ret << "bucket " << bucket << " prefix \"" << prefix << "\" on " << host << ":" << port
+        << ", " << size/(1024*1024) << " MB in blocks of " << block_size/1024 << " KB, up to "
+        << n_conns << " connection(s) per thread";
+    if(access_key.empty())
+        ret << ", unsigned";
+    return ret.str();
+}
+
+fuse_io_context::io_uring_task<int> S3Backend::acquire(fuse_io_context& io, bool fresh)
+{
+    Pool& pool = *pools[io.fuse_ring.thread_idx];
+    while(true)
+    {
+        if(!pool.idle.empty())
+        {
+            int fd = pool.idle.back();
+            pool.idle.pop_back();
+            if(!fresh)
+                co_return fd;
+
+            close(fd);
+            --pool.n_open;
+        }
+
+        if(pool.n_open<n_conns)
+            break;
+
+        co_await PoolAwaiter{pool};
+    }
+
+    ++pool.n_open;
+
+    int rc = -EIO;
+    int fd = new_socket(addr);
+    if(fd==-1)
+    {
+        rc = -errno;
+    }
+    else
+    {
+        io_uring_sqe* sqe = co_await io.get_sqe();
+        if(sqe!=nullptr)
+        {
+            io_uring_prep_connect(sqe, fd, reinterpret_cast<const struct sockaddr*>(&addr), addr_len);
+            rc = co_await io.complete(sqe);
+        }
+    }
+
+    if(rc<0)
+    {
+        if(fd!=-1)
+            close(fd);
+        release(io, -1, false);
+        co_return rc;
+    }
+
+    ++connects;
+    co_return fd;
+}
+
+void S3Backend::release(fuse_io_context& io, int fd, bool reuse)
+{
+    Pool& pool = *pools[io.fuse_ring.thread_idx];
+    if(reuse)
+    {
+        pool.idle.push_back(fd);
+    }
+    else
+    {
+        if(fd!=-1)
+            close(fd);
+        --pool.n_open;
+    }
+
+    if(!pool.waiters.empty())
+    {
+        std::coroutine_handle<> next = pool.waiters.front();
+        pool.waiters.pop_front();
+        next.resume();
+    }
+}
+
+fuse_io_context::io_uring_task<int> S3Backend::exchange(fuse_io_context& io, int fd,
+    Request& req, bool& reuse, std::string& code)
+{
+    reuse = false;
+    code.clear();
+
+    const std::string path = object_path(req.block);
+    std::string header;
+    if(req.method==Method::Get)
+        header = request_header("GET", path, req.offset, req.len, 0);
+    else if(req.method==Method::Put)
+        header = request_header("PUT", path, 0, 0, req.len);
+    else
+        header = request_header("DELETE", path, 0, 0, 0);
+
+    std::vector<struct iovec> iov;
+    iov.push_back(iovec{&header[0], header.size()});
+    if(req.method==Method::Put)
+    {
+        for(const Segment& seg: req.segs)
+            iov.push_back(iovec{seg.buf, seg.len});
+    }
+
+    int rc = co_await send_all(io, fd, iov);
+    if(rc<0)
+        co_return rc;
+
+    std::string resp(max_header_size, '\0');
+    size_t have = 0;
+    size_t header_end = std::string::npos;
+    while(header_end==std::string::npos)
+    {
+        if(have==resp.size())
+            co_return -EPROTO;
+
+        rc = co_await recv_some(io, fd, &resp[have], resp.size() - have);
+        if(rc<0)
+            co_return rc;
+
+        size_t search = have>3 ? have - 3 : 0;
+        have += rc;
+        header_end = std::string_view(resp.data(), have).find("\r\n\r\n", search);
+    }
+
+    int status;
+    int64_t content_length;
+    bool keep_alive;
+    if(!parse_response(std::string_view(resp.data(), header_end), status, content_length, keep_alive))
+        co_return -EPROTO;
+
+    // Part of the body received with the header
+    const char* extra = resp.data() + header_end + 4;
+    size_t n_extra = have - header_end - 4;
+
+    if(req.method==Method::Get &&
+        (status==200 || status==206))
+    {
+        if(content_length!=static_cast<int64_t>(req.len) ||
+            n_extra>req.len)
+            co_return -EPROTO;
+
+        for(const Segment& seg: req.segs)
+        {
+            size_t n = std::min(n_extra, static_cast<size_t>(seg.len));
+            memcpy(seg.buf, extra, n);
+            extra += n;
+            n_extra -= n;
+
+            if(n<seg.len)
+            {
+                rc = co_await recv_full(io, fd, seg.buf + n, seg.len - n,
+                            seg.buf_idx);
+                if(rc<0)
+                    co_return rc;
+            }
+        }
+
+        reuse = keep_alive;
+        co_return status;
+    }
+
+    // Error bodies are small. The connection is closed if the length is
+    // not known or it is larger
+    if(content_length<0 ||
+        content_length>max_error_body ||
+        static_cast<int64_t>(n_extra)>content_length)
+        co_return status;
+
+    std::string body(extra, n_extra);
+    if(static_cast<int64_t>(n_extra)<content_length)
+    {
+        body.resize(content_length);
+        rc = co_await recv_full(io, fd, &body[n_extra], content_length - n_extra, -1);
+        if(rc<0)
+            co_return status;
+    }
+
+    if(status>=300)
+        code = error_code(body);
+
+    reuse = keep_alive;
+    co_return status;
+}
+
+fuse_io_context::io_uring_task<int> S3Backend::run(fuse_io_context& io, Request& req)
+{
+    const size_t method_idx = static_cast<size_t>(req.method);
+    int status = -EIO;
+    std::string code;
+    for(size_t attempt=0;attempt<max_attempts;++attempt)
+    {
+        if(attempt>0)
+        {
+            ++retries;
+            // Idle connections the server closed fail right away
+            if(attempt>1 || status>0)
+            {
+                if(co_await sleep_ms(io, retry_wait_ms << attempt)!=0)
+                    break;
+            }
+        }
+
+        int fd = co_await acquire(io, attempt>0);
+        if(fd<0)
+        {
+            status = fd;
+            continue;
+        }
+
+        int64_t start_us = fuse_io_context::get_monotonic_us();
+        bool reuse;
+        status = co_await exchange(io, fd, req, reuse, code);
+        release(io, fd, reuse);
+
+        if(status<0)
+            continue;
+
+        latencies[method_idx].add(fuse_io_context::get_monotonic_us() - start_us);
+
+        // Overloaded or internal error
+        if(status>=500)
+            continue;
+
+        if(req.method==Method::Get &&
+            (status==200 || status==206))
+        {
+            read_bytes += req.len;
+            req.res = static_cast<int>(req.len);
+            co_return 0;
+        }
+        else if(req.method==Method::Get &&
+            status==404 && code!="NoSuchBucket")
+        {
+            ++missing_blocks;
+            for(const Segment& seg: req.segs)
+                memset(seg.buf, 0, seg.len);
+            req.missing = true;
+            req.res = static_cast<int>(req.len);
+            co_return 0;
+        }
+        else if(req.method==Method::Put &&
+            status==200)
+        {
+            written_bytes += req.len;
+            req.res = static_cast<int>(req.len);
+            co_return 0;
+        }
+        else if(req.method==Method::Delete &&
+            (status==200 || status==204 || status==404))
+        {
+            req.res = 0;
+            co_return 0;
+        }
+
+        break;
+    }
+
+    ++errors;
+    std::cerr << "S3 " << method_names[method_idx] << " " << object_path(req.block) << " failed. ";
+    if(status>0)
+        std::cerr << "HTTP status " << status << (code.empty() ? "" : " ") << code << std::endl;
+    else
+        std::cerr << "rc=" << status << std::endl;
+
+    req.res = status==403 ? -EACCES : -EIO;
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task_discard<int> S3Backend::run_detached(fuse_io_context& io,
+    Request& req, RunState& state)
+{
+    co_await run(io, req);
+
+    --state.pending;
+    if(state.pending==0 &&
+        state.awaiter)
+        std::exchange(state.awaiter, nullptr).resume();
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> S3Backend::run_all(fuse_io_context& io,
+    std::vector<Request>& reqs)
+{
+    RunState state{reqs.size(), nullptr};
+    for(Request& req: reqs)
+    {
+        run_detached(io, req, state);
+    }
+
+    co_await RunAwaiter{state};
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> S3Backend::lock_block(fuse_io_context& io, uint64_t block)
+{
+    std::unique_lock lock(mutex);
+    while(std::find(writing.begin(), writing.end(), block)!=writing.end())
+        co_await waiters.wait(io, lock);
+
+    writing.push_back(block);
+    co_return 0;
+}
+
+void S3Backend::unlock_block(uint64_t block)
+{
+    std::scoped_lock lock(mutex);
+    auto it = std::find(writing.begin(), writing.end(), block);
+    if(it!=writing.end())
+        writing.erase(it);
+    waiters.notify_all();
+}
+
+void S3Backend::split(std::vector<BlockIo>& ios, std::vector<Piece>& pieces) const
+{
+    for(size_t i=0;i<ios.size();++i)
+    {
+        const BlockIo& req = ios[i];
+        uint64_t done = 0;
+        while(done<req.len)
+        {
+            uint64_t offset = req.offset + done;
+            uint64_t in_block = offset % block_size;
+            uint64_t len = std::min(req.len - done, block_size - in_block);
+            pieces.push_back(Piece{i, offset / block_size, in_block, len,
+                    req.buf + done, req.buf_idx, 0});
+            done += len;
+        }
+    }
+
+    // Keeps the order of overlapping writes
+    std::stable_sort(pieces.begin(), pieces.end(), [](const Piece& a, const Piece& b) {
+        return a.block<b.block || (a.block==b.block && a.offset<b.offset);
+    });
+}
+
+fuse_io_context::io_uring_task<int> S3Backend::read_pieces(fuse_io_context& io,
+    std::vector<Piece>& pieces)
+{
+    std::vector<Request> reqs;
+    std::vector<size_t> piece_req(pieces.size());
+    for(size_t i=0;i<pieces.size();++i)
+    {
+        const Piece& piece = pieces[i];
+        if(i>0 &&
+            pieces[i-1].block==piece.block &&
+            pieces[i-1].offset + pieces[i-1].len==piece.offset)
+        {
+            Request& req = reqs.back();
+            if(req.segs.size()==1)
+                ++merged_reads;
+            req.len += piece.len;
+            req.segs.push_back(Segment{piece.buf, piece.buf_idx, piece.len});
+        }
+        else
+        {
+            reqs.push_back(Request{Method::Get, piece.block, piece.offset, piece.len,
+                    {Segment{piece.buf, piece.buf_idx, piece.len}}, false, 0});
+        }
+        piece_req[i] = reqs.size() - 1;
+    }
+
+    if(co_await run_all(io, reqs)!=0)
+        co_return -1;
+
+    for(size_t i=0;i<pieces.size();++i)
+    {
+        int res = reqs[piece_req[i]].res;
+        pieces[i].res = res<0 ? res : static_cast<int>(pieces[i].len);
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> S3Backend::write_pieces(fuse_io_context& io,
+    std::vector<Piece>& pieces)
+{
+    // First piece of each block, and the end
+    std::vector<size_t> starts;
+    for(size_t i=0;i<pieces.size();++i)
+    {
+        if(i==0 || pieces[i].block!=pieces[i-1].block)
+            starts.push_back(i);
+    }
+    starts.push_back(pieces.size());
+    const size_t n_blocks = starts.size() - 1;
+
+    // In ascending order, so writers of multiple blocks do not deadlock
+    size_t n_locked = 0;
+    int rc = 0;
+    for(;n_locked<n_blocks;++n_locked)
+    {
+        rc = co_await lock_block(io, pieces[starts[n_locked]].block);
+        if(rc<0)
+            break;
+    }
+
+    std::vector<std::unique_ptr<char, decltype(&free)> > tmps;
+    std::vector<Request> gets;
+    std::vector<size_t> get_block;
+    if(rc==0)
+    {
+        for(size_t b=0;b<n_blocks;++b)
+        {
+            tmps.emplace_back(nullptr, &free);
+
+            uint64_t covered = 0;
+            for(size_t i=starts[b];i<starts[b+1];++i)
+            {
+                if(pieces[i].offset!=covered)
+                    break;
+                covered += pieces[i].len;
+            }
+
+            if(covered==block_size)
+                continue;
+
+            ++partial_writes;
+            tmps[b].reset(alloc_aligned(block_size));
+            if(!tmps[b])
+            {
+                rc = -ENOMEM;
+                break;
+            }
+
+            gets.push_back(Request{Method::Get, pieces[starts[b]].block, 0, block_size,
+                    {Segment{tmps[b].get(), -1, block_size}}, false, 0});
+            get_block.push_back(b);
+        }
+    }
+
+    if(rc==0 && !gets.empty())
+        rc = co_await run_all(io, gets);
+
+    std::vector<Request> puts;
+    std::vector<size_t> put_block;
+    std::vector<int> block_res(n_blocks, rc<0 ? rc : 0);
+    for(size_t i=0;i<gets.size();++i)
+    {
+        if(gets[i].res<0)
+            block_res[get_block[i]] = gets[i].res;
+    }
+
+    if(rc==0)
+    {
+        for(size_t b=0;b<n_blocks;++b)
+        {
+            if(block_res[b]<0)
+                continue;
+
+            const uint64_t block = pieces[starts[b]].block;
+            if(starts[b+1] - starts[b]>1)
+                ++packed_writes;
+
+            Request req{Method::Put, block, 0, block_size, {}, false, 0};
+            if(tmps[b])
+            {
+                for(size_t i=starts[b];i<starts[b+1];++i)
+                    memcpy(tmps[b].get() + pieces[i].offset, pieces[i].buf, pieces[i].len);
+                req.segs.push_back(Segment{tmps[b].get(), -1, block_size});
+            }
+            else
+            {
+                for(size_t i=starts[b];i<starts[b+1];++i)
+                    req.segs.push_back(Segment{pieces[i].buf, pieces[i].buf_idx, pieces[i].len});
+            }
+
+            puts.push_back(std::move(req));
+            put_block.push_back(b);
+        }
+
+        if(!puts.empty())
+            rc = co_await run_all(io, puts);
+    }
+
+    for(size_t i=0;i<puts.size();++i)
+    {
+        if(puts[i].res<0)
+            block_res[put_block[i]] = puts[i].res;
+    }
+
+    for(size_t b=0;b<n_locked;++b)
+    {
+        unlock_block(pieces[starts[b]].block);
+    }
+
+    for(size_t b=0;b<n_blocks;++b)
+    {
+        int res = rc<0 ? rc : block_res[b];
+        for(size_t i=starts[b];i<starts[b+1];++i)
+            pieces[i].res = res<0 ? res : static_cast<int>(pieces[i].len);
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> S3Backend::transfer(fuse_io_context& io,
+    bool write, std::vector<BlockIo>& ios)
+{
+    std::vector<Piece> pieces;
+    split(ios, pieces);
+
+    if(!pieces.empty())
+    {
+        int rc = write ? co_await write_pieces(io, pieces) : co_await read_pieces(io, pieces);
+        if(rc!=0)
+            co_return rc;
+    }
+
+    for(BlockIo& req: ios)
+    {
+        req.res = static_cast<int>(req.len);
+    }
+
+    for(const Piece& piece: pieces)
+    {
+        if(piece.res<0 &&
+            ios[piece.io_idx].res>=0)
+            ios[piece.io_idx].res = piece.res;
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> S3Backend::flush(fuse_io_context&, bool)
+{
+    // Writes are durable once their PUT completes
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> S3Backend::discard(fuse_io_context& io,
+    uint64_t offset, uint64_t len, bool)
+{
+    // Blocks are deleted with and without punch. Missing blocks read as
+    // zeros and are allocated again by the next write
+    if(offset>=size ||
+        len==0)
+        co_return 0;
+    len = std::min(len, size - offset);
+
+    const uint64_t end = offset + len;
+    const uint64_t first_full = round_up(offset, static_cast<uint64_t>(block_size)) / block_size;
+    const uint64_t end_full = end / block_size;
+
+    // Parts of blocks are written with zeros
+    std::vector<BlockIo> zero_ios;
+    if(first_full>=end_full)
+    {
+        zero_ios.push_back(BlockIo{nullptr, -1, offset, len, 0});
+    }
+    else
+    {
+        if(offset % block_size!=0)
+            zero_ios.push_back(BlockIo{nullptr, -1, offset, first_full*block_size - offset, 0});
+        if(end % block_size!=0)
+            zero_ios.push_back(BlockIo{nullptr, -1, end_full*block_size, end - end_full*block_size, 0});
+    }
+
+    if(!zero_ios.empty())
+    {
+        std::unique_ptr<char, decltype(&free)> zeros(alloc_aligned(block_size), &free);
+        if(!zeros)
+            co_return -ENOMEM;
+        memset(zeros.get(), 0, block_size);
+
+        for(BlockIo& req: zero_ios)
+            req.buf = zeros.get();
+
+        if(co_await transfer(io, true, zero_ios)!=0)
+            co_return -EIO;
+
+        for(const BlockIo& req: zero_ios)
+        {
+            if(req.res<0)
+                co_return req.res;
+        }
+    }
+
+    for(uint64_t block=first_full;block<end_full;)
+    {
+        uint64_t n = std::min(max_delete_batch, end_full - block);
+        std::vector<Request> reqs;
+        for(uint64_t i=0;i<n;++i)
+        {
+            if(co_await lock_block(io, block + i)!=0)
+            {
+                for(uint64_t j=0;j<i;++j)
+                    unlock_block(block + j);
+                co_return -EIO;
+            }
+            reqs.push_back(Request{Method::Delete, block + i, 0, 0, {}, false, 0});
+        }
+
+        int rc = co_await run_all(io, reqs);
+
+        for(uint64_t i=0;i<n;++i)
+            unlock_block(block + i);
+
+        if(rc!=0)
+            co_return -EIO;
+
+        for(const Request& req: reqs)
+        {
+            if(req.res<0)
+                co_return req.res;
+        }
+
+        block += n;
+    }
+
+    co_return 0;
+}
+
+std::string S3Backend::get_stats() const
+{
+    std::ostringstream ret;
+    ret << "S3:";
+    for(size_t i=0;i<3;++i)
+    {
+        const Latency& latency = latencies[i];
+        uint64_t count = latency.count.load(std::memory_order_relaxed);
+        ret << " " << method_names[i] << "s=" << count
+            << " avg us=" << (count>0 ? latency.total_us.load(std::memory_order_relaxed)/count : 0)
+            << " p50 us=" << latency.percentile(50)
+            << " p99 us=" << latency.percentile(99)
+            << " max us=" << latency.max_us.load(std::memory_order_relaxed);
+    }
+    ret << " read MB=" << read_bytes.load(std::memory_order_relaxed)/(1024*1024)
+        << " written MB=" << written_bytes.load(std::memory_order_relaxed)/(1024*1024)
+        << " merged reads=" << merged_reads.load(std::memory_order_relaxed)
+        << " packed writes=" << packed_writes.load(std::memory_order_relaxed)
+        << " partial writes=" << partial_writes.load(std::memory_order_relaxed)
+        << " missing blocks=" << missing_blocks.load(std::memory_order_relaxed)
+        << " retries=" << retries.load(std::memory_order_relaxed)
+        << " errors=" << errors.load(std::memory_order_relaxed)
+        << " connects=" << connects.load(std::memory_order_relaxed);
+    return ret.str();
+}
@@ -0,0 +1,268 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "backend.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <coroutine>
+#include <sys/socket.h>
+#include <stdint.h>
+
+// Volume stored in an S3 compatible object store (AWS S3, MinIO, ...) like
+// s3backer. The volume is divided into blocks of block_size and block n is
+// the object PREFIX followed by n as 16 hex digits. Blocks that were never
+// written (no object) read as zeros.
+//
+// Requests are plain HTTP/1.1 with keep-alive on io_uring sockets, signed
+// with AWS signature version 4 (credentials from AWS_ACCESS_KEY_ID and
+// AWS_SECRET_ACCESS_KEY) with an unsigned payload. Every worker thread has
+// a pool of up to n_conns connections, and the requests of a transfer run
+// in parallel on them:
+//
+// * Reads of consecutive ranges of the same block are merged into one
+//   range GET, whose body is received directly into the buffers.
+// * Writes to the same block are packed into one PUT of the block. Parts
+//   of the block the writes do not cover are read first. Writes to a
+//   block are serialized across threads for that.
+// * Discards DELETE the blocks they cover completely and write zeros to
+//   the others.
+//
+// Writes are durable once their PUT completes. Failed requests (connection
+// errors, 5xx) are retried on a new connection.
+class S3Backend : public Backend
+{
+public:
+    // url is http://HOST[:PORT]/BUCKET[/PREFIX]
+    S3Backend(const std::string& url, uint64_t size, uint32_t block_size,
+        size_t n_conns, const std::string& region);
+    // Closes the connections of the pools. fd of open() is not closed
+    ~S3Backend();
+
+    // Connects to the host of url. Returns the fd or -1
+    static int connect_endpoint(const std::string& url);
+
+    // Checks the bucket with a request on fd (and creates it if it does not
+    // exist) and sets up the connection pools of n_threads worker threads
+    bool open(int fd, size_t n_threads);
+
+    std::string describe() const override;
+
+    uint64_t get_size() const override
+    {
+        return size;
+    }
+
+    // Connections are not fixed files, since the pool reconnects
+    int get_thread_fd(size_t) const override
+    {
+        return -1;
+    }
+
+    void start(fuse_io_context&) override {}
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io,
+        bool write, std::vector<BlockIo>& ios) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush(fuse_io_context& io,
+        bool datasync) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> discard(fuse_io_context& io,
+        uint64_t offset, uint64_t len, bool punch) override;
+
+    // Space is allocated on demand
+    [[nodiscard]] fuse_io_context::io_uring_task<int> allocate(fuse_io_context&,
+        uint64_t, uint64_t) override
+    {
+        co_return 0;
+    }
+
+    std::string get_stats() const override;
+
+    // Part of a request body, received into or sent from buf
+    struct Segment
+    {
+        char* buf;
+        int buf_idx;
+        uint64_t len;
+    };
+
+    enum class Method
+    {
+        Get = 0,
+        Put = 1,
+        Delete = 2
+    };
+
+    // Request for [offset, offset+len) of block. The body is in segs
+    struct Request
+    {
+        Method method;
+        uint64_t block;
+        uint64_t offset;
+        uint64_t len;
+        std::vector<Segment> segs;
+        // GET: the block does not exist
+        bool missing;
+        int res;
+    };
+
+private:
+    // Part of a BlockIo inside one block
+    struct Piece
+    {
+        size_t io_idx;
+        uint64_t block;
+        uint64_t offset;
+        uint64_t len;
+        char* buf;
+        int buf_idx;
+        int res;
+    };
+
+    // Requests of run_all() that have not finished
+    struct RunState
+    {
+        size_t pending;
+        std::coroutine_handle<> awaiter;
+    };
+
+    struct RunAwaiter
+    {
+        RunState& state;
+
+        bool await_ready() noexcept
+        {
+            return state.pending==0;
+        }
+
+        void await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+        {
+            state.awaiter = p_awaiter;
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    // Idle connections of a worker thread
+    struct Pool
+    {
+        std::vector<int> idle;
+        size_t n_open;
+        std::deque<std::coroutine_handle<> > waiters;
+    };
+
+    struct PoolAwaiter
+    {
+        Pool& pool;
+
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+        {
+            pool.waiters.push_back(p_awaiter);
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    // Latencies of one request method, in power of two microsecond buckets
+    struct Latency
+    {
+        static const size_t n_buckets = 32;
+
+        Latency();
+        void add(int64_t us);
+        // Upper bound of the bucket of the percentile p
+        int64_t percentile(unsigned int p) const;
+
+        std::atomic<uint64_t> buckets[n_buckets];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> total_us;
+        std::atomic<int64_t> max_us;
+    };
+
+    // Takes an idle connection of the thread or opens a new one. Returns
+    // the fd or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> acquire(fuse_io_context& io, bool fresh);
+    // Returns fd to the pool. Closes it instead unless reuse
+    void release(fuse_io_context& io, int fd, bool reuse);
+
+    // Runs req with retries. Sets req.res
+    [[nodiscard]] fuse_io_context::io_uring_task<int> run(fuse_io_context& io, Request& req);
+    // One attempt of req on fd. Returns the HTTP status or a negative
+    // errno. Sets reuse if the connection can be used for the next request
+    // and code to the S3 error code of an error response
+    [[nodiscard]] fuse_io_context::io_uring_task<int> exchange(fuse_io_context& io, int fd,
+        Request& req, bool& reuse, std::string& code);
+    // Runs all of reqs in parallel
+    [[nodiscard]] fuse_io_context::io_uring_task<int> run_all(fuse_io_context& io,
+        std::vector<Request>& reqs);
+    fuse_io_context::io_uring_task_discard<int> run_detached(fuse_io_context& io,
+        Request& req, RunState& state);
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> lock_block(fuse_io_context& io, uint64_t block);
+    void unlock_block(uint64_t block);
+
+    // Splits ios into pieces, sorted by block and offset
+    void split(std::vector<BlockIo>& ios, std::vector<Piece>& pieces) const;
+    // Reads pieces with one range GET per run of consecutive pieces in a
+    // block. Sets the res of the pieces
+    [[nodiscard]] fuse_io_context::io_uring_task<int> read_pieces(fuse_io_context& io,
+        std::vector<Piece>& pieces);
+    // Writes pieces with one PUT per block. Blocks the pieces do not cover
+    // completely are read first. Sets the res of the pieces
+    [[nodiscard]] fuse_io_context::io_uring_task<int> write_pieces(fuse_io_context& io,
+        std::vector<Piece>& pieces);
+
+    std::string object_path(uint64_t block) const;
+    // Request header including the signature. Has a range header if range_len>0
+    std::string request_header(const char* method, const std::string& path,
+        uint64_t range_offset, uint64_t range_len, uint64_t content_len);
+    // Request without body for the bucket on fd, with blocking I/O.
+    // Returns the HTTP status or -1
+    int bucket_request(int fd, const char* method);
+
+    std::string url;
+    uint64_t size;
+    uint32_t block_size;
+    size_t n_conns;
+    std::string region;
+    std::string host;
+    std::string port;
+    std::string bucket;
+    std::string prefix;
+    std::string access_key;
+    std::string secret_key;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    std::vector<std::unique_ptr<Pool> > pools;
+
+    // Cached signing key of signing_date
+    std::mutex signing_mutex;
+    std::string signing_date;
+    std::string signing_key;
+
+    // Blocks being written. Writers of the same block wait on waiters
+    std::mutex mutex;
+    std::vector<uint64_t> writing;
+    fuse_io_context::SharedWaitQueue waiters;
+
+    Latency latencies[3];
+    std::atomic<uint64_t> read_bytes;
+    std::atomic<uint64_t> written_bytes;
+    std::atomic<uint64_t> merged_reads;
+    std::atomic<uint64_t> packed_writes;
+    std::atomic<uint64_t> partial_writes;
+    std::atomic<uint64_t> missing_blocks;
+    std::atomic<uint64_t> retries;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> connects;
+};
@@ -0,0 +1,1044 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "snapshot.h"
+#include "io_util.h"
+#include <iostream>
+#include <sstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <linux/falloc.h>
+
+namespace
+{
+    const char snapshot_magic[8] = {'F', 'U', 'S', 'S', 'N', 'P', '0', '1'};
+    const uint32_t snapshot_version = 1;
+    const uint64_t page_size = 4096;
+    const uint64_t words_per_page = page_size / sizeof(uint64_t);
+    // Maximum number of reads/writes to wait for at once
+    const size_t max_snapshot_batch = 64;
+    // Number of counters of writes in flight while merging
+    const size_t n_pending = 1024;
+    const uint64_t no_word = UINT64_MAX;
+    // The merge retries after errors after this long
+    const unsigned int merge_retry_ms = 100;
+
+    // At the start of the bitmap area of the overlay
+    struct SnapshotHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t block_size;
+        uint64_t volume_size;
+        uint64_t n_blocks;
+        uint32_t state;
+        uint32_t reserved;
+        uint64_t generation;
+        uint64_t checksum;
+    };
+}
+
+Snapshot::Snapshot(const std::string& path, uint64_t volume_size, uint32_t block_size)
+    : path(path), fd(-1), volume_size(volume_size), block_size(block_size),
+        n_blocks((volume_size + block_size - 1) / block_size),
+        map_offset(round_up(volume_size, page_size)),
+        n_words((n_blocks + 63) / 64), direct_io(false), generation(0),
+        gen(0), transitioning(false),
+        pending(std::make_unique<std::atomic<uint32_t>[]>(n_pending)),
+        merging_word(no_word), overlay_blocks(0), cow_copies(0),
+        merged_blocks(0), settle_waits(0), copy_waits(0), merge_waits(0)
+{
+    inflight[0] = 0;
+    inflight[1] = 0;
+    for(size_t i=0;i<n_pending;++i)
+        pending[i].store(0, std::memory_order_relaxed);
+}
+
+Snapshot::~Snapshot()
+{
+    if(fd!=-1)
+        close(fd);
+}
+
+const char* Snapshot::state_name(State state)
+{
+    switch(state)
+    {
+    case State::None:
+        return "none";
+    case State::Active:
+        return "active";
+    case State::Merging:
+        return "merging";
+    }
+    return "unknown";
+}
+
+bool Snapshot::init(bool p_direct_io)
+{
+    direct_io = p_direct_io;
+    uint64_t bitmap_size = round_up(n_words*sizeof(uint64_t), page_size);
+    uint64_t file_size = map_offset + page_size + bitmap_size;
+
+    fd = ::open(path.c_str(), O_RDWR|O_CREAT|O_CLOEXEC|(direct_io ? O_DIRECT : 0), S_IRUSR|S_IWUSR);
+    if(fd==-1)
+    {
+        perror(("Error opening snapshot overlay "+path).c_str());
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st)!=0)
+    {
+        perror("Error getting snapshot overlay size");
+        return false;
+    }
+
+    marked = std::make_unique<std::atomic<uint64_t>[]>(n_words);
+    present = std::make_unique<std::atomic<uint64_t>[]>(n_words);
+    page_flushing.resize(bitmap_size / page_size);
+
+    std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(std::max(page_size, bitmap_size)), &free);
+    if(!buf)
+    {
+        std::cerr << "Error allocating snapshot bitmap" << std::endl;
+        return false;
+    }
+
+    if(st.st_size==0)
+    {
+        SnapshotHeader header = {};
+        memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+        header.version = snapshot_version;
+        header.block_size = block_size;
+        header.volume_size = volume_size;
+        header.n_blocks = n_blocks;
+        header.state = static_cast<uint32_t>(State::None);
+        header.checksum = hash_header(reinterpret_cast<const char*>(&header), offsetof(SnapshotHeader, checksum));
+
+        memset(buf.get(), 0, page_size);
+        memcpy(buf.get(), &header, sizeof(header));
+
+        if(ftruncate(fd, file_size)!=0 ||
+            !pwrite_full(fd, buf.get(), page_size, map_offset) ||
+            fdatasync(fd)!=0)
+        {
+            perror("Error creating snapshot overlay");
+            return false;
+        }
+
+        for(uint64_t i=0;i<n_words;++i)
+        {
+            marked[i].store(0, std::memory_order_relaxed);
+            present[i].store(0, std::memory_order_relaxed);
+        }
+
+        std::cout << "Created snapshot overlay \"" << path << "\"" << std::endl;
+        return true;
+    }
+
+    if(!pread_full(fd, buf.get(), page_size, map_offset))
+    {
+        perror("Error reading snapshot overlay header");
+        return false;
+    }
+
+    SnapshotHeader header;
+    memcpy(&header, buf.get(), sizeof(header));
+    if(memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic))!=0 ||
+        header.version!=snapshot_version ||
+        header.checksum!=hash_header(buf.get(), offsetof(SnapshotHeader, checksum)) ||
+        header.state>static_cast<uint32_t>(State::Merging) ||
+        static_cast<uint64_t>(st.st_size)<file_size)
+    {
+        std::cerr << "\"" << path << "\" is not a snapshot overlay" << std::endl;
+        return false;
+    }
+
+    if(header.block_size!=block_size ||
+        header.volume_size!=volume_size ||
+        header.n_blocks!=n_blocks)
+    {
+        std::cerr << "Snapshot overlay \"" << path << "\" has block size " << header.block_size
+            << " and volume size " << header.volume_size << ", not " << block_size
+            << " and " << volume_size << std::endl;
+        return false;
+    }
+
+    if(!pread_full(fd, buf.get(), bitmap_size, map_offset + page_size))
+    {
+        perror("Error reading snapshot bitmap");
+        return false;
+    }
+
+    const uint64_t* words = reinterpret_cast<const uint64_t*>(buf.get());
+    uint64_t n_present = 0;
+    for(uint64_t i=0;i<n_words;++i)
+    {
+        marked[i].store(words[i], std::memory_order_relaxed);
+        present[i].store(words[i], std::memory_order_relaxed);
+        n_present+=__builtin_popcountll(words[i]);
+    }
+    overlay_blocks = n_present;
+    generation = header.generation;
+
+    State state = static_cast<State>(header.state);
+    // Blocks in the overlay without snapshot are newer than the base
+    if(state==State::None && n_present>0)
+    {
+        std::cerr << "Snapshot overlay \"" << path << "\" has " << n_present
+            << " blocks without snapshot. Merging them" << std::endl;
+        state = State::Merging;
+    }
+    gen = static_cast<uint64_t>(state);
+
+    std::cout << "Loaded snapshot overlay \"" << path << "\" with " << n_present
+        << " blocks, snapshot " << state_name(state) << std::endl;
+    return true;
+}
+
+std::string Snapshot::describe() const
+{
+    std::ostringstream ret;
+    ret << volume_size/(1024*1024) << " MB in " << n_blocks << " blocks of "
+        << block_size/1024 << " KB, snapshot " << state_name(get_state());
+    return ret.str();
+}
+
+uint64_t Snapshot::io_size(uint64_t block) const
+{
+    if(direct_io)
+        return round_up(raw_size(block), page_size);
+    return raw_size(block);
+}
+
+void Snapshot::get_word_range(uint64_t offset, uint64_t len, uint64_t& first, uint64_t& last) const
+{
+    first = offset / block_size / 64;
+    last = (offset + std::max(len, static_cast<uint64_t>(1)) - 1) / block_size / 64;
+}
+
+void Snapshot::begin_io(IoGuard& guard)
+{
+    // Pairs with the generation switch in create()/remove()/merge(). Once
+    // the generation changed, no new I/O registers in the old counter
+    while(true)
+    {
+        uint64_t g = gen.load();
+        ++inflight[g & 1];
+        if(gen.load()==g)
+        {
+            guard.snapshot = this;
+            guard.gen = g;
+            return;
+        }
+        end_io(g);
+    }
+}
+
+void Snapshot::end_io(uint64_t p_gen)
+{
+    if(--inflight[p_gen & 1]==0)
+        waiters.notify_changed(mutex);
+}
+
+fuse_io_context::io_uring_task<int> Snapshot::wait_drained(fuse_io_context& io, uint64_t p_gen)
+{
+    // The counter of the previous generation is reused by the next one
+    co_return co_await waiters.wait_until(io, mutex, [this, p_gen]() {
+        return inflight[(p_gen + 1) & 1].load()==0;
+    });
+}
+
+fuse_io_context::io_uring_task<int> Snapshot::wait_settled(fuse_io_context& io, const IoGuard& guard)
+{
+    // If the generation changed, the switch already waited for the previous one
+    const uint64_t g = guard.gen;
+    auto settled = [this, g]() {
+        return gen.load()!=g ||
+            inflight[(g + 1) & 1].load()==0;
+    };
+
+    if(settled())
+        co_return 0;
+
+    ++settle_waits;
+    co_return co_await waiters.wait_until(io, mutex, settled);
+}
+
+fuse_io_context::io_uring_task<int> Snapshot::write_header(fuse_io_context& io, State state)
+{
+    std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(page_size), &free);
+    if(!buf)
+        co_return -ENOMEM;
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+    header.version = snapshot_version;
+    header.block_size = block_size;
+    header.volume_size = volume_size;
+    header.n_blocks = n_blocks;
+    header.state = static_cast<uint32_t>(state);
+    header.generation = generation.load();
+    header.checksum = hash_header(reinterpret_cast<const char*>(&header), offsetof(SnapshotHeader, checksum));
+
+    memset(buf.get(), 0, page_size);
+    memcpy(buf.get(), &header, sizeof(header));
+
+    io_uring_sqe* sqe = co_await io.get_backing_sqe();
+    if(sqe==nullptr)
+        co_return -EIO;
+
+    io_uring_prep_write(sqe, io.fuse_ring.files.snapshot_overlay, buf.get(), page_size, map_offset);
+    sqe->rw_flags = RWF_DSYNC;
+    sqe->flags |= IOSQE_FIXED_FILE;
+
+    int rc = co_await io.complete(sqe);
+    if(rc>=0 && static_cast<uint64_t>(rc)!=page_size)
+        rc = -EIO;
+    co_return rc<0 ? rc : 0;
+}
+
+fuse_io_context::io_uring_task<int> Snapshot::create(fuse_io_context& io)
+{
+    bool expected = false;
+    if(!transitioning.compare_exchange_strong(expected, true))
+        co_return -EBUSY;
+
+    uint64_t g = gen.load();
+    int rc = 0;
+    if(g % 3==static_cast<uint64_t>(State::Active))
+        rc = -EEXIST;
+    else if(g % 3==static_cast<uint64_t>(State::Merging))
+        rc = -EBUSY;
+
+    if(rc==0)
+        rc = co_await wait_drained(io, g);
+
+    // Drops the blocks of the last snapshot. The bitmap is empty
+    // after merging, so they are never read in any case
+    if(rc==0)
+    {
+        io_uring_sqe* sqe = co_await io.get_backing_sqe();
+        if(sqe==nullptr)
+        {
+            rc = -EIO;
+        }
+        else
+        {
+            io_uring_prep_fallocate(sqe, io.fuse_ring.files.snapshot_overlay,
+                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, map_offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+            co_await io.complete(sqe);
+        }
+    }
+
+    if(rc==0)
+    {
+        ++generation;
+        rc = co_await write_header(io, State::Active);
+        if(rc<0)
+            --generation;
+    }
+
+    if(rc==0)
+    {
+        gen.store(g + 1);
+        waiters.notify_changed(mutex);
+        std::cout << "Created snapshot " << generation.load() << std::endl;
+    }
+
+    transitioning = false;
+    co_return rc;
+}
+
+fuse_io_context::io_uring_task<int> Snapshot::remove(fuse_io_context& io)
+{
+    bool expected = false;
+    if(!transitioning.compare_exchange_strong(expected, true))
+        co_return -EBUSY;
+
+    uint64_t g = gen.load();
+    int rc = 0;
+    if(g % 3==static_cast<uint64_t>(State::None))
+        rc = -ENOENT;
+    else if(g % 3==static_cast<uint64_t>(State::Merging))
+        rc = -EBUSY;
+
+    if(rc==0)
+        rc = co_await wait_drained(io, g);
+
+    if(rc==0)
+        rc = co_await write_header(io, State::Merging);
+
+    if(rc==0)
+    {
+        gen.store(g + 1);
+        waiters.notify_changed(mutex);
+        std::cout << "Deleting snapshot " << generation.load() << ". Merging "
+            << overlay_blocks.load() << " blocks" << std::endl;
+    }
+
+    transitioning = false;
+    co_return rc;
+}
+
+fuse_io_context::io_uring_task<int> Snapshot::begin_merge_write(fuse_io_context& io,
+    uint64_t offset, uint64_t len)
+{
+    uint64_t first, last;
+    get_word_range(offset, len, first, last);
+
+    auto not_merging = [this, first, last]() {
+        uint64_t w = merging_word.load();
+        return w<first || w>last;
+    };
+
+    while(true)
+    {
+        // Pairs with the pending check in merge_word()
+        for(uint64_t w=first;w<=last;++w)
+            ++pending[w % n_pending];
+
+        if(not_merging())
+            co_return 0;
+
+        end_merge_write(offset, len);
+        co_await waiters.wait_until(io, mutex, not_merging);
+    }
+}
+
+void Snapshot::end_merge_write(uint64_t offset, uint64_t len)
+{
+    uint64_t first, last;
+    get_word_range(offset, len, first, last);
+
+    for(uint64_t w=first;w<=last;++w)
+        --pending[w % n_pending];
+
+    waiters.notify_changed(mutex);
+}
+
+fuse_io_context::io_uring_task<int> Snapshot::flush_map_page(fuse_io_context& io, uint64_t page)
+{
+    uint64_t first_word = page*words_per_page;
+    uint64_t n = std::min(words_per_page, n_words - first_word);
+
+    co_return co_await flush_meta_page(io, mutex, waiters, page_flushing, page,
+        io.fuse_ring.files.snapshot_overlay, map_offset + page_size + page*page_size, page_size,
+        [this, first_word, n](char* buf) {
+            uint64_t* words = reinterpret_cast<uint64_t*>(buf);
+            for(uint64_t i=0;i<n;++i)
+                words[i] = marked[first_word + i].load(std::memory_order_acquire);
+        },
+        [this, first_word, n](int rc, const char* buf) {
+            if(rc!=0)
+                return;
+
+            const uint64_t* words = reinterpret_cast<const uint64_t*>(buf);
+            for(uint64_t i=0;i<n;++i)
+                present[first_word + i].store(words[i], std::memory_order_release);
+        });
+}
+
+fuse_io_context::io_uring_task<int> Snapshot::copy_on_write(fuse_io_context& io,
+    const IoGuard& guard, const char* buf, uint64_t offset, uint64_t len,
+    std::vector<uint64_t>& copied)
+{
+    // Writes to the base started before the snapshot was created have to be
+    // in the copies
+    if(co_await wait_settled(io, guard)!=0)
+        co_return -EIO;
+
+    const uint64_t first = offset / block_size;
+    const uint64_t last = (offset + len - 1) / block_size;
+
+    // Claims the blocks that are not in the overlay yet. If another write
+    // copies one of them, waits until it is done
+    std::vector<uint64_t> blocks;
+    {
+        std::unique_lock lock(mutex);
+        while(true)
+        {
+            bool busy = false;
+            blocks.clear();
+            for(uint64_t block=first;block<=last;++block)
+            {
+                if(in_overlay(block))
+                    continue;
+
+                if(copying.find(block)!=copying.end())
+                {
+                    busy = true;
+                    break;
+                }
+
+                blocks.push_back(block);
+            }
+
+            if(!busy)
+            {
+                copying.insert(blocks.begin(), blocks.end());
+                break;
+            }
+
+            ++copy_waits;
+            co_await waiters.wait(io, lock);
+        }
+    }
+
+    if(blocks.empty())
+        co_return 0;
+
+    int rc = 0;
+    // Whole blocks with the write applied. Blocks the write does not cover
+    // completely are read from the base first
+    std::vector<std::unique_ptr<char, decltype(&free)> > bufs;
+    std::vector<size_t> reads;
+    for(size_t i=0;i<blocks.size();++i)
+    {
+        uint64_t block_start = blocks[i]*block_size;
+        uint64_t size = io_size(blocks[i]);
+        bufs.push_back(std::unique_ptr<char, decltype(&free)>(alloc_aligned(round_up(size, page_size)), &free));
+        if(!bufs.back())
+        {
+            rc = -ENOMEM;
+            break;
+        }
+
+        memset(bufs.back().get(), 0, size);
+        if(offset>block_start ||
+            offset + len<block_start + raw_size(blocks[i]))
+            reads.push_back(i);
+    }
+
+    for(size_t i=0;rc==0 && i<reads.size();)
+    {
+        size_t n = std::min(reads.size() - i, max_snapshot_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+        if(sqe==nullptr)
+        {
+            rc = -EIO;
+            break;
+        }
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            size_t idx = reads[i+j];
+            io_uring_prep_read(sqe, io.fuse_ring.backing_fd, bufs[idx].get(),
+                io_size(blocks[idx]), blocks[idx]*block_size);
+            sqe->flags |= IOSQE_FIXED_FILE;
+            sqes.push_back(sqe);
+        }
+
+        // Short reads at the end of the base are zeros
+        std::vector<int> rcs = co_await io.complete(sqes);
+        for(size_t j=0;j<n;++j)
+        {
+            if(rcs[j]<0)
+                rc = rcs[j];
+        }
+
+        i+=n;
+    }
+
+    for(size_t i=0;rc==0 && i<blocks.size();++i)
+    {
+        uint64_t block_start = blocks[i]*block_size;
+        uint64_t write_start = std::max(offset, block_start);
+        uint64_t write_end = std::min(offset + len, block_start + raw_size(blocks[i]));
+        memcpy(bufs[i].get() + (write_start - block_start), buf + (write_start - offset),
+            write_end - write_start);
+    }
+
+    for(size_t i=0;rc==0 && i<blocks.size();)
+    {
+        size_t n = std::min(blocks.size() - i, max_snapshot_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+        if(sqe==nullptr)
+        {
+            rc = -EIO;
+            break;
+        }
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            io_uring_prep_write(sqe, io.fuse_ring.files.snapshot_overlay, bufs[i+j].get(),
+                io_size(blocks[i+j]), blocks[i+j]*block_size);
+            // Has to be on disk before the bitmap says the block is in the overlay
+            sqe->rw_flags = RWF_DSYNC;
+            sqe->flags |= IOSQE_FIXED_FILE;
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+        for(size_t j=0;j<n;++j)
+        {
+            if(rcs[j]<0)
+                rc = rcs[j];
+            else if(static_cast<uint64_t>(rcs[j])!=io_size(blocks[i+j]))
+                rc = -EIO;
+        }
+
+        i+=n;
+    }
+
+    if(rc==0)
+    {
+        for(uint64_t block: blocks)
+        {
+            marked[block/64].fetch_or(1ULL << (block % 64), std::memory_order_release);
+        }
+
+        for(uint64_t block: blocks)
+        {
+            while(!in_overlay(block))
+            {
+                uint64_t page = block/64/words_per_page;
+                int frc = co_await flush_map_page(io, page);
+                if(frc<0)
+                {
+                    rc = frc;
+                    break;
+                }
+
+                if(frc==1)
+                    co_await wait_page_flushed(io, page);
+            }
+
+            if(rc<0)
+                break;
+        }
+
+        overlay_blocks+=blocks.size();
+        cow_copies+=blocks.size();
+        copied.insert(copied.end(), blocks.begin(), blocks.end());
+    }
+
+    if(rc<0)
+    {
+        static bool erronce=true;
+        if(erronce)
+        {
+            std::cerr << "Copying blocks to the snapshot overlay failed rc=" << rc << std::endl;
+            erronce=false;
+        }
+    }
+
+    std::scoped_lock lock(mutex);
+    for(uint64_t block: blocks)
+    {
+        copying.erase(block);
+    }
+    waiters.notify_all();
+
+    co_return rc;
+}
+
+fuse_io_context::io_uring_task<int> Snapshot::merge_word(fuse_io_context& io, uint64_t word, char* buf)
+{
+    uint64_t bits = marked[word].load();
+    if(bits==0)
+        co_return 0;
+
+    // Pairs with begin_merge_write()
+    merging_word.store(word);
+    if(pending[word % n_pending].load()!=0)
+    {
+        merging_word.store(no_word);
+        waiters.notify_changed(mutex);
+        ++merge_waits;
+        co_return 1;
+    }
+
+    std::vector<uint64_t> blocks;
+    for(uint64_t i=0;i<64;++i)
+    {
+        if(bits & (1ULL << i))
+            blocks.push_back(word*64 + i);
+    }
+
+    int rc = 0;
+    for(size_t pass=0;rc==0 && pass<2;++pass)
+    {
+        // Overlay blocks into buf, then buf to the base. The base has to have
+        // them on disk before they are removed from the bitmap
+        bool write = pass==1;
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(blocks.size());
+        if(sqe==nullptr)
+        {
+            rc = -EIO;
+            break;
+        }
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<blocks.size();++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            char* block_buf = buf + (blocks[j] % 64)*block_size;
+            if(write)
+            {
+                io_uring_prep_write(sqe, io.fuse_ring.backing_fd, block_buf,
+                    io_size(blocks[j]), blocks[j]*block_size);
+                sqe->rw_flags = RWF_DSYNC;
+            }
+            else
+            {
+                io_uring_prep_read(sqe, io.fuse_ring.files.snapshot_overlay, block_buf,
+                    io_size(blocks[j]), blocks[j]*block_size);
+            }
+            sqe->flags |= IOSQE_FIXED_FILE;
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+        for(size_t j=0;j<rcs.size();++j)
+        {
+            if(rcs[j]<0)
+                rc = rcs[j];
+            else if(static_cast<uint64_t>(rcs[j])!=io_size(blocks[j]))
+                rc = -EIO;
+        }
+    }
+
+    if(rc==0)
+    {
+        marked[word].fetch_and(~bits, std::memory_order_release);
+
+        while((present[word].load(std::memory_order_acquire) & bits)!=0)
+        {
+            int frc = co_await flush_map_page(io, word/words_per_page);
+            if(frc<0)
+            {
+                rc = frc;
+                break;
+            }
+
+            if(frc==1)
+                co_await wait_page_flushed(io, word/words_per_page);
+        }
+    }
+
+    if(rc==0)
+    {
+        overlay_blocks-=blocks.size();
+        merged_blocks+=blocks.size();
+    }
+
+    merging_word.store(no_word);
+    waiters.notify_changed(mutex);
+    co_return rc;
+}
+
+fuse_io_context::io_uring_task<int> Snapshot::wait_page_flushed(fuse_io_context& io, uint64_t page)
+{
+    std::unique_lock lock(mutex);
+    while(page_flushing[page])
+    {
+        co_await waiters.wait(io, lock);
+    }
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task_discard<int> Snapshot::merge(fuse_io_context& io)
+{
+    std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(static_cast<size_t>(block_size)*64), &free);
+    if(!buf)
+    {
+        std::cerr << "Error allocating snapshot merge buffer" << std::endl;
+        co_return -1;
+    }
+
+    uint64_t word = 0;
+    while(true)
+    {
+        co_await waiters.wait_until(io, mutex, [this]() {
+            return gen.load() % 3==static_cast<uint64_t>(State::Merging);
+        });
+
+        uint64_t g = gen.load();
+
+        // Copies of the snapshot may still be running
+        if(co_await wait_drained(io, g)!=0)
+            co_return -1;
+
+        for(uint64_t i=0;i<n_words && marked[word].load()==0;++i)
+            word = (word + 1) % n_words;
+
+        if(marked[word].load()==0)
+        {
+            int rc = co_await write_header(io, State::None);
+            if(rc<0)
+            {
+                std::cerr << "Error writing snapshot header rc=" << rc << std::endl;
+                co_await sleep_ms(io, merge_retry_ms);
+                continue;
+            }
+
+            gen.store(g + 1);
+            waiters.notify_changed(mutex);
+            std::cout << "Merged snapshot " << generation.load() << std::endl;
+            continue;
+        }
+
+        int rc = co_await merge_word(io, word, buf.get());
+        if(rc<0)
+        {
+            static bool erronce=true;
+            if(erronce)
+            {
+                std::cerr << "Merging snapshot overlay failed rc=" << rc << ". Retrying" << std::endl;
+                erronce=false;
+            }
+            co_await sleep_ms(io, merge_retry_ms);
+            continue;
+        }
+
+        if(rc==1)
+        {
+            // Writes to the word in flight
+            co_await waiters.wait_until(io, mutex, [this, word]() {
+                return pending[word % n_pending].load()==0;
+            });
+        }
+        else
+        {
+            word = (word + 1) % n_words;
+        }
+    }
+}
+
+Snapshot::Stats Snapshot::get_stats() const
+{
+    Stats ret;
+    ret.state = get_state();
+    ret.generation = generation.load(std::memory_order_relaxed);
+    ret.overlay_blocks = overlay_blocks.load(std::memory_order_relaxed);
+    ret.cow_copies = cow_copies.load(std::memory_order_relaxed);
+    ret.merged_blocks = merged_blocks.load(std::memory_order_relaxed);
+    ret.settle_waits = settle_waits.load(std::memory_order_relaxed);
+    ret.copy_waits = copy_waits.load(std::memory_order_relaxed);
+    ret.merge_waits = merge_waits.load(std::memory_order_relaxed);
+    return ret;
+}
+
+fuse_io_context::io_uring_task<int> snapshot_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios)
+{
+    Snapshot* snapshot = io.fuse_ring.snapshot;
+    const uint64_t block_size = snapshot->get_block_size();
+
+    Snapshot::IoGuard guard;
+    snapshot->begin_io(guard);
+    const Snapshot::State state = guard.get_state();
+
+    // Blocks not in the overlay are written to the base while merging,
+    // which copies to the overlay of the deleted snapshot may still read
+    if(write &&
+        state==Snapshot::State::Merging &&
+        co_await snapshot->wait_settled(io, guard)!=0)
+        co_return -1;
+
+    struct Piece
+    {
+        size_t req;
+        uint64_t offset;
+        uint64_t len;
+        uint64_t req_offset;
+        bool overlay;
+    };
+
+    std::vector<Piece> pieces;
+    std::vector<uint64_t> req_len(ios.size());
+    std::vector<bool> merge_write(ios.size());
+    for(size_t i=0;i<ios.size();++i)
+    {
+        BlockIo& req = ios[i];
+        req.res = 0;
+        req_len[i] = block_io_len(req, snapshot->get_size());
+
+        if(req_len[i]==0)
+        {
+            if(write)
+                req.res = -ENOSPC;
+            continue;
+        }
+
+        std::vector<uint64_t> copied;
+        if(write &&
+            state==Snapshot::State::Active)
+        {
+            int rc = co_await snapshot->copy_on_write(io, guard, req.buf, req.offset, req_len[i], copied);
+            if(rc<0)
+            {
+                req.res = rc;
+                continue;
+            }
+        }
+        else if(write &&
+            state==Snapshot::State::Merging)
+        {
+            co_await snapshot->begin_merge_write(io, req.offset, req_len[i]);
+            merge_write[i] = true;
+        }
+
+        const uint64_t req_end = req.offset + req_len[i];
+        size_t copied_idx = 0;
+        for(uint64_t off=req.offset;off<req_end;)
+        {
+            uint64_t block = off / block_size;
+            uint64_t end = std::min(req_end, (block + 1)*block_size);
+            Piece piece = {i, off, end - off, off - req.offset, false};
+            off = end;
+
+            // Already written with the copy
+            if(copied_idx<copied.size() &&
+                copied[copied_idx]==block)
+            {
+                ++copied_idx;
+                continue;
+            }
+
+            piece.overlay = state!=Snapshot::State::None && snapshot->in_overlay(block);
+
+            if(!pieces.empty() &&
+                pieces.back().req==i &&
+                pieces.back().overlay==piece.overlay &&
+                pieces.back().offset + pieces.back().len==piece.offset)
+                pieces.back().len+=piece.len;
+            else
+                pieces.push_back(piece);
+        }
+    }
+
+    for(size_t i=0;i<pieces.size();)
+    {
+        size_t n = std::min(pieces.size() - i, max_snapshot_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+        if(sqe==nullptr)
+            co_return -1;
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            const Piece& piece = pieces[i+j];
+            const BlockIo& req = ios[piece.req];
+            int file = piece.overlay ? io.fuse_ring.files.snapshot_overlay : io.fuse_ring.backing_fd;
+            char* buf = req.buf + piece.req_offset;
+            uint64_t len = piece.len;
+            // Reads of the end of the request in whole pages for O_DIRECT. Request
+            // buffers are whole pages
+            if(!write &&
+                io.fuse_ring.direct_io &&
+                piece.req_offset + piece.len==req_len[piece.req])
+                len = round_up(len, page_size);
+
+            if(write && req.buf_idx>=0)
+                io_uring_prep_write_fixed(sqe, file, buf, len, piece.offset, req.buf_idx);
+            else if(write)
+                io_uring_prep_write(sqe, file, buf, len, piece.offset);
+            else if(req.buf_idx>=0)
+                io_uring_prep_read_fixed(sqe, file, buf, len, piece.offset, req.buf_idx);
+            else
+                io_uring_prep_read(sqe, file, buf, len, piece.offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+
+        for(size_t j=0;j<n;++j)
+        {
+            const Piece& piece = pieces[i+j];
+            BlockIo& req = ios[piece.req];
+            if(req.res<0)
+                continue;
+
+            // The overlay has the size of the volume. Reads past the end
+            // of the base are zeros (the base has no data there)
+            if(!write &&
+                !piece.overlay &&
+                rcs[j]>=0 &&
+                static_cast<uint64_t>(rcs[j])<piece.len)
+                memset(req.buf + piece.req_offset + rcs[j], 0, piece.len - rcs[j]);
+            else
+                req.res = block_io_piece_res(rcs[j], piece.len);
+        }
+
+        i+=n;
+    }
+
+    for(size_t i=0;i<ios.size();++i)
+    {
+        if(merge_write[i])
+            snapshot->end_merge_write(ios[i].offset, req_len[i]);
+
+        if(ios[i].res>=0)
+            ios[i].res = static_cast<int>(req_len[i]);
+    }
+
+    co_return 0;
+}
+
+void SnapshotBackend::start(fuse_io_context& io)
+{
+    if(io.fuse_ring.thread_idx==0)
+        snapshot->merge(io);
+}
+
+fuse_io_context::io_uring_task<int> SnapshotBackend::flush(fuse_io_context& io,
+    bool datasync)
+{
+    std::vector<int> fds = {io.fuse_ring.backing_fd, io.fuse_ring.files.snapshot_overlay};
+
+    std::vector<int> rcs;
+    if(co_await sync_files(io, fds, datasync, rcs)!=0)
+        co_return -1;
+
+    int ret = 0;
+    for(int rc: rcs)
+    {
+        if(rc<0)
+            ret = rc;
+    }
+
+    co_return ret;
+}
+
+std::string SnapshotBackend::get_stats() const
+{
+    Snapshot::Stats snapshot_stats = snapshot->get_stats();
+    std::ostringstream ret;
+    ret << "Snapshot: state=" << Snapshot::state_name(snapshot_stats.state)
+        << " generation=" << snapshot_stats.generation
+        << " overlay blocks=" << snapshot_stats.overlay_blocks
+        << " copies=" << snapshot_stats.cow_copies
+        << " merged blocks=" << snapshot_stats.merged_blocks
+        << " settle waits=" << snapshot_stats.settle_waits
+        << " copy waits=" << snapshot_stats.copy_waits
+        << " merge waits=" << snapshot_stats.merge_waits;
+    return ret.str();
+}
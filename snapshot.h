@@ -0,0 +1,266 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include "backend.h"
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <algorithm>
+#include <stdint.h>
+
+// Copy-on-write snapshot of the volume. Creating a snapshot freezes the
+// backing file (base): From then on writes go to the overlay file (fixed
+// file index files.snapshot_overlay of the ring) and the base is exposed
+// as read-only snapshot.
+// The overlay has the blocks at their volume offset, followed by a header
+// page and a bitmap with one bit per block in the overlay. A block is
+// copied from the base to the overlay (with the data of the write applied)
+// on the first write to it and read from there afterwards. Like with the
+// chunk store overlay, the bitmap is written after the block data.
+//
+// Deleting the snapshot merges the overlay back into the base in the
+// background, one bitmap word of blocks at a time. Blocks not in the
+// overlay are written to the base directly while merging.
+//
+// Creating and deleting only write the header and switch the generation.
+// I/O is not stopped: Every read and write registers in one of two
+// counters by generation parity, and I/O that depends on the I/O of the
+// previous generation being finished (copying blocks from the base after
+// creation, writing the base while merging) waits until the counter of the
+// previous generation is zero. The state is the generation modulo 3
+// (none, active, merging).
+class Snapshot
+{
+public:
+    enum class State
+    {
+        None = 0,
+        Active = 1,
+        Merging = 2
+    };
+
+    struct Stats
+    {
+        State state;
+        uint64_t generation;
+        uint64_t overlay_blocks;
+        uint64_t cow_copies;
+        uint64_t merged_blocks;
+        uint64_t settle_waits;
+        uint64_t copy_waits;
+        uint64_t merge_waits;
+    };
+
+    class IoGuard
+    {
+    public:
+        IoGuard() noexcept
+            : snapshot(nullptr), gen(0) {}
+
+        IoGuard(IoGuard&& other) noexcept
+            : snapshot(std::exchange(other.snapshot, nullptr)), gen(other.gen) {}
+
+        IoGuard& operator=(IoGuard&& other) noexcept
+        {
+            std::swap(snapshot, other.snapshot);
+            std::swap(gen, other.gen);
+            return *this;
+        }
+
+        IoGuard(IoGuard const&) = delete;
+        IoGuard& operator=(IoGuard const&) = delete;
+
+        ~IoGuard()
+        {
+            if(snapshot!=nullptr)
+                snapshot->end_io(gen);
+        }
+
+        State get_state() const
+        {
+            return static_cast<State>(gen % 3);
+        }
+
+    private:
+        friend class Snapshot;
+        Snapshot* snapshot;
+        uint64_t gen;
+    };
+
+    Snapshot(const std::string& path, uint64_t volume_size, uint32_t block_size);
+    ~Snapshot();
+
+    // Loads the overlay file or creates a new one
+    bool init(bool direct_io);
+
+    int get_fd() const
+    {
+        return fd;
+    }
+
+    uint64_t get_size() const
+    {
+        return volume_size;
+    }
+
+    uint32_t get_block_size() const
+    {
+        return block_size;
+    }
+
+    std::string describe() const;
+
+    static const char* state_name(State state);
+
+    State get_state() const
+    {
+        return static_cast<State>(gen.load() % 3);
+    }
+
+    // Registers I/O with the current generation until guard is released
+    void begin_io(IoGuard& guard);
+
+    // Waits until the I/O of the generation before the one of guard is finished.
+    // Returns 0 or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> wait_settled(fuse_io_context& io,
+        const IoGuard& guard);
+
+    // Creates a snapshot. Returns -EEXIST if there is one, -EBUSY while
+    // one is being merged. Returns 0 or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> create(fuse_io_context& io);
+
+    // Deletes the snapshot by starting to merge the overlay into the base.
+    // Returns -ENOENT if there is none, -EBUSY if it is already being merged
+    [[nodiscard]] fuse_io_context::io_uring_task<int> remove(fuse_io_context& io);
+
+    // Merges the overlay into the base while the state is merging. Runs on one
+    // worker thread
+    fuse_io_context::io_uring_task_discard<int> merge(fuse_io_context& io);
+
+    // Copies the blocks of [offset, offset+len) that are not in the overlay
+    // yet to it, with the data of the write at buf applied. The copied blocks
+    // are appended to copied. Only while active. Returns 0 or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> copy_on_write(fuse_io_context& io,
+        const IoGuard& guard, const char* buf, uint64_t offset, uint64_t len,
+        std::vector<uint64_t>& copied);
+
+    // Registers a write of [offset, offset+len) while merging, so the merge
+    // does not copy these blocks at the same time. Waits if they are being
+    // merged right now. end_merge_write() has to be called afterwards
+    [[nodiscard]] fuse_io_context::io_uring_task<int> begin_merge_write(fuse_io_context& io,
+        uint64_t offset, uint64_t len);
+    void end_merge_write(uint64_t offset, uint64_t len);
+
+    bool in_overlay(uint64_t block) const
+    {
+        return (present[block/64].load(std::memory_order_acquire) & (1ULL << (block % 64)))!=0;
+    }
+
+    // Size of the block in the volume
+    uint64_t raw_size(uint64_t block) const
+    {
+        return std::min(static_cast<uint64_t>(block_size), volume_size - block*block_size);
+    }
+
+    Stats get_stats() const;
+
+private:
+    void end_io(uint64_t p_gen);
+    [[nodiscard]] fuse_io_context::io_uring_task<int> wait_drained(fuse_io_context& io, uint64_t p_gen);
+    [[nodiscard]] fuse_io_context::io_uring_task<int> wait_page_flushed(fuse_io_context& io, uint64_t page);
+    [[nodiscard]] fuse_io_context::io_uring_task<int> write_header(fuse_io_context& io, State state);
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush_map_page(fuse_io_context& io, uint64_t page);
+    [[nodiscard]] fuse_io_context::io_uring_task<int> merge_word(fuse_io_context& io, uint64_t word,
+        char* buf);
+    void get_word_range(uint64_t offset, uint64_t len, uint64_t& first, uint64_t& last) const;
+
+    // Length of reads/writes of block, in whole pages for O_DIRECT
+    uint64_t io_size(uint64_t block) const;
+
+    std::string path;
+    int fd;
+    uint64_t volume_size;
+    uint32_t block_size;
+    uint64_t n_blocks;
+    uint64_t map_offset;
+    uint64_t n_words;
+    bool direct_io;
+    // Number of snapshots created, in the header
+    std::atomic<uint64_t> generation;
+
+    std::atomic<uint64_t> gen;
+    std::atomic<uint64_t> inflight[2];
+    std::atomic<bool> transitioning;
+
+    // marked has one bit per block copied to the overlay, present the bits
+    // that are in the bitmap in the overlay file. Blocks are only read from
+    // the overlay once they are present
+    std::unique_ptr<std::atomic<uint64_t>[]> marked;
+    std::unique_ptr<std::atomic<uint64_t>[]> present;
+    std::mutex mutex;
+    std::unordered_set<uint64_t> copying;
+    std::vector<bool> page_flushing;
+
+    // Writes in flight while merging, by bitmap word (hashed), and the
+    // bitmap word being merged
+    std::unique_ptr<std::atomic<uint32_t>[]> pending;
+    std::atomic<uint64_t> merging_word;
+
+    std::atomic<uint64_t> overlay_blocks;
+    std::atomic<uint64_t> cow_copies;
+    std::atomic<uint64_t> merged_blocks;
+    std::atomic<uint64_t> settle_waits;
+    std::atomic<uint64_t> copy_waits;
+    std::atomic<uint64_t> merge_waits;
+
+    // Coroutines waiting for I/O to drain, copies, bitmap page writes, the
+    // merge and for merging to start
+    fuse_io_context::SharedWaitQueue waiters;
+};
+
+// Reads blocks in the overlay from the overlay and the others from the
+// base. Writes go to the base without snapshot, otherwise to the overlay
+// (while merging only blocks still in the overlay)
+[[nodiscard]] fuse_io_context::io_uring_task<int> snapshot_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios);
+
+// The volume with the snapshot overlay as backend. Syncs the base and
+// the overlay
+class SnapshotBackend : public Backend
+{
+public:
+    explicit SnapshotBackend(Snapshot* snapshot)
+        : snapshot(snapshot) {}
+
+    std::string describe() const override
+    {
+        return snapshot->describe();
+    }
+
+    uint64_t get_size() const override
+    {
+        return snapshot->get_size();
+    }
+
+    // Merge on the first worker thread
+    void start(fuse_io_context& io) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io,
+        bool write, std::vector<BlockIo>& ios) override
+    {
+        return snapshot_io(io, write, ios);
+    }
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush(fuse_io_context& io,
+        bool datasync) override;
+
+    std::string get_stats() const override;
+
+private:
+    Snapshot* snapshot;
+};
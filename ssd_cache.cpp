@@ -0,0 +1,348 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "ssd_cache.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+namespace
+{
+    const char index_magic[8] = {'F', 'U', 'S', 'C', 'I', 'D', 'X', '1'};
+    const uint32_t index_version = 1;
+    // Header has its own page so it can be synced separately
+    const size_t index_header_size = 4096;
+}
+
+SsdCache::SsdCache(const std::string& path, uint64_t cache_size, size_t chunk_size,
+    int backing_fd)
+    : path(path), chunk_size(chunk_size), backing_fd(backing_fd),
+        fd(-1), index_fd(-1), index_mem(nullptr), index_size(0),
+        entries(nullptr), loaded(0), clock_hand(0),
+        hits(0), misses(0), fills(0), evictions(0), invalidations(0)
+{
+    n_slots = std::max(static_cast<uint64_t>(1), cache_size / chunk_size);
+}
+
+SsdCache::~SsdCache()
+{
+    if(index_mem!=nullptr)
+    {
+        // Data has to be on disk before the index is marked as clean
+        if(fd!=-1 && fsync(fd)!=0)
+            perror("Error syncing SSD cache file");
+        else if(msync(index_mem, index_size, MS_SYNC)!=0)
+            perror("Error syncing SSD cache index");
+        else
+        {
+            IndexHeader* header = reinterpret_cast<IndexHeader*>(index_mem);
+            struct stat bst;
+            if(fstat(backing_fd, &bst)==0)
+            {
+                header->backing_size = bst.st_size;
+                header->backing_mtime = bst.st_mtime;
+                header->clean = 1;
+                if(msync(index_mem, index_header_size, MS_SYNC)!=0)
+                    perror("Error syncing SSD cache index header");
+            }
+        }
+
+        munmap(index_mem, index_size);
+    }
+
+    if(index_fd!=-1)
+        close(index_fd);
+
+    if(fd!=-1)
+        close(fd);
+}
+
+bool SsdCache::init(bool direct_io)
+{
+    fd = open(path.c_str(), O_RDWR|O_CREAT|O_CLOEXEC|(direct_io ? O_DIRECT : 0), S_IRUSR|S_IWUSR);
+    if(fd==-1)
+    {
+        perror(("Error opening SSD cache file \""+path+"\"").c_str());
+        return false;
+    }
+
+    int rc = posix_fallocate(fd, 0, slot_offset(n_slots));
+    if(rc!=0)
+    {
+        errno = rc;
+        perror("Error allocating SSD cache file");
+        return false;
+    }
+
+    std::string index_path = path + ".idx";
+    index_fd = open(index_path.c_str(), O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR);
+    if(index_fd==-1)
+    {
+        perror(("Error opening SSD cache index \""+index_path+"\"").c_str());
+        return false;
+    }
+
+    index_size = index_header_size + n_slots*sizeof(uint64_t);
+    if(ftruncate(index_fd, index_size)!=0)
+    {
+        perror("Error resizing SSD cache index");
+        return false;
+    }
+
+    void* p = mmap(nullptr, index_size, PROT_READ|PROT_WRITE, MAP_SHARED, index_fd, 0);
+    if(p==MAP_FAILED)
+    {
+        perror("Error mapping SSD cache index");
+        return false;
+    }
+    index_mem = static_cast<char*>(p);
+    entries = reinterpret_cast<uint64_t*>(index_mem + index_header_size);
+
+    slots.resize(n_slots);
+    for(Slot& slot: slots)
+    {
+        slot.state = SlotState::Free;
+        slot.pins = 0;
+        slot.referenced = false;
+    }
+
+    if(!load_index())
+    {
+        memset(entries, 0, n_slots*sizeof(uint64_t));
+        chunks.clear();
+        for(Slot& slot: slots)
+            slot.state = SlotState::Free;
+    }
+
+    free_slots.clear();
+    for(size_t i=n_slots;i>0;--i)
+    {
+        if(slots[i-1].state==SlotState::Free)
+            free_slots.push_back(i-1);
+    }
+    loaded = chunks.size();
+
+    // Mark as in use. If we crash the index might not match the cache file
+    // contents and is discarded on the next start
+    IndexHeader* header = reinterpret_cast<IndexHeader*>(index_mem);
+    memcpy(header->magic, index_magic, sizeof(index_magic));
+    header->version = index_version;
+    header->chunk_size = chunk_size;
+    header->n_slots = n_slots;
+    header->clean = 0;
+    if(msync(index_mem, index_size, MS_SYNC)!=0)
+    {
+        perror("Error syncing SSD cache index");
+        return false;
+    }
+
+    return true;
+}
+
+bool SsdCache::load_index()
+{
+    const IndexHeader* header = reinterpret_cast<const IndexHeader*>(index_mem);
+    if(memcmp(header->magic, index_magic, sizeof(index_magic))!=0)
+        return false;
+
+    if(header->version!=index_version ||
+        header->chunk_size!=chunk_size ||
+        header->n_slots!=n_slots)
+    {
+        std::cout << "SSD cache index layout changed. Starting with empty cache." << std::endl;
+        return false;
+    }
+
+    if(!header->clean)
+    {
+        std::cout << "SSD cache was not shut down cleanly. Starting with empty cache." << std::endl;
+        return false;
+    }
+
+    struct stat bst;
+    if(fstat(backing_fd, &bst)!=0 ||
+        header->backing_size!=static_cast<uint64_t>(bst.st_size) ||
+        header->backing_mtime!=bst.st_mtime)
+    {
+        std::cout << "Backing file changed since SSD cache was last used. Starting with empty cache." << std::endl;
+        return false;
+    }
+
+    for(size_t i=0;i<n_slots;++i)
+    {
+        if(entries[i]==0)
+            continue;
+
+        uint64_t chunk = entries[i]-1;
+        if(chunks.find(chunk)!=chunks.end())
+            return false;
+
+        chunks[chunk] = i;
+        slots[i].chunk = chunk;
+        slots[i].state = SlotState::Valid;
+    }
+
+    return true;
+}
+
+SsdCache::Stats SsdCache::get_stats() const
+{
+    Stats ret;
+    ret.hits = hits.load(std::memory_order_relaxed);
+    ret.misses = misses.load(std::memory_order_relaxed);
+    ret.fills = fills.load(std::memory_order_relaxed);
+    ret.evictions = evictions.load(std::memory_order_relaxed);
+    ret.invalidations = invalidations.load(std::memory_order_relaxed);
+    return ret;
+}
+
+bool SsdCache::lookup(uint64_t chunk, size_t& slot)
+{
+    std::scoped_lock lock(mutex);
+
+    auto it = chunks.find(chunk);
+    if(it==chunks.end() ||
+        slots[it->second].state!=SlotState::Valid)
+    {
+        ++misses;
+        return false;
+    }
+
+    Slot& s = slots[it->second];
+    s.referenced = true;
+    ++s.pins;
+    ++hits;
+    slot = it->second;
+    return true;
+}
+
+void SsdCache::unpin(size_t slot)
+{
+    std::scoped_lock lock(mutex);
+
+    Slot& s = slots[slot];
+    --s.pins;
+    if(s.pins==0 &&
+        s.state==SlotState::Dropped)
+    {
+        s.state = SlotState::Free;
+        free_slots.push_back(slot);
+    }
+}
+
+bool SsdCache::reserve(uint64_t chunk, size_t& slot)
+{
+    std::scoped_lock lock(mutex);
+
+    if(chunks.find(chunk)!=chunks.end())
+        return false;
+
+    if(!free_slots.empty())
+    {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    else if(!evict(slot))
+    {
+        return false;
+    }
+
+    Slot& s = slots[slot];
+    s.chunk = chunk;
+    s.state = SlotState::Filling;
+    s.pins = 1;
+    s.referenced = false;
+    chunks[chunk] = slot;
+    return true;
+}
+
+void SsdCache::fill_done(size_t slot, bool success)
+{
+    std::scoped_lock lock(mutex);
+
+    Slot& s = slots[slot];
+    if(s.state!=SlotState::Filling)
+        return;
+
+    if(success)
+    {
+        s.state = SlotState::Valid;
+        set_entry(slot, s.chunk+1);
+        ++fills;
+    }
+    else
+    {
+        chunks.erase(s.chunk);
+        s.state = SlotState::Dropped;
+    }
+}
+
+void SsdCache::invalidate(uint64_t offset, uint64_t len)
+{
+    if(len==0)
+        return;
+
+    uint64_t first_chunk = offset / chunk_size;
+    uint64_t last_chunk = (offset + len - 1) / chunk_size;
+
+    std::scoped_lock lock(mutex);
+    for(uint64_t chunk=first_chunk;chunk<=last_chunk;++chunk)
+    {
+        auto it = chunks.find(chunk);
+        if(it==chunks.end())
+            continue;
+
+        size_t slot = it->second;
+        chunks.erase(it);
+        set_entry(slot, 0);
+        ++invalidations;
+
+        Slot& s = slots[slot];
+        if(s.pins==0)
+        {
+            s.state = SlotState::Free;
+            free_slots.push_back(slot);
+        }
+        else
+        {
+            s.state = SlotState::Dropped;
+        }
+    }
+}
+
+bool SsdCache::evict(size_t& slot)
+{
+    for(size_t i=0;i<2*n_slots;++i)
+    {
+        size_t curr = clock_hand;
+        clock_hand = (clock_hand + 1) % n_slots;
+
+        Slot& s = slots[curr];
+        if(s.state!=SlotState::Valid ||
+            s.pins>0)
+            continue;
+
+        if(s.referenced)
+        {
+            s.referenced = false;
+            continue;
+        }
+
+        chunks.erase(s.chunk);
+        set_entry(curr, 0);
+        s.state = SlotState::Free;
+        ++evictions;
+        slot = curr;
+        return true;
+    }
+    return false;
+}
+
+void SsdCache::set_entry(size_t slot, uint64_t val)
+{
+    __atomic_store_n(&entries[slot], val, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <stdint.h>
+
+// Persistent read cache for fixed size chunks of the backing file in a
+// cache file on fast local storage. Which chunk is stored in which slot
+// of the cache file is recorded in an index file (cache path + ".idx"),
+// which is memory mapped. After a clean shutdown the index is reused on
+// the next start, so the cache is warm immediately. If the process did
+// not shut down cleanly (or the backing file changed) the cache starts
+// empty. Eviction uses CLOCK.
+class SsdCache
+{
+public:
+    struct Stats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t fills;
+        uint64_t evictions;
+        uint64_t invalidations;
+    };
+
+    SsdCache(const std::string& path, uint64_t cache_size, size_t chunk_size,
+        int backing_fd);
+    ~SsdCache();
+
+    bool init(bool direct_io);
+
+    // Returns true and pins the slot if the chunk is cached
+    bool lookup(uint64_t chunk, size_t& slot);
+    void unpin(size_t slot);
+
+    // Reserves (and pins) a slot for filling chunk. Returns false if the chunk is
+    // already cached/being filled or if there is no free slot
+    bool reserve(uint64_t chunk, size_t& slot);
+    void fill_done(size_t slot, bool success);
+
+    // Drops all chunks overlapping [offset, offset+len)
+    void invalidate(uint64_t offset, uint64_t len);
+
+    int get_fd() const
+    {
+        return fd;
+    }
+
+    size_t get_chunk_size() const
+    {
+        return chunk_size;
+    }
+
+    uint64_t slot_offset(size_t slot) const
+    {
+        return static_cast<uint64_t>(slot)*chunk_size;
+    }
+
+    size_t get_loaded() const
+    {
+        return loaded;
+    }
+
+    Stats get_stats() const;
+
+private:
+    struct IndexHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t clean;
+        uint64_t chunk_size;
+        uint64_t n_slots;
+        uint64_t backing_size;
+        int64_t backing_mtime;
+    };
+
+    enum class SlotState
+    {
+        Free,
+        Filling,
+        Valid,
+        // Invalidated while pinned. Freed on unpin
+        Dropped
+    };
+
+    struct Slot
+    {
+        uint64_t chunk;
+        SlotState state;
+        unsigned int pins;
+        bool referenced;
+    };
+
+    bool load_index();
+    bool evict(size_t& slot);
+    void set_entry(size_t slot, uint64_t val);
+
+    std::string path;
+    size_t chunk_size;
+    size_t n_slots;
+    int backing_fd;
+    int fd;
+    int index_fd;
+    char* index_mem;
+    size_t index_size;
+    // Chunk number + 1 of each slot. 0 if the slot is empty
+    uint64_t* entries;
+    size_t loaded;
+
+    std::mutex mutex;
+    std::vector<Slot> slots;
+    std::vector<size_t> free_slots;
+    std::unordered_map<uint64_t, size_t> chunks;
+    size_t clock_hand;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> fills;
+    std::atomic<uint64_t> evictions;
+    std::atomic<uint64_t> invalidations;
+};
+
+// Keeps a SSD cache slot pinned while it is read from
+class SsdCachePin
+{
+public:
+    SsdCachePin()
+        : cache(nullptr), slot(0)
+    {}
+
+    SsdCachePin(SsdCachePin&& other) noexcept
+        : cache(std::exchange(other.cache, nullptr)), slot(other.slot)
+    {}
+
+    SsdCachePin(SsdCachePin const&) = delete;
+    SsdCachePin& operator=(SsdCachePin&&) = delete;
+    SsdCachePin& operator=(SsdCachePin const&) = delete;
+
+    ~SsdCachePin()
+    {
+        reset();
+    }
+
+    void set(SsdCache* p_cache, size_t p_slot)
+    {
+        reset();
+        cache = p_cache;
+        slot = p_slot;
+    }
+
+    void reset()
+    {
+        if(cache!=nullptr)
+            cache->unpin(slot);
+        cache = nullptr;
+    }
+
+private:
+    SsdCache* cache;
+    size_t slot;
+};
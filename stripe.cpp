@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "stripe.h"
+#include "io_util.h"
+#include <sstream>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+
+namespace
+{
+    // Maximum number of pieces to wait for at once
+    const size_t max_stripe_batch = 64;
+}
+
+StripeLayout::StripeLayout(uint64_t stripe_size, size_t n_files)
+    : stripe_size(stripe_size), n_files(n_files),
+        files(std::make_unique<FileCounters[]>(n_files))
+{
+    for(size_t i=0;i<n_files;++i)
+    {
+        files[i].read_bytes = 0;
+        files[i].write_bytes = 0;
+    }
+}
+
+void StripeLayout::map(uint64_t offset, uint64_t len, std::vector<Piece>& pieces) const
+{
+    uint64_t done = 0;
+    while(done<len)
+    {
+        uint64_t stripe = (offset + done) / stripe_size;
+        uint64_t stripe_off = (offset + done) % stripe_size;
+
+        Piece piece;
+        piece.file = stripe % n_files;
+        piece.file_offset = (stripe / n_files)*stripe_size + stripe_off;
+        piece.len = std::min(len - done, stripe_size - stripe_off);
+        piece.req_offset = done;
+        pieces.push_back(piece);
+
+        done += piece.len;
+    }
+}
+
+std::vector<StripeLayout::FileStats> StripeLayout::get_stats() const
+{
+    std::vector<FileStats> ret(n_files);
+    for(size_t i=0;i<n_files;++i)
+    {
+        ret[i].read_bytes = files[i].read_bytes.load(std::memory_order_relaxed);
+        ret[i].write_bytes = files[i].write_bytes.load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+fuse_io_context::io_uring_task<int> striped_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios)
+{
+    StripeLayout* stripes = io.fuse_ring.stripes;
+
+    struct PendingPiece
+    {
+        size_t req;
+        StripeLayout::Piece piece;
+    };
+
+    std::vector<PendingPiece> pieces;
+    std::vector<StripeLayout::Piece> req_pieces;
+    std::vector<uint64_t> req_len(ios.size());
+    for(size_t i=0;i<ios.size();++i)
+    {
+        ios[i].res = 0;
+        req_len[i] = block_io_len(ios[i], io.fuse_ring.backing_f_size);
+        if(req_len[i]==0)
+        {
+            if(write)
+                ios[i].res = -ENOSPC;
+            continue;
+        }
+
+        req_pieces.clear();
+        stripes->map(ios[i].offset, req_len[i], req_pieces);
+        for(const StripeLayout::Piece& piece: req_pieces)
+        {
+            pieces.push_back(PendingPiece{i, piece});
+        }
+    }
+
+    for(size_t i=0;i<pieces.size();)
+    {
+        size_t n = std::min(pieces.size() - i, max_stripe_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+        if(sqe==nullptr)
+            co_return -1;
+
+        std::vector<io_uring_sqe*> sqes;
+        std::vector<uint64_t> expected;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            const PendingPiece& pending = pieces[i+j];
+            const BlockIo& req = ios[pending.req];
+            const StripeLayout::Piece& piece = pending.piece;
+            int fd = io.fuse_ring.files.stripe_files[piece.file];
+            char* buf = req.buf + piece.req_offset;
+
+            uint64_t len = piece.len;
+            if(!write &&
+                piece.req_offset + piece.len==req_len[pending.req])
+                len = round_up<uint64_t>(len, 4096);
+
+            if(write && req.buf_idx>=0)
+                io_uring_prep_write_fixed(sqe, fd, buf, len, piece.file_offset, req.buf_idx);
+            else if(write)
+                io_uring_prep_write(sqe, fd, buf, len, piece.file_offset);
+            else if(req.buf_idx>=0)
+                io_uring_prep_read_fixed(sqe, fd, buf, len, piece.file_offset, req.buf_idx);
+            else
+                io_uring_prep_read(sqe, fd, buf, len, piece.file_offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            sqes.push_back(sqe);
+            expected.push_back(piece.len);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+
+        for(size_t j=0;j<n;++j)
+        {
+            const PendingPiece& pending = pieces[i+j];
+            BlockIo& req = ios[pending.req];
+            if(rcs[j]>0)
+                stripes->add_stats(pending.piece.file, write, std::min(static_cast<uint64_t>(rcs[j]), expected[j]));
+
+            if(req.res>=0)
+                req.res = block_io_piece_res(rcs[j], expected[j]);
+        }
+
+        i+=n;
+    }
+
+    for(size_t i=0;i<ios.size();++i)
+    {
+        if(ios[i].res>=0)
+            ios[i].res = static_cast<int>(req_len[i]);
+    }
+
+    co_return 0;
+}
+
+std::string StripeBackend::describe() const
+{
+    std::ostringstream ret;
+    ret << size/(1024*1024) << " MB across " << stripes->get_n_files()
+        << " files with stripe size " << stripes->get_stripe_size()/1024 << " KB";
+    return ret.str();
+}
+
+fuse_io_context::io_uring_task<int> StripeBackend::flush(fuse_io_context& io,
+    bool datasync)
+{
+    std::vector<int> rcs;
+    if(co_await sync_files(io, io.fuse_ring.files.stripe_files, datasync, rcs)!=0)
+        co_return -1;
+
+    int ret = 0;
+    for(int rc: rcs)
+    {
+        if(rc<0)
+            ret = rc;
+    }
+
+    co_return ret;
+}
+
+fuse_io_context::io_uring_task<int> StripeBackend::fallocate_pieces(fuse_io_context& io,
+    uint64_t offset, uint64_t len, int mode)
+{
+    std::vector<StripeLayout::Piece> pieces;
+    stripes->map(offset, len, pieces);
+
+    std::vector<FileRange> ranges;
+    for(const StripeLayout::Piece& piece: pieces)
+        ranges.push_back(FileRange{io.fuse_ring.files.stripe_files[piece.file], piece.file_offset, piece.len});
+
+    co_return co_await fallocate_file_ranges(io, ranges, mode);
+}
+
+fuse_io_context::io_uring_task<int> StripeBackend::discard(fuse_io_context& io,
+    uint64_t offset, uint64_t len, bool punch)
+{
+    co_return co_await fallocate_pieces(io, offset, len,
+        (punch ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE) | FALLOC_FL_KEEP_SIZE);
+}
+
+fuse_io_context::io_uring_task<int> StripeBackend::allocate(fuse_io_context& io,
+    uint64_t offset, uint64_t len)
+{
+    co_return co_await fallocate_pieces(io, offset, len, FALLOC_FL_KEEP_SIZE);
+}
+
+std::string StripeBackend::get_stats() const
+{
+    std::vector<StripeLayout::FileStats> stripe_stats = stripes->get_stats();
+    std::ostringstream ret;
+    ret << "Stripes: stripe size KB=" << stripes->get_stripe_size()/1024;
+    for(size_t i=0;i<stripe_stats.size();++i)
+    {
+        ret << " file " << i << " read MB=" << stripe_stats[i].read_bytes/(1024*1024)
+            << " write MB=" << stripe_stats[i].write_bytes/(1024*1024);
+    }
+    return ret.str();
+}
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include "backend.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <stdint.h>
+
+// Layout of a volume striped across n_files backing files. Stripe i of
+// the volume is at offset (i / n_files)*stripe_size in file i % n_files.
+// The fixed file index of file i is files.stripe_files[i] of the ring.
+class StripeLayout
+{
+public:
+    struct Piece
+    {
+        size_t file;
+        uint64_t file_offset;
+        uint64_t len;
+        // Offset of the piece in the request
+        uint64_t req_offset;
+    };
+
+    struct FileStats
+    {
+        uint64_t read_bytes;
+        uint64_t write_bytes;
+    };
+
+    StripeLayout(uint64_t stripe_size, size_t n_files);
+
+    // Splits [offset, offset+len) of the volume at stripe boundaries
+    void map(uint64_t offset, uint64_t len, std::vector<Piece>& pieces) const;
+
+    uint64_t get_stripe_size() const
+    {
+        return stripe_size;
+    }
+
+    size_t get_n_files() const
+    {
+        return n_files;
+    }
+
+    void add_stats(size_t file, bool write, uint64_t bytes)
+    {
+        if(write)
+            files[file].write_bytes += bytes;
+        else
+            files[file].read_bytes += bytes;
+    }
+
+    std::vector<FileStats> get_stats() const;
+
+private:
+    struct FileCounters
+    {
+        std::atomic<uint64_t> read_bytes;
+        std::atomic<uint64_t> write_bytes;
+    };
+
+    uint64_t stripe_size;
+    size_t n_files;
+    std::unique_ptr<FileCounters[]> files;
+};
+
+// Splits the requests at stripe boundaries and submits all pieces together
+// on the backing ring. Reads of the last piece are rounded up to whole pages
+// for O_DIRECT
+[[nodiscard]] fuse_io_context::io_uring_task<int> striped_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios);
+
+// The striped volume as backend
+class StripeBackend : public Backend
+{
+public:
+    StripeBackend(StripeLayout* stripes, uint64_t size)
+        : stripes(stripes), size(size) {}
+
+    std::string describe() const override;
+
+    uint64_t get_size() const override
+    {
+        return size;
+    }
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io,
+        bool write, std::vector<BlockIo>& ios) override
+    {
+        return striped_io(io, write, ios);
+    }
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush(fuse_io_context& io,
+        bool datasync) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> discard(fuse_io_context& io,
+        uint64_t offset, uint64_t len, bool punch) override;
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> allocate(fuse_io_context& io,
+        uint64_t offset, uint64_t len) override;
+
+    std::string get_stats() const override;
+
+private:
+    // fallocate()s the pieces of [offset, offset+len) with mode
+    [[nodiscard]] fuse_io_context::io_uring_task<int> fallocate_pieces(fuse_io_context& io,
+        uint64_t offset, uint64_t len, int mode);
+
+    StripeLayout* stripes;
+    uint64_t size;
+};
@@ -0,0 +1,983 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "vhd.h"
+#include "io_util.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+namespace
+{
+    const uint64_t sector_size = 512;
+    const uint32_t bat_unallocated = 0xFFFFFFFF;
+    const uint32_t disk_type_fixed = 2;
+    const uint32_t disk_type_dynamic = 3;
+    const uint32_t disk_type_differencing = 4;
+    const size_t max_chain_depth = 32;
+    // Maximum number of pieces to wait for at once
+    const size_t max_vhd_batch = 64;
+
+    const uint32_t platform_w2ru = 0x57327275;
+    const uint32_t platform_w2ku = 0x57326B75;
+    const uint32_t platform_macx = 0x4D616358;
+
+    // All fields big-endian
+    struct __attribute__((packed)) VhdFooter
+    {
+        char cookie[8];
+        uint32_t features;
+        uint32_t version;
+        uint64_t data_offset;
+        uint32_t timestamp;
+        char creator_app[4];
+        uint32_t creator_version;
+        uint32_t creator_os;
+        uint64_t original_size;
+        uint64_t current_size;
+        uint32_t geometry;
+        uint32_t disk_type;
+        uint32_t checksum;
+        uint8_t unique_id[16];
+        uint8_t saved_state;
+        char reserved[427];
+    };
+    static_assert(sizeof(VhdFooter)==512);
+
+    struct __attribute__((packed)) VhdParentLocator
+    {
+        uint32_t platform_code;
+        uint32_t data_space;
+        uint32_t data_length;
+        uint32_t reserved;
+        uint64_t data_offset;
+    };
+
+    struct __attribute__((packed)) VhdDynamicHeader
+    {
+        char cookie[8];
+        uint64_t data_offset;
+        uint64_t table_offset;
+        uint32_t header_version;
+        uint32_t max_table_entries;
+        uint32_t block_size;
+        uint32_t checksum;
+        uint8_t parent_unique_id[16];
+        uint32_t parent_timestamp;
+        uint32_t reserved1;
+        uint8_t parent_name[512];
+        VhdParentLocator locators[8];
+        char reserved2[256];
+    };
+    static_assert(sizeof(VhdDynamicHeader)==1024);
+
+    // One's complement of the byte sum, without the checksum field
+    uint32_t vhd_checksum(const char* data, size_t len, size_t checksum_off)
+    {
+        uint32_t sum = 0;
+        for(size_t i=0;i<len;++i)
+        {
+            if(i>=checksum_off && i<checksum_off+4)
+                continue;
+            sum += static_cast<unsigned char>(data[i]);
+        }
+        return ~sum;
+    }
+
+    std::string utf16_to_utf8(const uint8_t* data, size_t len, bool big_endian)
+    {
+        std::string ret;
+        for(size_t i=0;i+1<len;i+=2)
+        {
+            uint32_t c = big_endian ? (data[i] << 8 | data[i+1]) : (data[i+1] << 8 | data[i]);
+            if(c==0)
+                break;
+
+            if(c>=0xD800 && c<0xDC00 && i+3<len)
+            {
+                uint32_t lo = big_endian ? (data[i+2] << 8 | data[i+3]) : (data[i+3] << 8 | data[i+2]);
+                c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+                i+=2;
+            }
+
+            if(c<0x80)
+            {
+                ret += static_cast<char>(c);
+            }
+            else if(c<0x800)
+            {
+                ret += static_cast<char>(0xC0 | (c >> 6));
+                ret += static_cast<char>(0x80 | (c & 0x3F));
+            }
+            else if(c<0x10000)
+            {
+                ret += static_cast<char>(0xE0 | (c >> 12));
+                ret += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                ret += static_cast<char>(0x80 | (c & 0x3F));
+            }
+            else
+            {
+                ret += static_cast<char>(0xF0 | (c >> 18));
+                ret += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+                ret += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                ret += static_cast<char>(0x80 | (c & 0x3F));
+            }
+        }
+        return ret;
+    }
+
+    std::string dir_name(const std::string& path)
+    {
+        size_t pos = path.find_last_of('/');
+        if(pos==std::string::npos)
+            return ".";
+        if(pos==0)
+            return "/";
+        return path.substr(0, pos);
+    }
+
+    const char* type_name(uint32_t type)
+    {
+        switch(type)
+        {
+        case disk_type_fixed: return "fixed";
+        case disk_type_dynamic: return "dynamic";
+        case disk_type_differencing: return "differencing";
+        default: return "unknown";
+        }
+    }
+}
+
+VhdChain::VhdChain(const std::string& path)
+    : path(path), allocating(false), allocated_blocks(0), alloc_waits(0),
+        bitmap_writes(0), bitmap_waits(0)
+{
+}
+
+VhdChain::~VhdChain()
+{
+    for(std::unique_ptr<Image>& image: images)
+    {
+        if(image->fd!=-1)
+            close(image->fd);
+    }
+}
+
+bool VhdChain::find_parent(int fd, const std::string& child_path, const char* header,
+    std::string& parent_path)
+{
+    const VhdDynamicHeader* dyn = reinterpret_cast<const VhdDynamicHeader*>(header);
+    std::string dir = dir_name(child_path);
+
+    std::vector<std::string> candidates;
+    for(const VhdParentLocator& locator: dyn->locators)
+    {
+        uint32_t code = be32toh(locator.platform_code);
+        uint32_t len = be32toh(locator.data_length);
+        if(code==0 || len==0 || len>64*1024)
+            continue;
+
+        std::vector<char> data(len);
+        if(!pread_full(fd, data.data(), len, be64toh(locator.data_offset)))
+            continue;
+
+        if(code==platform_w2ru ||
+            code==platform_w2ku)
+        {
+            std::string name = utf16_to_utf8(reinterpret_cast<const uint8_t*>(data.data()), len, false);
+            std::replace(name.begin(), name.end(), '\\', '/');
+            if(code==platform_w2ru)
+            {
+                if(name.compare(0, 2, "./")==0)
+                    name = name.substr(2);
+                candidates.push_back(dir + "/" + name);
+            }
+            else
+            {
+                // Absolute Windows path. Look for the file next to the image
+                candidates.push_back(dir + "/" + name.substr(name.find_last_of('/')+1));
+            }
+        }
+        else if(code==platform_macx)
+        {
+            std::string name(data.data(), strnlen(data.data(), len));
+            if(name.compare(0, 7, "file://")==0)
+                name = name.substr(7);
+            if(!name.empty() && name[0]!='/')
+                name = dir + "/" + name;
+            candidates.push_back(name);
+        }
+    }
+
+    std::string name = utf16_to_utf8(dyn->parent_name, sizeof(dyn->parent_name), true);
+    std::replace(name.begin(), name.end(), '\\', '/');
+    if(!name.empty())
+        candidates.push_back(dir + "/" + name.substr(name.find_last_of('/')+1));
+
+    for(const std::string& candidate: candidates)
+    {
+        if(access(candidate.c_str(), R_OK)==0)
+        {
+            parent_path = candidate;
+            return true;
+        }
+    }
+
+    std::cerr << "Parent of VHD " << child_path << " not found";
+    if(!name.empty())
+        std::cerr << " (" << name << ")";
+    std::cerr << std::endl;
+    return false;
+}
+
+bool VhdChain::read_image(Image& image)
+{
+    int fd = ::open(image.path.c_str(), O_RDONLY|O_CLOEXEC);
+    if(fd==-1)
+    {
+        perror(("Error opening VHD "+image.path).c_str());
+        return false;
+    }
+
+    std::unique_ptr<int, void(*)(int*)> fd_close(&fd, [](int* p) { close(*p); });
+
+    struct stat st;
+    if(fstat(fd, &st)!=0)
+    {
+        perror("Error getting VHD file info");
+        return false;
+    }
+
+    // Some older images have a 511 byte footer
+    VhdFooter* footer = reinterpret_cast<VhdFooter*>(image.footer);
+    uint64_t footer_off = 0;
+    bool found = false;
+    for(uint64_t footer_size: {static_cast<uint64_t>(512), static_cast<uint64_t>(511)})
+    {
+        if(static_cast<uint64_t>(st.st_size)<footer_size)
+            continue;
+
+        memset(image.footer, 0, sizeof(image.footer));
+        footer_off = st.st_size - footer_size;
+        if(pread_full(fd, image.footer, footer_size, footer_off) &&
+            memcmp(footer->cookie, "conectix", 8)==0)
+        {
+            found = true;
+            break;
+        }
+    }
+
+    if(!found)
+    {
+        std::cerr << "VHD " << image.path << " has no footer" << std::endl;
+        return false;
+    }
+
+    if(vhd_checksum(image.footer, sizeof(VhdFooter), offsetof(VhdFooter, checksum))!=be32toh(footer->checksum))
+    {
+        std::cerr << "VHD footer checksum of " << image.path << " is wrong" << std::endl;
+        return false;
+    }
+
+    image.type = be32toh(footer->disk_type);
+    image.size = be64toh(footer->current_size);
+    image.footer_pos = round_up<uint64_t>(footer_off, sector_size);
+    memcpy(image.unique_id, footer->unique_id, sizeof(image.unique_id));
+    memset(image.parent_id, 0, sizeof(image.parent_id));
+    image.block_size = 0;
+    image.max_entries = 0;
+    image.bat_offset = 0;
+    image.bitmap_size = 0;
+
+    if(image.type==disk_type_fixed)
+    {
+        if(image.size>footer_off)
+        {
+            std::cerr << "Fixed VHD " << image.path << " is smaller than its disk size" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    if(image.type!=disk_type_dynamic &&
+        image.type!=disk_type_differencing)
+    {
+        std::cerr << "VHD " << image.path << " has unsupported disk type " << image.type << std::endl;
+        return false;
+    }
+
+    char header[sizeof(VhdDynamicHeader)];
+    const VhdDynamicHeader* dyn = reinterpret_cast<const VhdDynamicHeader*>(header);
+    if(!pread_full(fd, header, sizeof(header), be64toh(footer->data_offset)) ||
+        memcmp(dyn->cookie, "cxsparse", 8)!=0)
+    {
+        std::cerr << "Error reading dynamic disk header of VHD " << image.path << std::endl;
+        return false;
+    }
+
+    if(vhd_checksum(header, sizeof(header), offsetof(VhdDynamicHeader, checksum))!=be32toh(dyn->checksum))
+    {
+        std::cerr << "VHD dynamic disk header checksum of " << image.path << " is wrong" << std::endl;
+        return false;
+    }
+
+    image.block_size = be32toh(dyn->block_size);
+    image.max_entries = be32toh(dyn->max_table_entries);
+    image.bat_offset = be64toh(dyn->table_offset);
+
+    if(image.block_size<sector_size ||
+        (image.block_size & (image.block_size-1))!=0 ||
+        static_cast<uint64_t>(image.max_entries)*image.block_size<image.size)
+    {
+        std::cerr << "VHD " << image.path << " has an invalid block size or table size" << std::endl;
+        return false;
+    }
+
+    image.bitmap_size = round_up<uint64_t>(image.block_size/sector_size/8, sector_size);
+
+    if(image.type==disk_type_differencing)
+    {
+        memcpy(image.parent_id, dyn->parent_unique_id, sizeof(image.parent_id));
+        if(!find_parent(fd, image.path, header, image.parent_path))
+            return false;
+    }
+
+    return true;
+}
+
+bool VhdChain::load_tables(Image& image)
+{
+    if(image.type==disk_type_fixed)
+        return true;
+
+    int fd = ::open(image.path.c_str(), O_RDONLY|O_CLOEXEC);
+    if(fd==-1)
+    {
+        perror(("Error opening VHD "+image.path).c_str());
+        return false;
+    }
+
+    std::unique_ptr<int, void(*)(int*)> fd_close(&fd, [](int* p) { close(*p); });
+
+    std::vector<uint32_t> bat(round_up<uint64_t>(image.max_entries*sizeof(uint32_t), sector_size)/sizeof(uint32_t));
+    if(!pread_full(fd, reinterpret_cast<char*>(bat.data()), bat.size()*sizeof(uint32_t), image.bat_offset))
+    {
+        perror(("Error reading BAT of VHD "+image.path).c_str());
+        return false;
+    }
+
+    image.bat = std::make_unique<std::atomic<uint32_t>[]>(image.max_entries);
+    image.bitmaps.resize(image.max_entries);
+
+    std::vector<char> bitmap(image.bitmap_size);
+    for(uint32_t i=0;i<image.max_entries;++i)
+    {
+        uint32_t entry = be32toh(bat[i]);
+        image.bat[i] = entry;
+        if(entry==bat_unallocated)
+            continue;
+
+        if(!pread_full(fd, bitmap.data(), bitmap.size(), static_cast<uint64_t>(entry)*sector_size))
+        {
+            perror(("Error reading sector bitmap of VHD "+image.path).c_str());
+            return false;
+        }
+
+        image.bitmaps[i] = std::make_unique<std::atomic<uint8_t>[]>(image.bitmap_size);
+        for(uint32_t j=0;j<image.bitmap_size;++j)
+            image.bitmaps[i][j] = static_cast<uint8_t>(bitmap[j]);
+    }
+
+    return true;
+}
+
+bool VhdChain::open(bool direct_io)
+{
+    std::string curr_path = path;
+    while(true)
+    {
+        if(images.size()>=max_chain_depth)
+        {
+            std::cerr << "VHD parent chain of " << path << " is too long" << std::endl;
+            return false;
+        }
+
+        std::unique_ptr<Image> image = std::make_unique<Image>();
+        image->path = curr_path;
+        image->fd = -1;
+        if(!read_image(*image))
+            return false;
+
+        if(!images.empty() &&
+            memcmp(images.back()->parent_id, image->unique_id, sizeof(image->unique_id))!=0)
+        {
+            std::cerr << "VHD " << image->path << " is not the parent of " << images.back()->path
+                << " (unique id does not match)" << std::endl;
+            return false;
+        }
+
+        bool has_parent = image->type==disk_type_differencing;
+        curr_path = image->parent_path;
+        images.push_back(std::move(image));
+
+        if(!has_parent)
+            break;
+    }
+
+    // The parents are known now. Read the tables of all of them in parallel
+    std::vector<char> loaded(images.size());
+    std::vector<std::thread> threads;
+    for(size_t i=0;i<images.size();++i)
+    {
+        threads.push_back(std::thread([this, i, &loaded]() {
+            loaded[i] = load_tables(*images[i]);
+        }));
+    }
+
+    for(std::thread& thread: threads)
+    {
+        thread.join();
+    }
+
+    if(std::find(loaded.begin(), loaded.end(), false)!=loaded.end())
+        return false;
+
+    for(size_t i=1;i<images.size();++i)
+    {
+        images[i]->fd = ::open(images[i]->path.c_str(), O_RDONLY|O_CLOEXEC|(direct_io ? O_DIRECT : 0));
+        if(images[i]->fd==-1)
+        {
+            perror(("Error opening VHD "+images[i]->path).c_str());
+            return false;
+        }
+    }
+
+    bitmap_version.resize(images[0]->max_entries);
+    bitmap_written.resize(images[0]->max_entries);
+    bitmap_writing.resize(images[0]->max_entries);
+
+    return true;
+}
+
+std::vector<int> VhdChain::get_parent_fds() const
+{
+    std::vector<int> ret;
+    for(size_t i=1;i<images.size();++i)
+        ret.push_back(images[i]->fd);
+    return ret;
+}
+
+std::string VhdChain::describe() const
+{
+    std::ostringstream ss;
+    for(size_t i=0;i<images.size();++i)
+    {
+        const Image& image = *images[i];
+        if(i>0)
+            ss << " -> ";
+        ss << image.path << " (" << type_name(image.type) << ", " << image.size/(1024*1024) << " MB";
+        if(image.type!=disk_type_fixed)
+            ss << ", block size " << image.block_size/1024 << " KB";
+        ss << ")";
+    }
+    return ss.str();
+}
+
+int64_t VhdChain::locate(const Image& image, uint64_t sector) const
+{
+    uint64_t offset = sector*sector_size;
+    if(offset>=image.size)
+        return -1;
+
+    if(image.type==disk_type_fixed)
+        return static_cast<int64_t>(offset);
+
+    uint64_t block = offset / image.block_size;
+    uint32_t entry = image.bat[block].load(std::memory_order_acquire);
+    if(entry==bat_unallocated)
+        return -1;
+
+    uint64_t block_off = offset % image.block_size;
+    if(image.type==disk_type_differencing)
+    {
+        uint64_t block_sector = block_off / sector_size;
+        uint8_t bits = image.bitmaps[block][block_sector / 8].load(std::memory_order_acquire);
+        if((bits & (0x80 >> (block_sector % 8)))==0)
+            return -1;
+    }
+
+    return static_cast<int64_t>(static_cast<uint64_t>(entry)*sector_size + image.bitmap_size + block_off);
+}
+
+void VhdChain::map_read(uint64_t offset, uint64_t len, std::vector<Piece>& pieces) const
+{
+    uint64_t end = offset + len;
+    uint64_t pos = offset;
+    while(pos<end)
+    {
+        uint64_t sector = pos / sector_size;
+        uint64_t seg_end = std::min(end, (sector + 1)*sector_size);
+
+        int file = -1;
+        uint64_t file_offset = 0;
+        for(size_t i=0;i<images.size();++i)
+        {
+            int64_t sector_offset = locate(*images[i], sector);
+            if(sector_offset>=0)
+            {
+                file = static_cast<int>(i);
+                file_offset = static_cast<uint64_t>(sector_offset) + pos % sector_size;
+                break;
+            }
+        }
+
+        uint64_t piece_len = seg_end - pos;
+        Piece* last = pieces.empty() ? nullptr : &pieces.back();
+        if(last!=nullptr &&
+            last->file==file &&
+            last->req_offset + last->len==pos - offset &&
+            (file<0 || last->file_offset + last->len==file_offset))
+        {
+            last->len += piece_len;
+        }
+        else
+        {
+            pieces.push_back(Piece{file, file_offset, piece_len, pos - offset});
+        }
+
+        pos = seg_end;
+    }
+}
+
+void VhdChain::map_write(uint64_t offset, uint64_t len, std::vector<Piece>& pieces) const
+{
+    const Image& image = *images[0];
+    if(image.type==disk_type_fixed)
+    {
+        pieces.push_back(Piece{0, offset, len, 0});
+        return;
+    }
+
+    uint64_t done = 0;
+    while(done<len)
+    {
+        uint64_t block = (offset + done) / image.block_size;
+        uint64_t block_off = (offset + done) % image.block_size;
+        uint64_t piece_len = std::min(len - done, image.block_size - block_off);
+
+        uint32_t entry = image.bat[block].load(std::memory_order_acquire);
+        if(entry==bat_unallocated)
+            pieces.push_back(Piece{-1, 0, piece_len, done});
+        else
+            pieces.push_back(Piece{0, static_cast<uint64_t>(entry)*sector_size + image.bitmap_size + block_off,
+                piece_len, done});
+
+        done += piece_len;
+    }
+}
+
+fuse_io_context::io_uring_task<int> VhdChain::allocate(fuse_io_context& io, uint64_t offset, uint64_t len)
+{
+    Image& image = *images[0];
+    if(image.type==disk_type_fixed ||
+        len==0)
+        co_return 0;
+
+    uint64_t first = offset / image.block_size;
+    uint64_t last = (offset + len - 1) / image.block_size;
+    for(uint64_t block=first;block<=last;)
+    {
+        if(image.bat[block].load(std::memory_order_acquire)!=bat_unallocated)
+        {
+            ++block;
+            continue;
+        }
+
+        uint64_t pos = 0;
+        {
+            std::unique_lock lock(mutex);
+            if(allocating)
+                ++alloc_waits;
+
+            while(allocating)
+            {
+                co_await waiters.wait(io, lock);
+            }
+
+            allocating = true;
+            pos = image.footer_pos;
+        }
+
+        int rc = 0;
+        if(image.bat[block].load(std::memory_order_acquire)==bat_unallocated)
+        {
+            if(pos/sector_size>=bat_unallocated)
+                rc = -ENOSPC;
+
+            // Zeroed sector bitmap and the footer after the new block. The
+            // data of the block is left as a hole and reads as zeros
+            std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(image.bitmap_size + sizeof(image.footer)), &free);
+            if(rc==0 && !buf)
+                rc = -ENOMEM;
+
+            if(rc==0)
+            {
+                memset(buf.get(), 0, image.bitmap_size);
+                memcpy(buf.get() + image.bitmap_size, image.footer, sizeof(image.footer));
+
+                io_uring_sqe* sqe1 = co_await io.get_backing_sqe(2);
+                if(sqe1==nullptr)
+                    co_return -1;
+                io_uring_sqe* sqe2 = io.get_reserved_backing_sqe();
+
+                io_uring_prep_write(sqe1, io.fuse_ring.backing_fd, buf.get(), image.bitmap_size, pos);
+                sqe1->flags |= IOSQE_FIXED_FILE;
+                io_uring_prep_write(sqe2, io.fuse_ring.backing_fd, buf.get() + image.bitmap_size,
+                    sizeof(image.footer), pos + image.bitmap_size + image.block_size);
+                sqe2->flags |= IOSQE_FIXED_FILE;
+
+                auto [rc1, rc2] = co_await io.complete(std::make_pair(sqe1, sqe2));
+                if(rc1<0 || rc2<0)
+                    rc = rc1<0 ? rc1 : rc2;
+                else if(static_cast<uint32_t>(rc1)!=image.bitmap_size || rc2!=sizeof(image.footer))
+                    rc = -EIO;
+            }
+
+            if(rc==0)
+            {
+                // BAT sector with the new entry
+                uint64_t bat_sector = block*sizeof(uint32_t) / sector_size;
+                uint32_t* entries = reinterpret_cast<uint32_t*>(buf.get());
+                for(uint64_t i=0;i<sector_size/sizeof(uint32_t);++i)
+                {
+                    uint64_t idx = bat_sector*sector_size/sizeof(uint32_t) + i;
+                    uint32_t entry = idx==block ? static_cast<uint32_t>(pos/sector_size) :
+                        (idx<image.max_entries ? image.bat[idx].load(std::memory_order_relaxed) : bat_unallocated);
+                    entries[i] = htobe32(entry);
+                }
+
+                io_uring_sqe* sqe = co_await io.get_backing_sqe();
+                if(sqe==nullptr)
+                    co_return -1;
+
+                io_uring_prep_write(sqe, io.fuse_ring.backing_fd, buf.get(), sector_size,
+                    image.bat_offset + bat_sector*sector_size);
+                sqe->flags |= IOSQE_FIXED_FILE;
+
+                rc = co_await io.complete(sqe);
+                if(rc>=0 && rc!=sector_size)
+                    rc = -EIO;
+                else if(rc>0)
+                    rc = 0;
+            }
+
+            if(rc==0)
+            {
+                // Bitmap before the entry is visible to readers
+                image.bitmaps[block] = std::make_unique<std::atomic<uint8_t>[]>(image.bitmap_size);
+                for(uint32_t j=0;j<image.bitmap_size;++j)
+                    image.bitmaps[block][j] = 0;
+                image.bat[block].store(static_cast<uint32_t>(pos/sector_size), std::memory_order_release);
+                ++allocated_blocks;
+            }
+        }
+
+        {
+            std::scoped_lock lock(mutex);
+            allocating = false;
+            waiters.notify_all();
+            if(rc==0 && image.bat[block].load(std::memory_order_relaxed)==pos/sector_size)
+                image.footer_pos = pos + image.bitmap_size + image.block_size;
+        }
+
+        if(rc<0)
+        {
+            static bool erronce = false;
+            if(!erronce)
+            {
+                erronce = true;
+                errno = -rc;
+                perror("Error allocating VHD block");
+            }
+            co_return rc;
+        }
+
+        ++block;
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> VhdChain::write_done(fuse_io_context& io, uint64_t offset, uint64_t len)
+{
+    Image& image = *images[0];
+    if(image.type==disk_type_fixed ||
+        len==0)
+        co_return 0;
+
+    uint64_t first = offset / image.block_size;
+    uint64_t last = (offset + len - 1) / image.block_size;
+    for(uint64_t block=first;block<=last;++block)
+    {
+        uint64_t block_start = block*image.block_size;
+        uint64_t first_sector = (std::max(offset, block_start) - block_start) / sector_size;
+        uint64_t last_sector = (std::min(offset + len, block_start + image.block_size) - 1 - block_start) / sector_size;
+
+        std::atomic<uint8_t>* bitmap = image.bitmaps[block].get();
+        bool changed = false;
+        for(uint64_t s=first_sector;s<=last_sector;)
+        {
+            uint8_t mask = 0;
+            uint64_t byte = s / 8;
+            for(;s<=last_sector && s/8==byte;++s)
+                mask |= 0x80 >> (s % 8);
+
+            if((bitmap[byte].fetch_or(mask) & mask)!=mask)
+                changed = true;
+        }
+
+        if(!changed)
+            continue;
+
+        uint32_t version;
+        {
+            std::scoped_lock lock(mutex);
+            version = ++bitmap_version[block];
+        }
+
+        while(true)
+        {
+            uint32_t write_version;
+            {
+                std::unique_lock lock(mutex);
+                if(static_cast<int32_t>(bitmap_written[block] - version)>=0)
+                    break;
+
+                if(bitmap_writing[block])
+                {
+                    ++bitmap_waits;
+                    co_await waiters.wait(io, lock);
+                    continue;
+                }
+
+                bitmap_writing[block] = true;
+                write_version = bitmap_version[block];
+            }
+
+            std::unique_ptr<char, decltype(&free)> buf(alloc_aligned(image.bitmap_size), &free);
+            int rc = -ENOMEM;
+            if(buf)
+            {
+                for(uint32_t j=0;j<image.bitmap_size;++j)
+                    buf.get()[j] = static_cast<char>(bitmap[j].load(std::memory_order_relaxed));
+
+                io_uring_sqe* sqe = co_await io.get_backing_sqe();
+                if(sqe==nullptr)
+                    co_return -1;
+
+                io_uring_prep_write(sqe, io.fuse_ring.backing_fd, buf.get(), image.bitmap_size,
+                    static_cast<uint64_t>(image.bat[block].load(std::memory_order_relaxed))*sector_size);
+                sqe->flags |= IOSQE_FIXED_FILE;
+
+                rc = co_await io.complete(sqe);
+                if(rc>=0 && static_cast<uint32_t>(rc)!=image.bitmap_size)
+                    rc = -EIO;
+            }
+
+            {
+                std::scoped_lock lock(mutex);
+                bitmap_writing[block] = false;
+                waiters.notify_all();
+                if(rc>=0)
+                    bitmap_written[block] = write_version;
+            }
+
+            if(rc<0)
+                co_return rc;
+
+            ++bitmap_writes;
+        }
+    }
+
+    co_return 0;
+}
+
+VhdChain::Stats VhdChain::get_stats() const
+{
+    Stats ret;
+    ret.allocated_blocks = allocated_blocks.load(std::memory_order_relaxed);
+    ret.alloc_waits = alloc_waits.load(std::memory_order_relaxed);
+    ret.bitmap_writes = bitmap_writes.load(std::memory_order_relaxed);
+    ret.bitmap_waits = bitmap_waits.load(std::memory_order_relaxed);
+    return ret;
+}
+
+fuse_io_context::io_uring_task<int> vhd_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios)
+{
+    VhdChain* vhd = io.fuse_ring.vhd;
+
+    struct PendingPiece
+    {
+        size_t req;
+        VhdChain::Piece piece;
+    };
+
+    std::vector<PendingPiece> pieces;
+    std::vector<VhdChain::Piece> req_pieces;
+    std::vector<uint64_t> req_len(ios.size());
+    for(size_t i=0;i<ios.size();++i)
+    {
+        BlockIo& req = ios[i];
+        req.res = 0;
+        req_len[i] = block_io_len(req, vhd->get_size());
+
+        if(write)
+        {
+            if(req_len[i]==0)
+            {
+                req.res = -ENOSPC;
+                continue;
+            }
+
+            if(vhd->needs_sector_align() &&
+                (req.offset % sector_size!=0 || req_len[i] % sector_size!=0))
+            {
+                req.res = -EINVAL;
+                continue;
+            }
+
+            int rc = co_await vhd->allocate(io, req.offset, req_len[i]);
+            if(rc<0)
+            {
+                req.res = rc;
+                continue;
+            }
+        }
+
+        req_pieces.clear();
+        if(write)
+            vhd->map_write(req.offset, req_len[i], req_pieces);
+        else
+            vhd->map_read(req.offset, req_len[i], req_pieces);
+
+        for(const VhdChain::Piece& piece: req_pieces)
+        {
+            if(piece.file>=0)
+                pieces.push_back(PendingPiece{i, piece});
+            else if(!write)
+                memset(req.buf + piece.req_offset, 0, piece.len);
+            else
+                req.res = -EIO;
+        }
+    }
+
+    for(size_t i=0;i<pieces.size();)
+    {
+        size_t n = std::min(pieces.size() - i, max_vhd_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+        if(sqe==nullptr)
+            co_return -1;
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            const PendingPiece& pending = pieces[i+j];
+            const BlockIo& req = ios[pending.req];
+            const VhdChain::Piece& piece = pending.piece;
+            int fd = io.fuse_ring.files.vhd_images[piece.file];
+            char* buf = req.buf + piece.req_offset;
+
+            if(write && req.buf_idx>=0)
+                io_uring_prep_write_fixed(sqe, fd, buf, piece.len, piece.file_offset, req.buf_idx);
+            else if(write)
+                io_uring_prep_write(sqe, fd, buf, piece.len, piece.file_offset);
+            else if(req.buf_idx>=0)
+                io_uring_prep_read_fixed(sqe, fd, buf, piece.len, piece.file_offset, req.buf_idx);
+            else
+                io_uring_prep_read(sqe, fd, buf, piece.len, piece.file_offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+
+        for(size_t j=0;j<n;++j)
+        {
+            const PendingPiece& pending = pieces[i+j];
+            BlockIo& req = ios[pending.req];
+            if(req.res<0)
+                continue;
+
+            // Pieces are inside the image files, so short transfers are errors
+            req.res = block_io_piece_res(rcs[j], pending.piece.len);
+        }
+
+        i+=n;
+    }
+
+    for(size_t i=0;i<ios.size();++i)
+    {
+        BlockIo& req = ios[i];
+        if(req.res<0)
+            continue;
+
+        if(write)
+        {
+            int rc = co_await vhd->write_done(io, req.offset, req_len[i]);
+            if(rc<0)
+            {
+                req.res = rc;
+                continue;
+            }
+        }
+
+        req.res = static_cast<int>(req_len[i]);
+    }
+
+    co_return 0;
+}
+
+fuse_io_context::io_uring_task<int> VhdBackend::flush(fuse_io_context& io,
+    bool datasync)
+{
+    std::vector<int> fds = {io.fuse_ring.backing_fd};
+    std::vector<int> rcs;
+    if(co_await sync_files(io, fds, datasync, rcs)!=0)
+        co_return -1;
+
+    int ret = 0;
+    for(int rc: rcs)
+    {
+        if(rc<0)
+            ret = rc;
+    }
+
+    co_return ret;
+}
+
+std::string VhdBackend::get_stats() const
+{
+    VhdChain::Stats vhd_stats = vhd->get_stats();
+    std::ostringstream ret;
+    ret << "VHD: allocated blocks=" << vhd_stats.allocated_blocks
+        << " allocation waits=" << vhd_stats.alloc_waits
+        << " bitmap writes=" << vhd_stats.bitmap_writes
+        << " bitmap waits=" << vhd_stats.bitmap_waits;
+    return ret.str();
+}
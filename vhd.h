@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include "backend.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+
+// Backing file in VHD format (fixed, dynamic or differencing disk). The
+// image and its parent chain are opened at startup and the block
+// allocation tables (BAT) and sector bitmaps of all of them are kept in
+// memory, so mapping a volume range to image file ranges needs no I/O.
+//
+// Only the image itself (chain level 0) is written. Its parents are opened
+// read-only. The fixed file index of level i is files.vhd_images[i] of the
+// ring. Sectors are read from the first
+// image in the chain that has them; sectors that are in no image read as
+// zeros.
+//
+// Blocks of a dynamic or differencing image are allocated on the first
+// write to them, one at a time: the zeroed sector bitmap and the moved
+// footer are written at the end of the file, then the BAT entry. Bits in
+// the sector bitmap are set once the data is written.
+class VhdChain
+{
+public:
+    // A range of a request in one image of the chain. file is the chain
+    // level or -1 if the range reads as zeros
+    struct Piece
+    {
+        int file;
+        uint64_t file_offset;
+        uint64_t len;
+        // Offset of the piece in the request
+        uint64_t req_offset;
+    };
+
+    struct Stats
+    {
+        uint64_t allocated_blocks;
+        uint64_t alloc_waits;
+        uint64_t bitmap_writes;
+        uint64_t bitmap_waits;
+    };
+
+    VhdChain(const std::string& path);
+    ~VhdChain();
+
+    // Reads the image and its parents. Parent images are opened read-only
+    // with O_DIRECT if direct_io is set
+    bool open(bool direct_io);
+
+    uint64_t get_size() const
+    {
+        return images[0]->size;
+    }
+
+    // Fds of the parent images in chain order
+    std::vector<int> get_parent_fds() const;
+
+    // Number of images in the chain, including the image itself
+    size_t get_depth() const
+    {
+        return images.size();
+    }
+
+    std::string describe() const;
+
+    // Splits [offset, offset+len) into pieces by the image they are read from
+    void map_read(uint64_t offset, uint64_t len, std::vector<Piece>& pieces) const;
+
+    // Splits [offset, offset+len) into pieces of the image itself. Blocks
+    // have to be allocated (see allocate())
+    void map_write(uint64_t offset, uint64_t len, std::vector<Piece>& pieces) const;
+
+    // Allocates the blocks of [offset, offset+len) the image does not have
+    // yet. Returns 0 or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> allocate(fuse_io_context& io, uint64_t offset, uint64_t len);
+
+    // Marks the sectors of [offset, offset+len) as present in the image,
+    // after their data was written, and writes changed sector bitmaps.
+    // Returns 0 or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> write_done(fuse_io_context& io, uint64_t offset, uint64_t len);
+
+    // Writes to a differencing image have to cover whole sectors
+    bool needs_sector_align() const
+    {
+        return images.size()>1;
+    }
+
+    Stats get_stats() const;
+
+private:
+    struct Image
+    {
+        std::string path;
+        int fd;
+        uint32_t type;
+        uint64_t size;
+        uint32_t block_size;
+        uint32_t max_entries;
+        uint64_t bat_offset;
+        uint32_t bitmap_size;
+        uint8_t unique_id[16];
+        uint8_t parent_id[16];
+        std::string parent_path;
+        std::unique_ptr<std::atomic<uint32_t>[]> bat;
+        // Sector bitmap of each allocated block (nullptr if not allocated)
+        std::vector<std::unique_ptr<std::atomic<uint8_t>[]> > bitmaps;
+        // Footer and its position (end of the allocated blocks)
+        char footer[512];
+        uint64_t footer_pos;
+    };
+
+    bool read_image(Image& image);
+    bool load_tables(Image& image);
+    bool find_parent(int fd, const std::string& child_path, const char* header,
+        std::string& parent_path);
+    // File offset of the sector in image or -1 if the image does not have it
+    int64_t locate(const Image& image, uint64_t sector) const;
+
+    std::string path;
+    std::vector<std::unique_ptr<Image> > images;
+
+    std::mutex mutex;
+    bool allocating;
+    // Sector bitmap versions of the blocks of the image itself, to write
+    // each changed bitmap once at a time
+    std::vector<uint32_t> bitmap_version;
+    std::vector<uint32_t> bitmap_written;
+    std::vector<bool> bitmap_writing;
+    // Writes waiting for the block allocation or a bitmap write
+    fuse_io_context::SharedWaitQueue waiters;
+
+    std::atomic<uint64_t> allocated_blocks;
+    std::atomic<uint64_t> alloc_waits;
+    std::atomic<uint64_t> bitmap_writes;
+    std::atomic<uint64_t> bitmap_waits;
+};
+
+// Maps the requests to the images of the chain and submits all pieces
+// together on the backing ring. Unallocated ranges of reads are zeroed
+[[nodiscard]] fuse_io_context::io_uring_task<int> vhd_io(fuse_io_context& io, bool write,
+    std::vector<BlockIo>& ios);
+
+// The VHD chain as backend. Only the backing file (the image the chain
+// starts with) is written, so only it is synced
+class VhdBackend : public Backend
+{
+public:
+    explicit VhdBackend(VhdChain* vhd)
+        : vhd(vhd) {}
+
+    std::string describe() const override
+    {
+        return vhd->describe();
+    }
+
+    uint64_t get_size() const override
+    {
+        return vhd->get_size();
+    }
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> transfer(fuse_io_context& io,
+        bool write, std::vector<BlockIo>& ios) override
+    {
+        return vhd_io(io, write, ios);
+    }
+
+    [[nodiscard]] fuse_io_context::io_uring_task<int> flush(fuse_io_context& io,
+        bool datasync) override;
+
+    std::string get_stats() const override;
+
+private:
+    VhdChain* vhd;
+};
@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#include "write_coalescer.h"
+#include <algorithm>
+#include <sys/uio.h>
+
+namespace
+{
+    // IOV_MAX
+    const size_t max_run_iovs = 1024;
+    // Maximum number of merged writes to wait for at once
+    const size_t max_run_batch = 64;
+}
+
+WriteCoalescer::WriteCoalescer(unsigned int window_us)
+    : window_us(window_us), flush_scheduled(false)
+{
+}
+
+fuse_io_context::io_uring_task<int> WriteCoalescer::write(fuse_io_context& io, const char* buf,
+    uint64_t offset, uint32_t size)
+{
+    PendingWrite pending;
+    pending.offset = offset;
+    pending.size = size;
+    pending.buf = buf;
+    pending.res = -EIO;
+
+    co_return co_await WriteAwaiter(*this, io, pending);
+}
+
+void WriteCoalescer::WriteAwaiter::await_suspend(std::coroutine_handle<> p_awaiter) noexcept
+{
+    pending.awaiter = p_awaiter;
+    coalescer.pending.push_back(&pending);
+
+    if(!coalescer.flush_scheduled)
+    {
+        coalescer.flush_scheduled = true;
+        coalescer.flush(io);
+    }
+}
+
+void WriteCoalescer::build_runs(std::vector<PendingWrite*>& writes, std::vector<Run>& runs)
+{
+    std::stable_sort(writes.begin(), writes.end(), [](const PendingWrite* a, const PendingWrite* b) {
+        return a->offset < b->offset;
+    });
+
+    for(PendingWrite* write: writes)
+    {
+        uint64_t write_end = write->offset + write->size;
+
+        if(!runs.empty() &&
+            write->offset <= runs.back().offset + runs.back().len &&
+            runs.back().iovs.size() < max_run_iovs)
+        {
+            Run& run = runs.back();
+            uint64_t run_end = run.offset + run.len;
+            run.writes.push_back(write);
+
+            if(write_end > run_end)
+            {
+                struct iovec iov;
+                iov.iov_base = const_cast<char*>(write->buf) + (run_end - write->offset);
+                iov.iov_len = write_end - run_end;
+                run.iovs.push_back(iov);
+                run.len += iov.iov_len;
+            }
+            continue;
+        }
+
+        Run run;
+        run.offset = write->offset;
+        run.len = write->size;
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>(write->buf);
+        iov.iov_len = write->size;
+        run.iovs.push_back(iov);
+        run.writes.push_back(write);
+        runs.push_back(std::move(run));
+    }
+}
+
+fuse_io_context::io_uring_task_discard<int> WriteCoalescer::flush(fuse_io_context& io)
+{
+    if(window_us>0)
+    {
+        struct __kernel_timespec ts;
+        ts.tv_sec = window_us / 1000000;
+        ts.tv_nsec = (window_us % 1000000)*1000;
+
+        io_uring_sqe* sqe = co_await io.get_sqe();
+        if(sqe!=nullptr)
+        {
+            io_uring_prep_timeout(sqe, &ts, 0, 0);
+            co_await io.complete(sqe);
+        }
+    }
+    else
+    {
+        co_await io.batch_end();
+    }
+
+    std::vector<PendingWrite*> writes;
+    writes.swap(pending);
+    flush_scheduled = false;
+
+    std::vector<Run> runs;
+    build_runs(writes, runs);
+
+    for(size_t i=0;i<runs.size();)
+    {
+        size_t n = std::min(runs.size() - i, max_run_batch);
+
+        io_uring_sqe* sqe = co_await io.get_backing_sqe(n);
+        if(sqe==nullptr)
+            break;
+
+        std::vector<io_uring_sqe*> sqes;
+        for(size_t j=0;j<n;++j)
+        {
+            if(j>0)
+                sqe = io.get_reserved_backing_sqe();
+
+            Run& run = runs[i+j];
+            io_uring_prep_writev(sqe, io.fuse_ring.backing_fd, run.iovs.data(),
+                    run.iovs.size(), run.offset);
+            sqe->flags |= IOSQE_FIXED_FILE;
+            sqes.push_back(sqe);
+        }
+
+        std::vector<int> rcs = co_await io.complete(sqes);
+
+        for(size_t j=0;j<n;++j)
+        {
+            Run& run = runs[i+j];
+            int rc = rcs[j];
+            uint64_t written_end = run.offset + (rc>0 ? rc : 0);
+            for(PendingWrite* write: run.writes)
+            {
+                if(rc<0)
+                    write->res = rc;
+                else if(write->offset + write->size <= written_end)
+                    write->res = write->size;
+                else if(write->offset < written_end)
+                    write->res = written_end - write->offset;
+                else
+                    write->res = -EIO;
+            }
+        }
+
+        io.stats.backing_writes += n;
+        i+=n;
+    }
+
+    io.stats.coalesced_writes += writes.size();
+
+    for(PendingWrite* write: writes)
+    {
+        write->awaiter.resume();
+    }
+
+    co_return 0;
+}
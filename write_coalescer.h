@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Copyright (C) Martin Raiber
+#pragma once
+#include "fuse_io_context.h"
+#include <vector>
+#include <stdint.h>
+
+// Collects backing file writes of one worker thread and merges contiguous
+// or overlapping ones into a single vectored write. Writes are collected
+// until the current batch of completions was handled or, with a window,
+// for window_us microseconds after the first write.
+//
+// Overlapping writes are all in flight at the same time (none of them was
+// acknowledged yet), so the order they are applied in is undefined. Data
+// that is overlapped by a write at a lower offset is not written.
+class WriteCoalescer
+{
+public:
+    WriteCoalescer(unsigned int window_us);
+
+    // Writes size bytes at buf to offset. Returns the number of bytes written
+    // or a negative errno
+    [[nodiscard]] fuse_io_context::io_uring_task<int> write(fuse_io_context& io, const char* buf,
+        uint64_t offset, uint32_t size);
+
+private:
+    struct PendingWrite
+    {
+        uint64_t offset;
+        uint32_t size;
+        const char* buf;
+        int res;
+        std::coroutine_handle<> awaiter;
+    };
+
+    struct WriteAwaiter
+    {
+        WriteAwaiter(WriteCoalescer& coalescer, fuse_io_context& io, PendingWrite& pending) noexcept
+            : coalescer(coalescer), io(io), pending(pending) {}
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> p_awaiter) noexcept;
+
+        int await_resume() const noexcept
+        {
+            return pending.res;
+        }
+
+    private:
+        WriteCoalescer& coalescer;
+        fuse_io_context& io;
+        PendingWrite& pending;
+    };
+
+    struct Run
+    {
+        uint64_t offset;
+        size_t len;
+        std::vector<struct iovec> iovs;
+        std::vector<PendingWrite*> writes;
+    };
+
+    fuse_io_context::io_uring_task_discard<int> flush(fuse_io_context& io);
+    static void build_runs(std::vector<PendingWrite*>& writes, std::vector<Run>& runs);
+
+    unsigned int window_us;
+    bool flush_scheduled;
+    std::vector<PendingWrite*> pending;
+};